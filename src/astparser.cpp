@@ -1,10 +1,12 @@
 #ifndef _AST_CPP_
 #define _AST_CPP_
 
+#include <stdint.h>
 #include <stdio.h>
 #include <string>
 #include <vector>
 #include "lexer.cpp"
+#include "types.cpp"
 
 static std::string tokenToString(const Token &tok) {
   return std::string(tok.start, tok.length);
@@ -75,6 +77,9 @@ static void printOp(TokenType op) {
   case TokenType::PIP:
     printf("|");
     break;
+  case TokenType::TILDE:
+    printf("~");
+    break;
   case TokenType::DOT:
     printf(".");
     break;
@@ -83,70 +88,62 @@ static void printOp(TokenType op) {
   }
 }
 
-struct ASTNode {
-  virtual ~ASTNode() = default;
-  virtual void print(int indent) const {
-    printIndent(indent);
-    printf("INVALID NODE!\n");
-  }
+// Every kind of node: X(kind, struct)
+#define AST_NODES(X) \
+  X(NUMBER    , NumberNode    ) \
+  X(BINARY    , BinaryNode    ) \
+  X(UNARY     , UnaryNode     ) \
+  X(IDENTIFIER, IdentifierNode) \
+  X(CALL      , CallNode      ) \
+  X(CODE_BLOCK, CodeBlockNode ) \
+  X(EXPR_BLOCK, ExprBlockNode ) \
+  X(DO_EXPR   , DoExprNode    ) \
+  X(YIELD     , YieldNode     ) \
+  X(IF_ELSE   , IfElseNode    ) \
+  X(VAR_DECL  , VarDeclNode   )
+
+enum class NodeKind : uint8_t {
+  #define NODE_KIND(kind, type) kind,
+  AST_NODES(NODE_KIND)
+  #undef NODE_KIND
 };
 
-struct ASTType {
-  std::string name;
-  std::vector<ASTType> tempargs;
-  bool locked = false;
-  bool ref = false;
-  int arrsize = 0; // Not an array
-
-  ASTType() = default;
-  ASTType(const ASTType &) = default;
-
-  bool operator==(const ASTType &other) const {
-    if (other.name != name) return false;
-    if (other.arrsize != arrsize) return false;
-    if (other.tempargs != tempargs) return false;
-    // We don't care about lockiness
-    return true;
-  }
+// Passes switch on kind, or go through visitNode(), instead of trying
+// dynamic_casts. Each node struct has its kind as KIND
+struct ASTNode {
+  const NodeKind kind;
+  int line = -1; // Token::line the node starts on, -1 if unknown
 
-  bool operator!=(const ASTType &other) const {
-    return !(*this == other);
-  }
+  explicit ASTNode(NodeKind k) : kind(k) {}
+  virtual ~ASTNode() = default;
 
-  void print() const {
-    if (ref)    printf("ref ");
-    if (locked) printf("lock ");
-    printf("%.*s", name.length(), name.c_str());
-    if (!tempargs.empty()) {
-      printf("<");
-      for (int i = 0; i < tempargs.size() - 1; ++i) {
-        tempargs[i].print();
-        printf(", ");
-      }
-      tempargs.back().print();
-      printf(">");
-    }
-    if (arrsize > 0) {
-      printf("[%d]", arrsize);
-    }
-  }
+  void print(int indent) const;
 };
 
+// node as a T, nullptr if it is another kind of node or null
+template <class T> static inline const T *nodeAs(const ASTNode *node) {
+  return node && node->kind == T::KIND ? static_cast<const T *>(node) : nullptr;
+}
+
 struct NumberNode : ASTNode {
+  static constexpr NodeKind KIND = NodeKind::NUMBER;
+
   Token tok;
-  explicit NumberNode(Token tk) : tok(tk) {}
+  explicit NumberNode(Token tk) : ASTNode(KIND), tok(tk) {}
 
-  void print(int indent) const override {
+  void print(int indent) const {
     printIndent(indent);
     printf("%.*s\n", tok.length, tok.start);
   }
 };
 
 struct BinaryNode : ASTNode {
+  static constexpr NodeKind KIND = NodeKind::BINARY;
+
   TokenType op;
   ASTNode  *left, *right;
 
-  explicit BinaryNode(TokenType op, ASTNode *left, ASTNode *right) : left(left), right(right), op(op) {}
+  explicit BinaryNode(TokenType op, ASTNode *left, ASTNode *right) : ASTNode(KIND), left(left), right(right), op(op) {}
 
   ~BinaryNode() {
     if (left)
@@ -155,7 +152,7 @@ struct BinaryNode : ASTNode {
       delete right;
   }
 
-  void print(int indent) const override {
+  void print(int indent) const {
     left->print(indent + 1);
     printIndent(indent);
     printOp(op);
@@ -165,17 +162,19 @@ struct BinaryNode : ASTNode {
 };
 
 struct UnaryNode : ASTNode {
+  static constexpr NodeKind KIND = NodeKind::UNARY;
+
   TokenType op;
   ASTNode  *expr;
 
-  explicit UnaryNode(TokenType op, ASTNode *expr) : expr(expr), op(op) {}
+  explicit UnaryNode(TokenType op, ASTNode *expr) : ASTNode(KIND), expr(expr), op(op) {}
 
   ~UnaryNode() {
     if (expr)
       delete expr;
   }
 
-  void print(int indent) const override {
+  void print(int indent) const {
     printIndent(indent);
     printOp(op);
     printf("\n");
@@ -184,25 +183,55 @@ struct UnaryNode : ASTNode {
 };
 
 struct IdentifierNode : ASTNode {
+  static constexpr NodeKind KIND = NodeKind::IDENTIFIER;
+
   Token tok;
-  explicit IdentifierNode(const Token &t) : tok(t) {}
+  explicit IdentifierNode(const Token &t) : ASTNode(KIND), tok(t) {}
 
-  void print(int indent) const override {
+  void print(int indent) const {
     printIndent(indent);
     printf("%.*s\n", tok.length, tok.start);
   }
 };
 
+// name(args...), a call to a host function
+struct CallNode : ASTNode {
+  static constexpr NodeKind KIND = NodeKind::CALL;
+
+  Token name;
+  std::vector<ASTNode *> args;
+
+  explicit CallNode(const Token &t) : ASTNode(KIND), name(t) {}
+
+  ~CallNode() {
+    for (ASTNode *node : args) {
+      delete node;
+    }
+  }
+
+  void print(int indent) const {
+    printIndent(indent);
+    printf("%.*s()\n", name.length, name.start);
+    for (const ASTNode *node : args) {
+      node->print(indent + 1);
+    }
+  }
+};
+
 struct CodeBlockNode : ASTNode {
+  static constexpr NodeKind KIND = NodeKind::CODE_BLOCK;
+
   std::vector<ASTNode *> statements;
 
+  CodeBlockNode() : ASTNode(KIND) {}
+
   ~CodeBlockNode() {
     for (ASTNode *node : statements) {
       delete node;
     }
   }
 
-  void print(int indent) const override {
+  void print(int indent) const {
     printIndent(indent);
     printf("{\n");
     for (const ASTNode *node : statements) {
@@ -218,16 +247,20 @@ struct CodeBlockNode : ASTNode {
 };
 
 struct ExprBlockNode : ASTNode {
+  static constexpr NodeKind KIND = NodeKind::EXPR_BLOCK;
+
   std::vector<ASTNode *> statements;
   ASTType type;
 
+  ExprBlockNode() : ASTNode(KIND) {}
+
   ~ExprBlockNode() {
     for (ASTNode *node : statements) {
       delete node;
     }
   }
 
-  void print(int indent) const override {
+  void print(int indent) const {
     printIndent(indent);
     type.print();
     printf(" : {\n");
@@ -244,15 +277,17 @@ struct ExprBlockNode : ASTNode {
 };
 
 struct DoExprNode : ASTNode {
+  static constexpr NodeKind KIND = NodeKind::DO_EXPR;
+
   ASTNode *expr;
 
-  DoExprNode(ASTNode *e) : expr(e) {}
+  DoExprNode(ASTNode *e) : ASTNode(KIND), expr(e) {}
 
   ~DoExprNode() {
     delete expr;
   }
 
-  void print(int indent) const override {
+  void print(int indent) const {
     printIndent(indent);
     printf("Do:\n");
     expr->print(indent + 1);
@@ -260,15 +295,17 @@ struct DoExprNode : ASTNode {
 };
 
 struct YieldNode : ASTNode {
+  static constexpr NodeKind KIND = NodeKind::YIELD;
+
   ASTNode *expr;
 
-  YieldNode(ASTNode *node) : expr(node) {}
+  YieldNode(ASTNode *node) : ASTNode(KIND), expr(node) {}
 
   ~YieldNode() {
     delete expr;
   }
 
-  void print(int indent) const override {
+  void print(int indent) const {
     printIndent(indent);
     printf("yield\n");
     expr->print(indent + 1);
@@ -276,10 +313,14 @@ struct YieldNode : ASTNode {
 };
 
 struct IfElseNode : ASTNode {
+  static constexpr NodeKind KIND = NodeKind::IF_ELSE;
+
   ASTNode *cond,
       *left,  // The "if" part
       *right; // The "else" part
 
+  IfElseNode() : ASTNode(KIND), cond(nullptr), left(nullptr), right(nullptr) {}
+
   ~IfElseNode() {
     if (cond)
       delete cond;
@@ -289,7 +330,7 @@ struct IfElseNode : ASTNode {
       delete right;
   }
 
-  void print(int indent) const override {
+  void print(int indent) const {
     printIndent(indent);
     printf("If\n");
     cond->print(indent + 1);
@@ -305,23 +346,27 @@ struct IfElseNode : ASTNode {
 };
 
 struct VarDeclNode : ASTNode {
+  static constexpr NodeKind KIND = NodeKind::VAR_DECL;
+
   ASTType type;
   Token name;
   ASTNode *init; // Either a CodeBlockNode (representing a set of parameters) or an expression
+  bool constant = false; // Declared with const, init is folded by the compiler
 
   ~VarDeclNode() {
     if (init) delete init;
   }
 
   VarDeclNode(ASTType &t, Token v_name, ASTNode *e) : 
+    ASTNode(KIND),
     type(t),
     name(v_name),
     init(e)
   {}
 
-  void print(int indent) const override {
+  void print(int indent) const {
     printIndent(indent);
-    printf("let ");
+    printf(constant ? "const " : "let ");
     type.print();
     printf(" %.*s\n", name.length, name.start);
 
@@ -329,6 +374,73 @@ struct VarDeclNode : ASTNode {
   }
 };
 
+// Calls visitor with node as the struct of its kind. Every visitor
+// overload must return the same type
+template <class V> static inline auto visitNode(const ASTNode *node, V &&visitor) {
+  typedef decltype(visitor((const NumberNode *) nullptr)) Result;
+  switch (node->kind) {
+    #define NODE_VISIT(kind, type) case NodeKind::kind: return visitor(static_cast<const type *>(node));
+    AST_NODES(NODE_VISIT)
+    #undef NODE_VISIT
+  }
+  return Result();
+}
+
+// Calls fn on every child of node that isn't null, in source order
+template <class F> static inline void forEachChild(const ASTNode *node, F &&fn) {
+  const ASTNode *children[3] = {};
+  const std::vector<ASTNode *> *list = nullptr;
+
+  switch (node->kind) {
+    case NodeKind::NUMBER:
+    case NodeKind::IDENTIFIER:
+      break;
+    case NodeKind::BINARY:
+      children[0] = static_cast<const BinaryNode *>(node)->left;
+      children[1] = static_cast<const BinaryNode *>(node)->right;
+      break;
+    case NodeKind::UNARY:
+      children[0] = static_cast<const UnaryNode *>(node)->expr;
+      break;
+    case NodeKind::CALL:
+      list = &static_cast<const CallNode *>(node)->args;
+      break;
+    case NodeKind::CODE_BLOCK:
+      list = &static_cast<const CodeBlockNode *>(node)->statements;
+      break;
+    case NodeKind::EXPR_BLOCK:
+      list = &static_cast<const ExprBlockNode *>(node)->statements;
+      break;
+    case NodeKind::DO_EXPR:
+      children[0] = static_cast<const DoExprNode *>(node)->expr;
+      break;
+    case NodeKind::YIELD:
+      children[0] = static_cast<const YieldNode *>(node)->expr;
+      break;
+    case NodeKind::IF_ELSE:
+      children[0] = static_cast<const IfElseNode *>(node)->cond;
+      children[1] = static_cast<const IfElseNode *>(node)->left;
+      children[2] = static_cast<const IfElseNode *>(node)->right;
+      break;
+    case NodeKind::VAR_DECL:
+      children[0] = static_cast<const VarDeclNode *>(node)->init;
+      break;
+  }
+
+  for (const ASTNode *child : children) {
+    if (child) fn(child);
+  }
+  if (list) {
+    for (const ASTNode *child : *list) {
+      if (child) fn(child);
+    }
+  }
+}
+
+inline void ASTNode::print(int indent) const {
+  visitNode(this, [indent](const auto *node) { node->print(indent); });
+}
+
 class Parser {
   Lexer       lexer;
   Token       previous, current;
@@ -393,6 +505,9 @@ class Parser {
 
   ASTType parseType() {
     ASTType result;
+    std::string name;
+    std::vector<ASTType> tempargs;
+    int arrsize = 0;
     if (current.type == TokenType::KEY_REF) {
       result.ref = true;
       advance();
@@ -411,7 +526,7 @@ class Parser {
       logToken(current);
     }
     
-    result.name = tokenToString(current);
+    name = tokenToString(current);
     advance();
 
     if (
@@ -423,7 +538,17 @@ class Parser {
     ) {
       advance();
       expect(TokenType::RIGHT_SQUARE, "Expected '[]', but found '['\n");
-      result.name.append("[]");
+      name.append("[]");
+    } else if (current.type == TokenType::LEFT_SQUARE) {
+      // Fixed-size array, u8[16]
+      advance();
+      if (current.type != TokenType::NUMBER) {
+        error("Expected array size after '['\n");
+      } else {
+        arrsize = std::stoi(tokenToString(current));
+        advance();
+      }
+      expect(TokenType::RIGHT_SQUARE, "Expected ']' after array size\n");
     }
 
     if (current.type == TokenType::LT) {
@@ -431,12 +556,13 @@ class Parser {
 
       if (current.type == TokenType::GT) {
         advance();
+        result.id = types.intern(name, tempargs, arrsize);
         return result; // Empty ("<>")
       }
 
       while (current.type != TokenType::EOF_TOKEN) {
 
-        result.tempargs.push_back(parseType());
+        tempargs.push_back(parseType());
 
         if (current.type == TokenType::GT) break;
 
@@ -445,6 +571,7 @@ class Parser {
       advance();
     }
 
+    result.id = types.intern(name, tempargs, arrsize);
     return result;
   }
 
@@ -562,7 +689,32 @@ class Parser {
     return exprblock;
   }
 
+  // Arguments are expressions without the comma operator
+  ASTNode *parseCallAfterName(const Token &name) {
+    CallNode *call = new CallNode(name);
+    advance();
+
+    while (
+      current.type != TokenType::EOF_TOKEN &&
+      current.type != TokenType::RIGHT_ROUND
+    ) {
+      call->args.push_back(parseBinaryRHS(getPrec(TokenType::COMMA) + 1, parsePrimary()));
+      if (current.type == TokenType::RIGHT_ROUND) break;
+      if (!expect(TokenType::COMMA, "Expected ',' between arguments\n")) break;
+    }
+
+    expect(TokenType::RIGHT_ROUND, "Expected ')' after arguments\n");
+    return call;
+  }
+
   ASTNode *parsePrimary() {
+    int line = current.line;
+    ASTNode *node = parsePrimaryNode();
+    if (node) node->line = line;
+    return node;
+  }
+
+  ASTNode *parsePrimaryNode() {
     switch (current.type) {
       case TokenType::NUMBER: {
         advance();
@@ -616,6 +768,7 @@ class Parser {
 
         REVERT
         advance();
+        if (current.type == TokenType::LEFT_ROUND) return parseCallAfterName(previous);
         return new IdentifierNode(previous);
 
         #undef REVERT
@@ -660,6 +813,7 @@ class Parser {
       }
 
       lhs = new BinaryNode(op.type, lhs, rhs);
+      lhs->line = op.line;
     }
     return lhs;
   }
@@ -670,7 +824,14 @@ class Parser {
   }
 
   ASTNode *parseStatement() {
-    ASTNode *out;
+    int line = current.line;
+    ASTNode *out = parseStatementNode();
+    if (out) out->line = line;
+    return out;
+  }
+
+  ASTNode *parseStatementNode() {
+    ASTNode *out = nullptr;
     bool need_semi = true;
     switch (current.type) {
       case TokenType::KEY_IF: {
@@ -716,19 +877,11 @@ class Parser {
         out = code;
         need_semi = false;
       } break;
+      case TokenType::KEY_CONST:
       case TokenType::KEY_LET: {
+        bool constant = current.type == TokenType::KEY_CONST;
         advance();
         
-        Lexer lexstate = lexer;
-        Token prev = previous, curr = current;
-        if (isValidType()) {
-          error("Expected identifier at the beginning of type\n");
-          logToken(current);
-        }
-        lexer = lexstate;
-        previous = prev;
-        current = curr;
-        
         ASTType type = parseType();
 
         if (current.type != TokenType::IDENTIFIER) {
@@ -765,9 +918,10 @@ class Parser {
         } else {
           out = new VarDeclNode(type, previous, nullptr);
         }
+
+        if (out) static_cast<VarDeclNode *>(out)->constant = constant;
       } break;
       default:
-        printf("Token type: %d\n", current.type);
         out = parseExpr();
         break;
         /*if (!statementHadBadDetect) {
@@ -0,0 +1,124 @@
+#ifndef _ATOMS_CPP_
+#define _ATOMS_CPP_
+
+// Interned identifiers. The lexer gives every identifier token the atom of
+// its bytes, a dense 32-bit number shared by every name spelled the same,
+// so the parser and compiler compare and look names up by atom without
+// making strings. AtomMap is a symbol table indexed by atom.
+
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+typedef uint32_t Atom;
+
+class AtomTable {
+  std::vector<std::string> names;
+  std::vector<uint32_t> hashes; // Per atom
+  std::vector<Atom> slots;      // Open addressing, atom + 1 or 0 if empty
+
+  static uint32_t hash(const char *start, int length) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (int i = 0; i < length; ++i) h = (h ^ (unsigned char) start[i]) * 16777619u;
+    return h;
+  }
+
+  void insert(Atom atom) {
+    size_t mask = slots.size() - 1;
+    size_t i = hashes[atom] & mask;
+    while (slots[i]) i = (i + 1) & mask;
+    slots[i] = atom + 1;
+  }
+
+public:
+  AtomTable() : slots(64) {
+    intern("", 0); // 0, no name
+  }
+
+  Atom intern(const char *start, int length) {
+    uint32_t h = hash(start, length);
+    size_t mask = slots.size() - 1;
+    for (size_t i = h & mask; slots[i]; i = (i + 1) & mask) {
+      Atom atom = slots[i] - 1;
+      const std::string &name = names[atom];
+      if (hashes[atom] == h && (int) name.length() == length && memcmp(name.data(), start, length) == 0) return atom;
+    }
+
+    Atom atom = names.size();
+    names.emplace_back(start, length);
+    hashes.push_back(h);
+
+    // At most half full
+    if (names.size() * 2 > slots.size()) {
+      slots.assign(slots.size() * 2, 0);
+      for (Atom old = 0; old < names.size(); ++old) insert(old);
+    } else {
+      insert(atom);
+    }
+    return atom;
+  }
+
+  Atom intern(const std::string &name) {
+    return intern(name.data(), name.length());
+  }
+
+  const std::string &name(Atom atom) const {
+    return names[atom];
+  }
+
+  size_t size() const {
+    return names.size();
+  }
+};
+
+static AtomTable atoms;
+
+// A value per atom, indexed by it. Storing a value doesn't move the
+// others, references to them stay valid like with a node-based map
+template <class T> class AtomMap {
+  std::deque<T> values;
+  std::vector<bool> present;
+
+public:
+  // Nullptr if the atom has no value
+  T *find(Atom atom) {
+    return count(atom) ? &values[atom] : nullptr;
+  }
+
+  const T *find(Atom atom) const {
+    return count(atom) ? &values[atom] : nullptr;
+  }
+
+  bool count(Atom atom) const {
+    return atom < present.size() && present[atom];
+  }
+
+  // The atom's value, a new default one if it had none
+  T &operator[](Atom atom) {
+    if (atom >= values.size()) {
+      values.resize(atom + 1);
+      present.resize(atom + 1);
+    }
+    if (!present[atom]) {
+      values[atom] = T();
+      present[atom] = true;
+    }
+    return values[atom];
+  }
+
+  // False if the atom had no value
+  bool erase(Atom atom) {
+    if (!count(atom)) return false;
+    present[atom] = false;
+    return true;
+  }
+
+  void clear() {
+    values.clear();
+    present.clear();
+  }
+};
+
+#endif // _ATOMS_CPP_
@@ -0,0 +1,628 @@
+#ifndef _BATCH_CPP_
+#define _BATCH_CPP_
+
+// Lane-batched interpreter: runs one program over a block of inputs at once.
+// Every register is a column with an 8-byte slot per lane, and each
+// instruction is decoded once and then applied to all lanes in a loop, so
+// `ADD u32` becomes a loop the compiler vectorizes instead of 64 dispatches.
+//
+// Lanes that go different ways at a branch split into groups. The group at
+// the lowest instruction runs first and the others wait, so a group that
+// catches up with a waiting one merges with it again, the way structured
+// code reconverges after an `if` or a loop. Each lane has its own stack, SPP
+// and FPP point into it, so LOAD and STORE work per lane without changes.
+//
+// It runs the same bytecode as VM, but only programs accepts() takes: they
+// must be verified and may not use vector instructions. Runs go straight to
+// the end, without safe points or fuel.
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "program.cpp"
+#include "vm.cpp"
+
+#ifndef VM_BATCH_LANES
+#define VM_BATCH_LANES 64
+#endif
+
+// Low bytes of a register slot as a T
+template <class T> static inline T laneGet(uint64_t slot) {
+  T value;
+  memcpy(&value, &slot, sizeof(T));
+  return value;
+}
+
+template <int size> struct LaneBits;
+template <> struct LaneBits<1> { typedef uint8_t type; };
+template <> struct LaneBits<2> { typedef uint16_t type; };
+template <> struct LaneBits<4> { typedef uint32_t type; };
+template <> struct LaneBits<8> { typedef uint64_t type; };
+
+// A register slot with its low bytes replaced by value, the others are kept
+// as writes through a VM register pointer would keep them. Masks rather than
+// memcpy into the slot, which would stall on store forwarding
+template <class T> static inline uint64_t laneSet(uint64_t slot, T value) {
+  typedef typename LaneBits<sizeof(T)>::type U;
+  U bits;
+  memcpy(&bits, &value, sizeof(T));
+  return (slot & ~(uint64_t) (U) ~(U) 0) | bits;
+}
+
+// memcpy with the register sizes spelled out, so they get inlined
+static inline void copyBytes(void *dst, const void *src, int size) {
+  switch (size) {
+    case 1: memcpy(dst, src, 1); break;
+    case 2: memcpy(dst, src, 2); break;
+    case 4: memcpy(dst, src, 4); break;
+    case 8: memcpy(dst, src, 8); break;
+    default: memcpy(dst, src, size);
+  }
+}
+
+struct BatchStats {
+  uint64_t steps = 0;      // Instructions decoded
+  uint64_t lane_steps = 0; // Instructions run, summed over lanes
+  uint64_t splits = 0;     // Branches and returns that split a group
+};
+
+class BatchVM {
+public:
+  static const int LANES = VM_BATCH_LANES;
+
+private:
+  uint64_t columns[2][LANES] = {};
+  uint64_t *left = columns[0];  // SWAP swaps the columns themselves
+  uint64_t *right = columns[1];
+  std::vector<uint64_t> register_file; // Register r of lane i at r * LANES + i
+  std::vector<byte> stacks;            // Lane i's stack at i * MAX_STACK_SIZE
+  int32_t stack_end[LANES];
+  int32_t stack_frame[LANES];
+  int32_t lane_pc[LANES]; // Negative once the lane returned. Stale in the group
+
+  const byte *instructions = nullptr;
+  int count = 0;
+
+  // The lanes running together, all at prog_counter. A dense group is every
+  // lane of a full block, its loops skip the index list
+  int group[LANES];
+  int group_size = 0;
+  bool dense = false;
+  int32_t prog_counter = 0;
+  int32_t waiting_pc = INT32_MAX; // Lowest instruction a waiting lane is at
+  bool split = false; // lane_pc was set per lane, regroup before going on
+
+  BatchStats totals;
+
+  template <class F> void each(F f) {
+    if (dense) {
+      for (int i = 0; i < LANES; ++i) f(i);
+    } else {
+      for (int k = 0; k < group_size; ++k) f(group[k]);
+    }
+  }
+
+  // dst = f(dst, a, b) lane by lane. Dense groups write to a temporary
+  // first, the columns may overlap and this way the loop vectorizes without
+  // checking for that
+  template <class F> void apply(uint64_t *dst, const uint64_t *a, const uint64_t *b, F f) {
+    if (dense) {
+      uint64_t out[LANES];
+      for (int i = 0; i < LANES; ++i) out[i] = f(dst[i], a[i], b[i]);
+      memcpy(dst, out, sizeof(out));
+    } else {
+      each([&](int i) { dst[i] = f(dst[i], a[i], b[i]); });
+    }
+  }
+
+  byte *stackBase(int lane) {
+    return stacks.data() + (size_t) lane * MAX_STACK_SIZE;
+  }
+
+  uint64_t *registerColumn(byte reg) {
+    return register_file.data() + (size_t) reg * LANES;
+  }
+
+  void push(int lane, const void *data, int size) {
+    copyBytes(stackBase(lane) + stack_end[lane], data, size);
+    stack_end[lane] += size;
+  }
+
+  void pop(int lane, void *dest, int size) {
+    stack_end[lane] -= size;
+    copyBytes(dest, stackBase(lane) + stack_end[lane], size);
+  }
+
+  // Loads and stores that may cross from left into right go through the
+  // lane's registers laid out like VM::registers
+  void readRegisters(int lane, byte *registers) {
+    memcpy(registers, &left[lane], 8);
+    memcpy(registers + 8, &right[lane], 8);
+  }
+
+  void writeRegisters(int lane, const byte *registers) {
+    memcpy(&left[lane], registers, 8);
+    memcpy(&right[lane], registers + 8, 8);
+  }
+
+  void load(int lane, const void *ptr, int size) {
+    if (size <= 8) {
+      copyBytes(&left[lane], ptr, size);
+      return;
+    }
+    byte registers[16];
+    readRegisters(lane, registers);
+    memcpy(registers, ptr, size);
+    writeRegisters(lane, registers);
+  }
+
+  // Makes the lanes at the lowest instruction the group, false once every
+  // lane has returned
+  bool regroup() {
+    int32_t low = INT32_MAX;
+    for (int i = 0; i < count; ++i) {
+      if (lane_pc[i] >= 0 && lane_pc[i] < low) low = lane_pc[i];
+    }
+
+    group_size = 0;
+    waiting_pc = INT32_MAX;
+    if (low == INT32_MAX) {
+      dense = false;
+      prog_counter = -1;
+      return false;
+    }
+    for (int i = 0; i < count; ++i) {
+      if (lane_pc[i] == low) group[group_size++] = i;
+      else if (lane_pc[i] >= 0 && lane_pc[i] < waiting_pc) waiting_pc = lane_pc[i];
+    }
+    dense = group_size == LANES;
+    prog_counter = low;
+    return true;
+  }
+
+  // Sends the lanes whose left is zero (or isn't, for JMPNZ) to target, the
+  // rest go on with the next instruction
+  void branch(int32_t target, bool if_zero) {
+    const uint64_t *l = left;
+    int taken = 0;
+    each([&](int i) { taken += ((uint8_t) l[i] == 0) == if_zero; });
+    if (taken == 0) return;
+    if (taken == group_size) {
+      prog_counter = target;
+      return;
+    }
+
+    int32_t next = prog_counter;
+    each([&](int i) { lane_pc[i] = ((uint8_t) l[i] == 0) == if_zero ? target : next; });
+    split = true;
+    totals.splits++;
+  }
+
+  void print(int lane) {
+    printf("Lane %d registers:\n   Left: 0x%.16llX\n   Left: %lli\n   Left: %ff\n", lane,
+      (unsigned long long) left[lane], (long long) left[lane], laneGet<float>(left[lane]));
+    printf("\n  Right: 0x%.16llX\n  Right: %lli\n  Right: %ff\n",
+      (unsigned long long) right[lane], (long long) right[lane], laneGet<float>(right[lane]));
+  }
+
+  #define GET_BYTES(num) (instructions + (prog_counter += num) - num)
+
+  // Runs the instruction at prog_counter for every lane of the group
+  void step() {
+    totals.steps++;
+    totals.lane_steps += group_size;
+
+    uint64_t *l = left, *r = right;
+    byte opcode = genericOpcode(*GET_BYTES(1));
+
+    switch (opcode) {
+      case OPCODE_LOADC:
+      case OPCODE_LOADC_SWAP: {
+        int size = *GET_BYTES(1);
+        int32_t pos = *(int32_t *) GET_BYTES(4);
+        uint64_t constant = 0, keep = size >= 8 ? 0 : ~0ull << (size * 8);
+        memcpy(&constant, instructions + pos, size);
+        if (opcode == OPCODE_LOADC_SWAP) {
+          each([&](int i) { uint64_t t = l[i]; l[i] = r[i]; r[i] = (t & keep) | constant; });
+        } else {
+          apply(l, l, l, [&](uint64_t d, uint64_t, uint64_t) { return (d & keep) | constant; });
+        }
+        break;
+      }
+
+      case OPCODE_SWAP:
+        if (dense) {
+          left = r;
+          right = l;
+        } else {
+          each([&](int i) { uint64_t t = l[i]; l[i] = r[i]; r[i] = t; });
+        }
+        break;
+
+      // Typed opcodes, quickened forms were mapped to theirs above and keep
+      // the type byte
+      #define BATCH_OPB(type, op) \
+        apply(l, l, r, [](uint64_t d, uint64_t a, uint64_t b) { return laneSet<type>(d, (type) (laneGet<type>(a) op laneGet<type>(b))); })
+      #define BATCH_OPU(type, op) \
+        apply(l, l, r, [](uint64_t d, uint64_t a, uint64_t) { return laneSet<type>(d, (type) (op laneGet<type>(a))); })
+      #define BATCH_OPC(type, op) \
+        apply(l, l, r, [](uint64_t d, uint64_t a, uint64_t b) { return laneSet<uint8_t>(d, laneGet<type>(a) op laneGet<type>(b)); })
+
+      #define BATCH_TYPED_CASE(suffix, tbyte, value, bits, op, ub, sel) \
+        case tbyte: \
+          BATCH_OP##ub(sel(value, bits), op); \
+          break;
+
+      #define BATCH_OP_CASE(name, op, ub, sel, ...) \
+      case OPCODE_##name: \
+        switch (*GET_BYTES(1)) { \
+          PRIMITIVE_TYPES(BATCH_TYPED_CASE, op, ub, sel) \
+        } \
+        break;
+
+      TYPED_OPCODES(BATCH_OP_CASE)
+      #undef BATCH_OP_CASE
+
+      case OPCODE_BAND:
+        BATCH_OPC(uint8_t, &&);
+        break;
+      case OPCODE_BOR:
+        BATCH_OPC(uint8_t, ||);
+        break;
+      case OPCODE_BNOT:
+        BATCH_OPU(uint8_t, !);
+        break;
+
+      #define BATCH_CMP_JMPZ(name, op) \
+      case OPCODE_##name##_JMPZ: { \
+        switch (*GET_BYTES(1)) { \
+          PRIMITIVE_TYPES(BATCH_TYPED_CASE, op, C, VALUE_TYPE) \
+        } \
+        int32_t pos = *(int32_t *) GET_BYTES(4); \
+        branch(pos, true); \
+        break; \
+      }
+
+      BATCH_CMP_JMPZ(CMPE, ==)
+      BATCH_CMP_JMPZ(CMPL, < )
+      BATCH_CMP_JMPZ(CMPG, > )
+      #undef BATCH_CMP_JMPZ
+      #undef BATCH_TYPED_CASE
+      #undef BATCH_OPC
+      #undef BATCH_OPU
+      #undef BATCH_OPB
+
+      case OPCODE_CONV: {
+        byte from = *GET_BYTES(1);
+        ConvertFn convert = conversionFor(from, *GET_BYTES(1));
+        if (convert) each([&](int i) { convert((byte *) &l[i]); });
+        break;
+      }
+
+      case OPCODE_RETURN:
+        each([&](int i) {
+          pop(i, &lane_pc[i], 4);
+          pop(i, &stack_frame[i], 4);
+        });
+        split = true;
+        break;
+
+      case OPCODE_CALL: {
+        int32_t target = *(int32_t *) GET_BYTES(4);
+        int32_t next = prog_counter;
+        each([&](int i) {
+          push(i, &stack_frame[i], 4);
+          push(i, &next, 4);
+          stack_frame[i] = stack_end[i];
+        });
+        prog_counter = target;
+        break;
+      }
+
+      case OPCODE_PUSH:
+      case OPCODE_POP: {
+        byte reg = *GET_BYTES(1);
+        each([&](int i) {
+          byte registers[16];
+          readRegisters(i, registers);
+          if (opcode == OPCODE_PUSH) {
+            push(i, registers + UPPER(reg), LOWER(reg));
+          } else {
+            pop(i, registers + UPPER(reg), LOWER(reg));
+            writeRegisters(i, registers);
+          }
+        });
+        break;
+      }
+
+      case OPCODE_RESERVE: {
+        int16_t size = *(int16_t *) GET_BYTES(2);
+        each([&](int i) {
+          bulk.fill(stackBase(i) + stack_end[i], 0, 1, size);
+          stack_end[i] += size;
+        });
+        break;
+      }
+
+      case OPCODE_RELEASE: {
+        int16_t size = *(int16_t *) GET_BYTES(2);
+        each([&](int i) { stack_end[i] -= size; });
+        break;
+      }
+
+      case OPCODE_LOAD: {
+        int size = *GET_BYTES(1);
+        each([&](int i) { load(i, (const void *) l[i], size); });
+        break;
+      }
+
+      case OPCODE_STORE: {
+        int size = *GET_BYTES(1);
+        each([&](int i) { copyBytes((void *) l[i], &r[i], size); });
+        break;
+      }
+
+      case OPCODE_CPY: {
+        int32_t count = *(int32_t *) GET_BYTES(4);
+        each([&](int i) { bulk.copy((byte *) l[i], (const byte *) r[i], count); });
+        break;
+      }
+
+      case OPCODE_FILL: {
+        int width = *GET_BYTES(1);
+        int32_t count = *(int32_t *) GET_BYTES(4);
+        each([&](int i) { bulk.fill((byte *) l[i], r[i], width, count); });
+        break;
+      }
+
+      case OPCODE_MCMP: {
+        int32_t count = *(int32_t *) GET_BYTES(4);
+        each([&](int i) {
+          l[i] = laneSet<int8_t>(l[i], bulk.compare((const byte *) l[i], (const byte *) r[i], count));
+        });
+        break;
+      }
+
+      // Host functions see one lane's registers at a time, laid out as in VM
+      case OPCODE_SPECCALL: {
+        const NativeFunction &native = natives.get(*GET_BYTES(1));
+        each([&](int i) {
+          uint64_t lane[2] = {l[i], r[i]};
+          stack_end[i] -= native.stack;
+          native.call((byte *) lane, stackBase(i) + stack_end[i]);
+          l[i] = lane[0];
+        });
+        break;
+      }
+
+      case OPCODE_FTRIG: {
+        byte type = *GET_BYTES(1);
+        NativeFn function = trigFunction(type, *GET_BYTES(1));
+        each([&](int i) { function((byte *) &l[i], nullptr); });
+        break;
+      }
+
+      case OPCODE_SPP:
+      case OPCODE_FPP:
+      case OPCODE_SPP_LOAD:
+      case OPCODE_FPP_LOAD: {
+        int32_t index = *(int32_t *) GET_BYTES(4);
+        bool frame = opcode == OPCODE_FPP || opcode == OPCODE_FPP_LOAD;
+        each([&](int i) { l[i] = (uint64_t) (stackBase(i) + (frame ? stack_frame[i] : 8) + index); });
+        if (opcode == OPCODE_SPP_LOAD || opcode == OPCODE_FPP_LOAD) {
+          int size = *GET_BYTES(1);
+          each([&](int i) { load(i, (const void *) l[i], size); });
+        }
+        break;
+      }
+
+      case OPCODE_JMP: {
+        int32_t pos = *(int32_t *) GET_BYTES(4);
+        prog_counter = pos;
+        break;
+      }
+
+      case OPCODE_JMPZ:
+      case OPCODE_JMPNZ: {
+        int32_t pos = *(int32_t *) GET_BYTES(4);
+        branch(pos, opcode == OPCODE_JMPZ);
+        break;
+      }
+
+      case OPCODE_SWAP_POP_STORE: {
+        byte reg = *GET_BYTES(1);
+        int size = *GET_BYTES(1);
+        each([&](int i) {
+          byte registers[16];
+          memcpy(registers, &r[i], 8);
+          memcpy(registers + 8, &l[i], 8);
+          pop(i, registers + UPPER(reg), LOWER(reg));
+          memcpy(&l[i], registers, 8);
+          memcpy(&r[i], registers + 8, 8);
+          copyBytes((void *) l[i], &r[i], size);
+        });
+        break;
+      }
+
+      // Register file, one column per register
+      #define REG(index) registerColumn(index)
+
+      case OPCODE_R_LOADC: {
+        uint64_t *dst = REG(*GET_BYTES(1));
+        int size = *GET_BYTES(1);
+        int32_t pos = *(int32_t *) GET_BYTES(4);
+        uint64_t constant = 0, keep = size >= 8 ? 0 : ~0ull << (size * 8);
+        memcpy(&constant, instructions + pos, size);
+        apply(dst, dst, dst, [&](uint64_t d, uint64_t, uint64_t) { return (d & keep) | constant; });
+        break;
+      }
+
+      case OPCODE_R_MOV:
+      case OPCODE_R_GET:
+      case OPCODE_R_SET: {
+        uint64_t *dst = opcode == OPCODE_R_GET ? l : REG(*GET_BYTES(1));
+        const uint64_t *src = opcode == OPCODE_R_SET ? l : REG(*GET_BYTES(1));
+        each([&](int i) { dst[i] = src[i]; });
+        break;
+      }
+
+      case OPCODE_R_SPP:
+      case OPCODE_R_FPP: {
+        uint64_t *dst = REG(*GET_BYTES(1));
+        int32_t index = *(int32_t *) GET_BYTES(4);
+        bool frame = opcode == OPCODE_R_FPP;
+        each([&](int i) { dst[i] = (uint64_t) (stackBase(i) + (frame ? stack_frame[i] : 8) + index); });
+        break;
+      }
+
+      case OPCODE_R_LOAD: {
+        uint64_t *dst = REG(*GET_BYTES(1));
+        const uint64_t *ptr = REG(*GET_BYTES(1));
+        int size = *GET_BYTES(1);
+        each([&](int i) { copyBytes(&dst[i], (const void *) ptr[i], size); });
+        break;
+      }
+
+      case OPCODE_R_STORE: {
+        const uint64_t *ptr = REG(*GET_BYTES(1));
+        const uint64_t *src = REG(*GET_BYTES(1));
+        int size = *GET_BYTES(1);
+        each([&](int i) { copyBytes((void *) ptr[i], &src[i], size); });
+        break;
+      }
+
+      case OPCODE_R_PUSH: {
+        const uint64_t *src = REG(*GET_BYTES(1));
+        int size = *GET_BYTES(1);
+        each([&](int i) { push(i, &src[i], size); });
+        break;
+      }
+
+      case OPCODE_R_POP: {
+        uint64_t *dst = REG(*GET_BYTES(1));
+        int size = *GET_BYTES(1);
+        each([&](int i) { pop(i, &dst[i], size); });
+        break;
+      }
+
+      case OPCODE_R_CONV: {
+        uint64_t *dst = REG(*GET_BYTES(1));
+        byte from = *GET_BYTES(1);
+        ConvertFn convert = conversionFor(from, *GET_BYTES(1));
+        if (convert) each([&](int i) { convert((byte *) &dst[i]); });
+        break;
+      }
+
+      case OPCODE_R_BNOT: {
+        uint64_t *dst = REG(*GET_BYTES(1));
+        const uint64_t *src = REG(*GET_BYTES(1));
+        apply(dst, src, src, [](uint64_t d, uint64_t a, uint64_t) { return laneSet<uint8_t>(d, !laneGet<uint8_t>(a)); });
+        break;
+      }
+
+      #define BATCH_ROPB(type, op) \
+        apply(dst, a, b, [](uint64_t d, uint64_t x, uint64_t y) { return laneSet<type>(d, (type) (laneGet<type>(x) op laneGet<type>(y))); })
+      #define BATCH_ROPU(type, op) \
+        apply(dst, a, b, [](uint64_t d, uint64_t x, uint64_t) { return laneSet<type>(d, (type) (op laneGet<type>(x))); })
+      #define BATCH_ROPC(type, op) \
+        apply(dst, a, b, [](uint64_t d, uint64_t x, uint64_t y) { return laneSet<uint8_t>(d, laneGet<type>(x) op laneGet<type>(y)); })
+
+      #define BATCH_REGISTER_CASE(suffix, tbyte, value, bits, op, ub, sel) \
+        case tbyte: \
+          BATCH_ROP##ub(sel(value, bits), op); \
+          break;
+
+      #define BATCH_REGISTER_OP(name, op, ub, sel, ...) \
+      case OPCODE_R_##name: { \
+        uint64_t *dst = REG(*GET_BYTES(1)); \
+        const uint64_t *a = REG(*GET_BYTES(1)); \
+        const uint64_t *b = REG(*GET_BYTES(1)); \
+        (void) b; \
+        switch (*GET_BYTES(1)) { \
+          PRIMITIVE_TYPES(BATCH_REGISTER_CASE, op, ub, sel) \
+        } \
+        break; \
+      }
+
+      TYPED_OPCODES(BATCH_REGISTER_OP)
+      #undef BATCH_REGISTER_OP
+      #undef BATCH_REGISTER_CASE
+      #undef BATCH_ROPC
+      #undef BATCH_ROPU
+      #undef BATCH_ROPB
+      #undef REG
+
+      case OPCODE_PRINT:
+        each([&](int i) { print(i); });
+        break;
+
+      default:
+        printf("Expected valid instruction\n");
+        exit(11);
+    }
+  }
+
+  #undef GET_BYTES
+
+public:
+  BatchVM() : register_file((size_t) VM_REGISTER_COUNT * LANES), stacks((size_t) LANES * MAX_STACK_SIZE) {}
+
+  BatchVM(const BatchVM &) = delete;
+  BatchVM &operator=(const BatchVM &) = delete;
+
+  // Whether run() can take the program
+  static bool accepts(const Program &program) {
+    if (!program.isVerified()) return false;
+    const byte *code = program.data();
+    for (int pc = 0; pc < program.codeSize(); pc += opcodeLength(code[pc])) {
+      if (code[pc] >= OPCODE_VLOAD && code[pc] <= OPCODE_VMAX) return false;
+    }
+    return true;
+  }
+
+  // Registers of every lane, lane i's left register is leftColumn()[i].
+  // Write the inputs before run() and read the results after it, SWAP
+  // trades the columns so get them again after running
+  uint64_t *leftColumn() {
+    return left;
+  }
+
+  uint64_t *rightColumn() {
+    return right;
+  }
+
+  // Runs the first `lanes` lanes from the start of the program until each
+  // of them returned. Stacks start empty as after VM::init(), the registers
+  // and the register file are kept from before
+  void run(const Program &program, int lanes = LANES) {
+    instructions = program.data();
+    count = min(max(lanes, 0), LANES);
+    for (int i = 0; i < count; ++i) {
+      int32_t entry = -10;
+      stack_end[i] = 0;
+      stack_frame[i] = 0;
+      push(i, &stack_frame[i], 4);
+      push(i, &entry, 4);
+      lane_pc[i] = 0;
+    }
+    if (!regroup()) return;
+
+    for (;;) {
+      step();
+      if (split) {
+        split = false;
+        if (!regroup()) break;
+      } else if (prog_counter < 0 || prog_counter >= waiting_pc) {
+        int32_t pc = prog_counter;
+        each([&](int i) { lane_pc[i] = pc; });
+        if (!regroup()) break;
+      }
+    }
+  }
+
+  const BatchStats &stats() const {
+    return totals;
+  }
+};
+
+#endif // _BATCH_CPP_
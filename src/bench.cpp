@@ -0,0 +1,921 @@
+// Interpreter benchmarks. Build with: g++ -std=c++17 -O2 -pthread src/bench.cpp -o bench
+
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "astparser.cpp"
+#include "batch.cpp"
+#include "compiler.cpp"
+#include "executor.cpp"
+#include "jit.cpp"
+#include "program.cpp"
+#include "scheduler.cpp"
+#include "verify.cpp"
+#include "vm.cpp"
+#include "codebuilder.cpp"
+
+// A straight-line arithmetic kernel, the kind of script we run most
+static CodeBuilder arithmeticKernel(int repeats) {
+  const byte u32 = MERGE(TYPE_UNSIGNED, FROM_SIZE(32));
+  CodeBuilder builder;
+
+  for (int i = 0; i < repeats; ++i) {
+    builder.loadConstant<uint32_t>(i + 1);
+    builder.op(OPCODE_ADD, u32);
+    builder.op(OPCODE_MUL, u32);
+    builder.op(OPCODE_XOR, u32);
+    builder.op(OPCODE_SUB, u32);
+    builder.op(OPCODE_CMPL, u32);
+    builder.op(OPCODE_NOT, u32);
+    builder.op(OPCODE_NEG, u32);
+  }
+  builder.op(OPCODE_RETURN);
+  builder.finish();
+  return builder;
+}
+
+template <class F> static double timeRuns(int runs, F run) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < runs; ++i) run();
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+static void benchDispatch() {
+  const int repeats = 4096, runs = 500;
+  const int instructions = repeats * 8 + 1;
+  CodeBuilder kernel = arithmeticKernel(repeats);
+  std::vector<byte> &code = kernel.code;
+
+  VM vm;
+  vm.instructions = code.data();
+  vm.instructions_size = code.size();
+
+  double switch_ns = timeRuns(runs, [&]() {
+    vm.init();
+    memset(vm.registers, 0, sizeof(vm.registers));
+    vm.execute_switch();
+  });
+  uint64_t switch_result = *(uint64_t *) vm.registers;
+
+  double threaded_ns = timeRuns(runs, [&]() {
+    vm.init();
+    memset(vm.registers, 0, sizeof(vm.registers));
+    vm.execute();
+  });
+  uint64_t threaded_result = *(uint64_t *) vm.registers;
+
+  std::vector<byte> quick = code;
+  quicken(quick.data(), kernel.code_size);
+  vm.instructions = quick.data();
+
+  double quick_ns = timeRuns(runs, [&]() {
+    vm.init();
+    memset(vm.registers, 0, sizeof(vm.registers));
+    vm.execute();
+  });
+  uint64_t quick_result = *(uint64_t *) vm.registers;
+
+  VerifyReport report;
+  if (!verifyBytecode(quick.data(), kernel.code_size, quick.size(), report)) {
+    printf("Kernel failed verification at %d: %s\n", report.error_pc, report.error);
+    exit(1);
+  }
+  vm.unchecked = true;
+
+  double unchecked_ns = timeRuns(runs, [&]() {
+    vm.init();
+    memset(vm.registers, 0, sizeof(vm.registers));
+    vm.execute();
+  });
+  uint64_t unchecked_result = *(uint64_t *) vm.registers;
+
+  printf("Dispatch (%d instructions x %d runs):\n", instructions, runs);
+  printf("  execute_one loop: %8.3f ns/instruction\n", switch_ns / runs / instructions);
+#ifdef VM_COMPUTED_GOTO
+  printf("  threaded run():   %8.3f ns/instruction\n", threaded_ns / runs / instructions);
+#else
+  printf("  switch run():     %8.3f ns/instruction (computed goto unavailable)\n", threaded_ns / runs / instructions);
+#endif
+  printf("  quickened run():  %8.3f ns/instruction\n", quick_ns / runs / instructions);
+  printf("  verified run():   %8.3f ns/instruction (unchecked)\n", unchecked_ns / runs / instructions);
+  if (switch_result != threaded_result || switch_result != quick_result || switch_result != unchecked_result) {
+    printf("  Results differ!\n");
+    exit(1);
+  }
+}
+
+// Counts the u64 in stack slot 0 down to zero, then returns
+static void emitCountdown(CodeBuilder &builder) {
+  const byte u64 = MERGE(TYPE_UNSIGNED, FROM_SIZE(64));
+  int32_t loop = builder.code.size();
+  builder.op(OPCODE_SPP);
+  builder.value<int32_t>(0);
+  builder.op(OPCODE_LOAD, 8);
+  builder.op(OPCODE_SWAP);
+  builder.loadConstant<uint64_t>(0);
+  builder.op(OPCODE_SWAP);
+  builder.op(OPCODE_CMPG, u64);
+  builder.op(OPCODE_JMPZ);
+  int exit_operand = builder.code.size();
+  builder.value<int32_t>(0);
+
+  builder.op(OPCODE_SPP);
+  builder.value<int32_t>(0);
+  builder.op(OPCODE_LOAD, 8);
+  builder.op(OPCODE_SWAP);
+  builder.loadConstant<uint64_t>(1);
+  builder.op(OPCODE_SWAP);
+  builder.op(OPCODE_SUB, u64);
+  builder.op(OPCODE_SWAP);
+  builder.op(OPCODE_SPP);
+  builder.value<int32_t>(0);
+  builder.op(OPCODE_STORE, 8);
+  builder.op(OPCODE_JMP);
+  builder.value<int32_t>(loop);
+
+  *(int32_t *)(builder.code.data() + exit_operand) = builder.code.size();
+  builder.op(OPCODE_SPP);
+  builder.value<int32_t>(0);
+  builder.op(OPCODE_LOAD, 8);
+  builder.op(OPCODE_RELEASE);
+  builder.value<int16_t>(8);
+  builder.op(OPCODE_RETURN);
+  builder.finish();
+}
+
+// A countdown loop through the stack, mixing native jumps with
+// interpreter callbacks (SPP, LOAD, STORE, RESERVE)
+static CodeBuilder countdownLoop(uint64_t count) {
+  CodeBuilder builder;
+  builder.op(OPCODE_RESERVE);
+  builder.value<int16_t>(8);
+  builder.loadConstant<uint64_t>(count);
+  builder.op(OPCODE_SWAP);
+  builder.op(OPCODE_SPP);
+  builder.value<int32_t>(0);
+  builder.op(OPCODE_STORE, 8);
+  emitCountdown(builder);
+  return builder;
+}
+
+// The same loop counting down the input in the right register, so every
+// input goes around a different number of times
+static CodeBuilder inputCountdown() {
+  CodeBuilder builder;
+  builder.op(OPCODE_RESERVE);
+  builder.value<int16_t>(8);
+  builder.op(OPCODE_SPP);
+  builder.value<int32_t>(0);
+  builder.op(OPCODE_STORE, 8);
+  emitCountdown(builder);
+  return builder;
+}
+
+// Straight-line code over every primitive type. Integer division is left
+// out, both ways would fault on a zero divisor
+static CodeBuilder randomProgram(uint32_t seed, int length) {
+  static const byte types[] = {
+    #define TYPE_BYTE(suffix, tbyte, ...) tbyte,
+    PRIMITIVE_TYPES(TYPE_BYTE)
+    #undef TYPE_BYTE
+  };
+  static const byte ops[] = {
+    #define TYPED_BYTE(name, ...) OPCODE_##name,
+    TYPED_OPCODES(TYPED_BYTE)
+    #undef TYPED_BYTE
+    OPCODE_BAND, OPCODE_BOR, OPCODE_BNOT,
+  };
+
+  CodeBuilder builder;
+  for (int i = 0; i < length; ++i) {
+    seed = seed * 1664525 + 1013904223;
+    byte type = types[(seed >> 8) % PRIMITIVE_TYPE_COUNT];
+    byte op = ops[(seed >> 16) % sizeof(ops)];
+
+    switch ((seed >> 24) % 4) {
+      case 0: builder.loadConstant<uint64_t>(((uint64_t) seed << 32) | (seed * 2654435761u)); break;
+      case 1: builder.loadConstant<uint16_t>(seed >> 5); break;
+      case 2: builder.op(OPCODE_LOADC_SWAP, 4); builder.value<int32_t>(builder.code.size() - 2); break;
+    }
+
+    if (op == OPCODE_DIV && UPPER(type) != TYPE_FLOAT) op = OPCODE_MUL;
+    if (op == OPCODE_BAND || op == OPCODE_BOR || op == OPCODE_BNOT) builder.op(op);
+    else builder.op(op, type);
+  }
+  builder.op(OPCODE_RETURN);
+  builder.finish();
+  return builder;
+}
+
+static bool sameState(const VM &a, const VM &b) {
+  return memcmp(a.registers, b.registers, sizeof(a.registers)) == 0 &&
+         a.stack_end == b.stack_end && a.prog_counter == b.prog_counter;
+}
+
+// Runs programs through the interpreter and the JIT and compares the state
+// they leave behind
+static bool checkJit(const CodeBuilder &program, bool quickened) {
+  std::vector<byte> code = program.code;
+  if (quickened) quicken(code.data(), program.code_size);
+
+  VM reference;
+  reference.instructions = code.data();
+  reference.instructions_size = code.size();
+  reference.init();
+  reference.execute();
+
+  JitCode jit;
+  if (!jit.compile(code.data(), program.code_size, code.size())) return true;
+
+  VM native;
+  native.instructions = code.data();
+  native.instructions_size = code.size();
+  native.native = jit.entry();
+  native.init();
+  native.execute();
+
+  return sameState(reference, native);
+}
+
+static void benchJit() {
+  JitCode probe;
+  CodeBuilder countdown = countdownLoop(3);
+  if (!probe.compile(countdown.code.data(), countdown.code_size, countdown.code.size())) {
+    printf("JIT: unavailable on this platform\n");
+    return;
+  }
+
+  int failures = 0, programs = 0;
+  for (bool quickened : {false, true}) {
+    failures += !checkJit(countdown, quickened);
+    failures += !checkJit(arithmeticKernel(64), quickened);
+    programs += 2;
+    for (uint32_t seed = 1; seed <= 200; ++seed) {
+      failures += !checkJit(randomProgram(seed, 64), quickened);
+      programs++;
+    }
+  }
+
+  const int repeats = 4096, runs = 500;
+  const int instructions = repeats * 8 + 1;
+  CodeBuilder kernel = arithmeticKernel(repeats);
+  JitCode jit;
+  jit.compile(kernel.code.data(), kernel.code_size, kernel.code.size());
+
+  VM vm;
+  vm.instructions = kernel.code.data();
+  vm.instructions_size = kernel.code.size();
+  vm.native = jit.entry();
+
+  double jit_ns = timeRuns(runs, [&]() {
+    vm.init();
+    memset(vm.registers, 0, sizeof(vm.registers));
+    vm.execute();
+  });
+
+  printf("JIT (%d instructions x %d runs):\n", instructions, runs);
+  printf("  native code:      %8.3f ns/instruction\n", jit_ns / runs / instructions);
+  printf("  differential:     %d/%d programs match the interpreter\n", programs - failures, programs);
+  if (failures) exit(1);
+}
+
+// Expression statements end in PRINT, keep that out of the terminal
+class SilenceStdout {
+  int saved;
+
+public:
+  SilenceStdout() {
+    fflush(stdout);
+    saved = dup(1);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    close(null);
+  }
+
+  ~SilenceStdout() {
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+  }
+};
+
+// A program in the source language over u8, u32 and u64 variables, with
+// constants, references, ifs and expression blocks. It ends by printing a
+// u64 of every variable, so left holds the same bits however it's compiled
+class SourceGenerator {
+  struct Variable {
+    std::string name;
+    const char *type;
+  };
+
+  uint32_t seed;
+  std::vector<Variable> variables;
+  std::vector<Variable> refs;
+  int temporaries = 0;
+  std::string out;
+
+  uint32_t below(uint32_t n) {
+    seed = seed * 1664525 + 1013904223;
+    return (seed >> 8) % n;
+  }
+
+  const char *type() {
+    static const char *const types[] = {"u8", "u32", "u64"};
+    return types[below(3)];
+  }
+
+  void operand() {
+    if (below(3) == 0) out += std::to_string(below(300));
+    else out += variables[below(variables.size())].name;
+  }
+
+  void expression() {
+    static const char *const ops[] = {" + ", " - ", " * ", " ^ ", " & ", " | "};
+    operand();
+    for (int count = below(3); count >= 0; --count) {
+      out += ops[below(6)];
+      operand();
+    }
+  }
+
+  // A variable or a reference to one
+  const std::string &target() {
+    if (!refs.empty() && below(2) == 0) return refs[below(refs.size())].name;
+    return variables[below(variables.size())].name;
+  }
+
+  void assignment() {
+    static const char *const assigns[] = {" = ", " += ", " -= ", " *= "};
+    out += target();
+    out += assigns[below(4)];
+    expression();
+    out += ";\n";
+  }
+
+  void declaration() {
+    Variable var = {"v" + std::to_string(variables.size()), type()};
+    out += "let " + std::string(var.type) + " " + var.name + " = ";
+    if (below(4) == 0) {
+      std::string temp = "t" + std::to_string(temporaries++);
+      out += std::string(var.type) + " : {\n  let u32 " + temp + " = ";
+      expression();
+      out += ";\n  " + temp + " += ";
+      operand();
+      out += ";\n  yield " + temp + " * 2;\n}";
+    } else {
+      expression();
+    }
+    out += ";\n";
+    variables.push_back(var);
+  }
+
+  // Comparisons give a u8, anything else is compared with zero
+  void ifElse() {
+    static const char *const compares[] = {" < ", " > ", " == ", " & "};
+    out += "if (";
+    operand();
+    out += compares[below(4)];
+    operand();
+    out += ") {\n  ";
+    assignment();
+    if (below(2)) {
+      out += "  ";
+      assignment();
+    }
+    out += "}";
+    if (below(2)) {
+      out += " else {\n  ";
+      assignment();
+      out += "}";
+    }
+    out += "\n";
+  }
+
+  void reference() {
+    const Variable &to = variables[below(variables.size())];
+    Variable ref = {"r" + std::to_string(refs.size()), to.type};
+    out += "let ref " + std::string(ref.type) + " " + ref.name + " = " + to.name + ";\n";
+    refs.push_back(ref);
+  }
+
+public:
+  explicit SourceGenerator(uint32_t seed) : seed(seed) {}
+
+  std::string generate(int statements) {
+    variables.push_back({"v0", "u64"});
+    out = "let u64 v0 = " + std::to_string(below(1000)) + ";\n";
+
+    for (int i = 0; i < statements; ++i) {
+      switch (below(6)) {
+        case 0: case 1: declaration(); break;
+        case 2: assignment(); break;
+        case 3: ifElse(); break;
+        case 4: reference(); break;
+        case 5: out += target() + ";\n"; break; // Prints it
+      }
+    }
+
+    out += "let u64 result = v0";
+    for (size_t i = 1; i < variables.size(); ++i) out += " + " + variables[i].name;
+    out += ";\nresult;\n";
+    return out;
+  }
+};
+
+// Compiles and runs source, leaving the final left in result. False if it
+// doesn't compile. `skipped` gets why the optimizer didn't run, if it didn't
+static bool runSource(const std::string &source, bool register_mode, int opt_level, uint32_t peephole,
+                      uint64_t &result, std::string *skipped = nullptr) {
+  Parser parser;
+  parser.parse(source.c_str());
+  Compiler compiler;
+  compiler.register_mode = register_mode;
+  compiler.opt_level = opt_level;
+  compiler.peephole = peephole;
+  bool compiled = compiler.compile(parser.top);
+  delete parser.top;
+  if (!compiled) return false;
+  if (skipped) *skipped = compiler.optimizerSkipped() ? compiler.optimizerSkipped() : "";
+
+  std::vector<byte> code(compiler.resultData(), compiler.resultData() + compiler.resultSize());
+  VM vm;
+  vm.instructions = code.data();
+  vm.instructions_size = code.size();
+  vm.init();
+  {
+    SilenceStdout silence;
+    vm.execute();
+  }
+  memcpy(&result, vm.registers, sizeof(result));
+  return true;
+}
+
+// Generated programs with and without the peephole rules, in both modes
+static void checkPeephole() {
+  int failures = 0, programs = 0;
+  for (bool register_mode : {false, true}) {
+    for (uint32_t seed = 1; seed <= 100; ++seed) {
+      std::string source = SourceGenerator(seed).generate(40);
+      uint64_t plain, optimized;
+      bool ok = runSource(source, register_mode, 0, PEEP_NONE, plain) &&
+                runSource(source, register_mode, 0, PEEP_ALL, optimized);
+      if (!ok || plain != optimized) {
+        printf("  seed %u%s: %s\n", seed, register_mode ? " (registers)" : "",
+          ok ? "results differ" : "doesn't compile");
+        failures++;
+      }
+      programs++;
+    }
+  }
+
+  printf("Peephole:\n");
+  printf("  differential:     %d/%d programs match --no-peephole\n", programs - failures, programs);
+  if (failures) exit(1);
+}
+
+// Generated programs at -O0 and -O2 in both modes. Arrays aren't optimized,
+// a program with one has to fall back to the direct compiler and say why
+static void checkOptimizer() {
+  int failures = 0, programs = 0;
+  for (bool register_mode : {false, true}) {
+    for (uint32_t seed = 1; seed <= 100; ++seed) {
+      std::string source = SourceGenerator(seed).generate(40);
+      uint64_t direct, optimized;
+      std::string skipped;
+      bool ok = runSource(source, register_mode, 0, PEEP_ALL, direct) &&
+                runSource(source, register_mode, 2, PEEP_ALL, optimized, &skipped);
+      if (!ok || direct != optimized || !skipped.empty()) {
+        printf("  seed %u%s: %s\n", seed, register_mode ? " (registers)" : "",
+          !ok ? "doesn't compile" : !skipped.empty() ? skipped.c_str() : "results differ");
+        failures++;
+      }
+      programs++;
+    }
+  }
+
+  const std::string array = "let u64 v0 = 5;\nlet u32[4] a = 7;\nlet u64 result = v0 * 3;\nresult;\n";
+  uint64_t direct = 0, fallback = 0;
+  std::string skipped;
+  bool ok = runSource(array, false, 0, PEEP_ALL, direct) && runSource(array, false, 2, PEEP_ALL, fallback, &skipped);
+  if (!ok || direct != 15 || fallback != 15 || skipped.find("'a' on line 2") == std::string::npos) {
+    printf("  array: %s\n", ok ? (skipped.empty() ? "optimized" : skipped.c_str()) : "doesn't compile");
+    failures++;
+  }
+  programs++;
+
+  printf("Optimizer:\n");
+  printf("  differential:     %d/%d programs match -O0\n", programs - failures, programs);
+  printf("  array fallback:   %s\n", skipped.c_str());
+  if (failures) exit(1);
+}
+
+static uint64_t batchInput(int index) {
+  return index * 37 % 101;
+}
+
+// Runs a program once per input, one VM run after another and then BatchVM
+// lanes at a time. Returns whether every lane matches its own VM run
+static bool runBatched(const CodeBuilder &code, int runs, double &scalar_ns, double &batch_ns,
+                       BatchStats &stats) {
+  Program program(code.code, code.code_size);
+  if (!BatchVM::accepts(program)) return false;
+
+  std::vector<uint64_t> expected(runs * 2), results(runs * 2);
+  VM vm;
+  scalar_ns = timeRuns(1, [&]() {
+    for (int i = 0; i < runs; ++i) {
+      vm.init();
+      program.attach(vm);
+      memset(vm.registers, 0, sizeof(vm.registers));
+      uint64_t input = batchInput(i);
+      memcpy(vm.registers + 8, &input, 8);
+      vm.execute();
+      memcpy(&expected[i * 2], vm.registers, 16);
+    }
+  });
+
+  BatchVM batch;
+  batch_ns = timeRuns(1, [&]() {
+    for (int first = 0; first < runs; first += BatchVM::LANES) {
+      int lanes = std::min(BatchVM::LANES, runs - first);
+      for (int i = 0; i < lanes; ++i) {
+        batch.leftColumn()[i] = 0;
+        batch.rightColumn()[i] = batchInput(first + i);
+      }
+      batch.run(program, lanes);
+      for (int i = 0; i < lanes; ++i) {
+        results[(first + i) * 2] = batch.leftColumn()[i];
+        results[(first + i) * 2 + 1] = batch.rightColumn()[i];
+      }
+    }
+  });
+  stats = batch.stats();
+  return results == expected;
+}
+
+// One script over many inputs, a VM run per input against BatchVM lanes
+static void benchBatch() {
+  const int runs = 20000;
+  CodeBuilder kernel = arithmeticKernel(256);
+  CodeBuilder quick = kernel;
+  quicken(quick.code.data(), quick.code_size);
+  const std::pair<const char *, CodeBuilder> programs[] = {
+    {"straight-line", kernel},
+    {"quickened", quick},
+    {"divergent loop", inputCountdown()},
+  };
+
+  printf("Batched (%d lanes, %d runs, input in the right register):\n", BatchVM::LANES, runs);
+  bool failed = false;
+  for (const std::pair<const char *, CodeBuilder> &program : programs) {
+    double scalar_ns, batch_ns;
+    BatchStats stats;
+    bool same = runBatched(program.second, runs, scalar_ns, batch_ns, stats);
+    printf("  %-15s %9.0f runs/s, batched %9.0f runs/s, %5.2fx, %3.0f%% of lanes busy\n", program.first,
+      runs / scalar_ns * 1e9, runs / batch_ns * 1e9, scalar_ns / batch_ns,
+      100.0 * stats.lane_steps / (stats.steps * BatchVM::LANES));
+    failed |= !same;
+  }
+
+  int failures = 0, random_programs = 200;
+  for (uint32_t seed = 1; seed <= (uint32_t) random_programs; ++seed) {
+    double scalar_ns, batch_ns;
+    BatchStats stats;
+    failures += !runBatched(randomProgram(seed, 64), 100, scalar_ns, batch_ns, stats);
+  }
+  printf("  differential:   %d/%d programs match the interpreter\n", random_programs - failures,
+    random_programs);
+  if (failed || failures) {
+    printf("  Lanes differ from their VM runs!\n");
+    exit(1);
+  }
+}
+
+// Many independent runs of one shared program, the input is the right
+// register. Checks every thread count against a serial run
+static void benchParallel() {
+  const int repeats = 256, runs = 20000;
+  const int instructions = repeats * 8 + 1;
+  CodeBuilder kernel = arithmeticKernel(repeats);
+  Program program(kernel.code, kernel.code_size);
+
+  Executor::Step prepare = [](VM &vm, int index) {
+    memset(vm.registers, 0, sizeof(vm.registers));
+    uint64_t input = index;
+    memcpy(vm.registers + 8, &input, 8);
+  };
+
+  std::vector<uint64_t> expected(runs), results(runs);
+  {
+    VM vm;
+    for (int i = 0; i < runs; ++i) {
+      vm.init();
+      program.attach(vm);
+      prepare(vm, i);
+      vm.execute();
+      memcpy(&expected[i], vm.registers, 8);
+    }
+  }
+  Executor::Step finish = [&](VM &vm, int index) {
+    memcpy(&results[index], vm.registers, 8);
+  };
+
+  printf("Parallel (%d instructions x %d runs, one shared program):\n", instructions, runs);
+  unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+  double single_ns = 0;
+  for (unsigned threads = 1; ; threads = std::min(threads * 2, hardware)) {
+    Executor executor(threads);
+    executor.run(program, runs, prepare, finish); // Warm up
+    double ns = timeRuns(1, [&]() { executor.run(program, runs, prepare, finish); });
+    if (threads == 1) single_ns = ns;
+
+    printf("  %3u threads:      %8.0f runs/s, %5.2fx, %llu steals\n", threads, runs / ns * 1e9,
+      single_ns / ns, (unsigned long long) executor.steals());
+    if (results != expected) {
+      printf("  Results differ from the serial run!\n");
+      exit(1);
+    }
+    if (threads == hardware) break;
+  }
+}
+
+// Thousands of loops in flight at once, each suspending at its backward
+// jumps. Compared with running them one after another in a single VM
+static void benchGreenThreads() {
+  const int scripts = 10000, iterations = 200, slice = 16;
+  CodeBuilder loop = countdownLoop(iterations);
+  ProgramRef program = std::make_shared<const Program>(loop.code, loop.code_size);
+
+  VM vm;
+  double serial_ns = timeRuns(scripts, [&]() {
+    vm.init();
+    program->attach(vm);
+    vm.execute();
+  });
+
+  std::atomic<int> wrong{0};
+  Scheduler scheduler(0, slice);
+  double green_ns = timeRuns(1, [&]() {
+    for (int i = 0; i < scripts; ++i) {
+      scheduler.spawn(program, nullptr, [&](VM &vm) {
+        if (*(uint64_t *) vm.registers != 0 || vm.stack_end != 0) wrong++;
+      });
+    }
+    scheduler.wait();
+  });
+
+  printf("Green threads (%d loops of %d iterations, slice of %d safe points):\n", scripts, iterations, slice);
+  printf("  one VM, serial:   %8.0f ns/script\n", serial_ns / scripts);
+  printf("  %2d workers:       %8.0f ns/script, %llu resumes\n", (int) std::max(1u, std::thread::hardware_concurrency()),
+    green_ns / scripts, (unsigned long long) scheduler.resumeCount());
+  if (wrong) {
+    printf("  %d scripts finished in the wrong state!\n", (int) wrong);
+    exit(1);
+  }
+}
+
+// Latency of one tenant's scripts, with and without another tenant's
+// runaway loops competing for the workers. The runaways are stopped by
+// their fuel budget
+static void benchFuel() {
+  const int scripts = 2000, runaways = 64;
+  const int64_t budget = 1 << 20;
+  CodeBuilder spin;
+  spin.op(OPCODE_JMP);
+  spin.value<int32_t>(0);
+  spin.op(OPCODE_RETURN);
+  spin.finish();
+  ProgramRef runaway = std::make_shared<const Program>(spin.code, spin.code_size);
+  CodeBuilder loop = countdownLoop(200);
+  ProgramRef program = std::make_shared<const Program>(loop.code, loop.code_size);
+
+  printf("Fuel (%d loops, %d runaway scripts with %lld bytes of fuel each):\n",
+    scripts, runaways, (long long) budget);
+  for (bool compete : {false, true}) {
+    Scheduler scheduler(0, 16);
+    scheduler.setBudget(1, budget);
+
+    std::mutex lock;
+    std::vector<double> latencies;
+    int stopped_wrong = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (compete) {
+      for (int i = 0; i < runaways; ++i) {
+        scheduler.spawn(runaway, nullptr, [&](VM &vm) {
+          std::lock_guard<std::mutex> guard(lock);
+          if (!vm.out_of_fuel || vm.fuel >= 0 || vm.prog_counter != 0) stopped_wrong++;
+        }, 1);
+      }
+    }
+    for (int i = 0; i < scripts; ++i) {
+      scheduler.spawn(program, nullptr, [&](VM &) {
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        std::lock_guard<std::mutex> guard(lock);
+        latencies.push_back(elapsed.count());
+      }, 2);
+    }
+    scheduler.wait();
+
+    std::sort(latencies.begin(), latencies.end());
+    TenantStats runaway_stats = scheduler.tenantStats(1);
+    printf("  %-16s p50 %8.0f us, p99 %8.0f us", compete ? "with runaways:" : "alone:",
+      latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100]);
+    if (compete) {
+      printf(", %llu stopped after %llu bytes of fuel", (unsigned long long) runaway_stats.out_of_fuel,
+        (unsigned long long) runaway_stats.fuel_used);
+    }
+    printf("\n");
+    if (stopped_wrong || runaway_stats.out_of_fuel != (compete ? runaways : 0) ||
+        scheduler.tenantStats(2).finished != scripts) {
+      printf("  Wrong fuel accounting!\n");
+      exit(1);
+    }
+  }
+}
+
+static uint64_t hostMix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCDull;
+  return x ^ (x >> 33);
+}
+
+static uint64_t hostMad(uint64_t a, uint64_t b, uint64_t c) {
+  return a * b + c;
+}
+
+// Runs `code` verified from left = 1 and right = 3, returns ns per run and
+// the final left
+static double runHostKernel(const CodeBuilder &kernel, int runs, uint64_t &result) {
+  VerifyReport report;
+  if (!verifyBytecode(kernel.code.data(), kernel.code_size, kernel.code.size(), report)) {
+    printf("Kernel failed verification at %d: %s\n", report.error_pc, report.error);
+    exit(1);
+  }
+
+  VM vm;
+  vm.instructions = kernel.code.data();
+  vm.instructions_size = kernel.code.size();
+  vm.unchecked = true;
+  double ns = timeRuns(runs, [&]() {
+    vm.init();
+    uint64_t start[2] = {1, 3};
+    memcpy(vm.registers, start, sizeof(start));
+    vm.execute();
+  });
+  memcpy(&result, vm.registers, 8);
+  return ns / runs;
+}
+
+// Host calls through SPECCALL against a bytecode CALL and a C++ call
+static void benchNative() {
+  const int repeats = 4096, runs = 500;
+  const byte u64 = MERGE(TYPE_UNSIGNED, FROM_SIZE(64));
+  natives.bind<hostMix>(0, "mix");
+  natives.bind<hostMad>(1, "mad");
+
+  // left = mix(left)
+  CodeBuilder one;
+  for (int i = 0; i < repeats; ++i) one.op(OPCODE_SPECCALL, 0);
+  one.op(OPCODE_RETURN);
+  one.finish();
+
+  // left = mad(left, left, right), the first argument is pushed
+  CodeBuilder three;
+  for (int i = 0; i < repeats; ++i) {
+    three.op(OPCODE_PUSH, LOWER(u64));
+    three.op(OPCODE_SPECCALL, 1);
+  }
+  three.op(OPCODE_RETURN);
+  three.finish();
+
+  // left = ~left in a bytecode function
+  CodeBuilder call;
+  int32_t function = repeats * 5 + 1;
+  for (int i = 0; i < repeats; ++i) {
+    call.op(OPCODE_CALL);
+    call.value<int32_t>(function);
+  }
+  call.op(OPCODE_RETURN);
+  call.op(OPCODE_NOT, u64);
+  call.op(OPCODE_RETURN);
+  call.finish();
+
+  uint64_t one_result, three_result, call_result;
+  double one_ns = runHostKernel(one, runs, one_result) / repeats;
+  double three_ns = runHostKernel(three, runs, three_result) / repeats;
+  double call_ns = runHostKernel(call, runs, call_result) / repeats;
+
+  // The same work from C++, through a pointer the compiler can't see through
+  uint64_t (*volatile mix)(uint64_t) = hostMix;
+  uint64_t direct = 1;
+  double direct_ns = timeRuns(runs, [&]() {
+    direct = 1;
+    for (int i = 0; i < repeats; ++i) direct = mix(direct);
+  }) / runs / repeats;
+
+  uint64_t mad = 1;
+  for (int i = 0; i < repeats; ++i) mad = hostMad(mad, mad, 3);
+
+  printf("Host calls (%d calls x %d runs):\n", repeats, runs);
+  printf("  SPECCALL, 1 argument:   %8.3f ns/call\n", one_ns);
+  printf("  SPECCALL, 3 arguments:  %8.3f ns/call (with the PUSH)\n", three_ns);
+  printf("  bytecode CALL:          %8.3f ns/call (with the RETURN)\n", call_ns);
+  printf("  C++ function pointer:   %8.3f ns/call\n", direct_ns);
+  if (one_result != direct || three_result != mad || call_result != (repeats % 2 ? ~1ull : 1)) {
+    printf("  Results differ!\n");
+    exit(1);
+  }
+}
+
+// Hand-written programs the verifier has to reject, with the reason it
+// should give. Fails the run if any gets through or fails for another reason
+static void checkVerifier() {
+  struct Rejected {
+    const char *what;
+    CodeBuilder code;
+    const char *error;
+  };
+  std::vector<Rejected> cases;
+
+  CodeBuilder mid_jump; // Into the operands of the LOADC
+  mid_jump.loadConstant<uint64_t>(1);
+  mid_jump.op(OPCODE_JMP);
+  mid_jump.value<int32_t>(2);
+  mid_jump.op(OPCODE_RETURN);
+  cases.push_back({"jump into an instruction", mid_jump, "Control flow leaves the instructions"});
+
+  CodeBuilder past_constants;
+  past_constants.op(OPCODE_LOADC, 8);
+  past_constants.value<int32_t>(64);
+  past_constants.op(OPCODE_RETURN);
+  cases.push_back({"LOADC past the constants", past_constants, "Constant offset out of range"});
+
+  CodeBuilder unbalanced_return;
+  unbalanced_return.op(OPCODE_PUSH, 8);
+  unbalanced_return.op(OPCODE_RETURN);
+  cases.push_back({"unbalanced RETURN", unbalanced_return, "Stack not balanced at return"});
+
+  CodeBuilder unbalanced_join; // Only the fallthrough pushes before the RETURN
+  unbalanced_join.op(OPCODE_JMPZ);
+  unbalanced_join.value<int32_t>(7);
+  unbalanced_join.op(OPCODE_PUSH, 8);
+  unbalanced_join.op(OPCODE_RETURN);
+  cases.push_back({"unbalanced join", unbalanced_join, "Stack depth differs between paths"});
+
+  CodeBuilder truncated;
+  truncated.op(OPCODE_JMP);
+  truncated.value<int16_t>(0);
+  cases.push_back({"truncated instruction", truncated, "Truncated instruction"});
+
+  CodeBuilder unbound;
+  unbound.op(OPCODE_SPECCALL, VM_NATIVE_COUNT - 1);
+  unbound.op(OPCODE_RETURN);
+  cases.push_back({"SPECCALL to an unbound id", unbound, "No host function bound to the id"});
+
+  int failures = 0;
+  for (Rejected &rejected : cases) {
+    rejected.code.finish();
+    VerifyReport report;
+    const std::vector<byte> &code = rejected.code.code;
+    if (verifyBytecode(code.data(), rejected.code.code_size, code.size(), report)) {
+      printf("  %s: verified\n", rejected.what);
+      failures++;
+    } else if (strcmp(report.error, rejected.error) != 0) {
+      printf("  %s: rejected with \"%s\"\n", rejected.what, report.error);
+      failures++;
+    }
+  }
+
+  // And one that is fine, so the cases above fail for their own reason
+  CodeBuilder countdown = countdownLoop(3);
+  VerifyReport report;
+  if (!verifyBytecode(countdown.code.data(), countdown.code_size, countdown.code.size(), report)) {
+    printf("  countdown loop: rejected with \"%s\"\n", report.error);
+    failures++;
+  }
+
+  printf("Verifier:\n");
+  printf("  malformed programs: %d/%d rejected for the right reason\n",
+         (int) cases.size() - failures, (int) cases.size());
+  if (failures) exit(1);
+}
+
+int main() {
+  checkVerifier();
+  benchDispatch();
+  benchJit();
+  checkPeephole();
+  checkOptimizer();
+  benchParallel();
+  benchBatch();
+  benchGreenThreads();
+  benchFuel();
+  benchNative();
+  return 0;
+}
@@ -0,0 +1,139 @@
+#ifndef _BULK_CPP_
+#define _BULK_CPP_
+
+// Kernels behind the bulk memory instructions CPY, FILL and MCMP, also used
+// by VM::reserve() to zero the stack. Included by vm.cpp.
+// Every kernel has a portable version built on the C library. On x86 with
+// GCC or Clang there is also an AVX2 version, compiled for that target on
+// its own, which is picked at startup if the CPU has AVX2, so one binary
+// runs everywhere. VM_NO_SIMD keeps the portable kernels.
+
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(VM_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define VM_BULK_AVX2
+#include <immintrin.h>
+#endif
+
+// The low `width` bytes of pattern repeated over 8 bytes
+static inline uint64_t fillPattern(uint64_t pattern, int width) {
+  switch (width) {
+    case 1: return (pattern & 0xFF) * 0x0101010101010101ull;
+    case 2: return (pattern & 0xFFFF) * 0x0001000100010001ull;
+    case 4: return (pattern & 0xFFFFFFFF) * 0x0000000100000001ull;
+  }
+  return pattern;
+}
+
+// Writes the repeated pattern to dst[from, n). `from` has to be a multiple
+// of 8 so the pattern stays in phase
+static inline void fillTail(byte *dst, uint64_t repeated, size_t from, size_t n) {
+  for (; from + 8 <= n; from += 8) memcpy(dst + from, &repeated, 8);
+  for (int i = 0; from < n; ++from, ++i) dst[from] = (byte) (repeated >> (i * 8));
+}
+
+static void copyPortable(byte *dst, const byte *src, size_t n) {
+  memmove(dst, src, n);
+}
+
+static void fillPortable(byte *dst, uint64_t pattern, int width, size_t n) {
+  if (width == 1) memset(dst, (byte) pattern, n);
+  else fillTail(dst, fillPattern(pattern, width), 0, n);
+}
+
+static int comparePortable(const byte *a, const byte *b, size_t n) {
+  int order = memcmp(a, b, n);
+  return (order > 0) - (order < 0);
+}
+
+#ifdef VM_BULK_AVX2
+#define BULK_AVX2 __attribute__((target("avx2")))
+
+// Whole blocks in the direction that is safe for the overlap, with the
+// block at the far end loaded up front and stored last
+BULK_AVX2 static void copyAVX2(byte *dst, const byte *src, size_t n) {
+  // Short copies are two loads, from the start and the end, then two stores
+  if (n < 32) {
+    if (n >= 16) {
+      __m128i first = _mm_loadu_si128((const __m128i *) src);
+      __m128i last = _mm_loadu_si128((const __m128i *) (src + n - 16));
+      _mm_storeu_si128((__m128i *) dst, first);
+      _mm_storeu_si128((__m128i *) (dst + n - 16), last);
+    } else if (n >= 8) {
+      uint64_t first, last;
+      memcpy(&first, src, 8);
+      memcpy(&last, src + n - 8, 8);
+      memcpy(dst, &first, 8);
+      memcpy(dst + n - 8, &last, 8);
+    } else {
+      memmove(dst, src, n);
+    }
+    return;
+  }
+
+  if (dst < src || dst >= src + n) {
+    __m256i last = _mm256_loadu_si256((const __m256i *) (src + n - 32));
+    for (size_t i = 0; i + 32 <= n; i += 32) {
+      _mm256_storeu_si256((__m256i *) (dst + i), _mm256_loadu_si256((const __m256i *) (src + i)));
+    }
+    _mm256_storeu_si256((__m256i *) (dst + n - 32), last);
+  } else {
+    __m256i first = _mm256_loadu_si256((const __m256i *) src);
+    for (size_t i = n; i >= 32; i -= 32) {
+      _mm256_storeu_si256((__m256i *) (dst + i - 32), _mm256_loadu_si256((const __m256i *) (src + i - 32)));
+    }
+    _mm256_storeu_si256((__m256i *) dst, first);
+  }
+}
+
+BULK_AVX2 static void fillAVX2(byte *dst, uint64_t pattern, int width, size_t n) {
+  uint64_t repeated = fillPattern(pattern, width);
+  __m256i block = _mm256_set1_epi64x((long long) repeated);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) _mm256_storeu_si256((__m256i *) (dst + i), block);
+  fillTail(dst, repeated, i, n);
+}
+
+BULK_AVX2 static int compareAVX2(const byte *a, const byte *b, size_t n) {
+  if (n < 32) return comparePortable(a, b, n);
+
+  // The last block overlaps the one before, which was already equal
+  for (size_t i = 0;; i += 32) {
+    if (i + 32 > n) i = n - 32;
+    __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+    uint32_t equal = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+    if (equal != 0xFFFFFFFFu) {
+      size_t at = i + __builtin_ctz(~equal);
+      return a[at] < b[at] ? -1 : 1;
+    }
+    if (i + 32 == n) return 0;
+  }
+}
+
+#undef BULK_AVX2
+#endif
+
+struct BulkKernels {
+  void (*copy)(byte *dst, const byte *src, size_t n); // Like memmove
+  void (*fill)(byte *dst, uint64_t pattern, int width, size_t n); // The low `width` bytes of pattern, repeated
+  int (*compare)(const byte *a, const byte *b, size_t n); // memcmp's sign, -1, 0 or 1
+  const char *name; // Of the kernels picked
+
+  BulkKernels() : copy(copyPortable), fill(fillPortable), compare(comparePortable), name("portable") {
+#ifdef VM_BULK_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      copy = copyAVX2;
+      fill = fillAVX2;
+      compare = compareAVX2;
+      name = "avx2";
+    }
+#endif
+  }
+};
+
+static const BulkKernels bulk;
+
+#endif // _BULK_CPP_
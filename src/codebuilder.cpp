@@ -0,0 +1,54 @@
+#ifndef _CODEBUILDER_CPP_
+#define _CODEBUILDER_CPP_
+
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+#include "vm.cpp"
+
+// Builds bytecode by hand so the benchmarks don't depend on the front end
+struct CodeBuilder {
+  std::vector<byte> code;
+  int code_size = 0;
+  std::vector<std::pair<int32_t, std::vector<byte>>> constants;
+
+  void op(byte opcode) {
+    code.push_back(opcode);
+  }
+
+  void op(byte opcode, byte arg) {
+    code.push_back(opcode);
+    code.push_back(arg);
+  }
+
+  template <class T> void value(T val) {
+    code.insert(code.end(), sizeof(T), 0);
+    memcpy(code.data() + code.size() - sizeof(T), &val, sizeof(T));
+  }
+
+  // An int32 constant offset operand, patched by finish()
+  template <class T> void constant(T val) {
+    std::vector<byte> data(sizeof(T));
+    memcpy(data.data(), &val, sizeof(T));
+    constants.push_back({(int32_t) code.size(), data});
+    value<int32_t>(0);
+  }
+
+  template <class T> void loadConstant(T val) {
+    code.push_back(OPCODE_LOADC);
+    code.push_back(sizeof(T));
+    constant(val);
+  }
+
+  // Appends the constants after the code and patches the LOADC offsets
+  void finish() {
+    code_size = code.size();
+    for (const std::pair<int32_t, std::vector<byte>> &constant : constants) {
+      *(int32_t *)(code.data() + constant.first) = code.size();
+      code.insert(code.end(), constant.second.begin(), constant.second.end());
+    }
+  }
+};
+
+#endif // _CODEBUILDER_CPP_
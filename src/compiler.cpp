@@ -4,67 +4,75 @@
 #include "vm.cpp"
 #include "astparser.cpp"
 #include "constpool.cpp"
+#include "rewrite.cpp"
+#include "peephole.cpp"
+#include "linetable.cpp"
+#include "program.cpp"
+#include "fold.cpp"
+#include "ssa.cpp"
+#include <map>
 #include <vector>
 #include <iostream>
+#include <unordered_set>
 
 #define ADD_UNDONE(dest, src) ((dest += src) - src)
 
-#define CONSTANT_VAL_TYPE(name) (ASTType{#name, {}, true, 0})
+#define CONSTANT_VAL_TYPE(name) (ASTType(types.intern(#name), true))
 
 static const ASTType VOID_TYPE = CONSTANT_VAL_TYPE(void);
 
 static bool isPrimitive(const ASTType &type) {
-  // Arrays aren't primitives. Primitives don't have arguments
-  if (type.arrsize != 0 || type.tempargs.size() != 0) return false;
-  // All of them are either 2 or 3
-  if (type.name.length() > 3 || type.name.length() < 2) return false;
+  return type.info().prim != TYPE_NONE;
+}
+
+static byte primitiveByte(const ASTType &type) {
+  return type.info().prim;
+}
 
-  if(type.name[0] != 'u' && type.name[0] != 'i' && type.name[0] != 'f') return false;
+// The locked value type of a primitive type byte
+static ASTType primitiveType(byte type) {
+  return ASTType(types.primitive(type), true);
+}
 
-  std::string length = type.name.substr(1);
+// Vector reductions, by member name
+static const Atom ATOM_SUM = atoms.intern("sum");
+static const Atom ATOM_MIN = atoms.intern("min");
+static const Atom ATOM_MAX = atoms.intern("max");
 
-  if (length == "8" || length == "16" || length == "32" || length == "64") return true;
-  return false;
+// Vector types are named after their lanes, f32x4, u8x16, i64x4... and
+// hold 16 or 32 bytes
+static bool isVector(const ASTType &type) {
+  return type.info().lanes != 0;
 }
 
-static byte primitiveByte(const ASTType &type) {
-  byte value;
-  switch (type.name[0]) {
-    case 'u':
-      value = TYPE_UNSIGNED;
-      break;
-    case 'i':
-      value = TYPE_SIGNED;
-      break;
-    case 'f':
-      value = TYPE_FLOAT;
-      break;
-  }
-
-  if (type.name.substr(1) == "8")  return MERGE(value, FROM_SIZE(8));
-  if (type.name.substr(1) == "32") return MERGE(value, FROM_SIZE(32));
-  if (type.name.substr(1) == "64") return MERGE(value, FROM_SIZE(64));
-  return MERGE(value, FROM_SIZE(16));
+// The lane type of a vector type, locked like the vector
+static ASTType vectorLane(const ASTType &type) {
+  return ASTType(type.info().lane, type.locked);
+}
+
+static int vectorLanes(const ASTType &type) {
+  return type.info().lanes;
 }
 
-static char bestPrimType(char l, char r) {
+// Of two primitive kinds (UPPER of a type byte), the one both convert to
+static byte bestPrimType(byte l, byte r) {
   switch (l) {
-    case 'u':
+    case TYPE_UNSIGNED:
       return r; // r is always going to be better or equal
-    case 'i':
-      if (r == 'f') return r; // If r is better...
+    case TYPE_SIGNED:
+      if (r == TYPE_FLOAT) return r; // If r is better...
       return l; // l is better or equal
-    case 'f':
+    case TYPE_FLOAT:
       return l; // l is always going to be better or equal
   }
-  return 'u';
+  return TYPE_UNSIGNED;
 }
 
-// TODO: Add precomputation (allows for declared constants, significant optimization)
 class Compiler {
   std::vector<byte> result;
   std::unordered_map<int32_t, int32_t> constant_indexes;
   ConstantPool constants;
+  LineTable lines;
 
   struct VarInfo {
     bool is_global;
@@ -73,30 +81,57 @@ class Compiler {
     int location;
     int size;
     ASTType type;
+    bool is_const = false; // No storage, uses are the folded value
+    FoldedValue value;
   };
 
-  std::unordered_map<std::string, VarInfo> variables;
-  std::vector<std::string> global_stack;
-  std::vector<std::vector<std::string>> local_stack;
+  AtomMap<VarInfo> variables;
+  std::vector<Atom> declared; // Every name in scope, in declaration order
+  std::vector<Atom> global_stack;
+  std::vector<std::vector<Atom>> local_stack;
 
   struct ExprBlockInfo {
     std::vector<int> jump_inserts;
     const ExprBlockNode *block;
+    int reg; // Where yield puts the value
 
-    ExprBlockInfo(const ExprBlockNode *ptr) :
+    ExprBlockInfo(const ExprBlockNode *ptr, int target) :
       jump_inserts(),
-      block(ptr)
+      block(ptr),
+      reg(target)
     {}
   };
 
   std::vector<ExprBlockInfo> expr_blocks;
 
+  int code_size = 0; // Instructions end here and the constants begin
+  PeepholeStats peephole_stats;
+
   int stack_global = 0;
   int stack_local  = 0;
   bool is_global = true;
 
   bool compile_fail;
 
+  // Values live either in the left register (stack code) or in a register
+  // of VM::register_file (register_mode). Registers are handed out like a
+  // stack: every expression frees what it allocated before returning
+  static const int ACCUMULATOR = -1;
+  int reg_top = 0;
+
+  byte allocReg() {
+    if (reg_top >= VM_REGISTER_COUNT) {
+      printf("Compile error: Expression needs too many registers\n");
+      compile_fail = true;
+      return 0;
+    }
+    return reg_top++;
+  }
+
+  void freeReg() {
+    reg_top--;
+  }
+
   int emitPush(byte reg) {
     result.push_back(OPCODE_PUSH);
     result.push_back(reg);
@@ -104,6 +139,17 @@ class Compiler {
     return ADD_UNDONE(stack_local, LOWER(reg));
   }
 
+  // Pushes size bytes of a value, returns its stack location
+  int emitPushValue(int reg, byte size) {
+    if (reg == ACCUMULATOR) return emitPush(size);
+
+    result.push_back(OPCODE_R_PUSH);
+    result.push_back(reg);
+    result.push_back(size);
+    if (is_global) return ADD_UNDONE(stack_global, size);
+    return ADD_UNDONE(stack_local, size);
+  }
+
   void emitPop(byte reg) {
     result.push_back(OPCODE_POP);
     result.push_back(reg);
@@ -126,52 +172,65 @@ class Compiler {
   }
 
   template <class T> void insertValue(T val) {
-    T &ptr = *(T *)(result.data() + result.size());
     result.insert(result.end(), sizeof(T), 0);
-    ptr = val;
+    memcpy(result.data() + result.size() - sizeof(T), &val, sizeof(T));
   }
 
   // TODO: Add structure compatiblity
-  template <class T> void insertConstant(T val) {
-    result.push_back(OPCODE_LOADC);
+  template <class T> void insertConstant(T val, int reg = ACCUMULATOR) {
+    if (reg == ACCUMULATOR) {
+      result.push_back(OPCODE_LOADC);
+    } else {
+      result.push_back(OPCODE_R_LOADC);
+      result.push_back(reg);
+    }
     result.push_back(sizeof(val));
     constant_indexes.insert({result.size(), constants.addConstant<T>(val)});
     result.insert(result.end(), 4, 0);
   }
 
-  ASTType number(const std::string &str) {
+  // A literal's value, in the smallest type that holds it
+  static FoldedValue parseNumber(const std::string &str) {
+    FoldedValue value;
     if (
       str.find('.') != std::string::npos ||
       str.find('f') != std::string::npos
     ) {
-      insertConstant<float>(std::stof(str));
-      return CONSTANT_VAL_TYPE(f32);
+      float val = std::stof(str);
+      value.type = MERGE(TYPE_FLOAT, FROM_SIZE(32));
+      memcpy(&value.bits, &val, sizeof(val));
+      return value;
     }
 
     if (str.find('d') != std::string::npos) {
-      insertConstant<double>(std::stod(str));
-      return CONSTANT_VAL_TYPE(f64);
+      double val = std::stod(str);
+      value.type = MERGE(TYPE_FLOAT, FROM_SIZE(64));
+      memcpy(&value.bits, &val, sizeof(val));
+      return value;
     }
 
-    uint64_t val = std::stoull(str);
-    
-    if (val < 256) {
-      insertConstant<uint8_t>(val);
-      return {"u8", {}, true, 0};
-    }
+    value.bits = std::stoull(str);
 
-    if (val < 65536) {
-      insertConstant<uint16_t>(val);
-      return {"u16", {}, true, 0};
-    }
+    if (value.bits < 256) value.type = MERGE(TYPE_UNSIGNED, FROM_SIZE(8));
+    else if (value.bits < 65536) value.type = MERGE(TYPE_UNSIGNED, FROM_SIZE(16));
+    else if (value.bits < 4294967296) value.type = MERGE(TYPE_UNSIGNED, FROM_SIZE(32));
+    else value.type = MERGE(TYPE_UNSIGNED, FROM_SIZE(64));
+    return value;
+  }
 
-    if (val < 4294967296) {
-      insertConstant<uint32_t>(val);
-      return {"u32", {}, true, 0};
+  // Loads a folded value into reg (or left)
+  ASTType emitFolded(const FoldedValue &value, int reg = ACCUMULATOR) {
+    switch (LOWER(value.type)) {
+      case 1: insertConstant(value.get<uint8_t>(), reg); break;
+      case 2: insertConstant(value.get<uint16_t>(), reg); break;
+      case 4: insertConstant(value.get<uint32_t>(), reg); break;
+      default: insertConstant(value.get<uint64_t>(), reg); break;
     }
+    return primitiveType(value.type);
+  }
 
-    insertConstant<uint64_t>(val);
-    return {"u64", {}, true, 0};
+  ASTType number(const std::string &str, int reg = ACCUMULATOR) {
+    return emitFolded(parseNumber(str), reg);
   }
 
   ASTType promoteTypes(const ASTType &left, const ASTType &right) {
@@ -180,16 +239,16 @@ class Compiler {
     bool lock = left.locked || right.locked;
 
     if (primleft && primright) {
-      char best = bestPrimType(left.name[0], right.name[0]);
+      byte l = primitiveByte(left), r = primitiveByte(right);
+      byte best = bestPrimType(UPPER(l), UPPER(r));
 
-      if (best != left.name[0] || best != right.name[0]) { // There is a better type
-        if (best == left.name[0])  return left;
-        return right;
+      if (best != UPPER(l) || best != UPPER(r)) { // There is a better type
+        ASTType promoted = best == UPPER(l) ? left : right;
+        promoted.ref = false; // The result of an operation, not the operand
+        return promoted;
       }
 
-      uint8_t leftsize = std::stoi(left.name.substr(1)),
-        rightsize = std::stoi(right.name.substr(1));
-      return {std::string(1, best) + std::to_string(max(leftsize, rightsize)), {}, lock, 0};
+      return ASTType(types.primitive(MERGE(best, max(LOWER(l), LOWER(r)))), lock);
     }
 
     printf("Compile error: Non-primitive type mismatch\n");
@@ -199,385 +258,2318 @@ class Compiler {
 
   int32_t typeSize(const ASTType &type) {
     if (type.ref) return 8;
-    
-    if (isPrimitive(type)) {
-      return std::stoi(type.name.substr(1)) / 8;
-    }
-    
-    return 0;
+    return type.info().size;
   }
 
-  void derefPrim(ASTType &type, byte p) {
+  void derefPrim(ASTType &type, byte p, int reg = ACCUMULATOR) {
     if (!type.ref) return;
     type.ref = false;
 
-    result.push_back(OPCODE_LOAD);
+    if (reg == ACCUMULATOR) {
+      result.push_back(OPCODE_LOAD);
+    } else {
+      result.push_back(OPCODE_R_LOAD);
+      result.push_back(reg);
+      result.push_back(reg);
+    }
     result.push_back(LOWER(p));
   }
-  
-  void applyOpPrimitive(TokenType op, byte type) {
-    switch (op) {
-      case TokenType::PLUS_EQ:
-      case TokenType::PLUS:
-        result.push_back(OPCODE_ADD);
-        result.push_back(type);
-        break;
+
+  void emitConv(byte from, byte to, int reg = ACCUMULATOR) {
+    if (reg == ACCUMULATOR) {
+      result.push_back(OPCODE_CONV);
+    } else {
+      result.push_back(OPCODE_R_CONV);
+      result.push_back(reg);
     }
+    result.push_back(from);
+    result.push_back(to);
   }
 
-  ASTType compileAssignOp(const BinaryNode * binop) {
-    ASTType left = compileExpression(binop->left);
-    byte primleft;
-    if (!left.ref || left.locked) {
-      printf("Expected an unlocked reference on the left of assignment operator");
-      compile_fail = true;
-      return VOID_TYPE;
+  // Stack code operates on left and right, register code on reg and rhs
+  void emitTyped(byte opcode, byte type, int reg, byte rhs) {
+    if (reg == ACCUMULATOR) {
+      result.push_back(quickOpcode(opcode, type));
+    } else {
+      result.push_back(registerOpcode(opcode));
+      result.push_back(reg);
+      result.push_back(reg);
+      result.push_back(rhs);
     }
-    
-    bool isprim = isPrimitive(left);
-
-    int location;
+    result.push_back(type);
+  }
 
-    if (isprim) {
-      primleft = primitiveByte(left);
-      location = emitPush(sizeof(void *));
+  void emitBoolNot(int reg) {
+    if (reg == ACCUMULATOR) {
+      result.push_back(OPCODE_BNOT);
     } else {
-
+      result.push_back(OPCODE_R_BNOT);
+      result.push_back(reg);
+      result.push_back(reg);
     }
+  }
 
-    ASTType right = compileExpression(binop->right);
+  // Sets reg (or left) to whether the prim in it is zero, as a u8
+  void emitIsZero(byte prim, int reg) {
+    FoldedValue zero;
+    zero.type = prim;
+    if (reg == ACCUMULATOR) {
+      result.push_back(OPCODE_SWAP);
+      emitFolded(zero);
+      emitTyped(OPCODE_CMPE, prim, ACCUMULATOR, 0);
+    } else {
+      byte rhs = allocReg();
+      emitFolded(zero, rhs);
+      emitTyped(OPCODE_CMPE, prim, reg, rhs);
+      freeReg();
+    }
+  }
 
-    if (isprim) {
-      if (!isPrimitive(right)) {
-        printf("Object assigned to primitive\n");
-        compile_fail = true;
-        return VOID_TYPE;
-      }
+  static bool isComparison(TokenType op) {
+    switch (op) {
+      case TokenType::EQ_EQUAL:
+      case TokenType::EX_EQUAL:
+      case TokenType::LT:
+      case TokenType::LT_EQUAL:
+      case TokenType::GT:
+      case TokenType::GT_EQUAL:
+        return true;
+      default:
+        return false;
+    }
+  }
 
-      byte primright = primitiveByte(right);
-      derefPrim(right, primright);
+  // The typed opcode behind a binary operator, `negate` if BNOT follows it.
+  // False if the operator has none
+  static bool operatorOpcode(TokenType op, byte &opcode, bool &negate) {
+    negate = false;
+    switch (op) {
+      case TokenType::PLUS_EQ:
+      case TokenType::PLUS:     opcode = OPCODE_ADD; break;
+      case TokenType::MINUS_EQ:
+      case TokenType::MINUS:    opcode = OPCODE_SUB; break;
+      case TokenType::STAR_EQ:
+      case TokenType::STAR:     opcode = OPCODE_MUL; break;
+      case TokenType::SLASH_EQ:
+      case TokenType::SLASH:    opcode = OPCODE_DIV; break;
+      case TokenType::AMP:      opcode = OPCODE_AND; break;
+      case TokenType::PIP:      opcode = OPCODE_OR; break;
+      case TokenType::CAR:      opcode = OPCODE_XOR; break;
+      case TokenType::EQ_EQUAL: opcode = OPCODE_CMPE; break;
+      case TokenType::EX_EQUAL: opcode = OPCODE_CMPE; negate = true; break;
+      case TokenType::LT:       opcode = OPCODE_CMPL; break;
+      case TokenType::LT_EQUAL: opcode = OPCODE_CMPG; negate = true; break;
+      case TokenType::GT:       opcode = OPCODE_CMPG; break;
+      case TokenType::GT_EQUAL: opcode = OPCODE_CMPL; negate = true; break;
+      default: return false;
+    }
+    return true;
+  }
 
-      if (primleft != primright) {
-        result.push_back(OPCODE_CONV);
-        result.push_back(primright);
-        result.push_back(primleft);
-      }
+  // Emits the typed opcode directly in its quickened form
+  void applyOpPrimitive(TokenType op, byte type, int reg = ACCUMULATOR, byte rhs = 0) {
+    byte opcode;
+    bool negate;
+    if (!operatorOpcode(op, opcode, negate)) {
+      printf("Compile error: Unsupported operator\n");
+      compile_fail = true;
+      return;
+    }
 
-      result.push_back(OPCODE_SWAP);
-      
-      // For example, +=
-      if (binop->op != TokenType::EQ) {
-        // Step 1 is to get the pointer without popping the stack
-        if (is_global) {
-          result.push_back(OPCODE_SPP);
-        } else {
-          result.push_back(OPCODE_FPP);
-        }
-        insertValue<int32_t>(location);
+    emitTyped(opcode, type, reg, rhs);
+    if (negate) emitBoolNot(reg);
+  }
 
-        result.push_back(OPCODE_LOAD);
-        result.push_back(sizeof(void *));
+  // --- Constant folding ---
+  // Expressions made of literals, constants, operators and expression
+  // blocks that only yield such an expression are evaluated here, with the
+  // conversions the code would do, and become one constant. Runtime
+  // semantics come from fold.cpp
 
-        result.push_back(OPCODE_LOAD);
-        result.push_back(LOWER(primleft));
+  std::unordered_set<const ASTNode *> unfoldable; // Known not to fold, per statement
+  int constant_count = 0;
 
-        applyOpPrimitive(binop->op, primleft);
+  bool fold(const ASTNode *node, FoldedValue &out) {
+    if (!node || unfoldable.count(node)) return false;
+    if (foldNode(node, out)) return true;
+    unfoldable.insert(node);
+    return false;
+  }
 
-        result.push_back(OPCODE_SWAP);
+  bool foldNode(const ASTNode *node, FoldedValue &out) {
+    switch (node->kind) {
+      case NodeKind::NUMBER: {
+        const NumberNode *num = static_cast<const NumberNode *>(node);
+        out = parseNumber(std::string(num->tok.start, num->tok.length));
+        return true;
       }
 
-      emitPop(sizeof(void *));
-
-      result.push_back(OPCODE_STORE);
-
-      // This should keep the pointer in the left register, so we don't need to do anything else to return the reference
-    } else {
-      if (left != right) {
-        printf("Type mismatch in assignment operator\n");
-        compile_fail = true;
-        return VOID_TYPE;
+      case NodeKind::IDENTIFIER: {
+        const IdentifierNode *id = static_cast<const IdentifierNode *>(node);
+        if (constant_count == 0) return false;
+        const VarInfo *var = variables.find(id->tok.atom);
+        if (!var || !var->is_const) return false;
+        out = var->value;
+        return true;
       }
-    }
-
-    // We still want reference and unlocked
 
-    return left;
-  }
+      case NodeKind::UNARY: {
+        const UnaryNode *unary = static_cast<const UnaryNode *>(node);
+        FoldedValue value;
+        if (!fold(unary->expr, value)) return false;
 
-  ASTType compileBinaryOp(const BinaryNode *binop) {
-    ASTType left = compileExpression(binop->left);
-    byte primleft;
+        // !x is x == 0, in the type of x
+        byte opcode = unary->op == TokenType::MINUS ? OPCODE_NEG : unary->op == TokenType::TILDE ? OPCODE_NOT : OPCODE_CMPE;
+        if (!foldTyped(opcode, value.type, value.bits, 0, out.bits)) return false;
+        out.type = opcode == OPCODE_CMPE ? MERGE(TYPE_UNSIGNED, FROM_SIZE(8)) : value.type;
+        return true;
+      }
 
-    if (isPrimitive(left)) {
-      primleft = primitiveByte(left);
-      derefPrim(left, primleft);
-      emitPush(LOWER(primleft));
-    } else {
-      // TODO
-    }
+      case NodeKind::BINARY: {
+        const BinaryNode *binop = static_cast<const BinaryNode *>(node);
+        byte opcode;
+        bool negate;
+        if (!operatorOpcode(binop->op, opcode, negate) || binop->op >= TokenType::EQ) return false;
 
-    ASTType right = compileExpression(binop->right);
-    ASTType best = promoteTypes(left, right);
-    byte primbest;
+        FoldedValue left, right;
+        if (!fold(binop->left, left) || !fold(binop->right, right)) return false;
 
-    // Since there are no implicit conversions, left and right are either the same or both primitives
-    if (isPrimitive(best)) {
-      primbest = primitiveByte(best);
-      byte primright = primitiveByte(right);
-      derefPrim(right, primright);
+        byte best = primitiveByte(promoteTypes(primitiveType(left.type), primitiveType(right.type)));
+        left = foldConvert(left, best);
+        right = foldConvert(right, best);
+        if (!foldTyped(opcode, best, left.bits, right.bits, out.bits)) return false;
 
-      if (primright != primbest) {
-        result.push_back(OPCODE_CONV);
-        result.push_back(primright);
-        result.push_back(primbest);
+        out.type = best;
+        if (isComparison(binop->op)) {
+          out.type = MERGE(TYPE_UNSIGNED, FROM_SIZE(8));
+          if (negate) out.bits = !(byte) out.bits;
+        }
+        return true;
       }
 
-      result.push_back(OPCODE_SWAP);
-
-      emitPop(LOWER(primleft));
+      case NodeKind::EXPR_BLOCK: {
+        const ExprBlockNode *eb = static_cast<const ExprBlockNode *>(node);
+        if (eb->statements.size() != 1 || !isPrimitive(eb->type)) return false;
+        const YieldNode *yld = nodeAs<YieldNode>(eb->statements[0]);
+        FoldedValue value;
+        if (!yld || !fold(yld->expr, value)) return false;
 
-      if (primleft != primbest) {
-        result.push_back(OPCODE_CONV);
-        result.push_back(primleft);
-        result.push_back(primbest);
+        out = foldConvert(value, primitiveByte(eb->type));
+        return true;
       }
 
-      applyOpPrimitive(binop->op, primbest);
-    } else {
-      // TODO
+      default:
+        return false;
     }
-
-    best.locked = true;
-    return best;
   }
 
-  void compileVarDecl(const VarDeclNode *vardecl) {
-    std::string name = tokenToString(vardecl->name);
-      
-    if (variables.count(name) > 0) {
-      printf("Variable already exists\n");
+  // Constants take no stack, every use is their folded value
+  void compileConstDecl(const VarDeclNode *vardecl, Atom name) {
+    if (!isPrimitive(vardecl->type) || vardecl->type.ref) {
+      printf("Compile error: Constants must be primitives\n");
       compile_fail = true;
       return;
     }
 
-    VarInfo &info = variables[name];
+    FoldedValue value;
+    if (!fold(vardecl->init, value)) {
+      printf("Compile error: Constant '%s' needs a constant initializer\n", atoms.name(name).c_str());
+      compile_fail = true;
+      return;
+    }
 
+    VarInfo &info = variables[name];
     info.type = vardecl->type;
+    info.type.locked = true;
     info.is_global = is_global;
-    info.size = typeSize(vardecl->type);
-
-    if (is_global) {
-      global_stack.push_back(name);
-    } else {
-      local_stack.back().push_back(name);
-    }
+    info.is_prim = true;
+    info.prim = primitiveByte(vardecl->type);
+    info.location = 0;
+    info.size = 0;
+    info.is_const = true;
+    constant_count++;
+    info.value = foldConvert(value, info.prim);
+  }
 
-    if (info.type.ref) {
-      if (!vardecl->init) {
-        printf("References must be initialized\n");
-        compile_fail = true;
-        return;
-      }
+  bool assignsConstant(const BinaryNode *binop) {
+    const IdentifierNode *id = nodeAs<IdentifierNode>(binop->left);
+    if (!id) return false;
 
-      ASTType res = compileExpression(vardecl->init);
-      
-      // Make sure the types line up...
+    const VarInfo *var = variables.find(id->tok.atom);
+    if (!var || !var->is_const) return false;
 
-      if (res != info.type) {
-        printf("Conflicting reference and initializer\n");
-        compile_fail = true;
-        return;
-      }
-      
-      if (!res.ref) {
-        printf("References must be initialized with a reference\n");
-        compile_fail = true;
-        return;
-      }
+    printf("Compile error: Cannot assign to constant '%s'\n", atoms.name(id->tok.atom).c_str());
+    compile_fail = true;
+    return true;
+  }
 
-      // We actually don't care about the data, just the pointer.
-      
-      info.location = emitPush(sizeof(void *));
+  // --- Vectors ---
+  // Vector values always live in vleft (VM::vregisters), whichever mode the
+  // rest of the expression uses. Scalars and pointers they meet go through
+  // left, register code copies them over with R_GET and R_SET
 
-      return;
-    }
+  void emitVector(byte opcode, const ASTType &type) {
+    result.push_back(opcode);
+    result.push_back(primitiveByte(vectorLane(type)));
+    result.push_back(vectorLanes(type));
+  }
 
-    if (isPrimitive(vardecl->type)) {
-      byte prim = primitiveByte(vardecl->type);
+  int emitVectorPush(const ASTType &type) {
+    emitVector(OPCODE_VPUSH, type);
+    if (is_global) return ADD_UNDONE(stack_global, typeSize(type));
+    return ADD_UNDONE(stack_local, typeSize(type));
+  }
 
-      info.is_prim = true;
-      info.prim = prim;
+  void emitVectorPop(const ASTType &type) {
+    emitVector(OPCODE_VPOP, type);
+    if (is_global) stack_global -= typeSize(type);
+    else stack_local -= typeSize(type);
+  }
 
-      if (vardecl->init) {
-        ASTType res = compileExpression(vardecl->init);
+  // Copies reg into left, nothing to do for stack code
+  void emitGetLeft(int reg) {
+    if (reg == ACCUMULATOR) return;
+    result.push_back(OPCODE_R_GET);
+    result.push_back(reg);
+  }
 
-        if (!isPrimitive(res)) {
-          printf("Assigning non-primitive to primitive value\n");
-          compile_fail = true;
-          return;
-        }
+  // Copies left into reg, nothing to do for stack code
+  void emitSetLeft(int reg) {
+    if (reg == ACCUMULATOR) return;
+    result.push_back(OPCODE_R_SET);
+    result.push_back(reg);
+  }
 
-        byte resprim = primitiveByte(res);
-        derefPrim(res, resprim);
+  void derefVector(ASTType &type, int reg) {
+    if (!type.ref) return;
+    type.ref = false;
+    emitGetLeft(reg);
+    emitVector(OPCODE_VLOAD, type);
+  }
 
-        if (res != vardecl->type) {
-          // Convert the result
-          result.push_back(OPCODE_CONV);
-          result.push_back(resprim);
-          result.push_back(prim);
-        }
-      } else {
-        switch (UPPER(prim)) {
-          case TYPE_SIGNED:
-          case TYPE_UNSIGNED:
-            number("0");
-            break;
-          case TYPE_FLOAT:
-            if (LOWER(prim) == FROM_SIZE(32)) number("0f");
-            else number("0d");
-            break;
-        }
+  // Gets the value of an expression of type `from`, compiled to reg, into
+  // vleft as a `to`. Scalars are converted to the lane type and splatted
+  bool loadVector(ASTType &from, const ASTType &to, int reg) {
+    if (isVector(from)) {
+      if (from != to) {
+        printf("Compile error: Vector type mismatch\n");
+        compile_fail = true;
+        return false;
       }
+      derefVector(from, reg);
+      return true;
+    }
 
-      // Either way, we push it to the stack
-     info.location = emitPush(LOWER(prim));
-    } else {
-      info.is_prim = false;
+    if (!isPrimitive(from)) {
+      printf("Compile error: Vectors only mix with vectors and primitives\n");
+      compile_fail = true;
+      return false;
     }
-  }
 
-  // --- Expressions --
-  // NOTE: Primitive values are passed down through the left register, but objects are passed at the top of the stack
+    byte prim = primitiveByte(from);
+    byte lane = primitiveByte(vectorLane(to));
+    derefPrim(from, prim, reg);
+    if (prim != lane) emitConv(prim, lane, reg);
+    emitGetLeft(reg);
+    emitVector(OPCODE_VSPLAT, to);
+    return true;
+  }
 
-#define CHECK_IS_TYPE(oldname, newname, newtype) \
-if (const newtype *newname = dynamic_cast<const newtype *>(oldname))
+  // vleft = vleft op vright. Comparisons give an unsigned mask vector with
+  // the lanes that hold set to all ones
+  ASTType applyOpVector(TokenType op, ASTType type) {
+    ASTType lane = vectorLane(type);
+    ASTType mask(types.vector(MERGE(TYPE_UNSIGNED, LOWER(primitiveByte(lane))), vectorLanes(type)), true);
 
-  ASTType compileExpression(const ASTNode *node) {
-    CHECK_IS_TYPE(node, num, NumberNode) {
-      return number(std::string(num->tok.start, num->tok.length));
+    switch (op) {
+      case TokenType::PLUS_EQ:
+      case TokenType::PLUS:
+        emitVector(OPCODE_VADD, type);
+        break;
+      case TokenType::MINUS_EQ:
+      case TokenType::MINUS:
+        emitVector(OPCODE_VSUB, type);
+        break;
+      case TokenType::STAR_EQ:
+      case TokenType::STAR:
+        emitVector(OPCODE_VMUL, type);
+        break;
+      case TokenType::SLASH_EQ:
+      case TokenType::SLASH:
+        emitVector(OPCODE_VDIV, type);
+        break;
+      case TokenType::AMP:
+        emitVector(OPCODE_VAND, type);
+        break;
+      case TokenType::PIP:
+        emitVector(OPCODE_VOR, type);
+        break;
+      case TokenType::CAR:
+        emitVector(OPCODE_VXOR, type);
+        break;
+      case TokenType::EQ_EQUAL:
+        emitVector(OPCODE_VCMPE, type);
+        return mask;
+      case TokenType::EX_EQUAL:
+        emitVector(OPCODE_VCMPE, type);
+        emitVector(OPCODE_VNOT, type);
+        return mask;
+      case TokenType::LT:
+        emitVector(OPCODE_VCMPL, type);
+        return mask;
+      case TokenType::LT_EQUAL:
+        emitVector(OPCODE_VCMPG, type);
+        emitVector(OPCODE_VNOT, type);
+        return mask;
+      case TokenType::GT:
+        emitVector(OPCODE_VCMPG, type);
+        return mask;
+      case TokenType::GT_EQUAL:
+        emitVector(OPCODE_VCMPL, type);
+        emitVector(OPCODE_VNOT, type);
+        return mask;
+      default:
+        printf("Compile error: Unsupported vector operator\n");
+        compile_fail = true;
+        return VOID_TYPE;
     }
 
-    CHECK_IS_TYPE(node, binop, BinaryNode) {
-      if (binop->op >= TokenType::EQ) return compileAssignOp(binop);
-      return compileBinaryOp(binop);
-    }
+    type.ref = false;
+    type.locked = true;
+    return type;
+  }
 
-    CHECK_IS_TYPE(node, id, IdentifierNode) {
-      std::string name = tokenToString(id->tok);
-      const VarInfo &info = variables.at(name);
-      ASTType new_type = info.type;
-      
-      if (info.is_global)
-        result.push_back(OPCODE_SPP);
-      else
-        result.push_back(OPCODE_FPP);
-      insertValue<int32_t>(info.location);
-
-      if (info.type.ref) {
-        if (info.is_prim) {
-          result.push_back(OPCODE_LOAD);
-          result.push_back(LOWER(info.prim));
-        }
-      } else
-        new_type.ref = true;
+  // vector op (vector or scalar). The left vector was compiled to reg, the
+  // right operand goes to the same place once the left one is on the stack
+  ASTType compileVectorOp(const BinaryNode *binop, ASTType left, int reg) {
+    derefVector(left, reg);
+    emitVectorPush(left);
 
-      return new_type;
+    ASTType right = compileValue(binop->right, reg);
+    if (!loadVector(right, left, reg)) return VOID_TYPE;
+
+    result.push_back(OPCODE_VSWAP);
+    emitVectorPop(left);
+    return applyOpVector(binop->op, left);
+  }
+
+  // scalar op vector. The scalar is on the stack (stack code) or in reg, the
+  // vector was compiled to rhs
+  // A constant scalar wasn't compiled, it's loaded here as a lane
+  ASTType compileScalarVectorOp(TokenType op, byte primleft, ASTType right, int reg, int rhs,
+                                const FoldedValue *constant = nullptr) {
+    derefVector(right, rhs);
+    result.push_back(OPCODE_VSWAP);
+
+    byte lane = primitiveByte(vectorLane(right));
+    if (constant) {
+      emitFolded(foldConvert(*constant, lane));
+    } else {
+      if (reg == ACCUMULATOR) emitPop(LOWER(primleft));
+      else emitGetLeft(reg);
+      if (primleft != lane) emitConv(primleft, lane);
     }
+    emitVector(OPCODE_VSPLAT, right);
+    return applyOpVector(op, right);
+  }
 
-    CHECK_IS_TYPE(node, eb, ExprBlockNode) {
-      expr_blocks.emplace_back(eb);
+  // Assigns to a vector the pointer to which is in reg (or left)
+  ASTType compileVectorAssign(const BinaryNode *binop, const ASTType &left, int reg) {
+    // Stack code keeps the pointer on the stack while the value is computed
+    int location = 0;
+    int value = ACCUMULATOR;
+    if (reg == ACCUMULATOR) location = emitPush(sizeof(void *));
+    else value = allocReg();
 
-      for (const ASTNode *node : eb->statements) {
-        compileStatement(node);
-      }
+    ASTType right = compileValue(binop->right, value);
+    ASTType type = left;
+    type.ref = false;
+    if (!loadVector(right, type, value)) return VOID_TYPE;
 
-      for (int pos : expr_blocks.back().jump_inserts) {
-        *(int32_t *)(result.data() + pos) = result.size();
+    // For example, +=
+    if (binop->op != TokenType::EQ) {
+      result.push_back(OPCODE_VSWAP);
+      if (reg == ACCUMULATOR) {
+        result.push_back(is_global ? OPCODE_SPP : OPCODE_FPP);
+        insertValue<int32_t>(location);
+        result.push_back(OPCODE_LOAD);
+        result.push_back(sizeof(void *));
+      } else {
+        emitGetLeft(reg);
       }
-      
-      expr_blocks.pop_back();
-      
-      return eb->type;
+      emitVector(OPCODE_VLOAD, type);
+      applyOpVector(binop->op, type);
     }
 
-    return VOID_TYPE;
+    if (reg == ACCUMULATOR) {
+      emitPop(sizeof(void *));
+    } else {
+      emitGetLeft(reg);
+      freeReg();
+    }
+    emitVector(OPCODE_VSTORE, type);
+
+    return left;
   }
 
-  void compileStatement(const ASTNode *node) {
-    CHECK_IS_TYPE(node, vardecl, VarDeclNode) {
-      compileVarDecl(vardecl);
+  // Lanes named by a swizzle: x, y, z and w for the first four, or s
+  // followed by one hex digit per lane. Empty if the name isn't one
+  // The lanes a swizzle names, in order, into indices, which has room for
+  // one per byte of the largest vector. 0 if it names none
+  static int swizzleLanes(const char *name, int length, int lanes, byte *indices) {
+    bool hex = length > 1 && name[0] == 's';
+    int count = 0;
+
+    for (int i = hex ? 1 : 0; i < length; ++i) {
+      const char *digits = hex ? "0123456789abcdef" : "xyzw";
+      const char *found = strchr(digits, name[i]);
+      if (!found || *found == 0 || found - digits >= lanes || count == VECTOR_MAX_SIZE) return 0;
+      indices[count++] = found - digits;
+    }
+    return count;
+  }
+
+  // Offsets the pointer in reg (or left) by a constant
+  void emitPointerOffset(int offset, int reg) {
+    if (offset == 0) return;
+    const byte u64 = MERGE(TYPE_UNSIGNED, FROM_SIZE(64));
+
+    if (reg == ACCUMULATOR) {
+      result.push_back(OPCODE_SWAP);
+      insertConstant<uint64_t>(offset);
+      emitTyped(OPCODE_ADD, u64, ACCUMULATOR, 0);
+    } else {
+      byte rhs = allocReg();
+      insertConstant<uint64_t>(offset, rhs);
+      emitTyped(OPCODE_ADD, u64, reg, rhs);
+      freeReg();
+    }
+  }
+
+  // vector.member: a swizzle of every lane (.wzyx, .s3210...), a single lane
+  // (.x, .s2) or a reduction (.sum, .min, .max). A single lane of a
+  // reference is a reference itself, so it can be assigned to
+  ASTType compileMember(const BinaryNode *binop, int reg) {
+    const IdentifierNode *member = nodeAs<IdentifierNode>(binop->right);
+    if (!member) {
+      printf("Compile error: Expected a member name after '.'\n");
+      compile_fail = true;
+      return VOID_TYPE;
+    }
+
+    ASTType vec = compileValue(binop->left, reg);
+    if (!isVector(vec)) {
+      printf("Compile error: Only vectors have members\n");
+      compile_fail = true;
+      return VOID_TYPE;
+    }
+
+    Atom name = member->tok.atom;
+    ASTType lane = vectorLane(vec);
+    int lanes = vectorLanes(vec);
+
+    byte reduction = 0;
+    if (name == ATOM_SUM) reduction = OPCODE_VSUM;
+    if (name == ATOM_MIN) reduction = OPCODE_VMIN;
+    if (name == ATOM_MAX) reduction = OPCODE_VMAX;
+    if (reduction) {
+      derefVector(vec, reg);
+      emitVector(reduction, vec);
+      emitSetLeft(reg);
+      lane.locked = true;
+      return lane;
+    }
+
+    byte indices[VECTOR_MAX_SIZE];
+    int count = swizzleLanes(member->tok.start, member->tok.length, lanes, indices);
+    if (count == 1 && vec.ref) {
+      emitPointerOffset(indices[0] * typeSize(lane), reg);
+      lane.ref = true;
+      return lane;
+    }
+
+    if (count == 1) {
+      emitVector(OPCODE_VEXTRACT, vec);
+      result.push_back(indices[0]);
+      emitSetLeft(reg);
+      lane.locked = true;
+      return lane;
+    }
+
+    if (count != lanes) {
+      printf("Compile error: Unknown vector member '%s'\n", atoms.name(name).c_str());
+      compile_fail = true;
+      return VOID_TYPE;
+    }
+
+    derefVector(vec, reg);
+    emitVector(OPCODE_VSHUF, vec);
+    constant_indexes.insert({result.size(), constants.addBytes(indices, count)});
+    result.insert(result.end(), 4, 0);
+    vec.locked = true;
+    return vec;
+  }
+
+  // --- Arrays ---
+  // Arrays (u32[8], f32x4[2]...) are only ever handled through pointers.
+  // Copying, filling and comparing one is a single bulk memory instruction
+  // on the pointer in left and the pointer or element value in right
+
+  static bool isArray(const ASTType &type) {
+    return type.info().arrsize > 0;
+  }
+
+  static ASTType arrayElement(const ASTType &type) {
+    return ASTType(type.info().element, type.locked);
+  }
+
+  int32_t arrayBytes(const ASTType &type) {
+    return typeSize(arrayElement(type)) * type.info().arrsize;
+  }
+
+  void emitBulk(byte opcode, int32_t count, byte width = 0) {
+    result.push_back(opcode);
+    if (opcode == OPCODE_FILL) result.push_back(width);
+    insertValue<int32_t>(count);
+  }
+
+  // Gets what is stored to an array, compiled to reg, ready for
+  // emitArrayStore(): a pointer to an array of the same type, or a value
+  // of the element type to fill it with
+  bool loadArraySource(const ASTType &array, ASTType &value, int reg) {
+    if (isArray(value)) {
+      if (value != array || !value.ref) {
+        printf("Compile error: Array type mismatch\n");
+        compile_fail = true;
+        return false;
+      }
+      return true;
+    }
+
+    ASTType element = arrayElement(array);
+    if (!isPrimitive(element) || !isPrimitive(value)) {
+      printf("Compile error: Arrays are assigned arrays, or primitives to fill them with\n");
+      compile_fail = true;
+      return false;
+    }
+
+    byte prim = primitiveByte(value);
+    byte lane = primitiveByte(element);
+    derefPrim(value, prim, reg);
+    if (prim != lane) emitConv(prim, lane, reg);
+    return true;
+  }
+
+  // Copies the array right points to, or fills with the element in right,
+  // the array left points to
+  void emitArrayStore(const ASTType &array, const ASTType &value) {
+    if (isArray(value)) emitBulk(OPCODE_CPY, arrayBytes(array));
+    else emitBulk(OPCODE_FILL, arrayBytes(array), typeSize(arrayElement(array)));
+  }
+
+  // Assigns to an array the pointer to which is in reg (or left)
+  ASTType compileArrayAssign(const BinaryNode *binop, const ASTType &left, int reg) {
+    if (binop->op != TokenType::EQ) {
+      printf("Compile error: Arrays only support '='\n");
+      compile_fail = true;
+      return VOID_TYPE;
+    }
+
+    // Stack code keeps the pointer on the stack while the value is computed
+    int value = ACCUMULATOR;
+    if (reg == ACCUMULATOR) emitPush(sizeof(void *));
+    else value = allocReg();
+
+    ASTType right = compileValue(binop->right, value);
+    if (!loadArraySource(left, right, value)) return VOID_TYPE;
+
+    if (reg == ACCUMULATOR) {
+      result.push_back(OPCODE_SWAP);
+      emitPop(sizeof(void *));
+    } else {
+      emitGetLeft(value);
+      result.push_back(OPCODE_SWAP);
+      emitGetLeft(reg);
+      freeReg();
+    }
+    emitArrayStore(left, right);
+
+    return left;
+  }
+
+  // array == array and array != array, the left pointer is in reg (or left)
+  ASTType compileArrayCompare(const BinaryNode *binop, const ASTType &left, int reg) {
+    if (binop->op != TokenType::EQ_EQUAL && binop->op != TokenType::EX_EQUAL) {
+      printf("Compile error: Arrays only compare with '==' and '!='\n");
+      compile_fail = true;
+      return VOID_TYPE;
+    }
+
+    int other = ACCUMULATOR;
+    if (reg == ACCUMULATOR) emitPush(sizeof(void *));
+    else other = allocReg();
+
+    ASTType right = compileValue(binop->right, other);
+    if (right != left || !right.ref || !left.ref) {
+      printf("Compile error: Array type mismatch\n");
+      compile_fail = true;
+      return VOID_TYPE;
+    }
+
+    if (reg == ACCUMULATOR) {
+      result.push_back(OPCODE_SWAP);
+      emitPop(sizeof(void *));
+    } else {
+      emitGetLeft(other);
+      result.push_back(OPCODE_SWAP);
+      emitGetLeft(reg);
+      freeReg();
+    }
+
+    // MCMP leaves 0 for equal arrays, BNOT turns that into a bool
+    emitBulk(OPCODE_MCMP, arrayBytes(left));
+    emitBoolNot(ACCUMULATOR);
+    if (binop->op == TokenType::EX_EQUAL) emitBoolNot(ACCUMULATOR);
+    emitSetLeft(reg);
+    return CONSTANT_VAL_TYPE(u8);
+  }
+
+  // --- Host functions ---
+  // name(args...) is a SPECCALL of the host function bound under name, see
+  // native.cpp for where its arguments go. sin, cos, tan, asin, acos and
+  // atan of a float are FTRIG when no host function took the name
+
+  // The script type of a host function's argument or result type byte.
+  // Pointers are u64s, they come from references
+  static ASTType hostType(byte type) {
+    if (type == NATIVE_POINTER) return primitiveType(MERGE(TYPE_UNSIGNED, FROM_SIZE(64)));
+    return primitiveType(type);
+  }
+
+  // Gets an argument, compiled to reg, as a host function's `type`
+  bool loadHostArgument(ASTType value, byte type, int reg) {
+    if (type == NATIVE_POINTER) {
+      if (!value.ref) {
+        printf("Compile error: Pointer arguments take references\n");
+        compile_fail = true;
+        return false;
+      }
+      return true;
+    }
+
+    if (!isPrimitive(value)) {
+      printf("Compile error: Host functions take primitives\n");
+      compile_fail = true;
+      return false;
+    }
+
+    byte prim = primitiveByte(value);
+    derefPrim(value, prim, reg);
+    if (prim != type) emitConv(prim, type, reg);
+    return true;
+  }
+
+  ASTType compileTrig(const CallNode *call, byte function, int reg) {
+    ASTType arg = compileValue(call->args[0], reg);
+    if (!isPrimitive(arg) || UPPER(primitiveByte(arg)) != TYPE_FLOAT) {
+      printf("Compile error: Trig functions take a float\n");
+      compile_fail = true;
+      return VOID_TYPE;
+    }
+
+    byte type = primitiveByte(arg);
+    derefPrim(arg, type, reg);
+    emitGetLeft(reg);
+    result.push_back(OPCODE_FTRIG);
+    result.push_back(type);
+    result.push_back(function);
+    emitSetLeft(reg);
+    arg.locked = true;
+    return arg;
+  }
+
+  // The FTRIG function called name, -1 if there is none
+  static int trigFunctionNamed(const std::string &name) {
+    static const char *trig[] = {
+      #define TRIG_NAME(name, fn) #fn,
+      TRIG_FUNCTIONS(TRIG_NAME)
+      #undef TRIG_NAME
+    };
+    for (byte function = 0; function < TRIG_COUNT; ++function) {
+      if (name == trig[function]) return function;
+    }
+    return -1;
+  }
+
+  // The result ends up in reg (or left)
+  ASTType compileCall(const CallNode *call, int reg) {
+    const std::string &name = atoms.name(call->name.atom);
+    int id = natives.find(name);
+
+    if (id < 0 && call->args.size() == 1) {
+      int function = trigFunctionNamed(name);
+      if (function >= 0) return compileTrig(call, function, reg);
+    }
+
+    if (id < 0) {
+      printf("Compile error: Unknown host function '%s'\n", name.c_str());
+      compile_fail = true;
+      return VOID_TYPE;
+    }
+
+    const NativeFunction &native = natives.get(id);
+    int count = call->args.size();
+    if (count != native.arity) {
+      printf("Compile error: '%s' takes %d arguments\n", name.c_str(), native.arity);
+      compile_fail = true;
+      return VOID_TYPE;
+    }
+
+    // All but the last two are pushed in order
+    int pushed = count > 2 ? count - 2 : 0;
+    int value = reg == ACCUMULATOR ? ACCUMULATOR : allocReg();
+    for (int i = 0; i < pushed; ++i) {
+      ASTType arg = compileValue(call->args[i], value);
+      if (!loadHostArgument(arg, native.args[i], value)) return VOID_TYPE;
+      emitPushValue(value, LOWER(native.args[i]));
+    }
+
+    // Then left and right. Stack code keeps the one for left on the stack
+    // while the other is computed
+    if (count - pushed == 2) {
+      byte type = native.args[pushed];
+      int other = reg == ACCUMULATOR ? ACCUMULATOR : allocReg();
+
+      ASTType arg = compileValue(call->args[pushed], value);
+      if (!loadHostArgument(arg, type, value)) return VOID_TYPE;
+      if (reg == ACCUMULATOR) emitPush(LOWER(type));
+
+      arg = compileValue(call->args[pushed + 1], other);
+      if (!loadHostArgument(arg, native.args[pushed + 1], other)) return VOID_TYPE;
+
+      emitGetLeft(other);
+      result.push_back(OPCODE_SWAP);
+      if (reg == ACCUMULATOR) emitPop(LOWER(type));
+      else emitGetLeft(value);
+      if (reg != ACCUMULATOR) freeReg();
+    } else if (count - pushed == 1) {
+      ASTType arg = compileValue(call->args[pushed], value);
+      if (!loadHostArgument(arg, native.args[pushed], value)) return VOID_TYPE;
+      emitGetLeft(value);
+    }
+    if (reg != ACCUMULATOR) freeReg();
+
+    result.push_back(OPCODE_SPECCALL);
+    result.push_back(id);
+    if (is_global) stack_global -= native.stack;
+    else stack_local -= native.stack;
+
+    if (native.result == TYPE_NONE) return VOID_TYPE;
+    emitSetLeft(reg);
+    return hostType(native.result);
+  }
+
+  ASTType compileAssignOp(const BinaryNode * binop) {
+    if (assignsConstant(binop)) return VOID_TYPE;
+    ASTType left = compileExpression(binop->left);
+    byte primleft;
+    if (!left.ref || left.locked) {
+      printf("Expected an unlocked reference on the left of assignment operator");
+      compile_fail = true;
+      return VOID_TYPE;
+    }
+
+    if (isVector(left)) return compileVectorAssign(binop, left, ACCUMULATOR);
+    if (isArray(left)) return compileArrayAssign(binop, left, ACCUMULATOR);
+    
+    bool isprim = isPrimitive(left);
+
+    int location;
+
+    if (isprim) {
+      primleft = primitiveByte(left);
+      location = emitPush(sizeof(void *));
+    } else {
+
+    }
+
+    ASTType right = isprim ? compileConverted(binop->right, primleft, ACCUMULATOR) : compileExpression(binop->right);
+
+    if (isprim) {
+      if (!isPrimitive(right)) {
+        printf("Object assigned to primitive\n");
+        compile_fail = true;
+        return VOID_TYPE;
+      }
+
+      result.push_back(OPCODE_SWAP);
+      
+      // For example, +=
+      if (binop->op != TokenType::EQ) {
+        // Step 1 is to get the pointer without popping the stack
+        if (is_global) {
+          result.push_back(OPCODE_SPP);
+        } else {
+          result.push_back(OPCODE_FPP);
+        }
+        insertValue<int32_t>(location);
+
+        result.push_back(OPCODE_LOAD);
+        result.push_back(sizeof(void *));
+
+        result.push_back(OPCODE_LOAD);
+        result.push_back(LOWER(primleft));
+
+        applyOpPrimitive(binop->op, primleft);
+
+        result.push_back(OPCODE_SWAP);
+      }
+
+      emitPop(sizeof(void *));
+
+      result.push_back(OPCODE_STORE);
+      result.push_back(LOWER(primleft));
+
+      // This should keep the pointer in the left register, so we don't need to do anything else to return the reference
+    } else {
+      if (left != right) {
+        printf("Type mismatch in assignment operator\n");
+        compile_fail = true;
+        return VOID_TYPE;
+      }
+    }
+
+    // We still want reference and unlocked
+
+    return left;
+  }
+
+  // Same as above, but the pointer stays in reg and the value gets its own
+  // register, so nothing goes through the stack
+  ASTType compileAssignOp(const BinaryNode * binop, byte reg) {
+    if (assignsConstant(binop)) return VOID_TYPE;
+    ASTType left = compileExpression(binop->left, reg);
+    if (!left.ref || left.locked) {
+      printf("Expected an unlocked reference on the left of assignment operator");
+      compile_fail = true;
+      return VOID_TYPE;
+    }
+
+    if (isVector(left)) return compileVectorAssign(binop, left, reg);
+    if (isArray(left)) return compileArrayAssign(binop, left, reg);
+
+    byte rhs = allocReg();
+    bool isprim = isPrimitive(left);
+    byte primleft = isprim ? primitiveByte(left) : TYPE_NONE;
+    ASTType right = isprim ? compileConverted(binop->right, primleft, rhs) : compileExpression(binop->right, rhs);
+
+    if (isprim) {
+      if (!isPrimitive(right)) {
+        printf("Object assigned to primitive\n");
+        compile_fail = true;
+        return VOID_TYPE;
+      }
+
+      byte value = rhs;
+
+      // For example, +=
+      if (binop->op != TokenType::EQ) {
+        value = allocReg();
+        result.push_back(OPCODE_R_LOAD);
+        result.push_back(value);
+        result.push_back(reg);
+        result.push_back(LOWER(primleft));
+
+        applyOpPrimitive(binop->op, primleft, value, rhs);
+        freeReg();
+      }
+
+      result.push_back(OPCODE_R_STORE);
+      result.push_back(reg);
+      result.push_back(value);
+      result.push_back(LOWER(primleft));
+    } else {
+      if (left != right) {
+        printf("Type mismatch in assignment operator\n");
+        compile_fail = true;
+        return VOID_TYPE;
+      }
+    }
+
+    freeReg();
+    return left;
+  }
+
+  ASTType compileBinaryOp(const BinaryNode *binop) {
+    if (binop->op == TokenType::DOT) return compileMember(binop, ACCUMULATOR);
+
+    // A constant operand is only loaded once the type both are promoted to
+    // is known, at that width
+    FoldedValue lconst, rconst;
+    bool lfolded = fold(binop->left, lconst);
+    ASTType left = lfolded ? primitiveType(lconst.type) : compileExpression(binop->left);
+    byte primleft;
+
+    if (isVector(left)) return compileVectorOp(binop, left, ACCUMULATOR);
+    if (isArray(left)) return compileArrayCompare(binop, left, ACCUMULATOR);
+
+    if (isPrimitive(left)) {
+      primleft = primitiveByte(left);
+      if (!lfolded) {
+        derefPrim(left, primleft);
+        emitPush(LOWER(primleft));
+      }
+    } else {
+      // TODO
+    }
+
+    bool rfolded = isPrimitive(left) && fold(binop->right, rconst);
+    ASTType right = rfolded ? primitiveType(rconst.type) : compileExpression(binop->right);
+    if (isPrimitive(left) && isVector(right)) {
+      return compileScalarVectorOp(binop->op, primleft, right, ACCUMULATOR, ACCUMULATOR, lfolded ? &lconst : nullptr);
+    }
+
+    ASTType best = promoteTypes(left, right);
+    byte primbest;
+
+    // Since there are no implicit conversions, left and right are either the same or both primitives
+    if (isPrimitive(best)) {
+      primbest = primitiveByte(best);
+      if (rfolded) {
+        emitFolded(foldConvert(rconst, primbest));
+      } else {
+        byte primright = primitiveByte(right);
+        derefPrim(right, primright);
+        if (primright != primbest) emitConv(primright, primbest);
+      }
+
+      result.push_back(OPCODE_SWAP);
+
+      if (lfolded) {
+        emitFolded(foldConvert(lconst, primbest));
+      } else {
+        emitPop(LOWER(primleft));
+        if (primleft != primbest) emitConv(primleft, primbest);
+      }
+
+      applyOpPrimitive(binop->op, primbest);
+      if (isComparison(binop->op)) best = CONSTANT_VAL_TYPE(u8);
+    } else {
+      // TODO
+    }
+
+    best.locked = true;
+    return best;
+  }
+
+  // Three-address version: left is computed into reg, right into the next
+  // free register, and the result overwrites reg
+  ASTType compileBinaryOp(const BinaryNode *binop, byte reg) {
+    if (binop->op == TokenType::DOT) return compileMember(binop, reg);
+
+    FoldedValue lconst, rconst;
+    bool lfolded = fold(binop->left, lconst);
+    ASTType left = lfolded ? primitiveType(lconst.type) : compileExpression(binop->left, reg);
+    byte primleft;
+
+    if (isVector(left)) return compileVectorOp(binop, left, reg);
+    if (isArray(left)) return compileArrayCompare(binop, left, reg);
+
+    if (isPrimitive(left)) {
+      primleft = primitiveByte(left);
+      if (!lfolded) derefPrim(left, primleft, reg);
+    }
+
+    byte rhs = allocReg();
+    bool rfolded = isPrimitive(left) && fold(binop->right, rconst);
+    ASTType right = rfolded ? primitiveType(rconst.type) : compileExpression(binop->right, rhs);
+    if (isPrimitive(left) && isVector(right)) {
+      ASTType type = compileScalarVectorOp(binop->op, primleft, right, reg, rhs, lfolded ? &lconst : nullptr);
+      freeReg();
+      return type;
+    }
+
+    ASTType best = promoteTypes(left, right);
+
+    if (isPrimitive(best)) {
+      byte primbest = primitiveByte(best);
+      if (rfolded) {
+        emitFolded(foldConvert(rconst, primbest), rhs);
+      } else {
+        byte primright = primitiveByte(right);
+        derefPrim(right, primright, rhs);
+        if (primright != primbest) emitConv(primright, primbest, rhs);
+      }
+
+      if (lfolded) emitFolded(foldConvert(lconst, primbest), reg);
+      else if (primleft != primbest) emitConv(primleft, primbest, reg);
+
+      applyOpPrimitive(binop->op, primbest, reg, rhs);
+      if (isComparison(binop->op)) best = CONSTANT_VAL_TYPE(u8);
+    }
+
+    freeReg();
+    best.locked = true;
+    return best;
+  }
+
+  // Compiles a primitive into reg (or left) converted to `to`. Constants are
+  // converted here and loaded at that width. The type it had if it wasn't
+  // a primitive
+  ASTType compileConverted(const ASTNode *node, byte to, int reg) {
+    FoldedValue constant;
+    if (fold(node, constant)) return emitFolded(foldConvert(constant, to), reg);
+
+    ASTType type = compileValue(node, reg);
+    if (!isPrimitive(type)) return type;
+    byte prim = primitiveByte(type);
+    derefPrim(type, prim, reg);
+    if (prim != to) emitConv(prim, to, reg);
+    return primitiveType(to);
+  }
+
+  // -x and ~x keep the type of x, !x is x == 0 as a u8
+  ASTType compileUnaryOp(const UnaryNode *unary, int reg) {
+    ASTType type = compileValue(unary->expr, reg);
+    if (!isPrimitive(type)) {
+      printf("Compile error: Unsupported unary operator\n");
+      compile_fail = true;
+      return VOID_TYPE;
+    }
+
+    byte prim = primitiveByte(type);
+    derefPrim(type, prim, reg);
+
+    switch (unary->op) {
+      case TokenType::MINUS:
+        emitTyped(OPCODE_NEG, prim, reg, reg);
+        return primitiveType(prim);
+      case TokenType::TILDE:
+        emitTyped(OPCODE_NOT, prim, reg, reg);
+        return primitiveType(prim);
+      case TokenType::EX:
+        if (prim == MERGE(TYPE_UNSIGNED, FROM_SIZE(8))) emitBoolNot(reg);
+        else emitIsZero(prim, reg);
+        return CONSTANT_VAL_TYPE(u8);
+      default:
+        printf("Compile error: Unsupported unary operator\n");
+        compile_fail = true;
+        return VOID_TYPE;
+    }
+  }
+
+  void compileVarDecl(const VarDeclNode *vardecl) {
+    Atom name = vardecl->name.atom;
+      
+    if (variables.count(name) > 0) {
+      printf("Variable already exists\n");
+      compile_fail = true;
+      return;
+    }
+
+    declared.push_back(name);
+    if (vardecl->constant) {
+      compileConstDecl(vardecl, name);
+      return;
+    }
+
+    VarInfo &info = variables[name];
+
+    info.type = vardecl->type;
+    info.is_global = is_global;
+    info.size = typeSize(vardecl->type);
+    info.is_prim = isPrimitive(vardecl->type);
+    if (info.is_prim) info.prim = primitiveByte(vardecl->type);
+
+    if (is_global) {
+      global_stack.push_back(name);
+    } else {
+      local_stack.back().push_back(name);
+    }
+
+    int reg = register_mode ? allocReg() : ACCUMULATOR;
+
+    if (info.type.ref) {
+      if (!vardecl->init) {
+        printf("References must be initialized\n");
+        compile_fail = true;
+        return;
+      }
+
+      ASTType res = compileValue(vardecl->init, reg);
+      
+      // Make sure the types line up...
+
+      if (res != info.type) {
+        printf("Conflicting reference and initializer\n");
+        compile_fail = true;
+        return;
+      }
+      
+      if (!res.ref) {
+        printf("References must be initialized with a reference\n");
+        compile_fail = true;
+        return;
+      }
+
+      // We actually don't care about the data, just the pointer.
+      
+      info.location = emitPushValue(reg, sizeof(void *));
+
+      if (register_mode) freeReg();
+      return;
+    }
+
+    if (isArray(info.type)) {
+      if (info.size <= 0 || info.size > MAX_STACK_SIZE) {
+        printf("Compile error: Array size out of range\n");
+        compile_fail = true;
+        return;
+      }
+
+      if (vardecl->init) {
+        ASTType res = compileValue(vardecl->init, reg);
+        if (!loadArraySource(info.type, res, reg)) return;
+        info.location = emitReserve(info.size);
+
+        // The source is in left (stack code) or reg
+        emitGetLeft(reg);
+        result.push_back(OPCODE_SWAP);
+        emitVariablePointer(info, ACCUMULATOR);
+        emitArrayStore(info.type, res);
+      } else {
+        info.location = emitReserve(info.size);
+      }
+
+      if (register_mode) freeReg();
+      return;
+    }
+
+    if (isVector(info.type)) {
+      if (vardecl->init) {
+        ASTType res = compileValue(vardecl->init, reg);
+        if (!loadVector(res, info.type, reg)) return;
+        info.location = emitVectorPush(info.type);
+      } else {
+        info.location = emitReserve(info.size);
+      }
+    }
+
+    if (info.is_prim) {
+      byte prim = info.prim;
+
+      if (vardecl->init) {
+        if (!isPrimitive(compileConverted(vardecl->init, prim, reg))) {
+          printf("Assigning non-primitive to primitive value\n");
+          compile_fail = true;
+          return;
+        }
+      } else {
+        switch (UPPER(prim)) {
+          case TYPE_SIGNED:
+          case TYPE_UNSIGNED:
+            number("0", reg);
+            break;
+          case TYPE_FLOAT:
+            if (LOWER(prim) == FROM_SIZE(32)) number("0f", reg);
+            else number("0d", reg);
+            break;
+        }
+      }
+
+      // Either way, we push it to the stack
+     info.location = emitPushValue(reg, LOWER(prim));
+    }
+
+    if (register_mode) freeReg();
+  }
+
+  // --- Control flow ---
+  // Blocks and both sides of an if are scopes. Their variables go at the
+  // end, and the stack they took is released without touching the
+  // registers, which may hold an expression block's value
+
+  void closeScope(size_t scope) {
+    int size = 0;
+    while (declared.size() > scope) {
+      Atom name = declared.back();
+      const VarInfo &info = variables[name];
+      if (info.is_const) {
+        constant_count--;
+      } else {
+        size += info.size;
+        if (is_global) global_stack.pop_back();
+        else local_stack.back().pop_back();
+      }
+      variables.erase(name);
+      declared.pop_back();
+    }
+
+    for (; size > 0; size -= INT16_MAX) emitRelease(std::min(size, (int) INT16_MAX));
+  }
+
+  void compileBranch(const ASTNode *node) {
+    size_t scope = declared.size();
+    if (node) compileStatement(node);
+    closeScope(scope);
+  }
+
+  void patchJump(int pos) {
+    *(int32_t *)(result.data() + pos) = result.size();
+  }
+
+  // Stack code works out the condition in left, where an expression
+  // block's value is. Inside one, left is saved first and each side starts
+  // by getting it back
+  void compileIfElse(const IfElseNode *ifelse) {
+    bool keep = !register_mode && !expr_blocks.empty();
+    if (keep) emitPush(8);
+
+    int reg = register_mode ? allocReg() : ACCUMULATOR;
+    ASTType cond = compileValue(ifelse->cond, reg);
+    if (!isPrimitive(cond)) {
+      printf("Compile error: Conditions must be primitives\n");
+      compile_fail = true;
+      return;
+    }
+
+    byte prim = primitiveByte(cond);
+    derefPrim(cond, prim, reg);
+
+    // JMPZ only looks at the low byte, anything but a u8 is compared with
+    // zero instead
+    byte jump = OPCODE_JMPZ;
+    if (prim != MERGE(TYPE_UNSIGNED, FROM_SIZE(8))) {
+      emitIsZero(prim, reg);
+      jump = OPCODE_JMPNZ;
+    }
+    emitGetLeft(reg);
+    if (register_mode) freeReg();
+
+    result.push_back(jump);
+    int to_else = result.size();
+    insertValue<int32_t>(0);
+
+    if (keep) emitPop(8);
+    compileBranch(ifelse->left);
+    if (ifelse->right || keep) {
+      result.push_back(OPCODE_JMP);
+      int to_end = result.size();
+      insertValue<int32_t>(0);
+      patchJump(to_else);
+      if (keep) {
+        // Both sides pop what was pushed once
+        if (is_global) stack_global += 8;
+        else stack_local += 8;
+        emitPop(8);
+      }
+      compileBranch(ifelse->right);
+      patchJump(to_end);
+    } else {
+      patchJump(to_else);
+    }
+  }
+
+  // --- Expressions --
+  // NOTE: Primitive values are passed down through the left register, but objects are passed at the top of the stack
+
+  // Sets reg (or left) to a pointer to the variable
+  void emitVariablePointer(const VarInfo &info, int reg) {
+    if (reg == ACCUMULATOR) {
+      result.push_back(info.is_global ? OPCODE_SPP : OPCODE_FPP);
+    } else {
+      result.push_back(info.is_global ? OPCODE_R_SPP : OPCODE_R_FPP);
+      result.push_back(reg);
+    }
+    insertValue<int32_t>(info.location);
+
+    // A reference's slot holds the pointer we want
+    if (info.type.ref) {
+      if (reg == ACCUMULATOR) {
+        result.push_back(OPCODE_LOAD);
+      } else {
+        result.push_back(OPCODE_R_LOAD);
+        result.push_back(reg);
+        result.push_back(reg);
+      }
+      result.push_back(sizeof(void *));
+    }
+  }
+
+  ASTType compileExprBlock(const ExprBlockNode *eb, int reg) {
+    expr_blocks.emplace_back(eb, reg);
+
+    for (const ASTNode *node : eb->statements) {
+      compileStatement(node);
+    }
+    lines.mark(result.size(), eb->line);
+
+    for (int pos : expr_blocks.back().jump_inserts) {
+      *(int32_t *)(result.data() + pos) = result.size();
+    }
+    
+    expr_blocks.pop_back();
+    
+    return eb->type;
+  }
+
+  const VarInfo *lookup(const IdentifierNode *id) {
+    const VarInfo *info = variables.find(id->tok.atom);
+    if (!info) {
+      printf("Compile error: Unknown variable '%s'\n", atoms.name(id->tok.atom).c_str());
+      compile_fail = true;
+    }
+    return info;
+  }
+
+  ASTType compileExpression(const ASTNode *node) {
+    FoldedValue value;
+    if (fold(node, value)) return emitFolded(value);
+
+    switch (node->kind) {
+      case NodeKind::BINARY: {
+        const BinaryNode *binop = static_cast<const BinaryNode *>(node);
+        if (binop->op >= TokenType::EQ) return compileAssignOp(binop);
+        return compileBinaryOp(binop);
+      }
+
+      case NodeKind::UNARY:
+        return compileUnaryOp(static_cast<const UnaryNode *>(node), ACCUMULATOR);
+
+      case NodeKind::IDENTIFIER: {
+        const VarInfo *info = lookup(static_cast<const IdentifierNode *>(node));
+        if (!info) return VOID_TYPE;
+        ASTType new_type = info->type;
+
+        emitVariablePointer(*info, ACCUMULATOR);
+        new_type.ref = true;
+
+        return new_type;
+      }
+
+      case NodeKind::EXPR_BLOCK:
+        return compileExprBlock(static_cast<const ExprBlockNode *>(node), ACCUMULATOR);
+
+      case NodeKind::CALL:
+        return compileCall(static_cast<const CallNode *>(node), ACCUMULATOR);
+
+      default:
+        return VOID_TYPE;
+    }
+  }
+
+  // Register mode: the value (or the pointer, for references) ends up in reg
+  ASTType compileExpression(const ASTNode *node, byte reg) {
+    FoldedValue value;
+    if (fold(node, value)) return emitFolded(value, reg);
+
+    switch (node->kind) {
+      case NodeKind::BINARY: {
+        const BinaryNode *binop = static_cast<const BinaryNode *>(node);
+        if (binop->op >= TokenType::EQ) return compileAssignOp(binop, reg);
+        return compileBinaryOp(binop, reg);
+      }
+
+      case NodeKind::UNARY:
+        return compileUnaryOp(static_cast<const UnaryNode *>(node), reg);
+
+      case NodeKind::IDENTIFIER: {
+        const VarInfo *info = lookup(static_cast<const IdentifierNode *>(node));
+        if (!info) return VOID_TYPE;
+        ASTType new_type = info->type;
+
+        emitVariablePointer(*info, reg);
+        new_type.ref = true;
+
+        return new_type;
+      }
+
+      case NodeKind::EXPR_BLOCK:
+        return compileExprBlock(static_cast<const ExprBlockNode *>(node), reg);
 
+      case NodeKind::CALL:
+        return compileCall(static_cast<const CallNode *>(node), reg);
+
+      default:
+        return VOID_TYPE;
+    }
+  }
+
+  ASTType compileValue(const ASTNode *node, int reg) {
+    if (reg == ACCUMULATOR) return compileExpression(node);
+    return compileExpression(node, (byte) reg);
+  }
+
+  void compileYield(const YieldNode *yld) {
+    if (expr_blocks.empty()) {
+      printf("Cannot use yield outside of expression-block\n");
+      compile_fail = true;
       return;
     }
 
-    CHECK_IS_TYPE(node, yld, YieldNode) {
-      if (expr_blocks.empty()) {
-        printf("Cannot use yield outside of expression-block\n");
-        compile_fail = true;
+    ExprBlockInfo &info = expr_blocks.back();
+
+    bool isprim = isPrimitive(info.block->type);
+    byte prim;
+
+    if (isprim) {
+      prim = primitiveByte(info.block->type);
+    }
+
+    ASTType res = isprim ? compileConverted(yld->expr, prim, info.reg) : compileValue(yld->expr, info.reg);
+
+    if (isprim && isPrimitive(res)) {
+      // Already converted
+    } else if (res != info.block->type) {
+      printf("Yield type mismatch\n");
+      compile_fail = true;
+      return;
+    }
+
+    // NOTE: TODO NOW
+    if (isprim) {
+      
+    } else {
+      
+    }
+  }
+
+  void compileStatement(const ASTNode *node) {
+    lines.mark(result.size(), node->line);
+
+    switch (node->kind) {
+      case NodeKind::VAR_DECL:
+        compileVarDecl(static_cast<const VarDeclNode *>(node));
+        return;
+
+      case NodeKind::IF_ELSE:
+        compileIfElse(static_cast<const IfElseNode *>(node));
+        return;
+
+      case NodeKind::CODE_BLOCK: {
+        size_t scope = declared.size();
+        for (const ASTNode *statement : static_cast<const CodeBlockNode *>(node)->statements) compileStatement(statement);
+        closeScope(scope);
         return;
       }
 
-      ExprBlockInfo &info = expr_blocks.back();
+      case NodeKind::YIELD:
+        compileYield(static_cast<const YieldNode *>(node));
+        return;
+
+      default:
+        break;
+    }
+
+    // Expression statements print their value, a variable or an assignment
+    // is read back first like the optimizer's SSA_PRINT does
+    if (register_mode) {
+      byte reg = allocReg();
+      ASTType type = compileExpression(node, reg);
+      if (isPrimitive(type)) derefPrim(type, primitiveByte(type), reg);
+      result.push_back(OPCODE_R_GET);
+      result.push_back(reg);
+      freeReg();
+    } else {
+      ASTType type = compileExpression(node);
+      if (isPrimitive(type)) derefPrim(type, primitiveByte(type));
+    }
+    result.push_back(OPCODE_PRINT); // NOTE: Remove this
+  }
+
+  // --- SSA construction ---
+  // With opt_level above 0 the program is first built in ssa.cpp's form.
+  // Variables are SSA values, except those a reference points to, which
+  // keep a stack slot. At the end of an if, what the two sides left a
+  // variable declared before it at meets in a phi. Only primitives and
+  // references to them are handled: for anything else (vectors, arrays,
+  // members...) the direct compiler takes the whole program, and it also
+  // reports the errors
+
+  struct SSAVariable {
+    byte type;            // For references, of what they point to
+    bool ref = false;     // value is the pointer
+    bool memory = false;  // Lives in its stack slot
+    bool locked = false;
+    int32_t slot = 0;
+    int value = -1;       // Current value, the pointer for references
+  };
+
+  SSAFunction ssa;
+  int ssa_block = 0; // Where instructions go
+  int ssa_line = -1;
+  std::vector<SSAVariable> ssa_variables;
+  AtomMap<int> ssa_names;
+  std::vector<std::vector<std::pair<int, int>>> ssa_writes; // Per open if side: variable, value before
+  std::vector<int> ssa_yields; // Variable holding each open expression block's value
+  AtomMap<bool> ssa_address_taken;
+  std::string ssa_skipped; // Why the optimizer left the program alone, empty if it didn't
+
+  int ssaUnsupported(const std::string &what) {
+    if (ssa_skipped.empty()) ssa_skipped = what;
+    return -1;
+  }
+
+  // Names the declaration that kept the optimizer out
+  bool ssaUnsupportedDecl(const VarDeclNode *vardecl, const char *what) {
+    ssaUnsupported(std::string(what) + " ('" + atoms.name(vardecl->name.atom) +
+                   "' on line " + std::to_string(vardecl->line + 1) + ")");
+    return false;
+  }
+
+  // The fields only some ops use are set by the caller
+  static SSAInst ssaInst(byte op, byte type = TYPE_NONE, byte opcode = 0) {
+    SSAInst inst;
+    inst.op = op;
+    inst.type = type;
+    inst.opcode = opcode;
+    return inst;
+  }
+
+  int ssaAdd(SSAInst inst) {
+    inst.line = ssa_line;
+    return ssa.add(ssa_block, inst);
+  }
+
+  byte ssaType(int value) const {
+    return ssa.insts[value].type;
+  }
+
+  int ssaConstant(const FoldedValue &value) {
+    SSAInst inst = ssaInst(SSA_CONST, value.type);
+    inst.value = value;
+    return ssaAdd(inst);
+  }
+
+  int ssaZero(byte type) {
+    FoldedValue zero;
+    zero.type = type;
+    return ssaConstant(zero);
+  }
+
+  int ssaConvert(int value, byte to) {
+    if (ssaType(value) == to) return value;
+    SSAInst inst = ssaInst(SSA_CONV, to);
+    inst.args = {value};
+    return ssaAdd(inst);
+  }
+
+  // b is -1 for the unary opcodes
+  int ssaTyped(byte opcode, byte operand, int a, int b) {
+    bool compare = opcode == OPCODE_CMPE || opcode == OPCODE_CMPL || opcode == OPCODE_CMPG;
+    SSAInst inst = ssaInst(SSA_TYPED, compare ? MERGE(TYPE_UNSIGNED, FROM_SIZE(8)) : operand, opcode);
+    inst.operand = operand;
+    inst.args = {a};
+    if (b >= 0) inst.args.push_back(b);
+    return ssaAdd(inst);
+  }
+
+  int ssaBoolNot(int value) {
+    SSAInst inst = ssaInst(SSA_BNOT, MERGE(TYPE_UNSIGNED, FROM_SIZE(8)));
+    inst.args = {value};
+    return ssaAdd(inst);
+  }
+
+  // The variable an identifier names, -1 for constants and unknown names
+  int ssaVariable(const IdentifierNode *id) const {
+    const int *found = ssa_names.find(id->tok.atom);
+    return found ? *found : -1;
+  }
+
+  int ssaAddress(int var) {
+    const SSAVariable &variable = ssa_variables[var];
+    if (variable.ref) return variable.value;
+
+    SSAInst inst = ssaInst(SSA_ADDR, MERGE(TYPE_UNSIGNED, FROM_SIZE(64)));
+    inst.slot = variable.slot;
+    return ssaAdd(inst);
+  }
+
+  int ssaRead(int var) {
+    const SSAVariable &variable = ssa_variables[var];
+    if (!variable.ref && !variable.memory) return variable.value;
+
+    SSAInst inst = ssaInst(SSA_LOAD, variable.type);
+    inst.args = {ssaAddress(var)};
+    return ssaAdd(inst);
+  }
+
+  void ssaWrite(int var, int value) {
+    SSAVariable &variable = ssa_variables[var];
+    if (variable.ref || variable.memory) {
+      SSAInst inst = ssaInst(SSA_STORE);
+      inst.args = {ssaAddress(var), value};
+      ssaAdd(inst);
+      return;
+    }
+
+    if (!ssa_writes.empty()) ssa_writes.back().push_back({var, variable.value});
+    variable.value = value;
+  }
+
+  // Names a reference is initialized with, their variables need a slot
+  void ssaFindAddressTaken(const ASTNode *node) {
+    if (!node) return;
+
+    if (const VarDeclNode *vardecl = nodeAs<VarDeclNode>(node)) {
+      const IdentifierNode *id = nodeAs<IdentifierNode>(vardecl->init);
+      if (vardecl->type.ref && id) ssa_address_taken[id->tok.atom] = true;
+    }
+    forEachChild(node, [this](const ASTNode *child) { ssaFindAddressTaken(child); });
+  }
+
+  int ssaBinary(const BinaryNode *binop) {
+    byte opcode;
+    bool negate;
+    if (!operatorOpcode(binop->op, opcode, negate)) return ssaUnsupported("an operator without an opcode");
+
+    int left = ssaExpression(binop->left);
+    if (left < 0) return -1;
+    int right = ssaExpression(binop->right);
+    if (right < 0) return -1;
+    if (ssaType(left) == TYPE_NONE || ssaType(right) == TYPE_NONE) return ssaUnsupported("a void operand");
+
+    byte best = primitiveByte(promoteTypes(primitiveType(ssaType(left)), primitiveType(ssaType(right))));
+    int value = ssaTyped(opcode, best, ssaConvert(left, best), ssaConvert(right, best));
+    return negate ? ssaBoolNot(value) : value;
+  }
+
+  int ssaUnary(const UnaryNode *unary) {
+    int value = ssaExpression(unary->expr);
+    if (value < 0) return -1;
+    byte type = ssaType(value);
+    if (type == TYPE_NONE) return ssaUnsupported("a void operand");
+
+    switch (unary->op) {
+      case TokenType::MINUS: return ssaTyped(OPCODE_NEG, type, value, -1);
+      case TokenType::TILDE: return ssaTyped(OPCODE_NOT, type, value, -1);
+      case TokenType::EX:
+        if (type == MERGE(TYPE_UNSIGNED, FROM_SIZE(8))) return ssaBoolNot(value);
+        return ssaTyped(OPCODE_CMPE, type, value, ssaZero(type));
+      default:
+        return ssaUnsupported("an unknown unary operator");
+    }
+  }
+
+  // Like the direct compiler, the right side is evaluated before the
+  // variable is read for a compound assignment
+  int ssaAssign(const BinaryNode *binop) {
+    const IdentifierNode *id = nodeAs<IdentifierNode>(binop->left);
+    int var = id ? ssaVariable(id) : -1;
+    if (var < 0 || ssa_variables[var].locked) return ssaUnsupported("an assignment to something but a variable");
+
+    byte opcode = 0;
+    bool negate;
+    if (binop->op != TokenType::EQ && !operatorOpcode(binop->op, opcode, negate)) {
+      return ssaUnsupported("an operator without an opcode");
+    }
+
+    int right = ssaExpression(binop->right);
+    if (right < 0) return -1;
+    if (ssaType(right) == TYPE_NONE) return ssaUnsupported("a void operand");
+
+    byte type = ssa_variables[var].type;
+    int value = ssaConvert(right, type);
+    if (binop->op != TokenType::EQ) value = ssaTyped(opcode, type, ssaRead(var), value);
+    ssaWrite(var, value);
+    return value;
+  }
+
+  // Arguments are converted to what the host function takes, its result
+  // has TYPE_NONE if it is void
+  int ssaCall(const CallNode *call) {
+    const std::string &name = atoms.name(call->name.atom);
+    int id = natives.find(name);
+    int function = id < 0 && call->args.size() == 1 ? trigFunctionNamed(name) : -1;
+
+    if (function >= 0) {
+      int arg = ssaExpression(call->args[0]);
+      if (arg < 0) return -1;
+      if (UPPER(ssaType(arg)) != TYPE_FLOAT) return ssaUnsupported("a trig function of something but a float");
+
+      SSAInst inst = ssaInst(SSA_TRIG, ssaType(arg), (byte) function);
+      inst.args = {arg};
+      return ssaAdd(inst);
+    }
+
+    if (id < 0) return ssaUnsupported("an unknown host function");
+    const NativeFunction &native = natives.get(id);
+    if ((int) call->args.size() != native.arity) return ssaUnsupported("a host call with the wrong arguments");
+    if (native.result == NATIVE_POINTER) return ssaUnsupported("a host function returning a pointer");
+
+    SSAInst inst = ssaInst(SSA_CALL, native.result, (byte) id);
+    for (int i = 0; i < native.arity; ++i) {
+      if (native.args[i] == NATIVE_POINTER) return ssaUnsupported("a pointer argument");
+      int arg = ssaExpression(call->args[i]);
+      if (arg < 0) return -1;
+      if (ssaType(arg) == TYPE_NONE) return ssaUnsupported("a void operand");
+      inst.args.push_back(ssaConvert(arg, native.args[i]));
+    }
+    return ssaAdd(inst);
+  }
+
+  // The value is whatever the last yield run left, zero if none ran
+  int ssaExprBlock(const ExprBlockNode *eb) {
+    if (!isPrimitive(eb->type) || eb->type.ref) return ssaUnsupported("an expression block of something but a primitive");
+
+    SSAVariable value;
+    value.type = primitiveByte(eb->type);
+    value.value = ssaZero(value.type);
+    int var = ssa_variables.size();
+    ssa_variables.push_back(value);
+
+    ssa_yields.push_back(var);
+    for (const ASTNode *node : eb->statements) {
+      if (!ssaStatement(node)) return -1;
+    }
+    ssa_yields.pop_back();
+    return ssa_variables[var].value;
+  }
+
+  int ssaExpression(const ASTNode *node) {
+    FoldedValue value;
+    if (fold(node, value)) return ssaConstant(value);
+
+    switch (node->kind) {
+      case NodeKind::BINARY: {
+        const BinaryNode *binop = static_cast<const BinaryNode *>(node);
+        if (binop->op == TokenType::DOT) return ssaUnsupported("a member");
+        if (binop->op >= TokenType::EQ) return ssaAssign(binop);
+        return ssaBinary(binop);
+      }
+
+      case NodeKind::UNARY:
+        return ssaUnary(static_cast<const UnaryNode *>(node));
+
+      case NodeKind::IDENTIFIER: {
+        int var = ssaVariable(static_cast<const IdentifierNode *>(node));
+        if (var < 0) return ssaUnsupported("an unknown name");
+        return ssaRead(var);
+      }
+
+      case NodeKind::EXPR_BLOCK:
+        return ssaExprBlock(static_cast<const ExprBlockNode *>(node));
+
+      case NodeKind::CALL:
+        return ssaCall(static_cast<const CallNode *>(node));
+
+      default:
+        return ssaUnsupported("an expression the optimizer doesn't handle");
+    }
+  }
+
+  bool ssaVarDecl(const VarDeclNode *vardecl) {
+    Atom name = vardecl->name.atom;
+    if (variables.count(name) || ssa_names.count(name)) return ssaUnsupportedDecl(vardecl, "a name declared twice");
+
+    if (vardecl->constant) {
+      compileConstDecl(vardecl, name);
+      if (compile_fail) return false;
+      declared.push_back(name);
+      return true;
+    }
+
+    const ASTType &type = vardecl->type;
+    if (!isPrimitive(type)) return ssaUnsupportedDecl(vardecl, "a variable of something but a primitive");
 
-      bool isprim = isPrimitive(info.block->type);
-      byte prim;
+    SSAVariable var;
+    var.type = primitiveByte(type);
+    var.locked = type.locked;
 
-      if (isprim) {
-        prim = primitiveByte(info.block->type);
+    if (type.ref) {
+      const IdentifierNode *id = nodeAs<IdentifierNode>(vardecl->init);
+      int target = id ? ssaVariable(id) : -1;
+      if (target < 0 || ssa_variables[target].type != var.type) {
+        return ssaUnsupportedDecl(vardecl, "a reference to something but a variable");
+      }
+      var.ref = true;
+      var.value = ssaAddress(target);
+    } else {
+      int value = vardecl->init ? ssaExpression(vardecl->init) : ssaZero(var.type);
+      if (value < 0) return false;
+      if (ssaType(value) == TYPE_NONE) {
+        ssaUnsupported("a void operand");
+        return false;
       }
+      var.value = ssaConvert(value, var.type);
 
-      ASTType res = compileExpression(yld->expr);
+      if (ssa_address_taken.count(name)) {
+        var.memory = true;
+        var.slot = ssa.frame;
+        ssa.frame += LOWER(var.type);
+      }
+    }
 
-      if (res != info.block->type) {
-        if (isprim && isPrimitive(res)) {
-          byte primres = primitiveByte(res);
+    int index = ssa_variables.size();
+    ssa_variables.push_back(var);
+    if (var.memory) ssaWrite(index, var.value);
+    ssa_names[name] = index;
+    declared.push_back(name);
+    return true;
+  }
 
-          result.push_back(OPCODE_CONV);
-          result.push_back(primres);
-          result.push_back(prim);
-        } else {
-          printf("Yield type mismatch\n");
-          compile_fail = true;
-          return;
+  void ssaLeaveScope(size_t scope) {
+    while (declared.size() > scope) {
+      Atom name = declared.back();
+      if (!ssa_names.erase(name)) {
+        variables.erase(name);
+        constant_count--;
+      }
+      declared.pop_back();
+    }
+  }
+
+  // Builds one side of an if from `block` on and jumps to join. `values`
+  // gets what each variable declared before the if was left at
+  bool ssaBranch(const ASTNode *node, int block, int join, std::map<int, int> &values) {
+    ssa_block = block;
+    int before = ssa_variables.size();
+    size_t scope = declared.size();
+
+    ssa_writes.emplace_back();
+    bool built = !node || ssaStatement(node);
+    ssaLeaveScope(scope);
+    std::vector<std::pair<int, int>> writes;
+    writes.swap(ssa_writes.back());
+    ssa_writes.pop_back();
+    if (!built) return false;
+
+    // Undone from the last write back, the first one seen is the final value
+    for (std::vector<std::pair<int, int>>::reverse_iterator write = writes.rbegin(); write != writes.rend(); ++write) {
+      if (write->first >= before) continue;
+      values.insert({write->first, ssa_variables[write->first].value});
+      ssa_variables[write->first].value = write->second;
+    }
+
+    ssaAdd(ssaInst(SSA_JMP));
+    ssa.edge(ssa_block, join);
+    return true;
+  }
+
+  // A condition that isn't a u8 is compared with zero, which swaps the
+  // sides. Both sides get a block, even an empty else, so the edges into
+  // the join never leave a block that branches
+  bool ssaIfElse(const IfElseNode *ifelse) {
+    int cond = ssaExpression(ifelse->cond);
+    if (cond < 0) return false;
+    byte type = ssaType(cond);
+    if (type == TYPE_NONE) {
+      ssaUnsupported("a void condition");
+      return false;
+    }
+
+    bool swapped = type != MERGE(TYPE_UNSIGNED, FROM_SIZE(8));
+    if (swapped) cond = ssaTyped(OPCODE_CMPE, type, cond, ssaZero(type));
+
+    int then_block = ssa.newBlock(), else_block = ssa.newBlock(), join = ssa.newBlock();
+    SSAInst branch = ssaInst(SSA_BRANCH);
+    branch.args = {cond};
+    ssaAdd(branch);
+    ssa.edge(ssa_block, swapped ? else_block : then_block);
+    ssa.edge(ssa_block, swapped ? then_block : else_block);
+
+    std::map<int, int> then_values, else_values;
+    if (!ssaBranch(ifelse->left, then_block, join, then_values)) return false;
+    if (!ssaBranch(ifelse->right, else_block, join, else_values)) return false;
+    ssa_block = join;
+
+    // Variables neither side wrote keep their value
+    std::map<int, int> merged = then_values;
+    merged.insert(else_values.begin(), else_values.end());
+    for (const std::pair<const int, int> &write : merged) {
+      int var = write.first;
+      int before = ssa_variables[var].value;
+      std::map<int, int>::const_iterator then_value = then_values.find(var), else_value = else_values.find(var);
+      int a = then_value == then_values.end() ? before : then_value->second;
+      int b = else_value == else_values.end() ? before : else_value->second;
+
+      int value = a;
+      if (a != b) {
+        SSAInst phi = ssaInst(SSA_PHI, ssaType(a));
+        phi.args = {a, b};
+        value = ssaAdd(phi);
+      }
+      ssaWrite(var, value);
+    }
+    return true;
+  }
+
+  bool ssaYield(const YieldNode *yld) {
+    if (ssa_yields.empty()) {
+      ssaUnsupported("a yield outside of an expression block");
+      return false;
+    }
+    int var = ssa_yields.back();
+    int value = ssaExpression(yld->expr);
+    if (value < 0) return false;
+    if (ssaType(value) == TYPE_NONE) {
+      ssaUnsupported("a void operand");
+      return false;
+    }
+    ssaWrite(var, ssaConvert(value, ssa_variables[var].type));
+    return true;
+  }
+
+  bool ssaStatement(const ASTNode *node) {
+    ssa_line = node->line;
+
+    switch (node->kind) {
+      case NodeKind::VAR_DECL:
+        return ssaVarDecl(static_cast<const VarDeclNode *>(node));
+
+      case NodeKind::IF_ELSE:
+        return ssaIfElse(static_cast<const IfElseNode *>(node));
+
+      case NodeKind::CODE_BLOCK: {
+        size_t scope = declared.size();
+        for (const ASTNode *statement : static_cast<const CodeBlockNode *>(node)->statements) {
+          if (!ssaStatement(statement)) return false;
         }
+        ssaLeaveScope(scope);
+        return true;
       }
 
-      // NOTE: TODO NOW
-      if (isprim) {
-        
+      case NodeKind::YIELD:
+        return ssaYield(static_cast<const YieldNode *>(node));
+
+      default:
+        break;
+    }
+
+    // Expression statements print their value
+    int value = ssaExpression(node);
+    if (value < 0) return false;
+    if (ssaType(value) != TYPE_NONE) {
+      SSAInst print = ssaInst(SSA_PRINT);
+      print.args = {value};
+      ssaAdd(print);
+    }
+    return true;
+  }
+
+  // --- SSA lowering ---
+  // Register code, whatever register_mode says. Constants are loaded where
+  // they are used, values allocate() put on the stack go through scratch
+  // registers, and the moves into a block's phis end each predecessor
+
+  void emitSlotPointer(byte reg, int32_t slot) {
+    result.push_back(OPCODE_R_SPP);
+    result.push_back(reg);
+    insertValue<int32_t>(slot);
+  }
+
+  // A register holding the value, scratch if it has to be loaded
+  byte ssaOperand(int value, byte scratch) {
+    const SSAInst &inst = ssa.insts[value];
+    if (inst.op == SSA_CONST) {
+      emitFolded(inst.value, scratch);
+      return scratch;
+    }
+    if (ssa.reg[value] >= 0) return ssa.reg[value];
+
+    emitSlotPointer(scratch, ssa.spill[value]);
+    result.push_back(OPCODE_R_LOAD);
+    result.push_back(scratch);
+    result.push_back(scratch);
+    result.push_back(sizeof(uint64_t));
+    return scratch;
+  }
+
+  // Where an instruction writes its value, see ssaSpill()
+  byte ssaTarget(int value) const {
+    return ssa.reg[value] >= 0 ? ssa.reg[value] : SSA_RESULT;
+  }
+
+  // Stores what reg holds to the value's stack slot, if it has one
+  void ssaSpill(int value, byte reg) {
+    if (ssa.reg[value] >= 0 || ssa.spill[value] < 0) return;
+    emitSlotPointer(SSA_POINTER, ssa.spill[value]);
+    result.push_back(OPCODE_R_STORE);
+    result.push_back(SSA_POINTER);
+    result.push_back(reg);
+    result.push_back(sizeof(uint64_t));
+  }
+
+  void emitMove(byte dst, byte src) {
+    if (dst == src) return;
+    result.push_back(OPCODE_R_MOV);
+    result.push_back(dst);
+    result.push_back(src);
+  }
+
+  // The moves into to's phis on the edge from `from`
+  void ssaPhiMoves(int from, int to) {
+    const SSABlock &block = ssa.blocks[to];
+    int index = std::find(block.preds.begin(), block.preds.end(), from) - block.preds.begin();
+    for (int i : block.insts) {
+      const SSAInst &phi = ssa.insts[i];
+      if (phi.op != SSA_PHI) break;
+
+      int arg = phi.args[index];
+      if (ssa.reg[i] >= 0) {
+        emitMove(ssa.reg[i], ssaOperand(arg, ssa.reg[i]));
       } else {
-        
+        ssaSpill(i, ssaOperand(arg, SSA_RESULT));
       }
+    }
+  }
 
-      return;
+  void ssaLower(const SSAInst &inst, int value) {
+    switch (inst.op) {
+      case SSA_TYPED: {
+        byte a = ssaOperand(inst.args[0], SSA_OPERAND_A);
+        byte b = inst.args.size() > 1 ? ssaOperand(inst.args[1], SSA_OPERAND_B) : a;
+        byte dst = ssaTarget(value);
+        result.push_back(registerOpcode(inst.opcode));
+        result.push_back(dst);
+        result.push_back(a);
+        result.push_back(b);
+        result.push_back(inst.operand);
+        ssaSpill(value, dst);
+        break;
+      }
+      case SSA_CONV: {
+        byte dst = ssaTarget(value);
+        emitMove(dst, ssaOperand(inst.args[0], dst));
+        emitConv(ssaType(inst.args[0]), inst.type, dst);
+        ssaSpill(value, dst);
+        break;
+      }
+      case SSA_BNOT: {
+        byte a = ssaOperand(inst.args[0], SSA_OPERAND_A);
+        byte dst = ssaTarget(value);
+        result.push_back(OPCODE_R_BNOT);
+        result.push_back(dst);
+        result.push_back(a);
+        ssaSpill(value, dst);
+        break;
+      }
+      case SSA_COPY: {
+        byte dst = ssaTarget(value);
+        emitMove(dst, ssaOperand(inst.args[0], dst));
+        ssaSpill(value, dst);
+        break;
+      }
+      case SSA_ADDR: {
+        byte dst = ssaTarget(value);
+        emitSlotPointer(dst, inst.slot);
+        ssaSpill(value, dst);
+        break;
+      }
+      case SSA_LOAD: {
+        byte ptr = ssaOperand(inst.args[0], SSA_OPERAND_A);
+        byte dst = ssaTarget(value);
+        result.push_back(OPCODE_R_LOAD);
+        result.push_back(dst);
+        result.push_back(ptr);
+        result.push_back(LOWER(inst.type));
+        ssaSpill(value, dst);
+        break;
+      }
+      case SSA_STORE: {
+        byte ptr = ssaOperand(inst.args[0], SSA_OPERAND_A);
+        byte src = ssaOperand(inst.args[1], SSA_OPERAND_B);
+        result.push_back(OPCODE_R_STORE);
+        result.push_back(ptr);
+        result.push_back(src);
+        result.push_back(LOWER(ssaType(inst.args[1])));
+        break;
+      }
+      case SSA_CALL: {
+        // See native.cpp, the last two arguments go in left and right
+        const NativeFunction &native = natives.get(inst.opcode);
+        int count = inst.args.size();
+        int pushed = count > 2 ? count - 2 : 0;
+        for (int i = 0; i < pushed; ++i) {
+          byte arg = ssaOperand(inst.args[i], SSA_OPERAND_A);
+          result.push_back(OPCODE_R_PUSH);
+          result.push_back(arg);
+          result.push_back(LOWER(native.args[i]));
+        }
+        if (count - pushed == 2) {
+          byte a = ssaOperand(inst.args[pushed], SSA_OPERAND_A);
+          byte b = ssaOperand(inst.args[pushed + 1], SSA_OPERAND_B);
+          emitGetLeft(b);
+          result.push_back(OPCODE_SWAP);
+          emitGetLeft(a);
+        } else if (count - pushed == 1) {
+          emitGetLeft(ssaOperand(inst.args[pushed], SSA_OPERAND_A));
+        }
+        result.push_back(OPCODE_SPECCALL);
+        result.push_back(inst.opcode);
+        if (inst.type != TYPE_NONE) {
+          emitSetLeft(ssaTarget(value));
+          ssaSpill(value, ssaTarget(value));
+        }
+        break;
+      }
+      case SSA_TRIG: {
+        emitGetLeft(ssaOperand(inst.args[0], SSA_OPERAND_A));
+        result.push_back(OPCODE_FTRIG);
+        result.push_back(inst.type);
+        result.push_back(inst.opcode);
+        emitSetLeft(ssaTarget(value));
+        ssaSpill(value, ssaTarget(value));
+        break;
+      }
+      case SSA_PRINT:
+        emitGetLeft(ssaOperand(inst.args[0], SSA_OPERAND_A));
+        result.push_back(OPCODE_PRINT);
+        break;
     }
+  }
 
-    compileExpression(node);
-    result.push_back(OPCODE_PRINT); // NOTE: Remove this
+  // The stack slots are reserved up front and released before RETURN
+  void lowerSSA() {
+    std::vector<int> order = ssa.layout();
+    int32_t frame = ssa.allocate(order);
+    for (int size = frame; size > 0; size -= INT16_MAX) emitReserve(std::min(size, (int) INT16_MAX));
+
+    std::vector<int32_t> start(ssa.blocks.size());
+    std::vector<std::pair<int, int>> jumps; // Operand, block
+    auto jumpTo = [&](byte opcode, int block) {
+      result.push_back(opcode);
+      jumps.push_back({(int) result.size(), block});
+      insertValue<int32_t>(0);
+    };
+
+    for (size_t n = 0; n < order.size(); ++n) {
+      int b = order[n];
+      int next = n + 1 < order.size() ? order[n + 1] : -1;
+      const SSABlock &block = ssa.blocks[b];
+      start[b] = result.size();
+
+      for (int i : block.insts) {
+        const SSAInst &inst = ssa.insts[i];
+        lines.mark(result.size(), inst.line);
+
+        if (inst.op == SSA_JMP) {
+          ssaPhiMoves(b, block.succs[0]);
+          if (block.succs[0] != next) jumpTo(OPCODE_JMP, block.succs[0]);
+        } else if (inst.op == SSA_BRANCH) {
+          emitGetLeft(ssaOperand(inst.args[0], SSA_OPERAND_A));
+          jumpTo(OPCODE_JMPZ, block.succs[1]);
+          if (block.succs[0] != next) jumpTo(OPCODE_JMP, block.succs[0]);
+        } else if (inst.op == SSA_RETURN) {
+          for (int size = frame; size > 0; size -= INT16_MAX) emitRelease(std::min(size, (int) INT16_MAX));
+          if (next >= 0) result.push_back(OPCODE_RETURN);
+        } else {
+          ssaLower(inst, i);
+        }
+      }
+    }
+
+    for (const std::pair<int, int> &jump : jumps) {
+      *(int32_t *)(result.data() + jump.first) = start[jump.second];
+    }
+  }
+
+  // Builds, optimizes and lowers the program. False if the direct
+  // compiler has to take it instead, see ssa_skipped, or on errors
+  bool compileOptimized(const CodeBlockNode *top) {
+    ssa.clear();
+    ssa_variables.clear();
+    ssa_names.clear();
+    ssa_writes.clear();
+    ssa_yields.clear();
+    ssa_address_taken.clear();
+    ssa_skipped.clear();
+    ssa_line = -1;
+
+    size_t scope = declared.size();
+    for (const ASTNode *node : top->statements) ssaFindAddressTaken(node);
+
+    ssa_block = ssa.newBlock();
+    for (const ASTNode *node : top->statements) {
+      unfoldable.clear();
+      if (!ssaStatement(node)) {
+        ssaLeaveScope(scope);
+        return false;
+      }
+    }
+    ssaAdd(ssaInst(SSA_RETURN));
+
+    ssa.optimize();
+    lowerSSA();
+    return true;
   }
 
-#undef CHECK_IS_TYPE
+  // Runs pass over the code in result, then moves the constant operands
+  // and line marks along with their instructions
+  template <class Pass> void rewrite(Pass pass) {
+    Rewriter rewriter;
+    if (!rewriter.begin(result)) return;
 
-  void finishResult() {
-    result.push_back(OPCODE_RETURN);
+    pass(rewriter);
+
+    std::unordered_map<int32_t, int32_t> moved_constants;
+    for (const std::pair<const int32_t, int32_t> &constant : constant_indexes) {
+      moved_constants.insert({rewriter.remap(constant.first), constant.second});
+    }
+    constant_indexes.swap(moved_constants);
+    lines.remap([&](int32_t pc) { return rewriter.remapBoundary(pc); });
+
+    rewriter.finish(result);
+  }
+
+  // Folds common instruction sequences into superinstructions
+  void fuse() {
+    rewrite([&](Rewriter &rw) { fuseInstructions(rw, fusions); });
+  }
+
+  // Removes redundant instructions until no rule applies, see peephole.cpp.
+  // The reload rule needs stack depths, so it only runs on code that
+  // verifies once the constants are in place
+  void optimize() {
+    for (bool again = true; again;) {
+      PeepholeContext context;
+      if (peephole & PEEP_RELOAD) {
+        std::vector<byte> code = withConstants();
+        context.states = stackStates(code.data(), result.size(), code.size());
+      }
 
+      again = false;
+      rewrite([&](Rewriter &rw) { again = peepholePass(rw, context, peephole, peephole_stats); });
+    }
+  }
+
+  // The code with the constants patched in and appended, as it will run
+  std::vector<byte> withConstants() const {
+    std::vector<byte> code = result;
     for (const std::pair<int32_t, int32_t> &replace : constant_indexes) {
-      *(int32_t *)(result.data() + replace.first) = replace.second + result.size();
+      *(int32_t *)(code.data() + replace.first) = replace.second + result.size();
     }
+    code.insert(code.end(), constants.storage.begin(), constants.storage.end());
+    return code;
+  }
 
-    result.insert(result.end(), constants.storage.begin(), constants.storage.end());
+  void finishResult() {
+    code_size = result.size();
+    result = withConstants();
   }
 
 public:
+  bool register_mode = false; // Target VM::register_file instead of left/right
+  uint32_t fusions = FUSE_ALL; // Superinstructions to form, see rewrite.cpp
+  uint32_t peephole = PEEP_ALL; // Peephole rules to apply, see peephole.cpp
+  int opt_level = 0; // Above 0, programs go through the SSA optimizer in ssa.cpp first
+
   bool compile(const CodeBlockNode *top) {
     result.clear();
     result.reserve(32);
+    lines.clear();
+    constant_count = 0;
     stack_global = 0;
     stack_local = 0;
+    reg_top = 0;
+    peephole_stats = PeepholeStats();
+    ssa.clear();
+    ssa_skipped.clear();
 
-    for (const ASTNode *node : top->statements) {
+    bool optimized = false;
+    if (opt_level > 0) {
       compile_fail = false;
-      compileStatement(node);
+      optimized = compileOptimized(top);
       if (compile_fail) {
         result.clear();
         printf("Compilation failed with errors!\n");
@@ -585,23 +2577,27 @@ public:
       }
     }
 
-    while (!global_stack.empty()) {
-      const std::string &name = global_stack.back();
-      VarInfo &info = variables[name];
-
-      if (info.type.ref) {
-        emitPop(sizeof(void *));
-      } else if (info.is_prim) {
-        emitPop(LOWER(info.prim));
-      } else {
-        emitRelease(info.size);
+    for (size_t i = 0; i < top->statements.size() && !optimized; ++i) {
+      compile_fail = false;
+      unfoldable.clear();
+      compileStatement(top->statements[i]);
+      if (compile_fail) {
+        result.clear();
+        printf("Compilation failed with errors!\n");
+        return false;
       }
-
-      global_stack.pop_back();
-      // Not neccessary?
-      //variables.erase(name);
     }
-    
+
+    // Released rather than popped, so left keeps what the last statement
+    // printed, as it does in optimized code
+    int globals = 0;
+    for (Atom name : global_stack) globals += variables[name].size;
+    for (; globals > 0; globals -= INT16_MAX) emitRelease(std::min(globals, (int) INT16_MAX));
+    global_stack.clear();
+
+    result.push_back(OPCODE_RETURN);
+    if (peephole != PEEP_NONE) optimize();
+    if (fusions != FUSE_NONE) fuse();
     finishResult();
     return true;
   }
@@ -613,6 +2609,36 @@ public:
   int resultSize() const {
     return result.size();
   }
+
+  int codeSize() const {
+    return code_size;
+  }
+
+  // What the peephole pass removed from the last compile()
+  const PeepholeStats &peepholeStats() const {
+    return peephole_stats;
+  }
+
+  // What the SSA optimizer did in the last compile()
+  const SSAStats &ssaStats() const {
+    return ssa.stats;
+  }
+
+  // Why the last compile() with opt_level above 0 compiled directly,
+  // nullptr if it didn't
+  const char *optimizerSkipped() const {
+    return ssa_skipped.empty() ? nullptr : ssa_skipped.c_str();
+  }
+
+  // Source line of every instruction in resultData()
+  const LineTable &lineTable() const {
+    return lines;
+  }
+
+  // A copy of the result that stays valid after the compiler is gone
+  ProgramRef program() const {
+    return std::make_shared<const Program>(result, code_size, lines);
+  }
 };
 
 #endif
\ No newline at end of file
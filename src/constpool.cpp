@@ -25,9 +25,10 @@ class ConstantPool {
 public:
   std::vector<uint8_t> storage;
 
-  template<class T> int32_t addConstant(T value) {
-    std::vector<uint8_t> data(sizeof(T));
-    memcpy(data.data(), &value, sizeof(T));
+  // Identical byte strings share one copy
+  int32_t addBytes(const void *bytes, size_t size) {
+    std::vector<uint8_t> data(size);
+    memcpy(data.data(), bytes, size);
 
     if (lookup.find(data) != lookup.end()) {
       return lookup.at(data);
@@ -38,4 +39,8 @@ public:
     lookup.insert({data, offset});
     return offset;
   }
+
+  template<class T> int32_t addConstant(T value) {
+    return addBytes(&value, sizeof(T));
+  }
 };
\ No newline at end of file
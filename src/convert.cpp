@@ -0,0 +1,79 @@
+#ifndef _CONVERT_CPP_
+#define _CONVERT_CPP_
+
+// Handlers behind CONV and R_CONV. Included by vm.cpp.
+// There is one handler per (from, to) pair of primitive types, generated
+// from one template and looked up in a table, so an instruction costs two
+// byte lookups and a call. Integer conversions that keep or drop high bytes
+// have no handler at all: a register already holds the low bytes of the
+// wider value, and like every other write a conversion leaves the bytes
+// above the new type alone. Floats that don't fit the integer type convert
+// however the hardware does it.
+
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+typedef void (*ConvertFn)(byte *reg);
+
+// Reads a From at reg and writes it back as a To
+template <class From, class To> static void convertValue(byte *reg) {
+  From value;
+  memcpy(&value, reg, sizeof(From));
+  To result = (To) value;
+  memcpy(reg, &result, sizeof(To));
+}
+
+static void convertInvalid(byte *) {
+  exit(12);
+}
+
+// Nothing to do for integers that don't get wider
+template <class From, class To> static constexpr ConvertFn conversion() {
+  if (std::is_integral<From>::value && std::is_integral<To>::value && sizeof(To) <= sizeof(From)) {
+    return nullptr;
+  }
+  return convertValue<From, To>;
+}
+
+template <class... Types> struct TypeList {};
+
+// Every primitive's value type in type index order, then void
+#define VALUE_OF(suffix, tbyte, value, ...) value,
+typedef TypeList<PRIMITIVE_TYPES(VALUE_OF) void> PrimitiveValues;
+#undef VALUE_OF
+
+// Fills a table row with the conversions from From to each type in turn
+template <class From, class To, class... Rest> static void conversionRow(ConvertFn *row, TypeList<To, Rest...>) {
+  if constexpr (!std::is_void<To>::value) {
+    *row = conversion<From, To>();
+    conversionRow<From>(row + 1, TypeList<Rest...>());
+  }
+}
+
+struct ConversionTable {
+  byte slot[256]; // typeIndex() of every byte
+  ConvertFn handlers[PRIMITIVE_TYPE_COUNT + 1][PRIMITIVE_TYPE_COUNT + 1];
+
+  ConversionTable() {
+    for (int i = 0; i < 256; ++i) slot[i] = typeIndex(i);
+    for (int from = 0; from <= PRIMITIVE_TYPE_COUNT; ++from) {
+      for (int to = 0; to <= PRIMITIVE_TYPE_COUNT; ++to) handlers[from][to] = convertInvalid;
+    }
+
+    #define CONVERSION_ROW(suffix, tbyte, value, ...) \
+      conversionRow<value>(handlers[typeIndex(tbyte)], PrimitiveValues());
+    PRIMITIVE_TYPES(CONVERSION_ROW)
+    #undef CONVERSION_ROW
+  }
+};
+
+static const ConversionTable conversions;
+
+// The handler converting a `from` into a `to`. nullptr when there's nothing
+// to do, convertInvalid when either isn't a primitive type
+static inline ConvertFn conversionFor(byte from, byte to) {
+  return conversions.handlers[conversions.slot[from]][conversions.slot[to]];
+}
+
+#endif // _CONVERT_CPP_
@@ -0,0 +1,176 @@
+#ifndef _EXECUTOR_CPP_
+#define _EXECUTOR_CPP_
+
+// Runs one Program against many independent inputs on a pool of threads.
+// Every worker owns a VM, so the only thing the workers share while running
+// is the Program, which never changes. Runs are handed out in chunks through
+// per-worker queues: a worker takes from the back of its own queue, and once
+// that is empty steals from the front of the others'.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "program.cpp"
+#include "vm.cpp"
+
+class Executor {
+public:
+  // Called on a worker thread with the VM of run `index`. The VM has been
+  // initialised and attached to the program, prepare() writes the inputs
+  // and finish() reads the results
+  typedef std::function<void(VM &vm, int index)> Step;
+
+private:
+  struct Chunk {
+    int begin, end;
+  };
+
+  struct Worker {
+    std::thread thread;
+    std::unique_ptr<VM> vm;
+    std::mutex lock; // Guards chunks
+    std::deque<Chunk> chunks;
+    uint64_t stolen = 0;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers;
+
+  // The batch being run, only written while every queue is empty
+  const Program *program = nullptr;
+  const Step *prepare = nullptr;
+  const Step *finish = nullptr;
+  std::atomic<int> pending{0}; // Chunks not finished yet
+
+  std::mutex state_lock; // Guards batch and stopping
+  std::condition_variable wake, done;
+  uint64_t batch = 0;
+  bool stopping = false;
+
+  bool take(size_t id, Chunk &chunk) {
+    Worker &self = *workers[id];
+    {
+      std::lock_guard<std::mutex> guard(self.lock);
+      if (!self.chunks.empty()) {
+        chunk = self.chunks.back();
+        self.chunks.pop_back();
+        return true;
+      }
+    }
+
+    for (size_t i = 1; i < workers.size(); ++i) {
+      Worker &victim = *workers[(id + i) % workers.size()];
+      std::lock_guard<std::mutex> guard(victim.lock);
+      if (!victim.chunks.empty()) {
+        chunk = victim.chunks.front();
+        victim.chunks.pop_front();
+        self.stolen++;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void runChunk(VM &vm, const Chunk &chunk) {
+    for (int index = chunk.begin; index < chunk.end; ++index) {
+      vm.init();
+      program->attach(vm);
+      if (*prepare) (*prepare)(vm, index);
+      vm.execute();
+      if (*finish) (*finish)(vm, index);
+    }
+  }
+
+  void work(size_t id) {
+    Worker &self = *workers[id];
+    uint64_t seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> guard(state_lock);
+        wake.wait(guard, [&]() { return stopping || batch != seen; });
+        if (stopping) return;
+        seen = batch;
+      }
+
+      Chunk chunk;
+      while (take(id, chunk)) {
+        runChunk(*self.vm, chunk);
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          std::lock_guard<std::mutex> guard(state_lock);
+          done.notify_all();
+        }
+      }
+    }
+  }
+
+public:
+  // 0 threads means one per hardware thread
+  explicit Executor(int threads = 0) {
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < threads; ++i) {
+      workers.emplace_back(new Worker);
+      workers.back()->vm.reset(new VM);
+    }
+    for (size_t i = 0; i < workers.size(); ++i) {
+      workers[i]->thread = std::thread(&Executor::work, this, i);
+    }
+  }
+
+  ~Executor() {
+    {
+      std::lock_guard<std::mutex> guard(state_lock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::unique_ptr<Worker> &worker : workers) worker->thread.join();
+  }
+
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  int threads() const {
+    return workers.size();
+  }
+
+  // Chunks taken from another worker's queue so far
+  uint64_t steals() const {
+    uint64_t total = 0;
+    for (const std::unique_ptr<Worker> &worker : workers) total += worker->stolen;
+    return total;
+  }
+
+  // Runs the program `count` times and returns once every run finished.
+  // `grain` runs make up a chunk, 0 picks about eight chunks per worker
+  void run(const Program &program, int count, const Step &prepare, const Step &finish, int grain = 0) {
+    if (count <= 0) return;
+    if (grain <= 0) grain = std::max(1, count / (threads() * 8));
+
+    this->program = &program;
+    this->prepare = &prepare;
+    this->finish = &finish;
+    pending.store((count + grain - 1) / grain, std::memory_order_relaxed);
+
+    size_t next = 0;
+    for (int begin = 0; begin < count; begin += grain) {
+      Worker &worker = *workers[next++ % workers.size()];
+      std::lock_guard<std::mutex> guard(worker.lock);
+      worker.chunks.push_back({begin, std::min(count, begin + grain)});
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(state_lock);
+      batch++;
+    }
+    wake.notify_all();
+
+    std::unique_lock<std::mutex> guard(state_lock);
+    done.wait(guard, [&]() { return pending.load(std::memory_order_acquire) == 0; });
+  }
+};
+
+#endif // _EXECUTOR_CPP_
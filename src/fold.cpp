@@ -0,0 +1,88 @@
+#ifndef _FOLD_CPP_
+#define _FOLD_CPP_
+
+// Compile-time evaluation of typed instructions, for constant folding in
+// compiler.cpp. The operations expand from the same TYPED_OPCODES and
+// PRIMITIVE_TYPES lists as the VM's, and conversions use convert.cpp's
+// handlers, so a folded expression gives the bytes the instructions would
+// have left in the register. Integer divisions that would trap aren't
+// folded, they stay in the code and fail at runtime like before.
+
+#include <stdint.h>
+#include <string.h>
+#include "vm.cpp"
+
+// A primitive value known at compile time: its type byte and the register
+// holding it. Only the low LOWER(type) bytes mean anything
+struct FoldedValue {
+  byte type = TYPE_NONE;
+  uint64_t bits = 0;
+
+  template <class T> T get() const {
+    T value;
+    memcpy(&value, &bits, sizeof(T));
+    return value;
+  }
+};
+
+static inline FoldedValue foldConvert(FoldedValue value, byte to) {
+  ConvertFn convert = conversionFor(value.type, to);
+  if (convert) convert((byte *) &value.bits);
+  value.type = to;
+  return value;
+}
+
+// Lowest `size` bytes set
+static inline uint64_t foldMask(int size) {
+  return size >= 8 ? ~0ull : (1ull << (size * 8)) - 1;
+}
+
+#define FOLD_OPB(type, op) \
+  *(type *) registers op##= *(type *) (registers + 8)
+
+#define FOLD_OPU(type, op) \
+  *(type *) registers = op (*(type *) registers)
+
+#define FOLD_OPC(type, op) \
+  *(uint8_t *) registers = (*(type *) registers) op (*(type *) (registers + 8))
+
+// Runs a typed instruction (OPCODE_ADD, ...) on left and right, the result
+// is the new left. False if it can't be folded
+static bool foldTyped(byte opcode, byte type, uint64_t left, uint64_t right, uint64_t &out) {
+  if (opcode == OPCODE_DIV && UPPER(type) != TYPE_FLOAT) {
+    uint64_t divisor = right & foldMask(LOWER(type));
+    if (divisor == 0) return false;
+    if (UPPER(type) == TYPE_SIGNED && divisor == foldMask(LOWER(type))) return false; // MIN / -1
+  }
+
+  byte registers[16];
+  memcpy(registers, &left, 8);
+  memcpy(registers + 8, &right, 8);
+
+  #define FOLD_CASE(suffix, tbyte, value, bits, op, ub, sel) \
+    case tbyte: FOLD_OP##ub(sel(value, bits), op); break;
+  #define FOLD_OPCODE(name, op, ub, sel, ...) \
+    case OPCODE_##name: \
+      switch (type) { \
+        PRIMITIVE_TYPES(FOLD_CASE, op, ub, sel) \
+        default: return false; \
+      } \
+      break;
+
+  switch (opcode) {
+    TYPED_OPCODES(FOLD_OPCODE)
+    default: return false;
+  }
+
+  #undef FOLD_OPCODE
+  #undef FOLD_CASE
+
+  memcpy(&out, registers, 8);
+  return true;
+}
+
+#undef FOLD_OPB
+#undef FOLD_OPU
+#undef FOLD_OPC
+
+#endif // _FOLD_CPP_
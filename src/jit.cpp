@@ -0,0 +1,519 @@
+#ifndef _JIT_CPP_
+#define _JIT_CPP_
+
+// Baseline JIT: translates a bytecode buffer into x86-64 machine code, one
+// instruction at a time and without any optimization. Left and right live in
+// rbx and r12 for the whole run. Arithmetic, comparisons, constants and jumps
+// are translated directly, everything else calls back into
+// VM::execute_one(), so the interpreter stays the reference for every opcode.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "vm.cpp"
+
+#if defined(__x86_64__) && defined(__unix__) && !defined(VM_NO_JIT)
+#define VM_JIT
+#include <sys/mman.h>
+#endif
+
+#ifdef VM_JIT
+
+// Runs one instruction for the generated code
+static void jitStep(VM *vm) {
+  vm->execute_one();
+}
+
+// Just enough of an x86-64 encoder for the JIT
+struct X64Assembler {
+  enum Reg : byte {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R8 = 8, R9, R10, R11, R12, R13, R14, R15,
+  };
+
+  enum Cond : byte {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+    CC_S = 0x8, CC_NP = 0xB, CC_L = 0xC, CC_G = 0xF,
+  };
+
+  std::vector<byte> code;
+
+  int here() const {
+    return code.size();
+  }
+
+  void emit(std::initializer_list<byte> bytes) {
+    code.insert(code.end(), bytes);
+  }
+
+  template <class T> void value(T val) {
+    code.insert(code.end(), sizeof(T), 0);
+    memcpy(code.data() + code.size() - sizeof(T), &val, sizeof(T));
+  }
+
+  void rex(bool wide, byte reg, byte rm, bool always = false) {
+    byte prefix = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (prefix != 0x40 || always) code.push_back(prefix);
+  }
+
+  void modrm(byte mod, byte reg, byte rm) {
+    code.push_back((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+  }
+
+  // op reg, [base + disp]. Bases that need a SIB byte are never used
+  void memory(byte reg, byte base, int32_t disp) {
+    modrm(2, reg, base);
+    value<int32_t>(disp);
+  }
+
+  void mov(byte dst, byte src) { rex(true, src, dst); emit({0x89}); modrm(3, src, dst); }
+  void movImm(byte dst, uint64_t imm) { rex(true, 0, dst); emit({(byte) (0xB8 + (dst & 7))}); value(imm); }
+  void load(byte dst, byte base, int32_t disp) { rex(true, dst, base); emit({0x8B}); memory(dst, base, disp); }
+  void load32(byte dst, byte base, int32_t disp) { rex(false, dst, base); emit({0x8B}); memory(dst, base, disp); }
+  void store(byte base, int32_t disp, byte src) { rex(true, src, base); emit({0x89}); memory(src, base, disp); }
+  void store32(byte base, int32_t disp, int32_t imm) { rex(false, 0, base); emit({0xC7}); memory(0, base, disp); value(imm); }
+  void lea(byte dst, byte base, int32_t disp) { rex(true, dst, base); emit({0x8D}); memory(dst, base, disp); }
+
+  // Two-operand integer ALU instructions: op r/m64, r64
+  void alu(byte opcode, byte dst, byte src) { rex(true, src, dst); emit({opcode}); modrm(3, src, dst); }
+  void add(byte dst, byte src) { alu(0x01, dst, src); }
+  void sub(byte dst, byte src) { alu(0x29, dst, src); }
+  void and_(byte dst, byte src) { alu(0x21, dst, src); }
+  void or_(byte dst, byte src) { alu(0x09, dst, src); }
+  void xor_(byte dst, byte src) { alu(0x31, dst, src); }
+  void cmp(byte dst, byte src) { alu(0x39, dst, src); }
+  void xchg(byte dst, byte src) { alu(0x87, dst, src); }
+  void imul(byte dst, byte src) { rex(true, dst, src); emit({0x0F, 0xAF}); modrm(3, dst, src); }
+  void neg(byte dst) { rex(true, 0, dst); emit({0xF7}); modrm(3, 3, dst); }
+  void not_(byte dst) { rex(true, 0, dst); emit({0xF7}); modrm(3, 2, dst); }
+  void cmpEax(int32_t imm) { emit({0x3D}); value(imm); }
+  void testEax() { emit({0x85, 0xC0}); }
+
+  // Widens the low `size` bytes of src into dst
+  void extend(byte dst, byte src, int size, bool is_signed) {
+    switch (size) {
+      case 1: rex(true, dst, src); emit({0x0F, (byte) (is_signed ? 0xBE : 0xB6)}); modrm(3, dst, src); break;
+      case 2: rex(true, dst, src); emit({0x0F, (byte) (is_signed ? 0xBF : 0xB7)}); modrm(3, dst, src); break;
+      case 4:
+        if (is_signed) { rex(true, dst, src); emit({0x63}); modrm(3, dst, src); }
+        else { rex(false, dst, src); emit({0x8B}); modrm(3, dst, src); }
+        break;
+      default: mov(dst, src); break;
+    }
+  }
+
+  // Byte register tests, 8-bit registers above bl need a REX prefix
+  void testByte(byte reg) { rex(false, reg, reg, reg >= 4); emit({0x84}); modrm(3, reg, reg); }
+  void setcc(byte cond, byte reg) { rex(false, 0, reg, reg >= 4); emit({0x0F, (byte) (0x90 | cond)}); modrm(3, 0, reg); }
+  void andByte(byte dst, byte src) { emit({0x20}); modrm(3, src, dst); }
+  void orByte(byte dst, byte src) { emit({0x08}); modrm(3, src, dst); }
+
+  // movq between general purpose and xmm registers
+  void toXmm(byte xmm, byte reg) { emit({0x66}); rex(true, xmm, reg); emit({0x0F, 0x6E}); modrm(3, xmm, reg); }
+  void fromXmm(byte reg, byte xmm) { emit({0x66}); rex(true, xmm, reg); emit({0x0F, 0x7E}); modrm(3, xmm, reg); }
+  // addsd/addss and friends: 0x58 add, 0x59 mul, 0x5C sub, 0x5E div
+  void sse(byte opcode, bool single, byte dst, byte src) { emit({(byte) (single ? 0xF3 : 0xF2), 0x0F, opcode}); modrm(3, dst, src); }
+  void ucomis(bool single, byte a, byte b) { if (!single) emit({0x66}); emit({0x0F, 0x2E}); modrm(3, a, b); }
+
+  void push(byte reg) { rex(false, 0, reg); emit({(byte) (0x50 + (reg & 7))}); }
+  void pop(byte reg) { rex(false, 0, reg); emit({(byte) (0x58 + (reg & 7))}); }
+  void callReg(byte reg) { rex(false, 0, reg); emit({0xFF}); modrm(3, 2, reg); }
+  void jmpReg(byte reg) { rex(false, 0, reg); emit({0xFF}); modrm(3, 4, reg); }
+  void ret() { emit({0xC3}); }
+
+  // Jumps with a rel32 to be patched, returns the position of the rel32
+  int jmp() { emit({0xE9}); value<int32_t>(0); return here() - 4; }
+  int jcc(byte cond) { emit({0x0F, (byte) (0x80 | cond)}); value<int32_t>(0); return here() - 4; }
+
+  void patch(int at, int target) {
+    int32_t rel = target - (at + 4);
+    memcpy(code.data() + at, &rel, 4);
+  }
+};
+
+// Machine code for one bytecode buffer. The constants are baked into the
+// code, so the buffer must not change after compile()
+class JitCode {
+  typedef X64Assembler A;
+
+  // Jump targets that aren't bytecode offsets
+  enum : int { LABEL_EXIT = -1, LABEL_DISPATCH = -2 };
+
+  struct Fixup {
+    int at;
+    int target;
+  };
+
+  const byte *instructions = nullptr;
+  int code_size = 0;
+  int size = 0;
+
+  A as;
+  std::vector<int> native; // Bytecode offset -> code offset, -1 between instructions
+  std::vector<Fixup> fixups;
+  std::vector<const void *> table; // Bytecode offset -> address, for computed jumps
+
+  void *memory = nullptr;
+  size_t memory_size = 0;
+
+  static int32_t registersOffset() { return offsetof(VM, registers); }
+  static int32_t counterOffset() { return offsetof(VM, prog_counter); }
+
+  bool isStart(int32_t pos) const {
+    return pos >= 0 && pos < code_size && native[pos] != -1;
+  }
+
+  // Jumps to pos, or leaves for the interpreter if pos isn't an instruction
+  void branch(int32_t pos, int cond = -1) {
+    if (isStart(pos)) {
+      fixups.push_back({cond < 0 ? as.jmp() : as.jcc(cond), pos});
+      return;
+    }
+
+    int skip = cond < 0 ? -1 : as.jcc(cond ^ 1);
+    leave(pos);
+    if (skip >= 0) as.patch(skip, as.here());
+  }
+
+  // Stops native execution with the program counter at pos
+  void leave(int32_t pos) {
+    as.store32(A::R13, counterOffset(), pos);
+    fixups.push_back({as.jmp(), LABEL_EXIT});
+  }
+
+  // Writes the low `bytes` bytes of rax into left, keeping the rest of it
+  void mergeLeft(int bytes) {
+    if (bytes >= 8) {
+      as.mov(A::RBX, A::RAX);
+      return;
+    }
+    as.extend(A::RAX, A::RAX, bytes, false);
+    as.movImm(A::RCX, ~((1ull << (bytes * 8)) - 1));
+    as.and_(A::RBX, A::RCX);
+    as.or_(A::RBX, A::RAX);
+  }
+
+  // The interpreter's view of a constant operand, false if it would fail
+  bool constant(int32_t pos, int bytes, uint64_t &out) const {
+    if (bytes <= 0 || bytes > 8 || pos < 0 || pos + bytes > size) return false;
+    out = 0;
+    memcpy(&out, instructions + pos, bytes);
+    return true;
+  }
+
+  void loadConstant(byte reg, int bytes, uint64_t val) {
+    if (bytes == 8) {
+      as.movImm(reg, val);
+      return;
+    }
+    as.movImm(A::RCX, ~((1ull << (bytes * 8)) - 1));
+    as.and_(reg, A::RCX);
+    as.movImm(A::RAX, val);
+    as.or_(reg, A::RAX);
+  }
+
+  // left = left op right for one primitive type
+  bool typedOp(byte opcode, byte type) {
+    if (typeIndex(type) == PRIMITIVE_TYPE_COUNT) return false;
+    int bytes = LOWER(type);
+    bool is_float = UPPER(type) == TYPE_FLOAT;
+    bool is_signed = UPPER(type) == TYPE_SIGNED;
+    bool single = bytes == 4;
+
+    if (is_float && opcode != OPCODE_XOR && opcode != OPCODE_AND &&
+        opcode != OPCODE_OR && opcode != OPCODE_NOT) {
+      switch (opcode) {
+        case OPCODE_NEG:
+          as.movImm(A::RCX, 1ull << (bytes * 8 - 1));
+          as.xor_(A::RBX, A::RCX);
+          return true;
+        case OPCODE_CMPE:
+        case OPCODE_CMPL:
+        case OPCODE_CMPG:
+          as.toXmm(0, A::RBX);
+          as.toXmm(1, A::R12);
+          if (opcode == OPCODE_CMPL) as.ucomis(single, 1, 0);
+          else as.ucomis(single, 0, 1);
+          if (opcode == OPCODE_CMPE) {
+            // Unordered operands set ZF too
+            as.setcc(A::CC_E, A::RAX);
+            as.setcc(A::CC_NP, A::RCX);
+            as.andByte(A::RAX, A::RCX);
+          } else {
+            as.setcc(A::CC_A, A::RAX);
+          }
+          mergeLeft(1);
+          return true;
+      }
+
+      byte sse = 0;
+      switch (opcode) {
+        case OPCODE_ADD: sse = 0x58; break;
+        case OPCODE_SUB: sse = 0x5C; break;
+        case OPCODE_MUL: sse = 0x59; break;
+        case OPCODE_DIV: sse = 0x5E; break;
+        default: return false;
+      }
+      as.toXmm(0, A::RBX);
+      as.toXmm(1, A::R12);
+      as.sse(sse, single, 0, 1);
+      as.fromXmm(A::RAX, 0);
+      mergeLeft(bytes);
+      return true;
+    }
+
+    switch (opcode) {
+      case OPCODE_CMPE:
+      case OPCODE_CMPL:
+      case OPCODE_CMPG: {
+        as.extend(A::RAX, A::RBX, bytes, is_signed);
+        as.extend(A::RCX, A::R12, bytes, is_signed);
+        as.cmp(A::RAX, A::RCX);
+        byte cond = opcode == OPCODE_CMPE ? A::CC_E :
+                    opcode == OPCODE_CMPL ? (is_signed ? A::CC_L : A::CC_B) :
+                                            (is_signed ? A::CC_G : A::CC_A);
+        as.setcc(cond, A::RAX);
+        mergeLeft(1);
+        return true;
+      }
+      case OPCODE_DIV: // Division faults are left to the interpreter
+        return false;
+    }
+
+    as.mov(A::RAX, A::RBX);
+    switch (opcode) {
+      case OPCODE_ADD: as.add(A::RAX, A::R12); break;
+      case OPCODE_SUB: as.sub(A::RAX, A::R12); break;
+      case OPCODE_MUL: as.imul(A::RAX, A::R12); break;
+      case OPCODE_XOR: as.xor_(A::RAX, A::R12); break;
+      case OPCODE_AND: as.and_(A::RAX, A::R12); break;
+      case OPCODE_OR : as.or_(A::RAX, A::R12); break;
+      case OPCODE_NEG: as.neg(A::RAX); break;
+      case OPCODE_NOT: as.not_(A::RAX); break;
+      default: return false;
+    }
+    mergeLeft(bytes);
+    return true;
+  }
+
+  // Translates the instruction at pc, false if it has to be interpreted
+  bool translate(int pc) {
+    const byte *at = instructions + pc;
+    byte opcode = genericOpcode(at[0]);
+    int32_t pos;
+    uint64_t val;
+
+    switch (opcode) {
+      case OPCODE_LOADC:
+        memcpy(&pos, at + 2, 4);
+        if (!constant(pos, at[1], val)) return false;
+        loadConstant(A::RBX, at[1], val);
+        return true;
+
+      case OPCODE_LOADC_SWAP:
+        memcpy(&pos, at + 2, 4);
+        if (!constant(pos, at[1], val)) return false;
+        as.xchg(A::RBX, A::R12);
+        loadConstant(A::R12, at[1], val);
+        return true;
+
+      case OPCODE_SWAP:
+        as.xchg(A::RBX, A::R12);
+        return true;
+
+      case OPCODE_SPP:
+        memcpy(&pos, at + 1, 4);
+        as.lea(A::RBX, A::R13, offsetof(VM, stack_base) + pos + 8);
+        return true;
+
+      case OPCODE_BAND:
+      case OPCODE_BOR:
+        as.testByte(A::RBX);
+        as.setcc(A::CC_NE, A::RAX);
+        as.testByte(A::R12);
+        as.setcc(A::CC_NE, A::RCX);
+        if (opcode == OPCODE_BAND) as.andByte(A::RAX, A::RCX);
+        else as.orByte(A::RAX, A::RCX);
+        mergeLeft(1);
+        return true;
+
+      case OPCODE_BNOT:
+        as.testByte(A::RBX);
+        as.setcc(A::CC_E, A::RAX);
+        mergeLeft(1);
+        return true;
+
+      case OPCODE_JMP:
+        memcpy(&pos, at + 1, 4);
+        branch(pos);
+        return true;
+
+      case OPCODE_JMPZ:
+      case OPCODE_JMPNZ:
+        memcpy(&pos, at + 1, 4);
+        as.testByte(A::RBX);
+        branch(pos, opcode == OPCODE_JMPZ ? A::CC_E : A::CC_NE);
+        return true;
+
+      case OPCODE_CMPE_JMPZ:
+      case OPCODE_CMPL_JMPZ:
+      case OPCODE_CMPG_JMPZ: {
+        byte compare = opcode == OPCODE_CMPE_JMPZ ? OPCODE_CMPE :
+                       opcode == OPCODE_CMPL_JMPZ ? OPCODE_CMPL : OPCODE_CMPG;
+        memcpy(&pos, at + 2, 4);
+        if (!typedOp(compare, at[1])) return false;
+        as.testByte(A::RBX);
+        branch(pos, A::CC_E);
+        return true;
+      }
+    }
+
+    switch (opcode) {
+      #define TYPED_CASE(name, ...) case OPCODE_##name:
+      TYPED_OPCODES(TYPED_CASE)
+      #undef TYPED_CASE
+        return typedOp(opcode, at[1]);
+    }
+    return false;
+  }
+
+  // Hands the instruction at pc to the interpreter
+  void step(int pc, int next) {
+    as.store(A::R13, registersOffset(), A::RBX);
+    as.store(A::R13, registersOffset() + 8, A::R12);
+    as.store32(A::R13, counterOffset(), pc);
+    as.mov(A::RDI, A::R13);
+    as.movImm(A::RAX, (uint64_t) (uintptr_t) &jitStep);
+    as.callReg(A::RAX);
+    as.load(A::RBX, A::R13, registersOffset());
+    as.load(A::R12, A::R13, registersOffset() + 8);
+    as.load32(A::RAX, A::R13, counterOffset());
+    as.cmpEax(next);
+    fixups.push_back({as.jcc(A::CC_NE), LABEL_DISPATCH});
+  }
+
+  void release() {
+    if (memory) munmap(memory, memory_size);
+    memory = nullptr;
+    memory_size = 0;
+  }
+
+public:
+  JitCode() = default;
+  JitCode(const JitCode &) = delete;
+  JitCode &operator=(const JitCode &) = delete;
+
+  ~JitCode() {
+    release();
+  }
+
+  // code_size is the length of the instructions, size includes the constants
+  bool compile(const byte *code, int code_size, int size) {
+    release();
+    instructions = code;
+    this->code_size = code_size;
+    this->size = size;
+    as.code.clear();
+    fixups.clear();
+    native.assign(code_size, -1);
+
+    // Mark every instruction start first, so jumps know where they may land
+    int end = 0;
+    while (end < code_size) {
+      int length = opcodeLength(code[end]);
+      if (length == 0 || end + length > code_size) break;
+      native[end] = 0;
+      end += length;
+    }
+
+    as.push(A::RBX);
+    as.push(A::R12);
+    as.push(A::R13);
+    as.push(A::R14);
+    as.push(A::R15); // Keeps the stack 16-byte aligned for calls
+    as.mov(A::R13, A::RDI);
+    int table_at = as.here() + 2;
+    as.movImm(A::R14, 0);
+    as.load(A::RBX, A::R13, registersOffset());
+    as.load(A::R12, A::R13, registersOffset() + 8);
+
+    for (int pc = 0; pc < end; pc += opcodeLength(code[pc])) {
+      native[pc] = as.here();
+      if (!translate(pc)) step(pc, pc + opcodeLength(code[pc]));
+    }
+    leave(end);
+
+    int exit_at = as.here();
+    as.store(A::R13, registersOffset(), A::RBX);
+    as.store(A::R13, registersOffset() + 8, A::R12);
+    as.pop(A::R15);
+    as.pop(A::R14);
+    as.pop(A::R13);
+    as.pop(A::R12);
+    as.pop(A::RBX);
+    as.ret();
+
+    // eax holds a program counter the interpreter jumped to
+    int dispatch_at = as.here();
+    as.testEax();
+    fixups.push_back({as.jcc(A::CC_S), LABEL_EXIT});
+    as.cmpEax(code_size);
+    fixups.push_back({as.jcc(A::CC_AE), LABEL_EXIT});
+    as.emit({0x49, 0x8B, 0x04, 0xC6}); // mov rax, [r14 + rax*8]
+    as.emit({0x48, 0x85, 0xC0});       // test rax, rax
+    fixups.push_back({as.jcc(A::CC_E), LABEL_EXIT});
+    as.jmpReg(A::RAX);
+
+    for (const Fixup &fixup : fixups) {
+      int target = fixup.target == LABEL_EXIT ? exit_at :
+                   fixup.target == LABEL_DISPATCH ? dispatch_at : native[fixup.target];
+      as.patch(fixup.at, target);
+    }
+
+    memory_size = (as.code.size() + 4095) & ~(size_t) 4095;
+    memory = mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      memory = nullptr;
+      memory_size = 0;
+      return false;
+    }
+
+    table.assign(code_size, nullptr);
+    for (int pc = 0; pc < code_size; ++pc) {
+      if (native[pc] != -1) table[pc] = (byte *) memory + native[pc];
+    }
+    uint64_t table_address = (uint64_t) (uintptr_t) table.data();
+    memcpy(as.code.data() + table_at, &table_address, 8);
+
+    memcpy(memory, as.code.data(), as.code.size());
+    if (mprotect(memory, memory_size, PROT_READ | PROT_EXEC) != 0) {
+      release();
+      return false;
+    }
+    return true;
+  }
+
+  // Entry point for VM::native, nullptr until compile() succeeds
+  void (*entry() const)(VM *) {
+    return (void (*)(VM *)) memory;
+  }
+
+  int codeSize() const {
+    return as.code.size();
+  }
+};
+
+#else
+
+// Keeps callers portable, compile() always falls back to the interpreter
+class JitCode {
+public:
+  bool compile(const byte *, int, int) { return false; }
+  void (*entry() const)(VM *) { return nullptr; }
+  int codeSize() const { return 0; }
+};
+
+#endif // VM_JIT
+
+#endif // _JIT_CPP_
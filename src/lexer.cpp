@@ -3,6 +3,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include "atoms.cpp"
 
 enum class TokenType {
   // Error goes first so that null tokens are error tokens!
@@ -81,6 +82,7 @@ struct Token {
   const char *start;
   int         length;
   int         line;
+  Atom        atom = 0; // Identifiers' name, see atoms.cpp
 };
 
 class Lexer {
@@ -141,6 +143,8 @@ class Lexer {
           advance();
           break;
         case '/':
+          // A lone '/' is division, not space
+          if (peekNext() != '/' && peekNext() != '*') return;
           // Consume it
           advance();
           // Single-line comment
@@ -227,6 +231,8 @@ class Lexer {
 
   TokenType wordType() {
     switch (start[0]) {
+      case 'c':
+        return checkKeyword(1, 4, "onst", TokenType::KEY_CONST);
       case 'e':
         return checkKeyword(1, 3, "lse", TokenType::KEY_ELSE);
       case 'f':
@@ -267,7 +273,9 @@ class Lexer {
       c = peek();
     }
 
-    return makeToken(wordType());
+    Token token = makeToken(wordType());
+    if (token.type == TokenType::IDENTIFIER) token.atom = atoms.intern(token.start, token.length);
+    return token;
   }
 
 public:
@@ -312,6 +320,8 @@ public:
         return makeToken(TokenType::SEMI);
       case '^':
         return makeToken(TokenType::CAR);
+      case '~':
+        return makeToken(TokenType::TILDE);
       case '!':
         return makeToken(
           match('=') ? TokenType::EX_EQUAL : TokenType::EX);
@@ -0,0 +1,56 @@
+#ifndef _LINETABLE_CPP_
+#define _LINETABLE_CPP_
+
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+
+// Maps instruction offsets back to source lines (Token::line, 0-based).
+// An entry is kept only where the line changes, so a statement costs 8
+// bytes no matter how many instructions it compiles to
+class LineTable {
+public:
+  struct Entry {
+    int32_t pc;   // First instruction of the run
+    int32_t line;
+  };
+
+  std::vector<Entry> entries; // Sorted by pc
+
+  void clear() {
+    entries.clear();
+  }
+
+  // Code emitted from pc on belongs to line
+  void mark(int32_t pc, int32_t line) {
+    if (line < 0) return;
+    if (!entries.empty()) {
+      Entry &last = entries.back();
+      if (last.line == line) return;
+      if (last.pc == pc) {
+        last.line = line;
+        if (entries.size() > 1 && entries[entries.size() - 2].line == line) entries.pop_back();
+        return;
+      }
+    }
+    entries.push_back({pc, line});
+  }
+
+  // Line of the instruction at pc, -1 before the first entry
+  int32_t lookup(int32_t pc) const {
+    std::vector<Entry>::const_iterator it = std::upper_bound(entries.begin(), entries.end(), pc,
+      [](int32_t value, const Entry &entry) { return value < entry.pc; });
+    if (it == entries.begin()) return -1;
+    return (it - 1)->line;
+  }
+
+  // Moves every entry to where remap() says its code went. Of entries that
+  // land on the same pc the last one wins, like with mark()
+  template <class F> void remap(F remap) {
+    std::vector<Entry> old;
+    old.swap(entries);
+    for (const Entry &entry : old) mark(remap(entry.pc), entry.line);
+  }
+};
+
+#endif // _LINETABLE_CPP_
@@ -1,14 +1,99 @@
 #include <bitset>
+#include <errno.h>
 #include <fstream>
 #include <iostream>
 
 #include "astparser.cpp"
 #include "compiler.cpp"
+#include "jit.cpp"
+#include "program.cpp"
+#include "sampler.cpp"
 #include "vm.cpp"
 
-int main() {
+// Host functions scripts can call by name, see native.cpp
+static uint64_t hostMix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCDull;
+  return x ^ (x >> 33);
+}
+
+static double hostClamp(double x, double low, double high) {
+  return x < low ? low : x > high ? high : x;
+}
+
+static void hostPrint(int64_t x) {
+  printf("host: %lld\n", (long long) x);
+}
+
+static void bindHostFunctions() {
+  natives.bind<hostMix>(0, "mix");
+  natives.bind<(double (*)(double)) sqrt>(1, "sqrt");
+  natives.bind<(double (*)(double, double)) pow>(2, "pow");
+  natives.bind<hostClamp>(3, "clamp");
+  natives.bind<hostPrint>(4, "print");
+}
+
+static int usage() {
+  printf("Usage: main [--registers] [--no-fusion] [--no-peephole] [--jit] [-O<level>]\n"
+         "            [--fuel <bytes>] [--trace <file>] [--profile] [--profile-json <file>]\n"
+         "            [--sample <interval>] [--folded <file>] [--fusions-from <profile.json>]\n"
+         "            [source]\n");
+  return 2;
+}
+
+// False unless all of text is a decimal integer
+template <class T> static bool parseInteger(const char *text, T &out) {
+  char *end;
+  errno = 0;
+  long long value = strtoll(text, &end, 10);
+  if (!*text || *end || errno || (T) value != value) return false;
+  out = value;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  bool register_mode = false;
+  bool fusion = true;
+  bool peephole = true;
+  bool jit = false;
+  int opt_level = 0;
+  long long fuel = 0;
+  const char *trace_path = nullptr;
+  bool profile = false;
+  const char *profile_path = nullptr;
+  int sample_interval = 0;
+  const char *folded_path = nullptr;
+  const char *fusions_path = nullptr;
+  const char *source_path = "./example.dcs";
+  for (int i = 1; i < argc; ++i) {
+    bool valid = true;
+    if (strcmp(argv[i], "--registers") == 0) register_mode = true;
+    else if (strcmp(argv[i], "--no-fusion") == 0) fusion = false;
+    else if (strcmp(argv[i], "--no-peephole") == 0) peephole = false;
+    else if (strcmp(argv[i], "--jit") == 0) jit = true;
+    else if (strcmp(argv[i], "-O") == 0) opt_level = 1;
+    else if (strncmp(argv[i], "-O", 2) == 0) valid = parseInteger(argv[i] + 2, opt_level);
+    else if (strcmp(argv[i], "--fuel") == 0 && i + 1 < argc) valid = parseInteger(argv[++i], fuel);
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) trace_path = argv[++i];
+    else if (strcmp(argv[i], "--profile") == 0) profile = true;
+    else if (strcmp(argv[i], "--profile-json") == 0 && i + 1 < argc) profile_path = argv[++i];
+    else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) valid = parseInteger(argv[++i], sample_interval);
+    else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc) folded_path = argv[++i];
+    else if (strcmp(argv[i], "--fusions-from") == 0 && i + 1 < argc) fusions_path = argv[++i];
+    else if (argv[i][0] != '-') source_path = argv[i];
+    else {
+      printf("Unknown argument: %s\n", argv[i]);
+      return usage();
+    }
+
+    if (!valid) {
+      printf("Not a number: %s\n", argv[i]);
+      return usage();
+    }
+  }
+
   // Open, get the length of, and read the source code file
-  std::ifstream source("./example.dcs");
+  std::ifstream source(source_path);
   if (!source.is_open()) {
     printf("File could not be opened. Teminating...\n");
     return 2;
@@ -16,8 +101,8 @@ int main() {
   source.seekg(0, std::ios::end);
   int length = source.tellg();
   source.seekg(0, std::ios::beg);
-  char *input_buf = new char[length];
-  memset(input_buf, 0, length);
+  char *input_buf = new char[length + 1]; // The lexer stops at the terminator
+  memset(input_buf, 0, length + 1);
   source.read(input_buf, length);
   source.close();
 
@@ -27,10 +112,38 @@ int main() {
   printf("Parse done. Printing...\n");
   parser.top->print(0);
 
+  bindHostFunctions();
   Compiler compiler;
+  compiler.register_mode = register_mode;
+  if (!fusion) {
+    compiler.fusions = FUSE_NONE;
+  } else if (fusions_path) {
+    // Only the fusions whose pairs the profiled run actually executed
+    Profile *measured = new Profile;
+    if (!readProfilePairs(fusions_path, measured->pairs)) {
+      printf("Could not read the profile %s\n", fusions_path);
+      return 2;
+    }
+    compiler.fusions = selectFusions(measured->pairs);
+    delete measured;
+
+    printf("Fusions from the profile:");
+    for (const FusionRule &rule : FUSION_RULES) {
+      if (compiler.fusions & rule.flag) printf(" %s", opcodeName(rule.fused));
+    }
+    printf("\n");
+  }
+  if (!peephole) compiler.peephole = PEEP_NONE;
+  compiler.opt_level = opt_level;
   printf("Compiling...\n");
   if (!compiler.compile(parser.top)) return 1;
   printf("Compilation successful!\n");
+  if (opt_level > 0 && compiler.optimizerSkipped()) {
+    printf("Optimizer skipped, the program has %s\n", compiler.optimizerSkipped());
+  } else if (opt_level > 0) {
+    compiler.ssaStats().print(stdout);
+  }
+  if (peephole) compiler.peepholeStats().print(stdout);
   
   // Free those resources
   delete parser.top;
@@ -38,12 +151,86 @@ int main() {
 
   std::cout << "Executing\n";
 
+  // The program keeps its own copy of the bytecode and is verified once
+  ProgramRef program = compiler.program();
+
   VM vm;
   vm.init();
-  vm.instructions = compiler.resultData();
-  vm.instructions_size = compiler.resultSize();
-  printf("Program size: %d\n", vm.instructions_size);
+  program->attach(vm);
+  printf("Program size: %d\n", program->size());
+
+  const VerifyReport &report = program->verification();
+  if (program->isVerified()) {
+    printf("Verified, stack depth at most %d bytes\n", report.max_stack);
+  } else {
+    printf("Verification failed at %d: %s. Running with checks\n", report.error_pc, report.error);
+  }
+
+  JitCode native;
+  if (jit && fuel > 0) {
+    printf("Native code isn't metered, interpreting to enforce --fuel\n");
+  } else if (jit) {
+    if (native.compile(program->data(), program->codeSize(), program->size())) {
+      vm.native = native.entry();
+      printf("JIT: %d bytes of machine code\n", native.codeSize());
+    } else {
+      printf("JIT unavailable, interpreting\n");
+    }
+  }
+#ifdef VM_TRACE
+  TraceBuffer trace;
+  if (trace_path) vm.trace = &trace;
+#else
+  if (trace_path) printf("Tracing needs a build with -DVM_TRACE\n");
+#endif
+
+  Profile *profiler = nullptr;
+  if (profile || profile_path) {
+    profiler = new Profile;
+    vm.profile = profiler;
+  }
+
+  Sampler sampler(program->lineTable());
+  if (sample_interval > 0 || folded_path) sampler.attach(vm, sample_interval > 0 ? sample_interval : 1);
+
+  if (fuel > 0) vm.fuel = fuel;
   vm.execute();
+  if (vm.out_of_fuel) {
+    printf("Out of fuel, stopped at pc %d with %d bytes of stack in use\n", vm.prog_counter, vm.stack_end);
+  }
+
+  if (sample_interval > 0) sampler.print(stdout, source_path);
+  if (folded_path) {
+    FILE *folded_file = fopen(folded_path, "w");
+    if (folded_file) {
+      sampler.writeFolded(folded_file, source_path);
+      fclose(folded_file);
+    } else {
+      printf("Could not write the folded stacks\n");
+    }
+  }
+
+  if (profiler) {
+    if (profile) profiler->print(stdout);
+    if (profile_path) {
+      FILE *profile_file = fopen(profile_path, "w");
+      if (profile_file) {
+        profiler->writeJson(profile_file);
+        fclose(profile_file);
+      } else {
+        printf("Could not write the profile\n");
+      }
+    }
+    delete profiler;
+  }
+
+#ifdef VM_TRACE
+  if (trace_path) {
+    FILE *trace_file = fopen(trace_path, "wb");
+    if (!trace_file || !trace.write(trace_file)) printf("Could not write the trace\n");
+    if (trace_file) fclose(trace_file);
+  }
+#endif
 
   std::cout << "Results:\n";
   std::cout << "   Left: 0b" << std::bitset<64>(*(uint64_t *)(vm.registers)) << "\n";
@@ -75,5 +262,5 @@ int main() {
   std::cout << "  Right: " << *(float *)(vm.registers + 8) << "f\n";
   std::cout << "  Right: " << *(double *)(vm.registers + 8) << "d\n";
 
-  return 0;
+  return vm.out_of_fuel ? 3 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,185 @@
+#ifndef _NATIVE_CPP_
+#define _NATIVE_CPP_
+
+// Host functions behind SPECCALL and FTRIG. Included by vm.cpp.
+// A C++ function is bound to an ID once with natives.bind<fn>(id, name),
+// which instantiates a trampoline for its exact signature. The trampoline
+// reads every argument straight from where the script left it and writes
+// the result into left, so a call costs an indirect jump and the copies.
+//
+// Calling convention: with n arguments, the last two (or the only one) go
+// in left and right, in that order, and the ones before them are pushed in
+// order, so a stack machine evaluates them left to right. SPECCALL pops the
+// pushed ones. Arguments and results are primitives or pointers, passed as
+// their bytes; the result keeps the bytes of left above it, like any write.
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+// SPECCALL takes a byte ID
+#define VM_NATIVE_COUNT 256
+#define VM_NATIVE_MAX_ARGS 8
+
+// Type byte of pointer arguments and results, not a primitive type
+#define NATIVE_POINTER MERGE(TYPE_NONE, FROM_SIZE(64))
+
+// Reads the arguments from the registers and from `args`, where the pushed
+// arguments begin, and writes the result back into the registers
+typedef void (*NativeFn)(byte *registers, const byte *args);
+
+// Type byte of an argument or result type, TYPE_NONE for void
+template <class T> static constexpr byte nativeType() {
+  if constexpr (std::is_void<T>::value) return TYPE_NONE;
+  else if constexpr (std::is_pointer<T>::value) return NATIVE_POINTER;
+  else if constexpr (std::is_same<T, bool>::value) return MERGE(TYPE_UNSIGNED, FROM_SIZE(8));
+  #define NATIVE_TYPE(suffix, tbyte, type, ...) else if constexpr (std::is_same<T, type>::value) return tbyte;
+  PRIMITIVE_TYPES(NATIVE_TYPE)
+  #undef NATIVE_TYPE
+  else static_assert(sizeof(T) == 0, "Native functions take and return primitives and pointers");
+}
+
+template <class Fn> struct NativeSignature;
+
+template <class R, class... Args> struct NativeSignature<R (*)(Args...)> {
+  typedef R Result;
+  static constexpr int arity = sizeof...(Args);
+  static constexpr int pushed = arity > 2 ? arity - 2 : 0;
+
+  static_assert(arity <= VM_NATIVE_MAX_ARGS, "Too many native arguments");
+
+  // Where pushed argument i starts, relative to the first one
+  static constexpr int offset(int i) {
+    constexpr int sizes[] = {(int) sizeof(Args)..., 0};
+    int bytes = 0;
+    for (int j = 0; j < i && j < pushed; ++j) bytes += sizes[j];
+    return bytes;
+  }
+
+  static constexpr int stack = offset(pushed);
+
+  template <class T, size_t i> static inline T arg(const byte *registers, const byte *args) {
+    T value;
+    if constexpr ((int) i < pushed) memcpy(&value, args + offset(i), sizeof(T));
+    else memcpy(&value, registers + (i - pushed) * 8, sizeof(T));
+    return value;
+  }
+
+  template <R (*fn)(Args...), size_t... i>
+  static inline void call(byte *registers, const byte *args, std::index_sequence<i...>) {
+    if constexpr (std::is_void<R>::value) {
+      fn(arg<Args, i>(registers, args)...);
+    } else {
+      R result = fn(arg<Args, i>(registers, args)...);
+      memcpy(registers, &result, sizeof(R));
+    }
+  }
+
+  static void types(byte *out) {
+    const byte all[] = {nativeType<Args>()..., TYPE_NONE};
+    memcpy(out, all, arity);
+  }
+};
+
+// noexcept is part of a function's type, the C library has it everywhere
+template <class R, class... Args>
+struct NativeSignature<R (*)(Args...) noexcept> : NativeSignature<R (*)(Args...)> {};
+
+template <auto fn> static void nativeTrampoline(byte *registers, const byte *args) {
+  typedef NativeSignature<decltype(fn)> Signature;
+  Signature::template call<fn>(registers, args, std::make_index_sequence<Signature::arity>());
+}
+
+struct NativeFunction {
+  NativeFn call = nullptr;
+  std::string name;
+  int stack = 0; // Bytes of pushed arguments, SPECCALL pops them
+  int arity = 0;
+  byte args[VM_NATIVE_MAX_ARGS] = {}; // Type byte of every argument
+  byte result = TYPE_NONE;
+  bool yields = false; // A safe point after the call, for functions that block
+};
+
+class NativeRegistry {
+  NativeFunction functions[VM_NATIVE_COUNT];
+
+public:
+  // Binds fn to id, replacing what was there. Programs verified before
+  // the binding don't see it. `yields` makes calls to it safe points, so
+  // a scheduler can switch scripts after one that waited on I/O
+  template <auto fn> void bind(byte id, const char *name, bool yields = false) {
+    typedef NativeSignature<decltype(fn)> Signature;
+    NativeFunction &native = functions[id];
+    native.call = nativeTrampoline<fn>;
+    native.name = name;
+    native.stack = Signature::stack;
+    native.arity = Signature::arity;
+    Signature::types(native.args);
+    native.result = nativeType<typename Signature::Result>();
+    native.yields = yields;
+  }
+
+  void unbind(byte id) {
+    functions[id] = NativeFunction();
+  }
+
+  // Always a function, check `call` to see if anything is bound
+  const NativeFunction &get(byte id) const {
+    return functions[id];
+  }
+
+  // ID of the function bound under name, -1 if there is none
+  int find(const std::string &name) const {
+    for (int id = 0; id < VM_NATIVE_COUNT; ++id) {
+      if (functions[id].call && functions[id].name == name) return id;
+    }
+    return -1;
+  }
+};
+
+static NativeRegistry natives;
+
+// FTRIG's functions, left = function(left) in f32 or f64:
+// X(name, C function)
+#define TRIG_FUNCTIONS(X) \
+  X(SIN , sin ) \
+  X(COS , cos ) \
+  X(TAN , tan ) \
+  X(ASIN, asin) \
+  X(ACOS, acos) \
+  X(ATAN, atan)
+
+enum : byte {
+  #define TRIG_ENUM(name, fn) TRIG_##name,
+  TRIG_FUNCTIONS(TRIG_ENUM)
+  #undef TRIG_ENUM
+  TRIG_COUNT
+};
+
+struct TrigTable {
+  NativeFn handlers[2][TRIG_COUNT]; // f32, then f64
+
+  TrigTable() : handlers{
+    #define TRIG_F32(name, fn) nativeTrampoline<(float (*)(float)) fn##f>,
+    #define TRIG_F64(name, fn) nativeTrampoline<(double (*)(double)) fn>,
+    {TRIG_FUNCTIONS(TRIG_F32)},
+    {TRIG_FUNCTIONS(TRIG_F64)}
+    #undef TRIG_F32
+    #undef TRIG_F64
+  } {}
+};
+
+static const TrigTable trig_functions;
+
+// The handler for FTRIG's operands, nullptr if they are invalid
+static inline NativeFn trigFunction(byte type, byte function) {
+  if (function >= TRIG_COUNT) return nullptr;
+  if (type == MERGE(TYPE_FLOAT, FROM_SIZE(32))) return trig_functions.handlers[0][function];
+  if (type == MERGE(TYPE_FLOAT, FROM_SIZE(64))) return trig_functions.handlers[1][function];
+  return nullptr;
+}
+
+#endif // _NATIVE_CPP_
@@ -0,0 +1,608 @@
+// Per-opcode microbenchmarks, checked against a stored baseline.
+// Build with: g++ -std=c++17 -O2 src/opbench.cpp -o opbench
+//
+// Usage: opbench [--filter <text>] [--baseline <file>] [--tolerance <fraction>]
+//                [--write-baseline <file>]
+// Without --baseline, bench/opbench.baseline is used when it exists. Exits
+// with 1 if any case's median is slower than its baseline by more than the
+// tolerance (default 0.5, plus 0.25 ns of slack for timer noise).
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "vm.cpp"
+#include "codebuilder.cpp"
+
+static const int REPEATS = 2048; // Copies of the measured block per program
+static const int SAMPLES = 101;  // Timed runs per case
+
+struct OpCase {
+  std::string name;
+  CodeBuilder program;
+  int instructions = 0; // Executed per run
+};
+
+struct Stats {
+  double mean, median, p99; // ns per instruction
+};
+
+// The value 1 in the given primitive type, loaded into left
+static void loadOne(CodeBuilder &builder, byte type) {
+  switch (type) {
+    #define LOAD_ONE(suffix, tbyte, value, ...) case tbyte: builder.loadConstant<value>((value) 1); break;
+    PRIMITIVE_TYPES(LOAD_ONE)
+    #undef LOAD_ONE
+  }
+}
+
+static void registerOne(CodeBuilder &builder, byte reg, byte type) {
+  switch (type) {
+    #define LOAD_ONE(suffix, tbyte, value, ...) \
+    case tbyte: \
+      builder.op(OPCODE_R_LOADC, reg); \
+      builder.code.push_back(sizeof(value)); \
+      builder.constant<value>((value) 1); \
+      break;
+    PRIMITIVE_TYPES(LOAD_ONE)
+    #undef LOAD_ONE
+  }
+}
+
+// Builds setup code, `REPEATS` copies of a block and a RETURN, with `stack`
+// bytes of stack reserved around them. Setup functions return how many
+// instructions they emitted
+template <class S, class B>
+static OpCase makeCase(const std::string &name, int block_length, S setup, B block, int16_t stack = 16) {
+  OpCase result;
+  result.name = name;
+  CodeBuilder &builder = result.program;
+
+  builder.op(OPCODE_RESERVE);
+  builder.value<int16_t>(stack);
+  int setup_length = 1 + setup(builder);
+  for (int i = 0; i < REPEATS; ++i) block(builder);
+  builder.op(OPCODE_RELEASE);
+  builder.value<int16_t>(stack);
+  builder.op(OPCODE_RETURN);
+  builder.finish();
+
+  result.instructions = setup_length + block_length * REPEATS + 2;
+  return result;
+}
+
+static int noSetup(CodeBuilder &) {
+  return 0;
+}
+
+static void typedCases(std::vector<OpCase> &cases) {
+  static const byte types[] = {
+    #define TYPE_BYTE(suffix, tbyte, ...) tbyte,
+    PRIMITIVE_TYPES(TYPE_BYTE)
+    #undef TYPE_BYTE
+  };
+  static const byte ops[] = {
+    #define TYPED_BYTE(name, ...) OPCODE_##name,
+    TYPED_OPCODES(TYPED_BYTE)
+    #undef TYPED_BYTE
+  };
+
+  for (byte op : ops) {
+    for (byte type : types) {
+      std::string suffix = typeName(typeIndex(type));
+      // left = right = 1, so DIV never divides by zero
+      auto setup = [type](CodeBuilder &builder) {
+        loadOne(builder, type);
+        builder.op(OPCODE_SWAP);
+        loadOne(builder, type);
+        return 3;
+      };
+
+      cases.push_back(makeCase(std::string(opcodeName(op)) + ":" + suffix, 1, setup,
+        [op, type](CodeBuilder &builder) { builder.op(op, type); }));
+
+      OpCase quick = makeCase(std::string(opcodeName(quickOpcode(op, type))), 1, setup,
+        [op, type](CodeBuilder &builder) { builder.op(op, type); });
+      quicken(quick.program.code.data(), quick.program.code_size);
+      cases.push_back(quick);
+
+      byte r_op = registerOpcode(op);
+      cases.push_back(makeCase(std::string(opcodeName(r_op)) + ":" + suffix, 1,
+        [type](CodeBuilder &builder) {
+          registerOne(builder, 1, type);
+          registerOne(builder, 2, type);
+          return 2;
+        },
+        [r_op, type](CodeBuilder &builder) {
+          builder.op(r_op, 1);
+          builder.code.push_back(1);
+          builder.code.push_back(2);
+          builder.code.push_back(type);
+        }));
+    }
+  }
+}
+
+// Every pair of types converted there and back, so the value stays 1
+static void conversionCases(std::vector<OpCase> &cases) {
+  static const byte types[] = {
+    #define TYPE_BYTE(suffix, tbyte, ...) tbyte,
+    PRIMITIVE_TYPES(TYPE_BYTE)
+    #undef TYPE_BYTE
+  };
+
+  for (int i = 0; i < PRIMITIVE_TYPE_COUNT; ++i) {
+    for (int j = i; j < PRIMITIVE_TYPE_COUNT; ++j) {
+      byte from = types[i], to = types[j];
+      std::string suffix = std::string(":") + typeName(i) + "<>" + typeName(j);
+
+      cases.push_back(makeCase("CONV" + suffix, 2,
+        [from](CodeBuilder &builder) {
+          loadOne(builder, from);
+          return 1;
+        },
+        [from, to](CodeBuilder &builder) {
+          builder.op(OPCODE_CONV, from);
+          builder.code.push_back(to);
+          builder.op(OPCODE_CONV, to);
+          builder.code.push_back(from);
+        }));
+
+      cases.push_back(makeCase("R_CONV" + suffix, 2,
+        [from](CodeBuilder &builder) {
+          registerOne(builder, 1, from);
+          return 1;
+        },
+        [from, to](CodeBuilder &builder) {
+          builder.op(OPCODE_R_CONV, 1);
+          builder.code.push_back(from);
+          builder.code.push_back(to);
+          builder.op(OPCODE_R_CONV, 1);
+          builder.code.push_back(to);
+          builder.code.push_back(from);
+        }));
+    }
+  }
+}
+
+static void memoryCases(std::vector<OpCase> &cases) {
+  for (int width : {1, 2, 4, 8}) {
+    std::string suffix = ":" + std::to_string(width);
+
+    cases.push_back(makeCase("LOADC" + suffix, 1, noSetup, [width](CodeBuilder &builder) {
+      switch (width) {
+        case 1: builder.loadConstant<uint8_t>(1); break;
+        case 2: builder.loadConstant<uint16_t>(1); break;
+        case 4: builder.loadConstant<uint32_t>(1); break;
+        case 8: builder.loadConstant<uint64_t>(1); break;
+      }
+    }));
+
+    cases.push_back(makeCase("SPP+LOAD" + suffix, 2, noSetup, [width](CodeBuilder &builder) {
+      builder.op(OPCODE_SPP);
+      builder.value<int32_t>(0);
+      builder.op(OPCODE_LOAD, width);
+    }));
+
+    cases.push_back(makeCase("SPP+STORE" + suffix, 2, noSetup, [width](CodeBuilder &builder) {
+      builder.op(OPCODE_SPP);
+      builder.value<int32_t>(0);
+      builder.op(OPCODE_STORE, width);
+    }));
+
+    cases.push_back(makeCase("PUSH+POP" + suffix, 2, noSetup, [width](CodeBuilder &builder) {
+      builder.op(OPCODE_PUSH, MERGE(REG_LEFT, width));
+      builder.op(OPCODE_POP, MERGE(REG_RIGHT, width));
+    }));
+
+    cases.push_back(makeCase("SPP_LOAD" + suffix, 1, noSetup, [width](CodeBuilder &builder) {
+      builder.op(OPCODE_SPP_LOAD);
+      builder.value<int32_t>(0);
+      builder.code.push_back(width);
+    }));
+
+    cases.push_back(makeCase("FPP_LOAD" + suffix, 1, noSetup, [width](CodeBuilder &builder) {
+      builder.op(OPCODE_FPP_LOAD);
+      builder.value<int32_t>(8);
+      builder.code.push_back(width);
+    }));
+
+    cases.push_back(makeCase("R_LOADC" + suffix, 1, noSetup, [width](CodeBuilder &builder) {
+      builder.op(OPCODE_R_LOADC, 1);
+      builder.code.push_back(width);
+      builder.constant<uint64_t>(1);
+    }));
+
+    cases.push_back(makeCase("R_PUSH+R_POP" + suffix, 2, noSetup, [width](CodeBuilder &builder) {
+      builder.op(OPCODE_R_PUSH, 1);
+      builder.code.push_back(width);
+      builder.op(OPCODE_R_POP, 2);
+      builder.code.push_back(width);
+    }));
+
+    cases.push_back(makeCase("R_SPP+R_LOAD" + suffix, 2, noSetup, [width](CodeBuilder &builder) {
+      builder.op(OPCODE_R_SPP, 1);
+      builder.value<int32_t>(0);
+      builder.op(OPCODE_R_LOAD, 2);
+      builder.code.push_back(1);
+      builder.code.push_back(width);
+    }));
+
+    cases.push_back(makeCase("R_SPP+R_STORE" + suffix, 2, noSetup, [width](CodeBuilder &builder) {
+      builder.op(OPCODE_R_SPP, 1);
+      builder.value<int32_t>(0);
+      builder.op(OPCODE_R_STORE, 1);
+      builder.code.push_back(2);
+      builder.code.push_back(width);
+    }));
+  }
+
+  cases.push_back(makeCase("LOADC_SWAP:8", 1, noSetup, [](CodeBuilder &builder) {
+    builder.op(OPCODE_LOADC_SWAP, 8);
+    builder.constant<uint64_t>(1);
+  }));
+
+  // SWAP_POP_STORE needs a pointer in right and a value on the stack
+  cases.push_back(makeCase("SPP+PUSH+SWAP+SWAP_POP_STORE:1", 4, noSetup, [](CodeBuilder &builder) {
+    builder.op(OPCODE_SPP);
+    builder.value<int32_t>(0);
+    builder.op(OPCODE_PUSH, MERGE(REG_LEFT, 1));
+    builder.op(OPCODE_SWAP);
+    builder.op(OPCODE_SWAP_POP_STORE, MERGE(REG_RIGHT, 1));
+    builder.code.push_back(1);
+  }));
+
+  cases.push_back(makeCase("RESERVE+RELEASE", 2, noSetup, [](CodeBuilder &builder) {
+    builder.op(OPCODE_RESERVE);
+    builder.value<int16_t>(8);
+    builder.op(OPCODE_RELEASE);
+    builder.value<int16_t>(8);
+  }));
+}
+
+// CPY, FILL and MCMP over both halves of the reserved stack, which stay
+// equal, so MCMP compares every byte
+static void bulkCases(std::vector<OpCase> &cases) {
+  const int16_t stack = 192;
+
+  for (int count : {8, 32, 96}) {
+    std::string suffix = ":" + std::to_string(count);
+
+    // Right points at the second half and left at the first
+    auto halves = [count](CodeBuilder &builder) {
+      builder.op(OPCODE_SPP);
+      builder.value<int32_t>(count);
+      builder.op(OPCODE_SWAP);
+      builder.op(OPCODE_SPP);
+      builder.value<int32_t>(0);
+      return 3;
+    };
+
+    cases.push_back(makeCase("CPY" + suffix, 1, halves, [count](CodeBuilder &builder) {
+      builder.op(OPCODE_CPY);
+      builder.value<int32_t>(count);
+    }, stack));
+
+    // MCMP overwrites the low byte of the pointer in left
+    cases.push_back(makeCase("SPP+MCMP" + suffix, 2, halves, [count](CodeBuilder &builder) {
+      builder.op(OPCODE_SPP);
+      builder.value<int32_t>(0);
+      builder.op(OPCODE_MCMP);
+      builder.value<int32_t>(count);
+    }, stack));
+
+    for (int width : {1, 8}) {
+      cases.push_back(makeCase("FILL" + suffix + "x" + std::to_string(width), 1,
+        [](CodeBuilder &builder) {
+          builder.loadConstant<uint64_t>(0);
+          builder.op(OPCODE_SWAP);
+          builder.op(OPCODE_SPP);
+          builder.value<int32_t>(0);
+          return 3;
+        },
+        [count, width](CodeBuilder &builder) {
+          builder.op(OPCODE_FILL, width);
+          builder.value<int32_t>(count);
+        }, stack));
+    }
+  }
+}
+
+static void registerCases(std::vector<OpCase> &cases) {
+  cases.push_back(makeCase("SWAP", 1, noSetup, [](CodeBuilder &builder) { builder.op(OPCODE_SWAP); }));
+  cases.push_back(makeCase("BAND", 1, noSetup, [](CodeBuilder &builder) { builder.op(OPCODE_BAND); }));
+  cases.push_back(makeCase("BOR", 1, noSetup, [](CodeBuilder &builder) { builder.op(OPCODE_BOR); }));
+  cases.push_back(makeCase("BNOT", 1, noSetup, [](CodeBuilder &builder) { builder.op(OPCODE_BNOT); }));
+
+  cases.push_back(makeCase("SPP", 1, noSetup, [](CodeBuilder &builder) {
+    builder.op(OPCODE_SPP);
+    builder.value<int32_t>(0);
+  }));
+  cases.push_back(makeCase("FPP", 1, noSetup, [](CodeBuilder &builder) {
+    builder.op(OPCODE_FPP);
+    builder.value<int32_t>(0);
+  }));
+
+  cases.push_back(makeCase("R_MOV", 1, noSetup, [](CodeBuilder &builder) {
+    builder.op(OPCODE_R_MOV, 1);
+    builder.code.push_back(2);
+  }));
+  cases.push_back(makeCase("R_SPP", 1, noSetup, [](CodeBuilder &builder) {
+    builder.op(OPCODE_R_SPP, 1);
+    builder.value<int32_t>(0);
+  }));
+  cases.push_back(makeCase("R_FPP", 1, noSetup, [](CodeBuilder &builder) {
+    builder.op(OPCODE_R_FPP, 1);
+    builder.value<int32_t>(0);
+  }));
+  cases.push_back(makeCase("R_GET", 1, noSetup, [](CodeBuilder &builder) { builder.op(OPCODE_R_GET, 1); }));
+  cases.push_back(makeCase("R_SET", 1, noSetup, [](CodeBuilder &builder) { builder.op(OPCODE_R_SET, 1); }));
+  cases.push_back(makeCase("R_BNOT", 1, noSetup, [](CodeBuilder &builder) {
+    builder.op(OPCODE_R_BNOT, 1);
+    builder.code.push_back(1);
+  }));
+}
+
+// Every jump lands on the instruction right after it, taken or not
+static void jumpCases(std::vector<OpCase> &cases) {
+  struct Jump {
+    const char *name;
+    byte opcode;
+    byte left; // Low byte of left, decides JMPZ/JMPNZ
+  };
+  static const Jump jumps[] = {
+    {"JMP"           , OPCODE_JMP  , 0},
+    {"JMPZ:taken"    , OPCODE_JMPZ , 0},
+    {"JMPZ:not-taken", OPCODE_JMPZ , 1},
+    {"JMPNZ:taken"   , OPCODE_JMPNZ, 1},
+    {"JMPNZ:not-taken", OPCODE_JMPNZ, 0},
+  };
+
+  for (const Jump &jump : jumps) {
+    byte left = jump.left;
+    byte opcode = jump.opcode;
+    cases.push_back(makeCase(jump.name, 1,
+      [left](CodeBuilder &builder) {
+        builder.loadConstant<uint8_t>(left);
+        return 1;
+      },
+      [opcode](CodeBuilder &builder) {
+        builder.op(opcode);
+        builder.value<int32_t>(builder.code.size() + 4);
+      }));
+  }
+
+  // left == right, so the comparison is true and the jump falls through
+  for (byte opcode : {OPCODE_CMPE_JMPZ, OPCODE_CMPL_JMPZ, OPCODE_CMPG_JMPZ}) {
+    const byte u32 = MERGE(TYPE_UNSIGNED, FROM_SIZE(32));
+    cases.push_back(makeCase(std::string(opcodeName(opcode)) + ":U32", 1, noSetup,
+      [opcode, u32](CodeBuilder &builder) {
+        builder.op(opcode, u32);
+        builder.value<int32_t>(builder.code.size() + 4);
+      }));
+  }
+
+  // CALL into a lone RETURN placed after the program
+  OpCase call;
+  call.name = "CALL+RETURN";
+  std::vector<int> targets;
+  for (int i = 0; i < REPEATS; ++i) {
+    call.program.op(OPCODE_CALL);
+    targets.push_back(call.program.code.size());
+    call.program.value<int32_t>(0);
+  }
+  call.program.op(OPCODE_RETURN);
+  int32_t stub = call.program.code.size();
+  call.program.op(OPCODE_RETURN);
+  for (int at : targets) memcpy(call.program.code.data() + at, &stub, 4);
+  call.program.finish();
+  call.instructions = REPEATS * 2 + 1;
+  cases.push_back(call);
+}
+
+// Both vector registers hold ones, so VDIV never divides by zero
+static void vectorCases(std::vector<OpCase> &cases) {
+  struct Shape {
+    byte type;
+    byte lanes;
+  };
+  static const Shape shapes[] = {
+    {MERGE(TYPE_UNSIGNED, FROM_SIZE(8)) , 16},
+    {MERGE(TYPE_SIGNED  , FROM_SIZE(32)), 8},
+    {MERGE(TYPE_FLOAT   , FROM_SIZE(32)), 4},
+    {MERGE(TYPE_FLOAT   , FROM_SIZE(32)), 8},
+    {MERGE(TYPE_FLOAT   , FROM_SIZE(64)), 4},
+  };
+  static const byte ops[] = {
+    #define VECTOR_BYTE(name, ...) OPCODE_##name,
+    VECTOR_OPCODES(VECTOR_BYTE)
+    VECTOR_REDUCTIONS(VECTOR_BYTE)
+    #undef VECTOR_BYTE
+    OPCODE_VNOT,
+    OPCODE_VSPLAT,
+  };
+
+  for (const Shape &shape : shapes) {
+    byte type = shape.type, lanes = shape.lanes;
+    std::string suffix = std::string(":") + typeName(typeIndex(type)) + "x" + std::to_string(lanes);
+    auto setup = [type, lanes](CodeBuilder &builder) {
+      loadOne(builder, type);
+      builder.op(OPCODE_VSPLAT, type);
+      builder.code.push_back(lanes);
+      builder.op(OPCODE_VSWAP);
+      builder.op(OPCODE_VSPLAT, type);
+      builder.code.push_back(lanes);
+      return 4;
+    };
+
+    for (byte op : ops) {
+      cases.push_back(makeCase(opcodeName(op) + suffix, 1, setup, [op, type, lanes](CodeBuilder &builder) {
+        builder.op(op, type);
+        builder.code.push_back(lanes);
+      }));
+    }
+
+    cases.push_back(makeCase("VSHUF" + suffix, 1, setup, [type, lanes](CodeBuilder &builder) {
+      std::array<byte, VECTOR_MAX_SIZE> reversed = {};
+      for (int i = 0; i < lanes; ++i) reversed[i] = lanes - 1 - i;
+      builder.op(OPCODE_VSHUF, type);
+      builder.code.push_back(lanes);
+      builder.constant(reversed);
+    }));
+
+    cases.push_back(makeCase("VEXTRACT" + suffix, 1, setup, [type, lanes](CodeBuilder &builder) {
+      builder.op(OPCODE_VEXTRACT, type);
+      builder.code.push_back(lanes);
+      builder.code.push_back(1);
+    }));
+
+    cases.push_back(makeCase("VPUSH+VPOP" + suffix, 2, setup, [type, lanes](CodeBuilder &builder) {
+      builder.op(OPCODE_VPUSH, type);
+      builder.code.push_back(lanes);
+      builder.op(OPCODE_VPOP, type);
+      builder.code.push_back(lanes);
+    }));
+
+    // 32 bytes go past the reserved 16 but stay inside the VM's stack
+    cases.push_back(makeCase("SPP+VLOAD+VSTORE" + suffix, 3, setup, [type, lanes](CodeBuilder &builder) {
+      builder.op(OPCODE_SPP);
+      builder.value<int32_t>(0);
+      builder.op(OPCODE_VLOAD, type);
+      builder.code.push_back(lanes);
+      builder.op(OPCODE_VSTORE, type);
+      builder.code.push_back(lanes);
+    }));
+  }
+
+  cases.push_back(makeCase("VSWAP", 1, noSetup, [](CodeBuilder &builder) { builder.op(OPCODE_VSWAP); }));
+}
+
+// One run of a case, in ns per instruction
+static double sample(VM &vm, const OpCase &op) {
+  vm.instructions = op.program.code.data();
+  vm.instructions_size = op.program.code.size();
+  vm.init();
+  memset(vm.registers, 0, sizeof(vm.registers));
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  vm.execute();
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / op.instructions;
+}
+
+static Stats summarize(std::vector<double> &samples) {
+  std::sort(samples.begin(), samples.end());
+  Stats stats;
+  stats.mean = 0;
+  for (double sample : samples) stats.mean += sample;
+  stats.mean /= samples.size();
+  stats.median = samples[samples.size() / 2];
+  stats.p99 = samples[(samples.size() * 99 + 99) / 100 - 1];
+  return stats;
+}
+
+static bool readBaseline(const char *path, std::map<std::string, double> &baseline) {
+  FILE *file = fopen(path, "r");
+  if (!file) return false;
+
+  char line[256];
+  while (fgets(line, sizeof(line), file)) {
+    if (line[0] == '#') continue;
+    char name[200];
+    double median;
+    if (sscanf(line, "%199s %lf", name, &median) == 2) baseline[name] = median;
+  }
+  fclose(file);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const char *filter = nullptr;
+  const char *baseline_path = nullptr;
+  const char *write_path = nullptr;
+  double tolerance = 0.5;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) filter = argv[++i];
+    else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) baseline_path = argv[++i];
+    else if (strcmp(argv[i], "--write-baseline") == 0 && i + 1 < argc) write_path = argv[++i];
+    else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) tolerance = atof(argv[++i]);
+    else {
+      printf("Unknown argument: %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  std::map<std::string, double> baseline;
+  if (baseline_path) {
+    if (!readBaseline(baseline_path, baseline)) {
+      printf("Baseline %s could not be read\n", baseline_path);
+      return 2;
+    }
+  } else if (!write_path && readBaseline("bench/opbench.baseline", baseline)) {
+    baseline_path = "bench/opbench.baseline";
+  }
+
+  std::vector<OpCase> cases;
+  typedCases(cases);
+  conversionCases(cases);
+  memoryCases(cases);
+  bulkCases(cases);
+  registerCases(cases);
+  jumpCases(cases);
+  vectorCases(cases);
+
+  FILE *out = nullptr;
+  if (write_path) {
+    out = fopen(write_path, "w");
+    if (!out) {
+      printf("Baseline %s could not be written\n", write_path);
+      return 2;
+    }
+    fprintf(out, "# opbench medians in ns per instruction\n");
+  }
+
+  std::vector<const OpCase *> selected;
+  for (const OpCase &op : cases) {
+    if (!filter || op.name.find(filter) != std::string::npos) selected.push_back(&op);
+  }
+
+  // Rounds sample every case once, so a stretch where the machine is busy
+  // slows all cases a little instead of a few cases a lot. Round 0 warms up
+  VM vm;
+  std::vector<std::vector<double>> samples(selected.size());
+  for (int round = 0; round <= SAMPLES; ++round) {
+    for (size_t i = 0; i < selected.size(); ++i) {
+      double ns = sample(vm, *selected[i]);
+      if (round > 0) samples[i].push_back(ns);
+    }
+  }
+
+  printf("%-32s %9s %9s %9s  (ns/instruction, %d samples)\n", "case", "mean", "median", "p99", SAMPLES);
+  int regressions = 0, compared = 0;
+  for (size_t i = 0; i < selected.size(); ++i) {
+    const OpCase &op = *selected[i];
+    Stats stats = summarize(samples[i]);
+    printf("%-32s %9.3f %9.3f %9.3f", op.name.c_str(), stats.mean, stats.median, stats.p99);
+    if (out) fprintf(out, "%s %.3f\n", op.name.c_str(), stats.median);
+
+    std::map<std::string, double>::const_iterator base = baseline.find(op.name);
+    if (base != baseline.end()) {
+      compared++;
+      double limit = base->second * (1 + tolerance) + 0.25;
+      if (stats.median > limit) {
+        printf("  REGRESSED (baseline %.3f)", base->second);
+        regressions++;
+      }
+    }
+    printf("\n");
+  }
+
+  if (out) fclose(out);
+  if (baseline_path) {
+    printf("%d of %d cases regressed against %s\n", regressions, compared, baseline_path);
+  }
+  return regressions ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+#ifndef _PEEPHOLE_CPP_
+#define _PEEPHOLE_CPP_
+
+// Peephole optimization: removes instruction sequences that leave the VM
+// as it was. It runs on the compiler's output before superinstruction
+// fusion, through a Rewriter, so jump targets, constant operands and line
+// marks follow the instructions that are left. Every rule only deletes
+// code, and never code that a jump lands in the middle of.
+
+#include <stdint.h>
+#include <vector>
+#include "rewrite.cpp"
+#include "verify.cpp"
+#include "vm.cpp"
+
+enum : uint32_t {
+  PEEP_PUSH_POP  = 1 << 0, // PUSH then POP of the same register
+  PEEP_SWAP_SWAP = 1 << 1, // Two SWAPs
+  PEEP_NOP_CONV  = 1 << 2, // CONV with nothing to do, see conversionFor()
+  PEEP_RELOAD    = 1 << 3, // Loading the slot that was just pushed
+
+  PEEP_NONE = 0,
+  PEEP_ALL  = 0xF,
+};
+
+// What the rules may look at besides the code
+struct PeepholeContext {
+  std::vector<StackState> states; // Per old instruction, from the verifier
+  int previous = -1;              // Old offset of the last instruction kept
+
+  // The stack offset a SPP/FPP index points at, -1 if unknown
+  int slot(int pc, bool frame, int32_t index) const {
+    if (pc >= (int) states.size() || states[pc].depth < 0) return -1;
+    return (frame ? states[pc].frame : 8) + index;
+  }
+};
+
+// Bytes starting at the current instruction that can go, 0 if the rule
+// doesn't apply
+typedef int (*PeepholeMatch)(const Rewriter &rw, const PeepholeContext &context);
+
+static int matchPushPop(const Rewriter &rw, const PeepholeContext &) {
+  int length = rw.length(0);
+  if (!rw.fusible(length)) return 0;
+
+  byte pop = rw.opcode(0) == OPCODE_PUSH ? OPCODE_POP : OPCODE_R_POP;
+  if (rw.opcode(length) != pop) return 0;
+  for (int i = 1; i < length; ++i) {
+    if (rw.operand<byte>(i) != rw.operand<byte>(length + i)) return 0;
+  }
+  return length * 2;
+}
+
+static int matchSwapSwap(const Rewriter &rw, const PeepholeContext &) {
+  if (!rw.fusible(1) || rw.opcode(1) != rw.opcode(0)) return 0;
+  return 2;
+}
+
+static int matchNopConv(const Rewriter &rw, const PeepholeContext &) {
+  int at = rw.opcode(0) == OPCODE_CONV ? 1 : 2;
+  byte from = rw.operand<byte>(at), to = rw.operand<byte>(at + 1);
+  if (conversionFor(from, to) == convertInvalid) return 0;
+  if (from != to && conversionFor(from, to)) return 0;
+  return rw.length(0);
+}
+
+// PUSH size; SPP slot; LOAD size, where the slot is the one just pushed,
+// and the register forms of it. The bytes the load writes are already there
+static int matchReload(const Rewriter &rw, const PeepholeContext &context) {
+  if (context.previous < 0 || !rw.fusible(0)) return 0;
+  int length = rw.length(0);
+  if (!rw.fusible(length)) return 0;
+
+  byte push = rw.at(context.previous);
+  bool frame = rw.opcode(0) == OPCODE_FPP || rw.opcode(0) == OPCODE_R_FPP;
+  int size, slot;
+  if (rw.opcode(0) == OPCODE_SPP || rw.opcode(0) == OPCODE_FPP) {
+    // Only pushes of left, which LOAD overwrites
+    byte reg = rw.at(context.previous + 1);
+    if (push != OPCODE_PUSH || UPPER(reg) != 0) return 0;
+    size = LOWER(reg);
+    if (rw.opcode(length) != OPCODE_LOAD || rw.operand<byte>(length + 1) != size) return 0;
+    slot = context.slot(rw.position(), frame, rw.operand<int32_t>(1));
+  } else {
+    // R_PUSH reg, size; R_SPP reg, index; R_LOAD reg, reg, size
+    byte reg = rw.operand<byte>(1);
+    if (push != OPCODE_R_PUSH || rw.at(context.previous + 1) != reg) return 0;
+    size = rw.at(context.previous + 2);
+    if (rw.opcode(length) != OPCODE_R_LOAD) return 0;
+    if (rw.operand<byte>(length + 1) != reg || rw.operand<byte>(length + 2) != reg) return 0;
+    if (rw.operand<byte>(length + 3) != size) return 0;
+    slot = context.slot(rw.position(), frame, rw.operand<int32_t>(2));
+  }
+
+  // The push went to the top of the stack as it was before it
+  if (slot < 0 || slot != context.states[context.previous].depth) return 0;
+  return length + rw.length(length);
+}
+
+struct PeepholeRule {
+  uint32_t flag;
+  byte opcode; // The pattern starts with it
+  PeepholeMatch match;
+  const char *name;
+};
+
+static const PeepholeRule PEEPHOLE_RULES[] = {
+  {PEEP_PUSH_POP , OPCODE_PUSH  , matchPushPop , "PUSH+POP"},
+  {PEEP_PUSH_POP , OPCODE_R_PUSH, matchPushPop , "R_PUSH+R_POP"},
+  {PEEP_SWAP_SWAP, OPCODE_SWAP  , matchSwapSwap, "SWAP+SWAP"},
+  {PEEP_SWAP_SWAP, OPCODE_VSWAP , matchSwapSwap, "VSWAP+VSWAP"},
+  {PEEP_NOP_CONV , OPCODE_CONV  , matchNopConv , "CONV"},
+  {PEEP_NOP_CONV , OPCODE_R_CONV, matchNopConv , "R_CONV"},
+  {PEEP_RELOAD   , OPCODE_SPP   , matchReload  , "PUSH+SPP+LOAD"},
+  {PEEP_RELOAD   , OPCODE_FPP   , matchReload  , "PUSH+FPP+LOAD"},
+  {PEEP_RELOAD   , OPCODE_R_SPP , matchReload  , "R_PUSH+R_SPP+R_LOAD"},
+  {PEEP_RELOAD   , OPCODE_R_FPP , matchReload  , "R_PUSH+R_FPP+R_LOAD"},
+};
+
+#define PEEPHOLE_RULE_COUNT ((int) (sizeof(PEEPHOLE_RULES) / sizeof(PEEPHOLE_RULES[0])))
+
+struct PeepholeStats {
+  int bytes = 0;      // Removed from the code
+  int dispatches = 0; // Instructions removed, each one a dispatch saved per run
+  int passes = 0;
+  int fired[PEEPHOLE_RULE_COUNT] = {};
+
+  void print(FILE *out) const {
+    fprintf(out, "Peephole: %d bytes, %d instructions removed in %d pass%s\n", bytes, dispatches, passes, passes == 1 ? "" : "es");
+    for (int i = 0; i < PEEPHOLE_RULE_COUNT; ++i) {
+      if (fired[i]) fprintf(out, "  %-20s %d\n", PEEPHOLE_RULES[i].name, fired[i]);
+    }
+  }
+};
+
+// True if a pair rule may apply once nothing separates first and second
+static bool formsPair(byte first, byte second) {
+  if (first == OPCODE_PUSH) return second == OPCODE_POP;
+  if (first == OPCODE_R_PUSH) return second == OPCODE_R_POP;
+  return (first == OPCODE_SWAP || first == OPCODE_VSWAP) && second == first;
+}
+
+// One pass over the code. Returns true if it brought instructions together
+// that another pass may remove
+static bool peepholePass(Rewriter &rw, PeepholeContext &context, uint32_t rules, PeepholeStats &stats) {
+  bool again = false;
+  context.previous = -1;
+
+  while (!rw.done()) {
+    byte opcode = rw.opcode(0);
+    int length = 0;
+    for (int i = 0; i < PEEPHOLE_RULE_COUNT && !length; ++i) {
+      const PeepholeRule &rule = PEEPHOLE_RULES[i];
+      if (rule.opcode != opcode || !(rules & rule.flag)) continue;
+
+      length = rule.match(rw, context);
+      if (!length) continue;
+
+      for (int at = 0; at < length; at += rw.length(at)) stats.dispatches++;
+      stats.fired[i]++;
+    }
+
+    if (length) {
+      rw.drop(length);
+      stats.bytes += length;
+      if (context.previous >= 0 && !rw.done() && formsPair(rw.at(context.previous), rw.opcode(0))) again = true;
+    } else {
+      context.previous = rw.position();
+      rw.copy();
+    }
+  }
+
+  stats.passes++;
+  return again;
+}
+
+#endif // _PEEPHOLE_CPP_
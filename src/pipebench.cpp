@@ -0,0 +1,280 @@
+// End-to-end benchmark of the lexer, parser, compiler and VM on generated
+// programs. Build with: g++ -std=c++17 -O2 src/pipebench.cpp -o pipebench
+//
+// Usage: pipebench [--shape <name>] [--max <statements>] [--runs <n>]
+//                  [-O<level>] [--dump <prefix>]
+// Each shape is generated at 1K, 4K, 16K... statements up to --max (default
+// 64K), so a phase that stops scaling linearly shows up as a falling
+// statements/s figure. --dump also writes every corpus to
+// <prefix><shape>-<statements>.dcs for use with the main executable, which
+// needs a larger -DMAX_STACK_SIZE to run them. -O compiles through the SSA
+// optimizer, to see what it adds to compile time.
+
+// Generated programs keep every variable on the stack
+#define MAX_STACK_SIZE (1 << 22)
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "astparser.cpp"
+#include "compiler.cpp"
+#include "lexer.cpp"
+#include "verify.cpp"
+#include "vm.cpp"
+
+// What a generated program is made of. Only u8 is used, it is the one type
+// every stage handles without conversions
+struct Shape {
+  const char *name;
+  int nesting;      // Parenthesised levels in each initializer
+  int block_every;  // Every nth declaration is an expr-block, 0 for none
+  int ref_every;    // Every nth declaration is a reference, 0 for none
+  int assign_every; // Compound assignment after every nth declaration
+};
+
+static const Shape SHAPES[] = {
+  {"flat"   , 0 , 0, 0, 0},
+  {"nested" , 24, 0, 0, 0},
+  {"blocks" , 1 , 2, 0, 0},
+  {"refs"   , 1 , 0, 2, 1},
+  {"mixed"  , 6 , 5, 4, 3},
+};
+
+class CorpusGenerator {
+  const Shape &shape;
+  std::mt19937 random;
+  std::string out;
+  int variables = 0;
+  int refs = 0;
+  int temporaries = 0;
+
+  int below(int n) {
+    return std::uniform_int_distribution<int>(0, n - 1)(random);
+  }
+
+  void operand() {
+    if (variables == 0 || below(3) == 0) out += std::to_string(1 + below(99));
+    else out += "v" + std::to_string(below(variables));
+  }
+
+  void op() {
+    static const char *const ops[] = {" + ", " - ", " * ", " ^ ", " & ", " | "};
+    out += ops[below(6)];
+  }
+
+  void expression(int depth) {
+    if (depth == 0) {
+      operand();
+      op();
+      operand();
+      return;
+    }
+    out += "(";
+    expression(depth - 1);
+    out += ")";
+    op();
+    operand();
+  }
+
+  // Returns how many statements it wrote
+  int declaration() {
+    int index = variables;
+    int written = 1;
+
+    if (shape.ref_every && index % shape.ref_every == 1) {
+      out += "let ref u8 r" + std::to_string(refs++) + " = v" + std::to_string(below(variables)) + ";\n";
+      written++;
+    }
+
+    out += "let u8 v" + std::to_string(index) + " = ";
+    if (shape.block_every && index % shape.block_every == 0) {
+      std::string temp = "t" + std::to_string(temporaries++);
+      out += "u8 : {\n  let u8 " + temp + " = ";
+      expression(shape.nesting);
+      out += ";\n  " + temp + " += ";
+      operand();
+      out += ";\n  yield " + temp + " * 2;\n};\n";
+      written += 3;
+    } else {
+      expression(shape.nesting);
+      out += ";\n";
+    }
+    variables++;
+
+    if (shape.assign_every && index % shape.assign_every == 0) {
+      static const char *const assigns[] = {" += ", " -= ", " *= "};
+      if (refs > 0) out += "r" + std::to_string(below(refs));
+      else out += "v" + std::to_string(below(variables));
+      out += assigns[below(3)];
+      expression(shape.nesting / 2);
+      out += ";\n";
+      written++;
+    }
+    return written;
+  }
+
+public:
+  int statements = 0;
+
+  explicit CorpusGenerator(const Shape &shape) : shape(shape), random(12345) {}
+
+  std::string generate(int target_statements) {
+    while (statements < target_statements) statements += declaration();
+    return out;
+  }
+};
+
+// Runs a phase `runs` times and keeps the median. `prepare` runs untimed
+// before each measurement and `cleanup` after it
+template <class P, class F, class C>
+static double medianSeconds(int runs, P prepare, F phase, C cleanup) {
+  std::vector<double> times;
+  for (int i = 0; i < runs; ++i) {
+    prepare();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    phase();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    cleanup();
+    times.push_back(elapsed.count());
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+static void report(const char *phase, double seconds, size_t bytes, int statements) {
+  printf("  %-8s %10.3f ms %10.2f MB/s %12.0f statements/s\n", phase, seconds * 1e3,
+    bytes / seconds / 1e6, statements / seconds);
+}
+
+// Expression statements end in PRINT, keep that out of the terminal
+class SilenceStdout {
+  int saved;
+
+public:
+  SilenceStdout() {
+    fflush(stdout);
+    saved = dup(1);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    close(null);
+  }
+
+  ~SilenceStdout() {
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+  }
+};
+
+static bool benchCorpus(const Shape &shape, int target, int runs, int opt_level, const char *dump_prefix) {
+  CorpusGenerator generator(shape);
+  std::string source = generator.generate(target);
+  int statements = generator.statements;
+
+  printf("%s: %d statements, %zu bytes\n", shape.name, statements, source.size());
+  if (dump_prefix) {
+    std::string path = std::string(dump_prefix) + shape.name + "-" + std::to_string(target) + ".dcs";
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file || fwrite(source.data(), 1, source.size(), file) != source.size()) {
+      printf("Could not write %s\n", path.c_str());
+    }
+    if (file) fclose(file);
+  }
+
+  int tokens = 0;
+  double lex = medianSeconds(runs, []() {}, [&]() {
+    Lexer lexer;
+    lexer.init(source.c_str());
+    tokens = 0;
+    while (lexer.getNext().type != TokenType::EOF_TOKEN) tokens++;
+  }, []() {});
+  report("lex", lex, source.size(), statements);
+
+  Parser parser;
+  double parse = medianSeconds(runs, []() {}, [&]() {
+    parser.parse(source.c_str());
+  }, [&]() {
+    delete parser.top;
+  });
+  report("parse", parse, source.size(), statements);
+
+  // The compiler keeps its symbols, so every run gets a fresh one
+  parser.parse(source.c_str());
+  Compiler *compiler = nullptr;
+  bool compiled = true;
+  double compile = medianSeconds(runs, [&]() {
+    delete compiler;
+    compiler = new Compiler;
+    compiler->opt_level = opt_level;
+  }, [&]() {
+    compiled = compiler->compile(parser.top);
+  }, []() {});
+  delete parser.top;
+  if (!compiled) {
+    delete compiler;
+    return false;
+  }
+  report("compile", compile, source.size(), statements);
+
+  // Large, the stack lives inside the VM
+  VM *vm = new VM;
+  vm->instructions = compiler->resultData();
+  vm->instructions_size = compiler->resultSize();
+  VerifyReport verified;
+  vm->unchecked = verifyBytecode(vm->instructions, compiler->codeSize(), vm->instructions_size, verified);
+
+  double execute;
+  {
+    SilenceStdout silence;
+    execute = medianSeconds(runs, [&]() {
+      vm->init();
+      memset(vm->registers, 0, sizeof(vm->registers));
+    }, [&]() {
+      vm->execute();
+    }, []() {});
+  }
+  report("execute", execute, source.size(), statements);
+  printf("  %d tokens, %d bytes of code, %s\n\n", tokens, compiler->codeSize(),
+    vm->unchecked ? "verified" : verified.error);
+
+  delete vm;
+  delete compiler;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const char *only = nullptr;
+  const char *dump_prefix = nullptr;
+  int max_statements = 1 << 16;
+  int runs = 5;
+  int opt_level = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--shape") == 0 && i + 1 < argc) only = argv[++i];
+    else if (strcmp(argv[i], "--max") == 0 && i + 1 < argc) max_statements = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) runs = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) dump_prefix = argv[++i];
+    else if (strncmp(argv[i], "-O", 2) == 0) opt_level = argv[i][2] ? atoi(argv[i] + 2) : 1;
+    else {
+      printf("Unknown argument: %s\n", argv[i]);
+      return 2;
+    }
+  }
+  if (runs < 1) runs = 1;
+
+  for (const Shape &shape : SHAPES) {
+    if (only && strcmp(only, shape.name) != 0) continue;
+    for (int statements = 1024; statements <= max_statements; statements *= 4) {
+      if (!benchCorpus(shape, statements, runs, opt_level, dump_prefix)) {
+        printf("%s failed to compile\n", shape.name);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,217 @@
+#ifndef _PROFILE_CPP_
+#define _PROFILE_CPP_
+
+// Per-opcode execution profile. Included by vm.cpp after the opcode helpers.
+// Setting VM::profile makes execute() run a separate instantiation of the
+// dispatch loop that calls Profile::enter() before every instruction, so the
+// normal loop is unchanged.
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+// Adjacent opcode counts, indexed [first][second]
+typedef uint64_t OpcodePairs[256][256];
+
+// Timestamp counter cycles, or nanoseconds where there is no rdtsc
+static inline uint64_t profileClock() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct OpcodeStats {
+  uint64_t count;
+  uint64_t cycles;
+};
+
+// Large (about 600KB), allocate it on the heap
+class Profile {
+  int last = -1;      // Opcode currently running
+  int last_typed = -1; // Its generic opcode if it carries a type, else -1
+  int last_type = 0;
+  uint64_t started = 0;
+
+  // Charges the time since the last call to the instruction that ran
+  void charge(uint64_t now) {
+    if (last < 0) return;
+    uint64_t spent = now - started;
+    opcodes[last].cycles += spent;
+    total_cycles += spent;
+    if (last_typed >= 0) typed[last_typed][last_type].cycles += spent;
+  }
+
+public:
+  OpcodeStats opcodes[256];
+  // Keyed by generic opcode and typeIndex(), so ADD with a u8 type byte and
+  // ADD_U8 share an entry. The extra column holds invalid type bytes
+  OpcodeStats typed[256][PRIMITIVE_TYPE_COUNT + 1];
+  // Generic opcodes, the keys selectFusions() in rewrite.cpp reads
+  OpcodePairs pairs;
+  uint64_t total_cycles;
+
+  Profile() {
+    clear();
+  }
+
+  void clear() {
+    memset(opcodes, 0, sizeof(opcodes));
+    memset(typed, 0, sizeof(typed));
+    memset(pairs, 0, sizeof(pairs));
+    total_cycles = 0;
+    last = -1;
+  }
+
+  // Called before the instruction at pc runs
+  void enter(int32_t pc, const byte *instructions) {
+    uint64_t now = profileClock();
+    charge(now);
+
+    byte opcode = instructions[pc];
+    byte generic = genericOpcode(opcode);
+    if (last >= 0) pairs[genericOpcode(last)][generic]++;
+    opcodes[opcode].count++;
+
+    int at = typeOperand(opcode);
+    last_typed = at ? generic : -1;
+    if (at) {
+      last_type = typeIndex(instructions[pc + at]);
+      typed[generic][last_type].count++;
+    }
+
+    last = opcode;
+    started = now;
+  }
+
+  // Charges the last instruction, call once execution stopped
+  void finish() {
+    charge(profileClock());
+    last = -1;
+  }
+
+  uint64_t instructions() const {
+    uint64_t total = 0;
+    for (const OpcodeStats &stats : opcodes) total += stats.count;
+    return total;
+  }
+
+  void print(FILE *out, int top_pairs = 10) const {
+    std::vector<int> order;
+    for (int i = 0; i < 256; ++i) {
+      if (opcodes[i].count) order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [this](int a, int b) {
+      return opcodes[a].cycles > opcodes[b].cycles;
+    });
+
+    fprintf(out, "Profile: %llu instructions, %llu cycles\n",
+      (unsigned long long) instructions(), (unsigned long long) total_cycles);
+    fprintf(out, "  %-16s %12s %14s %8s %10s\n", "opcode", "count", "cycles", "share", "cyc/instr");
+    for (int op : order) {
+      const OpcodeStats &stats = opcodes[op];
+      fprintf(out, "  %-16s %12llu %14llu %7.2f%% %10.1f\n", opcodeName(op),
+        (unsigned long long) stats.count, (unsigned long long) stats.cycles,
+        total_cycles ? 100.0 * stats.cycles / total_cycles : 0.0,
+        (double) stats.cycles / stats.count);
+    }
+
+    fprintf(out, "  By type:\n");
+    for (int op = 0; op < 256; ++op) {
+      for (int type = 0; type <= PRIMITIVE_TYPE_COUNT; ++type) {
+        const OpcodeStats &stats = typed[op][type];
+        if (!stats.count) continue;
+        fprintf(out, "    %-8s %-4s %12llu %14llu\n", opcodeName(op), typeName(type),
+          (unsigned long long) stats.count, (unsigned long long) stats.cycles);
+      }
+    }
+
+    std::vector<std::pair<uint64_t, int>> frequent;
+    for (int i = 0; i < 256 * 256; ++i) {
+      uint64_t count = pairs[i / 256][i % 256];
+      if (count) frequent.push_back({count, i});
+    }
+    std::sort(frequent.rbegin(), frequent.rend());
+    if ((int) frequent.size() > top_pairs) frequent.resize(top_pairs);
+
+    fprintf(out, "  Most frequent pairs:\n");
+    for (const std::pair<uint64_t, int> &pair : frequent) {
+      fprintf(out, "    %-16s -> %-16s %12llu\n", opcodeName(pair.second / 256),
+        opcodeName(pair.second % 256), (unsigned long long) pair.first);
+    }
+  }
+
+  void writeJson(FILE *out) const {
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"cycles\": %llu,\n  \"opcodes\": [",
+      (unsigned long long) instructions(), (unsigned long long) total_cycles);
+    const char *separator = "\n";
+    for (int op = 0; op < 256; ++op) {
+      if (!opcodes[op].count) continue;
+      fprintf(out, "%s    {\"opcode\": \"%s\", \"count\": %llu, \"cycles\": %llu}", separator,
+        opcodeName(op), (unsigned long long) opcodes[op].count,
+        (unsigned long long) opcodes[op].cycles);
+      separator = ",\n";
+    }
+
+    fprintf(out, "\n  ],\n  \"typed\": [");
+    separator = "\n";
+    for (int op = 0; op < 256; ++op) {
+      for (int type = 0; type <= PRIMITIVE_TYPE_COUNT; ++type) {
+        const OpcodeStats &stats = typed[op][type];
+        if (!stats.count) continue;
+        fprintf(out, "%s    {\"opcode\": \"%s\", \"type\": \"%s\", \"count\": %llu, \"cycles\": %llu}",
+          separator, opcodeName(op), typeName(type),
+          (unsigned long long) stats.count, (unsigned long long) stats.cycles);
+        separator = ",\n";
+      }
+    }
+
+    fprintf(out, "\n  ],\n  \"pairs\": [");
+    separator = "\n";
+    for (int first = 0; first < 256; ++first) {
+      for (int second = 0; second < 256; ++second) {
+        if (!pairs[first][second]) continue;
+        fprintf(out, "%s    {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}", separator,
+          opcodeName(first), opcodeName(second), (unsigned long long) pairs[first][second]);
+        separator = ",\n";
+      }
+    }
+    fprintf(out, "\n  ]\n}\n");
+  }
+};
+
+// Reads back the pairs writeJson() wrote, adding them to pairs. False if the
+// file can't be opened
+static bool readProfilePairs(const char *path, OpcodePairs &pairs) {
+  FILE *file = fopen(path, "r");
+  if (!file) return false;
+
+  char line[256];
+  while (fgets(line, sizeof(line), file)) {
+    char first[64], second[64];
+    unsigned long long count;
+    if (sscanf(line, " {\"first\": \"%63[^\"]\", \"second\": \"%63[^\"]\", \"count\": %llu}",
+               first, second, &count) != 3) continue;
+
+    int a = -1, b = -1;
+    for (int op = 0; op < 256; ++op) {
+      if (strcmp(opcodeName(op), first) == 0) a = op;
+      if (strcmp(opcodeName(op), second) == 0) b = op;
+    }
+    if (a >= 0 && b >= 0) pairs[a][b] += count;
+  }
+  fclose(file);
+  return true;
+}
+
+#endif // _PROFILE_CPP_
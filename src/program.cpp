@@ -0,0 +1,64 @@
+#ifndef _PROGRAM_CPP_
+#define _PROGRAM_CPP_
+
+// A compiled program that outlives its Compiler. It never changes after
+// construction, so any number of VMs on any number of threads may run it at
+// once. Pass it around as a ProgramRef.
+
+#include <memory>
+#include <vector>
+#include "linetable.cpp"
+#include "verify.cpp"
+#include "vm.cpp"
+
+class Program {
+  std::vector<byte> bytes; // Instructions followed by constants
+  int code_size;
+  LineTable lines;
+  VerifyReport report;
+  bool verified;
+
+public:
+  // Verifies the bytecode once, every VM it is attached to reuses the result
+  Program(std::vector<byte> bytes, int code_size, LineTable lines = LineTable())
+    : bytes(std::move(bytes)), code_size(code_size), lines(std::move(lines)) {
+    verified = verifyBytecode(this->bytes.data(), code_size, this->bytes.size(), report);
+  }
+
+  const byte *data() const {
+    return bytes.data();
+  }
+
+  int size() const {
+    return bytes.size();
+  }
+
+  int codeSize() const {
+    return code_size;
+  }
+
+  const LineTable &lineTable() const {
+    return lines;
+  }
+
+  // Verified programs run without the interpreter's bounds checks
+  bool isVerified() const {
+    return verified;
+  }
+
+  const VerifyReport &verification() const {
+    return report;
+  }
+
+  // Points the VM at this program. Its registers and stack are left alone,
+  // call VM::init() before running it
+  void attach(VM &vm) const {
+    vm.instructions = bytes.data();
+    vm.instructions_size = bytes.size();
+    vm.unchecked = verified;
+  }
+};
+
+typedef std::shared_ptr<const Program> ProgramRef;
+
+#endif // _PROGRAM_CPP_
@@ -0,0 +1,267 @@
+#ifndef _REWRITE_CPP_
+#define _REWRITE_CPP_
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "vm.cpp"
+
+// Rebuilds a bytecode buffer instruction by instruction. It remembers where
+// every old instruction ended up, so jump targets and operand positions
+// recorded against the old buffer can be patched afterwards.
+class Rewriter {
+  const std::vector<byte> *in = nullptr;
+  std::vector<int32_t> moved; // Old instruction start -> new start, -1 elsewhere
+  std::vector<bool> targets;  // Old offsets some jump lands on
+  int pc = 0;
+
+public:
+  std::vector<byte> out;
+
+  // Fails on bytecode it cannot decode, in which case nothing may be rewritten
+  bool begin(const std::vector<byte> &code) {
+    int size = code.size();
+    in = &code;
+    pc = 0;
+    out.clear();
+    out.reserve(size);
+    moved.assign(size + 1, -1);
+    targets.assign(size + 1, false);
+
+    for (int at = 0; at < size;) {
+      int length = opcodeLength(code[at]);
+      if (length == 0 || at + length > size) return false;
+
+      int operand = jumpOperand(code[at]);
+      if (operand) {
+        int32_t target = *(const int32_t *)(code.data() + at + operand);
+        if (target >= 0 && target <= size) targets[target] = true;
+      }
+      at += length;
+    }
+    return true;
+  }
+
+  bool done() const {
+    return pc >= (int) in->size();
+  }
+
+  // Old offset of the current instruction
+  int position() const {
+    return pc;
+  }
+
+  // A byte at an old offset
+  byte at(int pos) const {
+    return (*in)[pos];
+  }
+
+  // Offsets are relative to the current instruction
+  byte opcode(int offset) const {
+    return (*in)[pc + offset];
+  }
+
+  template <class T> T operand(int offset) const {
+    T value;
+    memcpy(&value, in->data() + pc + offset, sizeof(T));
+    return value;
+  }
+
+  int length(int offset) const {
+    return opcodeLength(opcode(offset));
+  }
+
+  // True if an instruction starts at offset and nothing jumps to it,
+  // meaning it can be folded into the instruction before it
+  bool fusible(int offset) const {
+    if (pc + offset >= (int) in->size()) return false;
+    return !targets[pc + offset];
+  }
+
+  void copy() {
+    int length = opcodeLength(opcode(0));
+    moved[pc] = out.size();
+    out.insert(out.end(), in->begin() + pc, in->begin() + pc + length);
+    pc += length;
+  }
+
+  // Starts a replacement for the next `length` old bytes
+  void replace(int length) {
+    moved[pc] = out.size();
+    pc += length;
+  }
+
+  // Removes the next `length` old bytes. Jumps to any instruction in them
+  // land on whatever comes next
+  void drop(int length) {
+    for (int at = pc; at < pc + length; at += opcodeLength((*in)[at])) moved[at] = out.size();
+    pc += length;
+  }
+
+  void emit(byte value) {
+    out.push_back(value);
+  }
+
+  template <class T> void emitValue(T value) {
+    out.insert(out.end(), sizeof(T), 0);
+    memcpy(out.data() + out.size() - sizeof(T), &value, sizeof(T));
+  }
+
+  // Where an old byte position (e.g. a LOADC operand) ended up. Replacements
+  // keep the operand layout of the instruction they start with
+  int32_t remap(int32_t pos) const {
+    int32_t start = pos;
+    while (start > 0 && moved[start] < 0) start--;
+    return moved[start] + (pos - start);
+  }
+
+  // Where code starting at an old instruction continues: its own new
+  // position, or the end of the replacement that absorbed it
+  int32_t remapBoundary(int32_t pos) const {
+    if (moved[pos] >= 0) return moved[pos];
+    while (pos > 0 && moved[pos] < 0) pos--;
+    return moved[pos] + opcodeLength(out[moved[pos]]);
+  }
+
+  // Patches every jump target and hands the new code back
+  void finish(std::vector<byte> &code) {
+    moved[in->size()] = out.size();
+
+    for (int at = 0; at < (int) out.size(); at += opcodeLength(out[at])) {
+      int operand = jumpOperand(out[at]);
+      if (!operand) continue;
+
+      int32_t *target = (int32_t *)(out.data() + at + operand);
+      if (*target >= 0 && *target < (int32_t) moved.size() && moved[*target] >= 0) {
+        *target = moved[*target];
+      }
+    }
+
+    code.swap(out);
+    out.clear();
+  }
+};
+
+// --- Superinstruction fusion ---
+
+enum : uint32_t {
+  FUSE_SPP_LOAD       = 1 << 0,
+  FUSE_FPP_LOAD       = 1 << 1,
+  FUSE_LOADC_SWAP     = 1 << 2,
+  FUSE_CMP_JMPZ       = 1 << 3,
+  FUSE_SWAP_POP_STORE = 1 << 4,
+
+  FUSE_NONE = 0,
+  FUSE_ALL  = 0x1F,
+};
+
+// The opcode pair each fusion starts with, and what it becomes. Quickened
+// opcodes are counted as their generic form, see genericOpcode()
+struct FusionRule {
+  uint32_t flag;
+  byte first, second;
+  byte fused;
+};
+
+static const FusionRule FUSION_RULES[] = {
+  {FUSE_SPP_LOAD      , OPCODE_SPP  , OPCODE_LOAD, OPCODE_SPP_LOAD      },
+  {FUSE_FPP_LOAD      , OPCODE_FPP  , OPCODE_LOAD, OPCODE_FPP_LOAD      },
+  {FUSE_LOADC_SWAP    , OPCODE_LOADC, OPCODE_SWAP, OPCODE_LOADC_SWAP    },
+  {FUSE_CMP_JMPZ      , OPCODE_CMPE , OPCODE_JMPZ, OPCODE_CMPE_JMPZ     },
+  {FUSE_CMP_JMPZ      , OPCODE_CMPL , OPCODE_JMPZ, OPCODE_CMPL_JMPZ     },
+  {FUSE_CMP_JMPZ      , OPCODE_CMPG , OPCODE_JMPZ, OPCODE_CMPG_JMPZ     },
+  {FUSE_SWAP_POP_STORE, OPCODE_SWAP , OPCODE_POP , OPCODE_SWAP_POP_STORE},
+};
+
+// Share of the measured pairs a fusion's pair needs to be picked
+#define FUSION_MIN_SHARE 0.01
+
+// Enables every fusion whose leading pair makes up at least min_share of
+// the pairs a profile measured, see Profile::pairs. A profile of fused code
+// has the superinstruction where the pair would be, so it counts as the pair
+static uint32_t selectFusions(const OpcodePairs &pairs, double min_share = FUSION_MIN_SHARE) {
+  uint64_t total = 0;
+  for (int i = 0; i < 256; ++i) {
+    for (int j = 0; j < 256; ++j) total += pairs[i][j];
+  }
+  if (total == 0) return FUSE_NONE;
+
+  uint32_t fusions = FUSE_NONE;
+  for (const FusionRule &rule : FUSION_RULES) {
+    uint64_t count = pairs[rule.first][rule.second];
+    for (int next = 0; next < 256; ++next) count += pairs[rule.fused][next];
+    if ((double) count / total >= min_share) fusions |= rule.flag;
+  }
+  return fusions;
+}
+
+// Replaces the current instruction and some of the ones after it with a
+// superinstruction. Returns false if nothing matched
+static bool fuseInstruction(Rewriter &rw, uint32_t fusions) {
+  byte first = genericOpcode(rw.opcode(0));
+  int length = rw.length(0);
+  if (!rw.fusible(length)) return false;
+  byte second = rw.opcode(length);
+
+  switch (first) {
+    case OPCODE_SPP:
+    case OPCODE_FPP: {
+      if (second != OPCODE_LOAD) return false;
+      if (!(fusions & (first == OPCODE_SPP ? FUSE_SPP_LOAD : FUSE_FPP_LOAD))) return false;
+      int32_t index = rw.operand<int32_t>(1);
+      byte size = rw.operand<byte>(length + 1);
+      rw.replace(length + 2);
+      rw.emit(first == OPCODE_SPP ? OPCODE_SPP_LOAD : OPCODE_FPP_LOAD);
+      rw.emitValue<int32_t>(index);
+      rw.emit(size);
+      return true;
+    }
+
+    case OPCODE_LOADC: {
+      if (second != OPCODE_SWAP || !(fusions & FUSE_LOADC_SWAP)) return false;
+      byte size = rw.operand<byte>(1);
+      int32_t pos = rw.operand<int32_t>(2);
+      rw.replace(length + 1);
+      rw.emit(OPCODE_LOADC_SWAP);
+      rw.emit(size);
+      rw.emitValue<int32_t>(pos);
+      return true;
+    }
+
+    case OPCODE_CMPE:
+    case OPCODE_CMPL:
+    case OPCODE_CMPG: {
+      if (second != OPCODE_JMPZ || !(fusions & FUSE_CMP_JMPZ)) return false;
+      byte type = rw.operand<byte>(1);
+      int32_t target = rw.operand<int32_t>(length + 1);
+      rw.replace(length + 5);
+      rw.emit(first == OPCODE_CMPE ? OPCODE_CMPE_JMPZ :
+              first == OPCODE_CMPL ? OPCODE_CMPL_JMPZ : OPCODE_CMPG_JMPZ);
+      rw.emit(type);
+      rw.emitValue<int32_t>(target);
+      return true;
+    }
+
+    case OPCODE_SWAP: {
+      if (second != OPCODE_POP || !(fusions & FUSE_SWAP_POP_STORE)) return false;
+      if (!rw.fusible(3) || rw.opcode(3) != OPCODE_STORE) return false;
+      byte reg = rw.operand<byte>(2);
+      byte size = rw.operand<byte>(4);
+      rw.replace(5);
+      rw.emit(OPCODE_SWAP_POP_STORE);
+      rw.emit(reg);
+      rw.emit(size);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void fuseInstructions(Rewriter &rw, uint32_t fusions) {
+  while (!rw.done()) {
+    if (!fuseInstruction(rw, fusions)) rw.copy();
+  }
+}
+
+#endif // _REWRITE_CPP_
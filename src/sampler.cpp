@@ -0,0 +1,90 @@
+#ifndef _SAMPLER_CPP_
+#define _SAMPLER_CPP_
+
+// Sampling profiler. Hooks VM::pause_fn, records the program counter and
+// the return addresses of the VM call stack every few instructions, and
+// aggregates the samples by source line through the compiler's LineTable.
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include "vm.cpp"
+#include "linetable.cpp"
+
+class Sampler {
+  const LineTable &lines;
+  std::map<std::vector<int32_t>, uint64_t> stacks; // Lines, outermost first
+  std::map<int32_t, uint64_t> self;                // Innermost line only
+  uint64_t samples = 0;
+
+  static const int MAX_DEPTH = 64;
+
+  static void pause(const VM *vm) {
+    ((Sampler *) vm->pause_data)->sample(*vm);
+  }
+
+  void sample(const VM &vm) {
+    std::vector<int32_t> stack;
+    stack.push_back(lines.lookup(vm.prog_counter));
+
+    // CALL leaves the caller's frame and return address below each frame
+    int32_t frame = vm.stack_frame;
+    while (frame >= 8 && frame <= vm.stack_end && (int) stack.size() < MAX_DEPTH) {
+      int32_t return_pc, saved_frame;
+      memcpy(&return_pc, vm.stack_base + frame - 4, 4);
+      memcpy(&saved_frame, vm.stack_base + frame - 8, 4);
+      if (return_pc <= 0 || saved_frame >= frame) break;
+      stack.push_back(lines.lookup(return_pc - 1));
+      frame = saved_frame;
+    }
+
+    self[stack.front()]++;
+    stacks[std::vector<int32_t>(stack.rbegin(), stack.rend())]++;
+    samples++;
+  }
+
+  static void printFrame(FILE *out, const char *source, int32_t line) {
+    if (line < 0) fprintf(out, "%s:?", source);
+    else fprintf(out, "%s:%d", source, line + 1);
+  }
+
+public:
+  explicit Sampler(const LineTable &lines) : lines(lines) {}
+
+  // Samples every `interval` instructions of the VM's next executions
+  void attach(VM &vm, int interval) {
+    vm.pause_fn = &Sampler::pause;
+    vm.pause_data = this;
+    vm.pause_interval = interval > 0 ? interval : 1;
+  }
+
+  uint64_t sampleCount() const {
+    return samples;
+  }
+
+  // Samples per line, 1-based like editors show them
+  void print(FILE *out, const char *source) const {
+    fprintf(out, "Samples: %llu\n", (unsigned long long) samples);
+    for (const std::pair<const int32_t, uint64_t> &line : self) {
+      fprintf(out, "  ");
+      printFrame(out, source, line.first);
+      fprintf(out, " %llu (%.1f%%)\n", (unsigned long long) line.second,
+        samples ? 100.0 * line.second / samples : 0.0);
+    }
+  }
+
+  // One "frame;frame;frame count" line per distinct stack, the input format
+  // of flamegraph.pl and most flame graph viewers
+  void writeFolded(FILE *out, const char *source) const {
+    for (const std::pair<const std::vector<int32_t>, uint64_t> &stack : stacks) {
+      for (size_t i = 0; i < stack.first.size(); ++i) {
+        if (i) fputc(';', out);
+        printFrame(out, source, stack.first[i]);
+      }
+      fprintf(out, " %llu\n", (unsigned long long) stack.second);
+    }
+  }
+};
+
+#endif // _SAMPLER_CPP_
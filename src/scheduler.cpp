@@ -0,0 +1,184 @@
+#ifndef _SCHEDULER_CPP_
+#define _SCHEDULER_CPP_
+
+// M:N scheduler for green threads. Every spawned script gets its own VM
+// (about 2.5KB) instead of an OS thread, and a few worker threads take turns
+// running them: a worker resumes a script for a slice of safe points (see
+// VM::resume()) and puts it back at the end of the run queue if it hasn't
+// finished, so tens of thousands of scripts can be in flight at once.
+//
+// Scripts belong to tenants. Workers take turns between tenants rather than
+// scripts, so a tenant with many scripts doesn't starve one with few, and a
+// tenant's fuel budget stops its runaway scripts (see VM::fuel).
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "program.cpp"
+#include "vm.cpp"
+
+struct TenantStats {
+  uint64_t fuel_used = 0;   // Across all its scripts, finished or not
+  uint64_t finished = 0;    // Scripts that returned
+  uint64_t out_of_fuel = 0; // Scripts stopped by the budget
+};
+
+class Scheduler {
+public:
+  // finish() sees the VM as the script left it. VM::out_of_fuel tells a
+  // script the budget stopped apart from one that returned
+  typedef std::function<void(VM &vm)> Callback;
+
+private:
+  struct Task {
+    VM vm;
+    ProgramRef program; // Keeps the bytecode alive while the task runs
+    Callback finish;
+    uint32_t tenant;
+  };
+
+  struct Tenant {
+    std::deque<Task *> ready;
+    int64_t budget = VM_FUEL_UNLIMITED; // Fuel every new script starts with
+    TenantStats stats;
+  };
+
+  std::vector<std::thread> workers;
+  int slice;
+
+  std::mutex lock; // Guards everything below
+  std::condition_variable ready, idle;
+  std::unordered_map<uint32_t, Tenant> tenants;
+  std::deque<uint32_t> rotation; // Tenants with ready scripts, each once
+  size_t live = 0; // Spawned and not finished
+  uint64_t resumes = 0;
+  bool stopping = false;
+
+  // Call with the lock held
+  void enqueue(Task *task) {
+    Tenant &tenant = tenants[task->tenant];
+    if (tenant.ready.empty()) rotation.push_back(task->tenant);
+    tenant.ready.push_back(task);
+  }
+
+  void work() {
+    for (;;) {
+      Task *task;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        ready.wait(guard, [&]() { return stopping || !rotation.empty(); });
+        if (stopping) return;
+
+        uint32_t id = rotation.front();
+        rotation.pop_front();
+        Tenant &tenant = tenants[id];
+        task = tenant.ready.front();
+        tenant.ready.pop_front();
+        if (!tenant.ready.empty()) rotation.push_back(id);
+        resumes++;
+      }
+
+      int64_t fuel = task->vm.fuel;
+      bool done = task->vm.resume(slice);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        TenantStats &stats = tenants[task->tenant].stats;
+        stats.fuel_used += fuel - task->vm.fuel;
+        if (!done && !task->vm.out_of_fuel) {
+          enqueue(task);
+          continue;
+        }
+        if (done) stats.finished++;
+        else stats.out_of_fuel++;
+      }
+
+      if (task->finish) task->finish(task->vm);
+      delete task;
+
+      std::lock_guard<std::mutex> guard(lock);
+      if (--live == 0) idle.notify_all();
+    }
+  }
+
+public:
+  // 0 threads means one per hardware thread. `slice` is how many safe
+  // points a script runs before it has to let the others have a turn
+  explicit Scheduler(int threads = 0, int slice = 64) : slice(slice > 0 ? slice : 1) {
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < threads; ++i) workers.emplace_back(&Scheduler::work, this);
+  }
+
+  // Stops the workers, scripts that haven't finished are dropped
+  ~Scheduler() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    ready.notify_all();
+    for (std::thread &worker : workers) worker.join();
+    for (std::pair<const uint32_t, Tenant> &tenant : tenants) {
+      for (Task *task : tenant.second.ready) delete task;
+    }
+  }
+
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+
+  // Queues a run of the program for a tenant. `prepare` is called right
+  // away on the caller's thread to set up the inputs, `finish` on a worker
+  // thread once the program returned or ran out of fuel. Safe to call from
+  // any thread, also from finish
+  void spawn(ProgramRef program, const Callback &prepare = nullptr, Callback finish = nullptr,
+             uint32_t tenant = 0) {
+    Task *task = new Task;
+    task->program = std::move(program);
+    task->finish = std::move(finish);
+    task->tenant = tenant;
+    task->vm.init();
+    task->program->attach(task->vm);
+    if (prepare) prepare(task->vm);
+    task->vm.start();
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      task->vm.fuel = tenants[tenant].budget;
+      live++;
+      enqueue(task);
+    }
+    ready.notify_one();
+  }
+
+  // Fuel each script of the tenant spawned from now on may spend
+  void setBudget(uint32_t tenant, int64_t fuel) {
+    std::lock_guard<std::mutex> guard(lock);
+    tenants[tenant].budget = fuel;
+  }
+
+  TenantStats tenantStats(uint32_t tenant) {
+    std::lock_guard<std::mutex> guard(lock);
+    return tenants[tenant].stats;
+  }
+
+  // Blocks until every spawned script has finished
+  void wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    idle.wait(guard, [&]() { return live == 0; });
+  }
+
+  size_t inFlight() {
+    std::lock_guard<std::mutex> guard(lock);
+    return live;
+  }
+
+  // Times a worker picked up a script
+  uint64_t resumeCount() {
+    std::lock_guard<std::mutex> guard(lock);
+    return resumes;
+  }
+};
+
+#endif // _SCHEDULER_CPP_
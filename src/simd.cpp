@@ -0,0 +1,160 @@
+#ifndef _SIMD_CPP_
+#define _SIMD_CPP_
+
+// Lane-wise kernels behind the vector opcodes. Included by vm.cpp.
+// A vector is 16 or 32 bytes of lanes of one primitive type. With GCC or
+// Clang the kernels are written with vector extensions, which compile to
+// SSE2 by default, to AVX/AVX2 with -mavx2 (or -march=native) and to scalar
+// code on targets without a vector unit. VM_NO_SIMD forces plain lane loops.
+
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(VM_NO_SIMD) && (defined(__GNUC__) || defined(__clang__))
+#define VM_SIMD
+#endif
+
+// Size of a vector register, the widest vector type
+#define VECTOR_MAX_SIZE 32
+
+#ifdef VM_SIMD
+template <class T, int size> struct VectorOf {
+  typedef T type __attribute__((vector_size(size)));
+};
+#endif
+
+// Kernels set a = a op b and work the same on vectors and on single lanes.
+// Comparisons are flagged so the lane loop can widen their result to a mask
+#define VECTOR_KERNEL(name, expr, is_compare) \
+struct name { \
+  static const bool compare = is_compare; \
+  template <class V> static void apply(V &a, const V &b) { a = (V) (expr); } \
+};
+
+VECTOR_KERNEL(VectorAdd    , a + b, false)
+VECTOR_KERNEL(VectorSub    , a - b, false)
+VECTOR_KERNEL(VectorMul    , a * b, false)
+VECTOR_KERNEL(VectorDiv    , a / b, false)
+VECTOR_KERNEL(VectorAnd    , a & b, false)
+VECTOR_KERNEL(VectorOr     , a | b, false)
+VECTOR_KERNEL(VectorXor    , a ^ b, false)
+VECTOR_KERNEL(VectorMin    , a < b ? a : b, false)
+VECTOR_KERNEL(VectorMax    , a > b ? a : b, false)
+VECTOR_KERNEL(VectorEqual  , a == b, true)
+VECTOR_KERNEL(VectorLess   , a < b , true)
+VECTOR_KERNEL(VectorGreater, a > b , true)
+
+#undef VECTOR_KERNEL
+
+// Bytes in a vector of `lanes` lanes of a primitive type, 0 if that isn't
+// a vector type
+static int vectorSize(byte type, int lanes) {
+  if (typeIndex(type) == PRIMITIVE_TYPE_COUNT) return 0;
+  int size = lanes * LOWER(type);
+  return size == 16 || size == VECTOR_MAX_SIZE ? size : 0;
+}
+
+// Copies a whole vector. The two fixed sizes keep memcpy inlined
+static inline void vectorCopy(void *dst, const void *src, int size) {
+  if (size == 16) memcpy(dst, src, 16);
+  else memcpy(dst, src, VECTOR_MAX_SIZE);
+}
+
+// a = a op b for every lane. T is the lane type and B the unsigned type of
+// the same width, comparisons set a lane to all ones where they hold
+template <class Op, class T, class B, int size> static inline void vectorApply(byte *a, const byte *b) {
+#ifdef VM_SIMD
+  // Without AVX, GCC lowers some 32-byte operations lane by lane, two SSE
+  // halves don't have that problem
+#ifndef __AVX__
+  if constexpr (size > 16) {
+    vectorApply<Op, T, B, 16>(a, b);
+    vectorApply<Op, T, B, 16>(a + 16, b + 16);
+    return;
+  }
+#endif
+  typedef typename VectorOf<T, size>::type V;
+  V x, y;
+  memcpy(&x, a, size);
+  memcpy(&y, b, size);
+  Op::apply(x, y);
+  memcpy(a, &x, size);
+#else
+  for (int i = 0; i < size; i += sizeof(T)) {
+    T x, y;
+    memcpy(&x, a + i, sizeof(T));
+    memcpy(&y, b + i, sizeof(T));
+    Op::apply(x, y);
+    if (Op::compare) {
+      B mask = x ? (B) ~(B) 0 : 0;
+      memcpy(a + i, &mask, sizeof(T));
+    } else {
+      memcpy(a + i, &x, sizeof(T));
+    }
+  }
+#endif
+}
+
+template <class B, int size> static inline void vectorNot(byte *a) {
+#ifdef VM_SIMD
+  typedef typename VectorOf<B, size>::type V;
+  V x;
+  memcpy(&x, a, size);
+  x = ~x;
+  memcpy(a, &x, size);
+#else
+  for (int i = 0; i < size; i += sizeof(B)) {
+    B x;
+    memcpy(&x, a + i, sizeof(B));
+    x = ~x;
+    memcpy(a + i, &x, sizeof(B));
+  }
+#endif
+}
+
+// Folds every lane into one with Op, halving the vector each step
+template <class Op, class T, int size> static inline T vectorReduce(const byte *a) {
+  if constexpr (size == sizeof(T)) {
+    T x;
+    memcpy(&x, a, sizeof(T));
+    return x;
+  } else {
+    byte half[size / 2];
+#ifdef VM_SIMD
+    typedef typename VectorOf<T, size / 2>::type V;
+    V low, high;
+    memcpy(&low, a, size / 2);
+    memcpy(&high, a + size / 2, size / 2);
+    Op::apply(low, high);
+    memcpy(half, &low, size / 2);
+#else
+    for (int i = 0; i < size / 2; i += sizeof(T)) {
+      T low, high;
+      memcpy(&low, a + i, sizeof(T));
+      memcpy(&high, a + size / 2 + i, sizeof(T));
+      Op::apply(low, high);
+      memcpy(half + i, &low, sizeof(T));
+    }
+#endif
+    return vectorReduce<Op, T, size / 2>(half);
+  }
+}
+
+// Sets every lane to value
+template <class T, int size> static inline void vectorSplat(byte *a, const byte *value) {
+  T lane;
+  memcpy(&lane, value, sizeof(T));
+  for (int i = 0; i < size; i += sizeof(T)) memcpy(a + i, &lane, sizeof(T));
+}
+
+// Lane i of a becomes lane indices[i] of a. Indices wrap at the lane count
+template <class T, int size> static inline void vectorShuffle(byte *a, const byte *indices) {
+  const int lanes = size / sizeof(T);
+  byte from[size];
+  memcpy(from, a, size);
+  for (int i = 0; i < lanes; ++i) {
+    memcpy(a + i * sizeof(T), from + (indices[i] & (lanes - 1)) * sizeof(T), sizeof(T));
+  }
+}
+
+#endif // _SIMD_CPP_
@@ -0,0 +1,702 @@
+#ifndef _SSA_CPP_
+#define _SSA_CPP_
+
+// SSA form for the optimizer behind Compiler::opt_level. compiler.cpp
+// builds it from the AST, the passes here rewrite it, and allocate() gives
+// every value a register or a stack slot before compiler.cpp lowers it to
+// register code.
+// Every instruction defines at most one value, named by its index in
+// SSAFunction::insts, and values are primitives or pointers (u64). Blocks
+// list their instructions with the phis first and a terminator last. The
+// language only branches forward, so the CFG has no cycles, and the builder
+// never makes critical edges: a block that branches has two successors with
+// one predecessor each.
+
+#include <algorithm>
+#include <set>
+#include <stdint.h>
+#include <stdio.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "fold.cpp"
+#include "vm.cpp"
+
+enum : byte {
+  SSA_CONST,  // value
+  SSA_TYPED,  // a, b - The typed `opcode` on `operand` values, comparisons give u8. NEG and NOT have no b
+  SSA_CONV,   // a - From the type of a to type
+  SSA_BNOT,   // a - u8 0 or 1
+  SSA_PHI,    // One argument per predecessor, in the same order
+  SSA_COPY,   // a
+  SSA_ADDR,   // Pointer to the stack slot at `slot`
+  SSA_LOAD,   // pointer
+  SSA_STORE,  // pointer, value
+  SSA_CALL,   // Arguments of the host function `opcode`
+  SSA_TRIG,   // a - FTRIG function `opcode`
+  SSA_PRINT,  // a
+  SSA_JMP,    // To succs[0]
+  SSA_BRANCH, // a - To succs[0] if a isn't zero, else to succs[1]
+  SSA_RETURN,
+};
+
+struct SSAInst {
+  byte op;
+  byte type = TYPE_NONE;    // Of the value, TYPE_NONE if it defines none
+  byte opcode = 0;          // See the ops
+  byte operand = TYPE_NONE; // SSA_TYPED: type of the arguments
+  bool removed = false;
+  int block = -1;
+  int line = -1;            // Source line, for the line table
+  int32_t slot = 0;         // SSA_ADDR
+  FoldedValue value;        // SSA_CONST
+  std::vector<int> args;
+};
+
+struct SSABlock {
+  std::vector<int> insts;
+  std::vector<int> preds, succs;
+  bool removed = false;
+};
+
+struct SSAStats {
+  int values = 0;   // Instructions built
+  int blocks = 0;
+  int folded = 0;   // Values SCCP found constant
+  int branches = 0; // Branches SCCP decided
+  int copies = 0;   // Copies and trivial phis propagated
+  int common = 0;   // Common subexpressions removed
+  int dead = 0;     // Instructions DCE removed
+  int spilled = 0;  // Values that didn't get a register
+  int frame = 0;    // Bytes of stack slots
+
+  void print(FILE *out) const {
+    fprintf(out, "SSA: %d values in %d blocks, %d folded, %d branches decided, %d copies, %d common, %d dead\n",
+      values, blocks, folded, branches, copies, common, dead);
+    fprintf(out, "  %d spilled, %d bytes of stack slots\n", spilled, frame);
+  }
+};
+
+// Registers the lowering uses as scratch space: two operands, a result
+// and a pointer. allocate() hands out the ones from SSA_SCRATCH up
+enum : byte { SSA_OPERAND_A, SSA_OPERAND_B, SSA_RESULT, SSA_POINTER, SSA_SCRATCH };
+
+// Whether an instruction has effects besides its value. Integer divisions
+// count unless the divisor is a constant they can't trap on
+static bool ssaHasEffects(const SSAInst &inst, const std::vector<SSAInst> &insts) {
+  switch (inst.op) {
+    case SSA_STORE:
+    case SSA_CALL:
+    case SSA_PRINT:
+    case SSA_JMP:
+    case SSA_BRANCH:
+    case SSA_RETURN:
+      return true;
+    case SSA_TYPED: {
+      if (inst.opcode != OPCODE_DIV || UPPER(inst.operand) == TYPE_FLOAT) return false;
+      const SSAInst &divisor = insts[inst.args[1]];
+      uint64_t out;
+      return divisor.op != SSA_CONST || !foldTyped(OPCODE_DIV, inst.operand, 0, divisor.value.bits, out);
+    }
+  }
+  return false;
+}
+
+class SSAFunction {
+  enum : byte { LATTICE_UNKNOWN, LATTICE_CONSTANT, LATTICE_VARYING };
+
+  struct Lattice {
+    byte state = LATTICE_UNKNOWN;
+    FoldedValue value;
+  };
+
+  // What makes two pure instructions compute the same value
+  struct Key {
+    byte op, opcode, type, operand;
+    int a, b;
+    uint64_t bits;
+
+    bool operator==(const Key &other) const {
+      return op == other.op && opcode == other.opcode && type == other.type && operand == other.operand &&
+        a == other.a && b == other.b && bits == other.bits;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      size_t hash = key.op | key.opcode << 8 | key.type << 16 | (size_t) key.operand << 24;
+      hash = hash * 31 + (size_t) key.a;
+      hash = hash * 31 + (size_t) key.b;
+      return hash * 31 + (size_t) (key.bits ^ (key.bits >> 32));
+    }
+  };
+
+  std::vector<std::vector<int>> users() const {
+    std::vector<std::vector<int>> out(insts.size());
+    for (int i = 0; i < (int) insts.size(); ++i) {
+      if (insts[i].removed) continue;
+      for (int arg : insts[i].args) out[arg].push_back(i);
+    }
+    return out;
+  }
+
+  void removeInst(int i) {
+    insts[i].removed = true;
+    insts[i].args.clear();
+  }
+
+  // Drops removed instructions from the block lists
+  void compact() {
+    for (SSABlock &block : blocks) {
+      block.insts.erase(std::remove_if(block.insts.begin(), block.insts.end(),
+        [&](int i) { return insts[i].removed; }), block.insts.end());
+    }
+  }
+
+  void removeEdge(int from, int to) {
+    std::vector<int> &preds = blocks[to].preds;
+    int index = std::find(preds.begin(), preds.end(), from) - preds.begin();
+    preds.erase(preds.begin() + index);
+    for (int i : blocks[to].insts) {
+      if (insts[i].op == SSA_PHI) insts[i].args.erase(insts[i].args.begin() + index);
+    }
+
+    std::vector<int> &succs = blocks[from].succs;
+    succs.erase(std::find(succs.begin(), succs.end(), to));
+  }
+
+  static bool sameConstant(const FoldedValue &a, const FoldedValue &b) {
+    if (a.type != b.type) return false;
+    uint64_t mask = foldMask(LOWER(a.type));
+    return (a.bits & mask) == (b.bits & mask);
+  }
+
+  // The lattice value of an instruction from those of its arguments
+  Lattice evaluate(int i, const std::vector<Lattice> &lattice, const std::vector<std::vector<bool>> &edges) const {
+    const SSAInst &inst = insts[i];
+    Lattice out;
+
+    if (inst.op == SSA_PHI) {
+      for (int p = 0; p < (int) inst.args.size(); ++p) {
+        const Lattice &arg = lattice[inst.args[p]];
+        if (!edges[inst.block][p] || arg.state == LATTICE_UNKNOWN) continue;
+        if (arg.state == LATTICE_VARYING || (out.state == LATTICE_CONSTANT && !sameConstant(out.value, arg.value))) {
+          out.state = LATTICE_VARYING;
+          return out;
+        }
+        out = arg;
+      }
+      return out;
+    }
+
+    switch (inst.op) {
+      case SSA_CONST:
+        out.state = LATTICE_CONSTANT;
+        out.value = inst.value;
+        return out;
+      case SSA_TYPED:
+      case SSA_CONV:
+      case SSA_BNOT:
+      case SSA_COPY:
+      case SSA_TRIG:
+        break;
+      default:
+        out.state = LATTICE_VARYING;
+        return out;
+    }
+
+    for (int arg : inst.args) {
+      if (lattice[arg].state == LATTICE_UNKNOWN) return out;
+      if (lattice[arg].state == LATTICE_VARYING) {
+        out.state = LATTICE_VARYING;
+        return out;
+      }
+    }
+
+    const FoldedValue &a = lattice[inst.args[0]].value;
+    out.state = LATTICE_CONSTANT;
+    out.value.type = inst.type;
+    switch (inst.op) {
+      case SSA_TYPED: {
+        uint64_t b = inst.args.size() > 1 ? lattice[inst.args[1]].value.bits : 0;
+        if (!foldTyped(inst.opcode, inst.operand, a.bits, b, out.value.bits)) out.state = LATTICE_VARYING;
+        break;
+      }
+      case SSA_CONV:
+        out.value = foldConvert(a, inst.type);
+        break;
+      case SSA_BNOT:
+        out.value.bits = !(byte) a.bits;
+        break;
+      case SSA_COPY:
+        out.value = a;
+        break;
+      case SSA_TRIG: {
+        // The same handler FTRIG would call
+        byte registers[16] = {};
+        memcpy(registers, &a.bits, 8);
+        trigFunction(inst.type, inst.opcode)(registers, nullptr);
+        memcpy(&out.value.bits, registers, 8);
+        break;
+      }
+    }
+    return out;
+  }
+
+public:
+  std::vector<SSAInst> insts;
+  std::vector<SSABlock> blocks; // The first one is the entry
+  int32_t frame = 0;            // Bytes of stack slots the builder handed out
+  SSAStats stats;
+
+  // Where allocate() put every value: a register, or -1 and a stack slot
+  std::vector<int> reg;
+  std::vector<int32_t> spill;
+
+  void clear() {
+    insts.clear();
+    blocks.clear();
+    frame = 0;
+    stats = SSAStats();
+  }
+
+  int newBlock() {
+    blocks.emplace_back();
+    stats.blocks++;
+    return blocks.size() - 1;
+  }
+
+  void edge(int from, int to) {
+    blocks[from].succs.push_back(to);
+    blocks[to].preds.push_back(from);
+  }
+
+  // Appends an instruction to a block, returns its value. Phis go after
+  // the other phis
+  int add(int block, SSAInst inst) {
+    inst.block = block;
+    insts.push_back(inst);
+    stats.values++;
+
+    int i = insts.size() - 1;
+    std::vector<int> &list = blocks[block].insts;
+    if (inst.op != SSA_PHI) {
+      list.push_back(i);
+    } else {
+      std::vector<int>::iterator at = list.begin();
+      while (at != list.end() && insts[*at].op == SSA_PHI) ++at;
+      list.insert(at, i);
+    }
+    return i;
+  }
+
+  // Reachable blocks in reverse postorder, a branch's first successor and
+  // what it dominates before the second one. Defs come before their uses
+  std::vector<int> layout() const {
+    std::vector<int> order;
+    std::vector<bool> seen(blocks.size());
+    std::vector<std::pair<int, int>> stack = {{0, 0}}; // Block, next successor
+    seen[0] = true;
+
+    while (!stack.empty()) {
+      std::pair<int, int> &top = stack.back();
+      const std::vector<int> &succs = blocks[top.first].succs;
+      if (top.second < (int) succs.size()) {
+        int succ = succs[succs.size() - 1 - top.second++];
+        if (!seen[succ]) {
+          seen[succ] = true;
+          stack.push_back({succ, 0});
+        }
+      } else {
+        order.push_back(top.first);
+        stack.pop_back();
+      }
+    }
+
+    std::reverse(order.begin(), order.end());
+    return order;
+  }
+
+  // Sparse conditional constant propagation (Wegman and Zadeck). Values
+  // start unknown and only move down to constant, then varying, and only
+  // instructions in blocks an executable edge reaches are evaluated. Then
+  // constants replace what computed them, decided branches become jumps
+  // and blocks that were never reached go
+  void propagateConstants() {
+    std::vector<std::vector<int>> uses = users();
+    std::vector<Lattice> lattice(insts.size());
+    std::vector<bool> reached(blocks.size());
+    std::vector<std::vector<bool>> edges(blocks.size());
+    for (int b = 0; b < (int) blocks.size(); ++b) edges[b].assign(blocks[b].preds.size(), false);
+
+    std::vector<std::pair<int, int>> flow = {{-1, 0}}; // Edges, from -1 for the entry
+    std::vector<int> changed;
+
+    auto visit = [&](int i) {
+      const SSAInst &inst = insts[i];
+      if (inst.op == SSA_JMP) {
+        flow.push_back({inst.block, blocks[inst.block].succs[0]});
+        return;
+      }
+      if (inst.op == SSA_BRANCH) {
+        const Lattice &cond = lattice[inst.args[0]];
+        const std::vector<int> &succs = blocks[inst.block].succs;
+        if (cond.state == LATTICE_VARYING || (cond.state == LATTICE_CONSTANT && (byte) cond.value.bits)) {
+          flow.push_back({inst.block, succs[0]});
+        }
+        if (cond.state == LATTICE_VARYING || (cond.state == LATTICE_CONSTANT && !(byte) cond.value.bits)) {
+          flow.push_back({inst.block, succs[1]});
+        }
+        return;
+      }
+
+      Lattice value = evaluate(i, lattice, edges);
+      Lattice &old = lattice[i];
+      if (old.state == LATTICE_CONSTANT && value.state == LATTICE_CONSTANT && !sameConstant(old.value, value.value)) {
+        value.state = LATTICE_VARYING;
+      }
+      if (value.state > old.state) {
+        old = value;
+        changed.push_back(i);
+      }
+    };
+
+    while (!flow.empty() || !changed.empty()) {
+      while (!flow.empty()) {
+        std::pair<int, int> next = flow.back();
+        flow.pop_back();
+
+        int to = next.second;
+        if (next.first >= 0) {
+          const std::vector<int> &preds = blocks[to].preds;
+          int index = std::find(preds.begin(), preds.end(), next.first) - preds.begin();
+          if (edges[to][index]) continue;
+          edges[to][index] = true;
+        }
+
+        if (!reached[to]) {
+          reached[to] = true;
+          for (int i : blocks[to].insts) visit(i);
+        } else {
+          for (int i : blocks[to].insts) {
+            if (insts[i].op == SSA_PHI) visit(i);
+          }
+        }
+      }
+
+      while (!changed.empty() && flow.empty()) {
+        int value = changed.back();
+        changed.pop_back();
+        for (int user : uses[value]) {
+          if (reached[insts[user].block]) visit(user);
+        }
+      }
+    }
+
+    for (int b = 0; b < (int) blocks.size(); ++b) {
+      if (reached[b] || blocks[b].removed) continue;
+      while (!blocks[b].succs.empty()) removeEdge(b, blocks[b].succs.back());
+      for (int i : blocks[b].insts) removeInst(i);
+      blocks[b].insts.clear();
+      blocks[b].removed = true;
+    }
+
+    for (int b = 0; b < (int) blocks.size(); ++b) {
+      if (!reached[b]) continue;
+      for (int i : blocks[b].insts) {
+        SSAInst &inst = insts[i];
+        if (inst.op == SSA_BRANCH && lattice[inst.args[0]].state == LATTICE_CONSTANT) {
+          int taken = (byte) lattice[inst.args[0]].value.bits ? 0 : 1;
+          removeEdge(b, blocks[b].succs[1 - taken]);
+          inst.op = SSA_JMP;
+          inst.args.clear();
+          stats.branches++;
+          continue;
+        }
+
+        if (inst.op == SSA_CONST || lattice[i].state != LATTICE_CONSTANT) continue;
+        inst.op = SSA_CONST;
+        inst.value = lattice[i].value;
+        inst.value.type = inst.type;
+        inst.args.clear();
+        stats.folded++;
+      }
+    }
+  }
+
+  // Uses of copies, and of phis that only ever get one value, become uses
+  // of that value. With no cycles one walk in layout order sees every def
+  // before its uses, except for phi arguments, which wait for the end
+  void propagateCopies() {
+    std::vector<int> forward(insts.size());
+    for (int i = 0; i < (int) insts.size(); ++i) forward[i] = i;
+    auto resolve = [&](int value) {
+      while (forward[value] != value) value = forward[value];
+      return value;
+    };
+
+    for (int b : layout()) {
+      for (int i : blocks[b].insts) {
+        SSAInst &inst = insts[i];
+        if (inst.op == SSA_PHI) continue;
+        for (int &arg : inst.args) arg = resolve(arg);
+        if (inst.op == SSA_COPY) {
+          forward[i] = inst.args[0];
+          removeInst(i);
+          stats.copies++;
+        }
+      }
+    }
+
+    for (int b : layout()) {
+      for (int i : blocks[b].insts) {
+        SSAInst &inst = insts[i];
+        if (inst.op != SSA_PHI) continue;
+        for (int &arg : inst.args) arg = resolve(arg);
+
+        bool trivial = !inst.args.empty() && std::all_of(inst.args.begin(), inst.args.end(),
+          [&](int arg) { return arg == inst.args[0]; });
+        if (trivial) {
+          forward[i] = inst.args[0];
+          removeInst(i);
+          stats.copies++;
+        }
+      }
+    }
+
+    // A trivial phi can feed a later block's instructions
+    for (SSAInst &inst : insts) {
+      for (int &arg : inst.args) arg = resolve(arg);
+    }
+    compact();
+  }
+
+  // Pure instructions that compute what one in a dominating block (or
+  // earlier in the same one) already did are replaced by it
+  void eliminateCommon() {
+    std::vector<int> order = layout();
+    std::vector<int> number(blocks.size(), -1);
+    for (int n = 0; n < (int) order.size(); ++n) number[order[n]] = n;
+
+    // Immediate dominators (Cooper, Harvey and Kennedy), one pass is
+    // enough without back edges
+    std::vector<int> idom(blocks.size(), -1);
+    idom[order[0]] = order[0];
+    for (int n = 1; n < (int) order.size(); ++n) {
+      int dom = -1;
+      for (int pred : blocks[order[n]].preds) {
+        if (idom[pred] < 0) continue;
+        if (dom < 0) {
+          dom = pred;
+          continue;
+        }
+        int other = pred;
+        while (dom != other) {
+          while (number[dom] > number[other]) dom = idom[dom];
+          while (number[other] > number[dom]) other = idom[other];
+        }
+      }
+      idom[order[n]] = dom;
+    }
+
+    std::vector<std::vector<int>> children(blocks.size());
+    for (int n = 1; n < (int) order.size(); ++n) children[idom[order[n]]].push_back(order[n]);
+
+    std::vector<int> forward(insts.size());
+    for (int i = 0; i < (int) insts.size(); ++i) forward[i] = i;
+
+    // Preorder over the dominator tree, what a block adds to the table is
+    // taken out again when the walk leaves it
+    std::unordered_map<Key, int, KeyHash> available;
+    std::vector<Key> added;
+    std::vector<std::pair<int, size_t>> stack = {{order[0], 0}}; // Block, where its keys start in `added`
+    std::vector<int> next_child(blocks.size(), 0);
+
+    auto enter = [&](int b) {
+      for (int i : blocks[b].insts) {
+        SSAInst &inst = insts[i];
+        if (inst.op == SSA_PHI) continue;
+        for (int &arg : inst.args) arg = forward[arg];
+
+        switch (inst.op) {
+          case SSA_CONST:
+          case SSA_TYPED:
+          case SSA_CONV:
+          case SSA_BNOT:
+          case SSA_ADDR:
+          case SSA_TRIG:
+            break;
+          default:
+            continue;
+        }
+
+        Key key = {inst.op, inst.opcode, inst.type, inst.operand,
+          inst.args.size() > 0 ? inst.args[0] : -1, inst.args.size() > 1 ? inst.args[1] : -1,
+          inst.op == SSA_CONST ? inst.value.bits & foldMask(LOWER(inst.type)) : (uint64_t) inst.slot};
+        std::unordered_map<Key, int, KeyHash>::const_iterator found = available.find(key);
+        if (found != available.end()) {
+          forward[i] = found->second;
+          removeInst(i);
+          stats.common++;
+        } else {
+          available.insert({key, i});
+          added.push_back(key);
+        }
+      }
+    };
+
+    enter(order[0]);
+    while (!stack.empty()) {
+      int b = stack.back().first;
+      if (next_child[b] < (int) children[b].size()) {
+        int child = children[b][next_child[b]++];
+        stack.push_back({child, added.size()});
+        enter(child);
+      } else {
+        for (size_t k = stack.back().second; k < added.size(); ++k) available.erase(added[k]);
+        added.resize(stack.back().second);
+        stack.pop_back();
+      }
+    }
+
+    for (SSAInst &inst : insts) {
+      for (int &arg : inst.args) arg = forward[arg];
+    }
+    compact();
+  }
+
+  // Removes every instruction nothing with an effect depends on
+  void eliminateDead() {
+    std::vector<bool> live(insts.size());
+    std::vector<int> work;
+    for (int i = 0; i < (int) insts.size(); ++i) {
+      if (!insts[i].removed && ssaHasEffects(insts[i], insts)) {
+        live[i] = true;
+        work.push_back(i);
+      }
+    }
+
+    while (!work.empty()) {
+      int i = work.back();
+      work.pop_back();
+      for (int arg : insts[i].args) {
+        if (live[arg]) continue;
+        live[arg] = true;
+        work.push_back(arg);
+      }
+    }
+
+    for (int i = 0; i < (int) insts.size(); ++i) {
+      if (insts[i].removed || live[i]) continue;
+      removeInst(i);
+      stats.dead++;
+    }
+    compact();
+  }
+
+  void optimize() {
+    propagateConstants();
+    propagateCopies();
+    eliminateCommon();
+    eliminateDead();
+  }
+
+  // Linear scan over `order`. Every value that is used and isn't a
+  // constant (those are loaded where they are used) gets a register from
+  // SSA_SCRATCH up, or a stack slot after the builder's ones when they run
+  // out. A phi is live from the end of its first predecessor, where the
+  // moves into it start, so it never shares a place with another phi's
+  // argument. Returns the bytes of stack the function needs
+  int32_t allocate(const std::vector<int> &order) {
+    std::vector<int> position(insts.size(), -1);
+    std::vector<int> block_end(blocks.size(), -1);
+    int at = 0;
+    for (int b : order) {
+      for (int i : blocks[b].insts) position[i] = at++;
+      block_end[b] = at - 1;
+    }
+
+    std::vector<int> start(insts.size(), -1), end(insts.size(), -1);
+    for (int b : order) {
+      for (int i : blocks[b].insts) {
+        const SSAInst &inst = insts[i];
+        start[i] = position[i];
+        if (inst.op == SSA_PHI) {
+          for (int pred : blocks[b].preds) start[i] = std::min(start[i], block_end[pred]);
+        }
+        for (int a = 0; a < (int) inst.args.size(); ++a) {
+          int use = inst.op == SSA_PHI ? block_end[blocks[b].preds[a]] : position[i];
+          end[inst.args[a]] = std::max(end[inst.args[a]], use);
+        }
+      }
+    }
+
+    std::vector<int> values;
+    for (int b : order) {
+      for (int i : blocks[b].insts) {
+        if (end[i] >= 0 && insts[i].op != SSA_CONST && insts[i].type != TYPE_NONE) values.push_back(i);
+      }
+    }
+    std::stable_sort(values.begin(), values.end(), [&](int a, int b) { return start[a] < start[b]; });
+
+    reg.assign(insts.size(), -1);
+    spill.assign(insts.size(), -1);
+
+    int32_t base = (frame + 7) & ~7;
+    int slots = 0;
+    std::vector<int> free_regs, free_slots;
+    for (int r = VM_REGISTER_COUNT - 1; r >= SSA_SCRATCH; --r) free_regs.push_back(r);
+    std::set<std::pair<int, int>> active, spilled; // End, value
+
+    // Slots are only reused by values that start where they get one, a
+    // value moved out of its register needs a fresh one
+    auto spillValue = [&](int value, bool fresh) {
+      int slot;
+      if (fresh || free_slots.empty()) {
+        slot = slots++;
+      } else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+      }
+      spill[value] = base + slot * 8;
+      spilled.insert({end[value], value});
+      stats.spilled++;
+    };
+
+    for (int value : values) {
+      while (!active.empty() && active.begin()->first < start[value]) {
+        free_regs.push_back(reg[active.begin()->second]);
+        active.erase(active.begin());
+      }
+      while (!spilled.empty() && spilled.begin()->first < start[value]) {
+        free_slots.push_back((spill[spilled.begin()->second] - base) / 8);
+        spilled.erase(spilled.begin());
+      }
+
+      if (!free_regs.empty()) {
+        reg[value] = free_regs.back();
+        free_regs.pop_back();
+        active.insert({end[value], value});
+        continue;
+      }
+
+      // Out of registers, the value that lives longest goes to the stack
+      std::set<std::pair<int, int>>::iterator last = std::prev(active.end());
+      if (last->first > end[value]) {
+        int victim = last->second;
+        reg[value] = reg[victim];
+        reg[victim] = -1;
+        active.erase(last);
+        active.insert({end[value], value});
+        spillValue(victim, true);
+      } else {
+        spillValue(value, false);
+      }
+    }
+
+    stats.frame = base + slots * 8;
+    return stats.frame;
+  }
+};
+
+#endif // _SSA_CPP_
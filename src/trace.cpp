@@ -0,0 +1,144 @@
+#ifndef _TRACE_CPP_
+#define _TRACE_CPP_
+
+// Binary execution trace. Included by vm.cpp after the opcode helpers.
+// Builds with VM_TRACE record one event per dispatched instruction into the
+// TraceBuffer set in VM::trace. Without VM_TRACE nothing is recorded and the
+// dispatch loops contain no trace code at all.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// One dispatched instruction, with the state it started from
+struct TraceEvent {
+  int32_t pc;
+  int32_t stack_end;
+  byte opcode;
+  byte operand_count;
+  byte operands[6]; // The longest instruction has 6 operand bytes
+  uint64_t left;
+  uint64_t right;
+};
+
+// The name vmops.cpp gives an opcode, "?" for opcodes the VM doesn't run
+static const char *opcodeName(byte opcode) {
+  switch (opcode) {
+    #define VM_OP(name, _code) case OPCODE_##name: return #name;
+    #include "vmops.cpp"
+    #undef VM_OP
+  }
+  return "?";
+}
+
+// Fixed-size ring of the most recent events. Nothing is allocated while
+// recording, older events are overwritten once the ring is full
+class TraceBuffer {
+  std::vector<TraceEvent> events;
+  uint64_t mask = 0;
+  uint64_t written = 0;
+  uint64_t dropped = 0; // Events a trace had lost before read() loaded it
+
+  // Trace files start with this, followed by the event size and count
+  static constexpr uint32_t MAGIC = 0x52544344; // "DCTR"
+
+public:
+  // The capacity is rounded up to a power of two
+  explicit TraceBuffer(size_t capacity = 1 << 16) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    events.resize(size);
+    mask = size - 1;
+  }
+
+  void record(int32_t pc, const byte *instructions, int instructions_size,
+              const byte *registers, int32_t stack_end) {
+    TraceEvent &event = events[written++ & mask];
+    event.pc = pc;
+    event.stack_end = stack_end;
+    event.opcode = instructions[pc];
+
+    int count = opcodeLength(event.opcode) - 1;
+    if (count < 0) count = 0;
+    if (count > (int) sizeof(event.operands)) count = sizeof(event.operands);
+    if (count > instructions_size - pc - 1) count = instructions_size - pc - 1;
+    event.operand_count = count;
+    memcpy(event.operands, instructions + pc + 1, count);
+
+    memcpy(&event.left, registers, 8);
+    memcpy(&event.right, registers + 8, 8);
+  }
+
+  void clear() {
+    written = 0;
+    dropped = 0;
+  }
+
+  // Events still held, oldest first
+  size_t size() const {
+    return written < events.size() ? written : events.size();
+  }
+
+  const TraceEvent &at(size_t index) const {
+    return events[(written - size() + index) & mask];
+  }
+
+  // Events recorded in total, including overwritten ones
+  uint64_t total() const {
+    return written + dropped;
+  }
+
+  bool write(FILE *file) const {
+    uint32_t header[2] = {MAGIC, sizeof(TraceEvent)};
+    uint64_t all = total(), count = size();
+    if (fwrite(header, sizeof(header), 1, file) != 1) return false;
+    if (fwrite(&all, sizeof(all), 1, file) != 1) return false;
+    if (fwrite(&count, sizeof(count), 1, file) != 1) return false;
+    for (size_t i = 0; i < count; ++i) {
+      if (fwrite(&at(i), sizeof(TraceEvent), 1, file) != 1) return false;
+    }
+    return true;
+  }
+
+  // Replaces the contents with a trace written by write()
+  bool read(FILE *file) {
+    uint32_t header[2];
+    uint64_t total, count;
+    if (fread(header, sizeof(header), 1, file) != 1) return false;
+    if (header[0] != MAGIC || header[1] != sizeof(TraceEvent)) return false;
+    if (fread(&total, sizeof(total), 1, file) != 1) return false;
+    if (fread(&count, sizeof(count), 1, file) != 1 || count > total) return false;
+
+    *this = TraceBuffer(count);
+    for (uint64_t i = 0; i < count; ++i) {
+      if (fread(&events[i], sizeof(TraceEvent), 1, file) != 1) return false;
+    }
+    written = count;
+    dropped = total - count;
+    return true;
+  }
+};
+
+// Prints a trace, one instruction per line
+static void decodeTrace(const TraceBuffer &trace, FILE *out) {
+  if (trace.total() > trace.size()) {
+    fprintf(out, "(%llu earlier events dropped)\n", (unsigned long long) (trace.total() - trace.size()));
+  }
+
+  for (size_t i = 0; i < trace.size(); ++i) {
+    const TraceEvent &event = trace.at(i);
+    fprintf(out, "%6d  %-16s", event.pc, opcodeName(event.opcode));
+    for (int j = 0; j < 6; ++j) {
+      if (j < event.operand_count) fprintf(out, " %02X", event.operands[j]);
+      else fprintf(out, "   ");
+    }
+    fprintf(out, "  left=%016llX right=%016llX stack=%d\n",
+      (unsigned long long) event.left,
+      (unsigned long long) event.right,
+      event.stack_end
+    );
+  }
+}
+
+#endif // _TRACE_CPP_
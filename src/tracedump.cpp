@@ -0,0 +1,28 @@
+// Offline decoder for trace files written by `main --trace <file>`.
+// Build with: g++ -std=c++17 -O2 src/tracedump.cpp -o tracedump
+
+#include "vm.cpp"
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: tracedump <trace file>\n");
+    return 2;
+  }
+
+  FILE *file = fopen(argv[1], "rb");
+  if (!file) {
+    printf("File could not be opened. Terminating...\n");
+    return 2;
+  }
+
+  TraceBuffer trace(0);
+  bool ok = trace.read(file);
+  fclose(file);
+  if (!ok) {
+    printf("Not a trace file, or one written by a different build\n");
+    return 1;
+  }
+
+  decodeTrace(trace, stdout);
+  return 0;
+}
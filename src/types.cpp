@@ -0,0 +1,184 @@
+#ifndef _TYPES_CPP_
+#define _TYPES_CPP_
+
+// Interned types. A type's shape (its name, template arguments and array
+// size) is interned once in `types`, and an ASTType is a 32-bit handle: the
+// shape's ID plus the ref and lock flags of that use. Everything the
+// compiler asks about a shape, whether it's a primitive, its type byte,
+// size, lanes or element type, is worked out when it is interned, so type
+// checks are integer compares and copying a type copies one word.
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "vm.cpp"
+
+typedef uint32_t TypeId;
+
+struct TypeInfo;
+
+struct ASTType {
+  uint32_t id : 30; // Shape, an index into types
+  uint32_t locked : 1;
+  uint32_t ref : 1;
+
+  ASTType() : id(0), locked(false), ref(false) {}
+
+  explicit ASTType(TypeId shape, bool lock = false, bool reference = false) :
+    id(shape),
+    locked(lock),
+    ref(reference)
+  {}
+
+  const TypeInfo &info() const;
+
+  // The handle as one word, for keys
+  uint32_t word() const {
+    return id << 2 | locked << 1 | ref;
+  }
+
+  // We don't care about lockiness, or references
+  bool operator==(const ASTType &other) const {
+    return id == other.id;
+  }
+
+  bool operator!=(const ASTType &other) const {
+    return !(*this == other);
+  }
+
+  void print() const;
+};
+
+static_assert(sizeof(ASTType) == sizeof(uint32_t), "ASTType is a handle");
+
+struct TypeInfo {
+  std::string name;
+  std::vector<ASTType> tempargs;
+  int arrsize = 0; // Not an array
+
+  byte prim = TYPE_NONE; // Primitive type byte, TYPE_NONE if it isn't one
+  int size = 0;          // Bytes of a value, 0 if not known
+  TypeId lane = 0;       // Vectors: the lanes' primitive type
+  int lanes = 0;         // Vectors: how many, 0 if it isn't one
+  TypeId element = 0;    // Arrays: the element type
+};
+
+class TypeTable {
+  std::vector<TypeInfo> infos;
+  std::unordered_map<std::string, TypeId> ids;
+  TypeId primitives[256] = {}; // By type byte, 0 until first asked for
+
+  // u8 ... f64, and the same odd names the old string checks took (f8)
+  static byte primitiveOf(const std::string &name) {
+    if (name.length() > 3 || name.length() < 2) return TYPE_NONE;
+
+    byte kind;
+    switch (name[0]) {
+      case 'u': kind = TYPE_UNSIGNED; break;
+      case 'i': kind = TYPE_SIGNED; break;
+      case 'f': kind = TYPE_FLOAT; break;
+      default: return TYPE_NONE;
+    }
+
+    std::string bits = name.substr(1);
+    if (bits == "8")  return MERGE(kind, FROM_SIZE(8));
+    if (bits == "16") return MERGE(kind, FROM_SIZE(16));
+    if (bits == "32") return MERGE(kind, FROM_SIZE(32));
+    if (bits == "64") return MERGE(kind, FROM_SIZE(64));
+    return TYPE_NONE;
+  }
+
+  // Vector types are named after their lanes, f32x4, u8x16, i64x4... and
+  // hold 16 or 32 bytes
+  void classifyVector(TypeInfo &info) {
+    size_t x = info.name.find('x');
+    if (x == std::string::npos || x + 1 >= info.name.length()) return;
+
+    std::string lane = info.name.substr(0, x), lanes = info.name.substr(x + 1);
+    byte prim = primitiveOf(lane);
+    if (prim == TYPE_NONE) return;
+    if (lanes.length() > 2 || lanes.find_first_not_of("0123456789") != std::string::npos) return;
+
+    int size = vectorSize(prim, std::stoi(lanes));
+    if (!size) return;
+    info.lane = intern(lane);
+    info.lanes = std::stoi(lanes);
+    info.size = size;
+  }
+
+public:
+  TypeTable() {
+    intern(""); // 0, what a default ASTType refers to
+  }
+
+  TypeId intern(const std::string &name, const std::vector<ASTType> &tempargs = {}, int arrsize = 0) {
+    std::string key = name + '#' + std::to_string(arrsize);
+    for (const ASTType &arg : tempargs) key += ',' + std::to_string(arg.word());
+
+    std::unordered_map<std::string, TypeId>::const_iterator found = ids.find(key);
+    if (found != ids.end()) return found->second;
+
+    TypeInfo info;
+    info.name = name;
+    info.tempargs = tempargs;
+    info.arrsize = arrsize;
+
+    if (arrsize > 0) {
+      info.element = intern(name, tempargs);
+      info.size = infos[info.element].size * arrsize;
+    } else if (tempargs.empty()) {
+      info.prim = primitiveOf(name);
+      if (info.prim != TYPE_NONE) info.size = LOWER(info.prim);
+      else classifyVector(info);
+    }
+
+    TypeId id = infos.size();
+    infos.push_back(info);
+    ids.emplace(key, id);
+    return id;
+  }
+
+  // The primitive type of a type byte
+  TypeId primitive(byte type) {
+    if (primitives[type]) return primitives[type];
+    char kind = UPPER(type) == TYPE_UNSIGNED ? 'u' : UPPER(type) == TYPE_SIGNED ? 'i' : 'f';
+    return primitives[type] = intern(std::string(1, kind) + std::to_string(LOWER(type) * 8));
+  }
+
+  // The vector type of `lanes` lanes of a primitive type byte
+  TypeId vector(byte lane, int lanes) {
+    return intern(infos[primitive(lane)].name + "x" + std::to_string(lanes));
+  }
+
+  const TypeInfo &get(TypeId id) const {
+    return infos[id];
+  }
+};
+
+static TypeTable types;
+
+inline const TypeInfo &ASTType::info() const {
+  return types.get(id);
+}
+
+inline void ASTType::print() const {
+  const TypeInfo &type = info();
+  if (ref)    printf("ref ");
+  if (locked) printf("lock ");
+  printf("%s", type.name.c_str());
+  if (!type.tempargs.empty()) {
+    printf("<");
+    for (size_t i = 0; i < type.tempargs.size() - 1; ++i) {
+      type.tempargs[i].print();
+      printf(", ");
+    }
+    type.tempargs.back().print();
+    printf(">");
+  }
+  if (type.arrsize > 0) {
+    printf("[%d]", type.arrsize);
+  }
+}
+
+#endif // _TYPES_CPP_
@@ -0,0 +1,285 @@
+#ifndef _VERIFY_CPP_
+#define _VERIFY_CPP_
+
+// Load-time bytecode verifier. Code it accepts may run with VM::unchecked
+// set, which drops the per-instruction bounds checks of the interpreter.
+//
+// What is proven: every reachable instruction is one the VM implements and
+// fits in the code, jumps and calls land on instruction boundaries, constant
+// operands stay inside the buffer, register operands stay inside their
+// registers, vector operands name a vector type, conversions name primitive
+// types, bulk memory counts aren't negative and fills are 1, 2, 4 or 8 bytes
+// wide, SPECCALL and FTRIG name a bound host function and a trig function,
+// control never runs off the end of the code and the stack depth is the same
+// on every path to an instruction, never negative and never above
+// MAX_STACK_SIZE. Pointers used by LOAD, STORE, VLOAD, VSTORE and the bulk
+// memory instructions are runtime values and remain the program's
+// responsibility, as does the return address a RETURN pops. Host functions
+// have to stay bound while verified code that calls them runs.
+
+#include <stdint.h>
+#include <vector>
+#include "vm.cpp"
+
+struct VerifyReport {
+  int max_stack = 0;      // Deepest the stack gets, in bytes
+  int error_pc = -1;      // Offending instruction if verification failed
+  const char *error = nullptr;
+};
+
+// True for every opcode vmops.cpp has a body for
+static bool implementedOpcode(byte opcode) {
+  static bool implemented[256];
+  static bool ready = false;
+  if (!ready) {
+    static const byte ops[] = {
+      #define VM_OP(name, _code) OPCODE_##name,
+      #include "vmops.cpp"
+      #undef VM_OP
+    };
+    for (byte op : ops) implemented[op] = true;
+    ready = true;
+  }
+  return implemented[opcode];
+}
+
+// Stack depth on entry to an instruction and of the frame it belongs to.
+// Frames start where CALL (or VM::execute) pushed the return address
+struct StackState {
+  int depth = -1;
+  int frame = -1;
+};
+
+class Verifier {
+
+  const byte *code;
+  int code_size;
+  int size;
+  std::vector<bool> starts;
+  std::vector<StackState> states;
+  std::vector<int> work;
+
+public:
+  VerifyReport report;
+
+private:
+  bool fail(int pc, const char *error) {
+    report.error_pc = pc;
+    report.error = error;
+    return false;
+  }
+
+  template <class T> T operand(int pc, int offset) const {
+    T value;
+    memcpy(&value, code + pc + offset, sizeof(T));
+    return value;
+  }
+
+  bool constantInRange(int pc, int32_t pos, int bytes) {
+    if (bytes < 1 || bytes > 8) return fail(pc, "Constant size out of range");
+    if (pos < 0 || pos + bytes > size) return fail(pc, "Constant offset out of range");
+    return true;
+  }
+
+  // Merges a state into the one already known for pc
+  bool reach(int from, int pc, int depth, int frame) {
+    if (pc < 0 || pc >= code_size || !starts[pc]) return fail(from, "Control flow leaves the instructions");
+    if (depth < 0) return fail(from, "Stack underflow");
+    if (depth > MAX_STACK_SIZE) return fail(from, "Stack overflow");
+    if (depth > report.max_stack) report.max_stack = depth;
+
+    StackState &state = states[pc];
+    if (state.depth < 0) {
+      state.depth = depth;
+      state.frame = frame;
+      work.push_back(pc);
+      return true;
+    }
+    if (state.depth != depth || state.frame != frame) return fail(from, "Stack depth differs between paths");
+    return true;
+  }
+
+  // Follows one instruction to its successors
+  bool step(int pc) {
+    int depth = states[pc].depth;
+    int frame = states[pc].frame;
+    byte opcode = code[pc];
+    int next = pc + opcodeLength(opcode);
+
+    switch (opcode) {
+      case OPCODE_LOADC:
+      case OPCODE_LOADC_SWAP:
+        if (!constantInRange(pc, operand<int32_t>(pc, 2), code[pc + 1])) return false;
+        break;
+      case OPCODE_R_LOADC:
+        if (!constantInRange(pc, operand<int32_t>(pc, 3), code[pc + 2])) return false;
+        break;
+
+      case OPCODE_LOAD:
+        if (code[pc + 1] > 16) return fail(pc, "Load size out of range");
+        break;
+      case OPCODE_STORE:
+        if (code[pc + 1] > 8) return fail(pc, "Store size out of range");
+        break;
+      case OPCODE_R_LOAD:
+      case OPCODE_R_STORE:
+        if (code[pc + 3] > 8) return fail(pc, "Register size out of range");
+        break;
+
+      case OPCODE_CONV:
+      case OPCODE_R_CONV: {
+        int at = opcode == OPCODE_CONV ? 1 : 2;
+        if (conversionFor(code[pc + at], code[pc + at + 1]) == convertInvalid) {
+          return fail(pc, "Invalid conversion type");
+        }
+        break;
+      }
+
+      case OPCODE_PUSH:
+      case OPCODE_POP:
+      case OPCODE_SWAP_POP_STORE: {
+        byte reg = code[pc + 1];
+        if (UPPER(reg) + LOWER(reg) > 16) return fail(pc, "Register operand out of range");
+        if (opcode == OPCODE_SWAP_POP_STORE && code[pc + 2] > 8) return fail(pc, "Store size out of range");
+        depth += opcode == OPCODE_PUSH ? LOWER(reg) : -LOWER(reg);
+        break;
+      }
+      case OPCODE_R_PUSH:
+      case OPCODE_R_POP:
+        if (code[pc + 2] > 8) return fail(pc, "Register size out of range");
+        depth += opcode == OPCODE_R_PUSH ? code[pc + 2] : -code[pc + 2];
+        break;
+
+      case OPCODE_VLOAD:
+      case OPCODE_VSTORE:
+      case OPCODE_VSPLAT:
+      case OPCODE_VPUSH:
+      case OPCODE_VPOP:
+      case OPCODE_VNOT:
+      case OPCODE_VSHUF:
+      case OPCODE_VEXTRACT:
+      #define VECTOR_CASE(name, ...) case OPCODE_##name:
+      VECTOR_OPCODES(VECTOR_CASE)
+      VECTOR_REDUCTIONS(VECTOR_CASE)
+      #undef VECTOR_CASE
+      {
+        byte lanes = code[pc + 2];
+        int bytes = vectorSize(code[pc + 1], lanes);
+        if (!bytes) return fail(pc, "Invalid vector type");
+        if (opcode == OPCODE_VPUSH) depth += bytes;
+        if (opcode == OPCODE_VPOP) depth -= bytes;
+        if (opcode == OPCODE_VSHUF) {
+          int32_t pos = operand<int32_t>(pc, 3);
+          if (pos < 0 || pos + lanes > size) return fail(pc, "Constant offset out of range");
+        }
+        break;
+      }
+
+      case OPCODE_SPECCALL: {
+        const NativeFunction &native = natives.get(code[pc + 1]);
+        if (!native.call) return fail(pc, "No host function bound to the id");
+        depth -= native.stack;
+        break;
+      }
+      case OPCODE_FTRIG:
+        if (!trigFunction(code[pc + 1], code[pc + 2])) return fail(pc, "Invalid trig function");
+        break;
+
+      case OPCODE_CPY:
+      case OPCODE_MCMP:
+        if (operand<int32_t>(pc, 1) < 0) return fail(pc, "Negative byte count");
+        break;
+      case OPCODE_FILL: {
+        byte width = code[pc + 1];
+        if (width == 0 || width > 8 || (width & (width - 1))) return fail(pc, "Fill width out of range");
+        if (operand<int32_t>(pc, 2) < 0) return fail(pc, "Negative byte count");
+        break;
+      }
+
+      case OPCODE_RESERVE:
+      case OPCODE_RELEASE: {
+        int16_t amount = operand<int16_t>(pc, 1);
+        if (amount < 0) return fail(pc, "Negative stack adjustment");
+        depth += opcode == OPCODE_RESERVE ? amount : -amount;
+        break;
+      }
+
+      case OPCODE_CALL: {
+        // The callee is checked in a frame of its own and has to return
+        // with that frame balanced, so the caller just continues afterwards
+        if (!reach(pc, operand<int32_t>(pc, 1), depth + 8, depth + 8)) return false;
+        break;
+      }
+
+      case OPCODE_RETURN:
+        if (depth != frame) return fail(pc, "Stack not balanced at return");
+        return true;
+
+      case OPCODE_JMP: {
+        int32_t target = operand<int32_t>(pc, 1);
+        return target < 0 || reach(pc, target, depth, frame);
+      }
+    }
+
+    int jump = jumpOperand(opcode);
+    if (jump && opcode != OPCODE_CALL) {
+      int32_t target = operand<int32_t>(pc, jump);
+      if (target >= 0 && !reach(pc, target, depth, frame)) return false;
+    }
+
+    if (next >= code_size) return fail(pc, "Control flow runs off the end of the code");
+    return reach(pc, next, depth, frame);
+  }
+
+public:
+  Verifier(const byte *code, int code_size, int size)
+    : code(code), code_size(code_size), size(size) {}
+
+  bool run() {
+    if (code_size <= 0 || code_size > size) return fail(0, "Invalid code size");
+
+    // Decode linearly first so jumps can be checked against boundaries
+    starts.assign(code_size, false);
+    states.assign(code_size, StackState());
+    for (int pc = 0; pc < code_size;) {
+      int length = opcodeLength(code[pc]);
+      if (length == 0 || !implementedOpcode(code[pc])) return fail(pc, "Invalid instruction");
+      if (pc + length > code_size) return fail(pc, "Truncated instruction");
+      starts[pc] = true;
+      pc += length;
+    }
+
+    // VM::execute() pushes the frame and return address before starting
+    if (!reach(0, 0, 8, 8)) return false;
+    while (!work.empty()) {
+      int pc = work.back();
+      work.pop_back();
+      if (!step(pc)) return false;
+    }
+    return true;
+  }
+
+  // Per instruction start, after run() succeeded
+  const std::vector<StackState> &stackStates() const {
+    return states;
+  }
+};
+
+// Checks code_size bytes of instructions followed by constants up to size.
+// Prints nothing, the reason for a failure is left in the report
+static bool verifyBytecode(const byte *code, int code_size, int size, VerifyReport &report) {
+  Verifier verifier(code, code_size, size);
+  bool ok = verifier.run();
+  report = verifier.report;
+  return ok;
+}
+
+// The stack state on entry to every instruction, empty if the code doesn't
+// verify. Unreachable instructions and other offsets have depth -1
+static std::vector<StackState> stackStates(const byte *code, int code_size, int size) {
+  Verifier verifier(code, code_size, size);
+  if (!verifier.run()) return {};
+  return verifier.stackStates();
+}
+
+#endif // _VERIFY_CPP_
@@ -5,10 +5,19 @@
 #define MAX_STACK_SIZE 256
 #endif
 
+// Register operands are a single byte, so the file always has 256 entries
+#define VM_REGISTER_COUNT 256
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <initializer_list>
+#include <utility>
+
+#if !defined(VM_NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define VM_COMPUTED_GOTO
+#endif
 
 #define SWITCH_CASE(_case, _code) \
 case _case: \
@@ -29,6 +38,62 @@ case _case: \
 
 typedef unsigned char byte;
 
+// Every primitive the typed opcodes accept, in type index order:
+// X(suffix, type byte, value type, bitwise type, ...)
+#define PRIMITIVE_TYPES(X, ...) \
+  X(U8 , MERGE(TYPE_UNSIGNED, FROM_SIZE(8)) , uint8_t , uint8_t , __VA_ARGS__) \
+  X(U16, MERGE(TYPE_UNSIGNED, FROM_SIZE(16)), uint16_t, uint16_t, __VA_ARGS__) \
+  X(U32, MERGE(TYPE_UNSIGNED, FROM_SIZE(32)), uint32_t, uint32_t, __VA_ARGS__) \
+  X(U64, MERGE(TYPE_UNSIGNED, FROM_SIZE(64)), uint64_t, uint64_t, __VA_ARGS__) \
+  X(I8 , MERGE(TYPE_SIGNED  , FROM_SIZE(8)) ,  int8_t , uint8_t , __VA_ARGS__) \
+  X(I16, MERGE(TYPE_SIGNED  , FROM_SIZE(16)),  int16_t, uint16_t, __VA_ARGS__) \
+  X(I32, MERGE(TYPE_SIGNED  , FROM_SIZE(32)),  int32_t, uint32_t, __VA_ARGS__) \
+  X(I64, MERGE(TYPE_SIGNED  , FROM_SIZE(64)),  int64_t, uint64_t, __VA_ARGS__) \
+  X(F32, MERGE(TYPE_FLOAT   , FROM_SIZE(32)), float   , uint32_t, __VA_ARGS__) \
+  X(F64, MERGE(TYPE_FLOAT   , FROM_SIZE(64)), double  , uint64_t, __VA_ARGS__)
+
+#define PRIMITIVE_TYPE_COUNT 10
+
+// Every opcode that reads a type byte and can be quickened:
+// X(name, operator, APPLY_OP kind, VALUE_/BITS_TYPE, ...)
+#define TYPED_OPCODES(X, ...) \
+  X(ADD , + , B, VALUE_TYPE, __VA_ARGS__) \
+  X(SUB , - , B, VALUE_TYPE, __VA_ARGS__) \
+  X(MUL , * , B, VALUE_TYPE, __VA_ARGS__) \
+  X(DIV , / , B, VALUE_TYPE, __VA_ARGS__) \
+  X(NEG , - , U, VALUE_TYPE, __VA_ARGS__) \
+  X(CMPE, ==, C, VALUE_TYPE, __VA_ARGS__) \
+  X(CMPL, < , C, VALUE_TYPE, __VA_ARGS__) \
+  X(CMPG, > , C, VALUE_TYPE, __VA_ARGS__) \
+  X(XOR , ^ , B, BITS_TYPE , __VA_ARGS__) \
+  X(AND , & , B, BITS_TYPE , __VA_ARGS__) \
+  X(OR  , | , B, BITS_TYPE , __VA_ARGS__) \
+  X(NOT , ~ , U, BITS_TYPE , __VA_ARGS__)
+
+#define VALUE_TYPE(value, bits) value
+#define BITS_TYPE(value, bits) bits
+
+// Lane-wise vector opcodes, vleft = vleft op vright:
+// X(name, kernel in simd.cpp, VALUE_/BITS_TYPE, ...)
+#define VECTOR_OPCODES(X, ...) \
+  X(VADD , VectorAdd    , VALUE_TYPE, __VA_ARGS__) \
+  X(VSUB , VectorSub    , VALUE_TYPE, __VA_ARGS__) \
+  X(VMUL , VectorMul    , VALUE_TYPE, __VA_ARGS__) \
+  X(VDIV , VectorDiv    , VALUE_TYPE, __VA_ARGS__) \
+  X(VCMPE, VectorEqual  , VALUE_TYPE, __VA_ARGS__) \
+  X(VCMPL, VectorLess   , VALUE_TYPE, __VA_ARGS__) \
+  X(VCMPG, VectorGreater, VALUE_TYPE, __VA_ARGS__) \
+  X(VAND , VectorAnd    , BITS_TYPE , __VA_ARGS__) \
+  X(VOR  , VectorOr     , BITS_TYPE , __VA_ARGS__) \
+  X(VXOR , VectorXor    , BITS_TYPE , __VA_ARGS__)
+
+// Horizontal reductions, left = vleft folded with the kernel:
+// X(name, kernel in simd.cpp, ...)
+#define VECTOR_REDUCTIONS(X, ...) \
+  X(VSUM, VectorAdd, __VA_ARGS__) \
+  X(VMIN, VectorMin, __VA_ARGS__) \
+  X(VMAX, VectorMax, __VA_ARGS__)
+
 enum : byte { // If no register is specified, assume left
   //OPCODE_NULL,
 
@@ -41,7 +106,7 @@ enum : byte { // If no register is specified, assume left
   OPCODE_STORE, // 5 - Indirect store to the pointer in the register
   OPCODE_LOAD, // 6 - Indirect load from the pointer in the register
   OPCODE_LOADC,  // 7 - Load a constant
-  OPCODE_CPY, // 8 - Moves data from the right pointer to the left pointer
+  OPCODE_CPY, // 8 - count - Moves count bytes from the right pointer to the left pointer
   
   OPCODE_SWAP, // 8 - Swaps the registers
   
@@ -70,7 +135,7 @@ enum : byte { // If no register is specified, assume left
   // Float-specific arithmetic
   OPCODE_FFLOOR, // 25
   OPCODE_FCEIL, // 26
-  OPCODE_FTRIG, // 27 - Like SPECCALL, but for trig functions
+  OPCODE_FTRIG, // 27 - type, function - Left = a trig function of left, see native.cpp
   
   // The following expect a size parameter
   OPCODE_AND, // 28 - Bitwise AND
@@ -83,9 +148,69 @@ enum : byte { // If no register is specified, assume left
   OPCODE_BOR, // 33
   OPCODE_BNOT, // 34
   
-  OPCODE_SPECCALL, // 35 - Call a VM function of given ID
+  OPCODE_SPECCALL, // 35 - id - Call the host function bound to id, see native.cpp
   OPCODE_PRINT, // 36 - Prints register content. NOTE: Remove this later
 
+  // Type-specialized forms of the typed opcodes (OPCODE_ADD_U8, ...).
+  // They keep the type byte, so quickening never moves an instruction
+  #define QUICK_OPCODE(suffix, tbyte, value, bits, name) OPCODE_##name##_##suffix,
+  #define QUICK_OPCODES(name, op, ub, sel, ...) PRIMITIVE_TYPES(QUICK_OPCODE, name)
+  TYPED_OPCODES(QUICK_OPCODES)
+  #undef QUICK_OPCODES
+  #undef QUICK_OPCODE
+
+  // Register-file opcodes. Register operands are one byte indexes into
+  // VM::register_file, so every byte names a valid register
+  OPCODE_R_LOADC, // dst, size, pos - Load a constant
+  OPCODE_R_MOV,   // dst, src
+  OPCODE_R_SPP,   // dst, index - Pointer to stack data
+  OPCODE_R_FPP,   // dst, index - Pointer to stack frame data
+  OPCODE_R_LOAD,  // dst, ptr, size - Indirect load through a register
+  OPCODE_R_STORE, // ptr, src, size - Indirect store through a register
+  OPCODE_R_PUSH,  // src, size
+  OPCODE_R_POP,   // dst, size
+  OPCODE_R_GET,   // src - Copies a register into left
+  OPCODE_R_SET,   // dst - Copies left into a register
+  OPCODE_R_CONV,  // dst, from, to
+  OPCODE_R_BNOT,  // dst, src
+
+  // Three-address forms of the typed opcodes: dst, a, b, type.
+  // The unary ones (NEG, NOT) ignore b
+  #define REGISTER_OPCODE(name, ...) OPCODE_R_##name,
+  TYPED_OPCODES(REGISTER_OPCODE)
+  #undef REGISTER_OPCODE
+
+  // Superinstructions, produced by the fusion pass in rewrite.cpp
+  OPCODE_SPP_LOAD,       // index, size - SPP then LOAD
+  OPCODE_FPP_LOAD,       // index, size - FPP then LOAD
+  OPCODE_LOADC_SWAP,     // size, pos - LOADC then SWAP, the constant ends up in right
+  OPCODE_CMPE_JMPZ,      // type, pos - CMPE then JMPZ
+  OPCODE_CMPL_JMPZ,      // type, pos - CMPL then JMPZ
+  OPCODE_CMPG_JMPZ,      // type, pos - CMPG then JMPZ
+  OPCODE_SWAP_POP_STORE, // reg, size - SWAP, POP reg, then STORE size
+
+  // Vector instructions, on VM::vregisters. All but VSWAP start with the
+  // lane type and the lane count, which make up 16 or 32 bytes
+  OPCODE_VLOAD,    // type, lanes - Load vleft from the pointer in left
+  OPCODE_VSTORE,   // type, lanes - Store vleft to the pointer in left
+  OPCODE_VSPLAT,   // type, lanes - Every lane of vleft = left
+  OPCODE_VSWAP,    // Swaps vleft and vright
+  OPCODE_VPUSH,    // type, lanes - Pushes vleft
+  OPCODE_VPOP,     // type, lanes - Pops vleft
+  OPCODE_VNOT,     // type, lanes - Inverts the bits of vleft
+  OPCODE_VSHUF,    // type, lanes, pos - Lane i of vleft = lane pos[i], one index byte per lane
+  OPCODE_VEXTRACT, // type, lanes, lane - left = a lane of vleft
+
+  #define VECTOR_OPCODE(name, ...) OPCODE_##name,
+  VECTOR_OPCODES(VECTOR_OPCODE)
+  VECTOR_REDUCTIONS(VECTOR_OPCODE)
+  #undef VECTOR_OPCODE
+
+  // Bulk memory instructions besides CPY, see bulk.cpp. Counts are int32
+  // byte counts
+  OPCODE_FILL, // width, count - Repeats the low width bytes of right over count bytes at the left pointer
+  OPCODE_MCMP, // count - Left = -1, 0 or 1 as count bytes at the left pointer order against the right's
+
   REG_LEFT  = 0x00,
   REG_RIGHT = 0x08,
   
@@ -112,297 +237,446 @@ enum : byte { // If no register is specified, assume left
 template<class T> constexpr T max(T a, T b) { return a > b ? a : b; }
 template<class T> constexpr T min(T a, T b) { return a < b ? a : b; }
 
+// Position of a type byte in PRIMITIVE_TYPES, or PRIMITIVE_TYPE_COUNT
+static byte typeIndex(byte type) {
+  static const byte types[PRIMITIVE_TYPE_COUNT] = {
+    #define TYPE_BYTE(suffix, tbyte, ...) tbyte,
+    PRIMITIVE_TYPES(TYPE_BYTE)
+    #undef TYPE_BYTE
+  };
+
+  for (byte i = 0; i < PRIMITIVE_TYPE_COUNT; ++i) {
+    if (types[i] == type) return i;
+  }
+  return PRIMITIVE_TYPE_COUNT;
+}
+
+// Suffix of a typeIndex() result, "?" for PRIMITIVE_TYPE_COUNT
+static const char *typeName(byte index) {
+  static const char *names[PRIMITIVE_TYPE_COUNT + 1] = {
+    #define TYPE_NAME(suffix, ...) #suffix,
+    PRIMITIVE_TYPES(TYPE_NAME)
+    #undef TYPE_NAME
+    "?"
+  };
+  return names[min<byte>(index, PRIMITIVE_TYPE_COUNT)];
+}
+
+// The type-specialized form of a typed opcode, or the opcode itself
+static byte quickOpcode(byte opcode, byte type) {
+  byte index = typeIndex(type);
+  if (index == PRIMITIVE_TYPE_COUNT) return opcode;
+
+  switch (opcode) {
+    #define QUICK_CASE(name, ...) case OPCODE_##name: return OPCODE_##name##_U8 + index;
+    TYPED_OPCODES(QUICK_CASE)
+    #undef QUICK_CASE
+  }
+  return opcode;
+}
+
+// The generic form of a quickened opcode, or the opcode itself
+static byte genericOpcode(byte opcode) {
+  static const byte generic[] = {
+    #define GENERIC_OPCODE(name, ...) OPCODE_##name,
+    TYPED_OPCODES(GENERIC_OPCODE)
+    #undef GENERIC_OPCODE
+  };
+
+  if (opcode < OPCODE_ADD_U8 || opcode > OPCODE_NOT_F64) return opcode;
+  return generic[(opcode - OPCODE_ADD_U8) / PRIMITIVE_TYPE_COUNT];
+}
+
+// The three-address form of a typed opcode, or the opcode itself
+static byte registerOpcode(byte opcode) {
+  switch (opcode) {
+    #define REGISTER_CASE(name, ...) case OPCODE_##name: return OPCODE_R_##name;
+    TYPED_OPCODES(REGISTER_CASE)
+    #undef REGISTER_CASE
+  }
+  return opcode;
+}
+
+// Total length of an instruction including its operands, 0 if unknown
+static int opcodeLength(byte opcode) {
+  switch (opcode) {
+    case OPCODE_RETURN:
+    case OPCODE_SWAP:
+    case OPCODE_BAND:
+    case OPCODE_BOR:
+    case OPCODE_BNOT:
+    case OPCODE_PRINT:
+    case OPCODE_VSWAP:
+      return 1;
+    case OPCODE_R_GET:
+    case OPCODE_R_SET:
+    case OPCODE_SPECCALL:
+      return 2;
+    case OPCODE_R_MOV:
+    case OPCODE_R_PUSH:
+    case OPCODE_R_POP:
+    case OPCODE_R_BNOT:
+      return 3;
+    case OPCODE_R_LOAD:
+    case OPCODE_R_STORE:
+    case OPCODE_R_CONV:
+      return 4;
+    #define REGISTER_CASE(name, ...) case OPCODE_R_##name:
+    TYPED_OPCODES(REGISTER_CASE)
+    #undef REGISTER_CASE
+      return 5;
+    case OPCODE_R_SPP:
+    case OPCODE_R_FPP:
+      return 6;
+    case OPCODE_R_LOADC:
+      return 7;
+    case OPCODE_STORE:
+    case OPCODE_LOAD:
+    case OPCODE_PUSH:
+    case OPCODE_POP:
+    #define TYPED_CASE(name, ...) case OPCODE_##name:
+    TYPED_OPCODES(TYPED_CASE)
+    #undef TYPED_CASE
+      return 2;
+    case OPCODE_RESERVE:
+    case OPCODE_RELEASE:
+    case OPCODE_SWAP_POP_STORE:
+      return 3;
+    case OPCODE_CONV:
+    case OPCODE_FTRIG:
+      return 3;
+    case OPCODE_VLOAD:
+    case OPCODE_VSTORE:
+    case OPCODE_VSPLAT:
+    case OPCODE_VPUSH:
+    case OPCODE_VPOP:
+    case OPCODE_VNOT:
+    #define VECTOR_CASE(name, ...) case OPCODE_##name:
+    VECTOR_OPCODES(VECTOR_CASE)
+    VECTOR_REDUCTIONS(VECTOR_CASE)
+    #undef VECTOR_CASE
+      return 3;
+    case OPCODE_VEXTRACT:
+      return 4;
+    case OPCODE_VSHUF:
+      return 7;
+    case OPCODE_CALL:
+    case OPCODE_SPP:
+    case OPCODE_FPP:
+    case OPCODE_JMP:
+    case OPCODE_JMPZ:
+    case OPCODE_JMPNZ:
+    case OPCODE_CPY:
+    case OPCODE_MCMP:
+      return 5;
+    case OPCODE_LOADC:
+    case OPCODE_SPP_LOAD:
+    case OPCODE_FPP_LOAD:
+    case OPCODE_LOADC_SWAP:
+    case OPCODE_CMPE_JMPZ:
+    case OPCODE_CMPL_JMPZ:
+    case OPCODE_CMPG_JMPZ:
+    case OPCODE_FILL:
+      return 6;
+  }
+
+  if (opcode >= OPCODE_ADD_U8 && opcode <= OPCODE_NOT_F64) return 2;
+  return 0;
+}
+
+// Offset of the int32 absolute jump target inside an instruction, 0 if none
+static int jumpOperand(byte opcode) {
+  switch (opcode) {
+    case OPCODE_CALL:
+    case OPCODE_JMP:
+    case OPCODE_JMPZ:
+    case OPCODE_JMPNZ:
+      return 1;
+    case OPCODE_CMPE_JMPZ:
+    case OPCODE_CMPL_JMPZ:
+    case OPCODE_CMPG_JMPZ:
+      return 2;
+  }
+  return 0;
+}
+
+// Offset of the type byte inside an instruction, 0 if it has none
+static int typeOperand(byte opcode) {
+  if (opcode >= OPCODE_ADD_U8 && opcode <= OPCODE_NOT_F64) return 1;
+  switch (opcode) {
+    #define TYPED_CASE(name, ...) case OPCODE_##name:
+    TYPED_OPCODES(TYPED_CASE)
+    #undef TYPED_CASE
+    case OPCODE_CMPE_JMPZ:
+    case OPCODE_CMPL_JMPZ:
+    case OPCODE_CMPG_JMPZ:
+    case OPCODE_FTRIG:
+    case OPCODE_VLOAD:
+    case OPCODE_VSTORE:
+    case OPCODE_VSPLAT:
+    case OPCODE_VPUSH:
+    case OPCODE_VPOP:
+    case OPCODE_VNOT:
+    case OPCODE_VSHUF:
+    case OPCODE_VEXTRACT:
+    #define VECTOR_CASE(name, ...) case OPCODE_##name:
+    VECTOR_OPCODES(VECTOR_CASE)
+    VECTOR_REDUCTIONS(VECTOR_CASE)
+    #undef VECTOR_CASE
+      return 1;
+    #define REGISTER_CASE(name, ...) case OPCODE_R_##name:
+    TYPED_OPCODES(REGISTER_CASE)
+    #undef REGISTER_CASE
+      return 4;
+  }
+  return 0;
+}
+
+// Rewrites the typed opcodes of older bytecode into their specialized forms.
+// Only the first code_size bytes are instructions, the constants follow them
+static bool quicken(byte *code, int code_size) {
+  int pc = 0;
+  while (pc < code_size) {
+    int length = opcodeLength(code[pc]);
+    if (length == 0 || pc + length > code_size) return false;
+    if (length == 2) code[pc] = quickOpcode(code[pc], code[pc + 1]);
+    pc += length;
+  }
+  return true;
+}
+
+#include "trace.cpp"
+#include "profile.cpp"
+#include "simd.cpp"
+#include "convert.cpp"
+#include "bulk.cpp"
+#include "native.cpp"
+
+// Records the instruction about to run when tracing is compiled in
+#ifdef VM_TRACE
+#define VM_TRACE_EVENT() \
+do { \
+  if (trace) trace->record(prog_counter, instructions, instructions_size, registers, stack_end); \
+} while(false)
+#else
+#define VM_TRACE_EVENT()
+#endif
+
+// Fuel is counted in bytes of bytecode. A backward jump charges the span it
+// jumps over, roughly the loop body it closes, and a CALL charges
+// VM_CALL_FUEL. Straight-line code is bounded by the program size and isn't
+// charged at all, so fuel is only checked at safe points
+#define VM_FUEL_UNLIMITED INT64_MAX
+#define VM_CALL_FUEL 16
+
+// Safe points are where a VM may suspend: backward jumps, CALL, RETURN and
+// PRINT. Once resume()'s slice of safe points is used up, or the fuel runs
+// out, the VM stops there with prog_counter on the next instruction, and
+// resume() picks it up again
+#define VM_SAFE_POINT(cost) \
+do { \
+  fuel -= (cost); \
+  if (fuel < 0) { \
+    out_of_fuel = true; \
+    suspended = true; \
+    return; \
+  } \
+  if (slice_left > 0 && --slice_left == 0) { \
+    suspended = true; \
+    return; \
+  } \
+} while(false)
+
+// Jumps to pos, which is a safe point if it goes backwards
+#define VM_JUMP(pos) \
+do { \
+  int32_t target = (pos); \
+  int32_t span = prog_counter - target; \
+  prog_counter = target; \
+  if (prog_counter < 0) return; \
+  if (span > 0) VM_SAFE_POINT(span); \
+} while(false)
+
 static void swap_u64(uint64_t *a, uint64_t *b) {
   uint64_t t = *a;
   *a = *b;
   *b = t;
 }
 
+// Maps every opcode byte to a label of the threaded interpreter loop
+struct DispatchTable {
+  const void *labels[256];
+
+  DispatchTable(std::initializer_list<std::pair<byte, const void *>> ops, const void *invalid) {
+    for (int i = 0; i < 256; ++i) labels[i] = invalid;
+    for (const std::pair<byte, const void *> &op : ops) labels[op.first] = op.second;
+  }
+};
+
 struct VM {
   const byte *instructions = nullptr;
   int instructions_size = 0;
   int prog_counter = 0;
   byte registers[8*2] = {};
+  byte register_file[8*VM_REGISTER_COUNT] = {};
+  alignas(VECTOR_MAX_SIZE) byte vregisters[VECTOR_MAX_SIZE*2] = {}; // vleft, then vright
   byte stack_base[MAX_STACK_SIZE] = {};
   int32_t stack_end;
   int32_t stack_frame;
-  void ( *pause_fn)(const VM *);
+  void ( *pause_fn)(const VM *) = nullptr; // Called every pause_interval instructions
+  void *pause_data = nullptr; // For pause_fn's own use
+  int pause_interval = 1;
+  void ( *native)(VM *) = nullptr; // Machine code for instructions, see jit.cpp
+  bool unchecked = false; // Drops runtime bounds checks, only for code verifyBytecode() accepted
+  TraceBuffer *trace = nullptr; // Receives events in VM_TRACE builds, ignored otherwise
+  Profile *profile = nullptr; // Runs the instrumented dispatch loop when set
+  int pause_countdown = 0;
+  int slice_left = 0; // Safe points until the VM suspends, 0 never suspends
+  bool suspended = false; // Stopped at a safe point, resume() continues
+  int64_t fuel = VM_FUEL_UNLIMITED; // Left to spend, negative once overdrawn
+  bool out_of_fuel = false; // Suspended for lack of fuel, add some to resume
   
   #define stack_ptr (stack_base + stack_end)
   #define frame_ptr (stack_base + stack_frame)
   
-  void push(const void *data, uint8_t size) {
-    if (stack_base + MAX_STACK_SIZE < stack_ptr) exit(1);
+  // The stack helpers skip their bounds checks once the code has been
+  // verified, see `unchecked`
+  template <bool checked = true> void push(const void *data, uint8_t size) {
+    if (checked && stack_base + MAX_STACK_SIZE < stack_ptr) exit(1);
     memcpy(stack_ptr, data, size);
-    printf("Val: %d ad %p\n", (int) (* (char *) stack_ptr), stack_ptr);
     stack_end += size;
   }
   
-  void pop(void *dest, uint8_t size) {
-    if (stack_base + size > stack_ptr) exit(1);
+  template <bool checked = true> void pop(void *dest, uint8_t size) {
+    if (checked && stack_base + size > stack_ptr) exit(1);
     stack_end -= size;
     memcpy(dest, stack_ptr, size);
   }
 
-  void reserve(int16_t size) {
-    if (stack_base + MAX_STACK_SIZE < stack_ptr) exit(1);
-    memset(stack_ptr, 0, size);
+  template <bool checked = true> void reserve(int16_t size) {
+    if (checked && stack_base + MAX_STACK_SIZE < stack_ptr) exit(1);
+    bulk.fill(stack_ptr, 0, 1, size);
     stack_end += size;
   }
   
-  void release(int16_t size) {
-    if (stack_base + size > stack_ptr) exit(1);
+  template <bool checked = true> void release(int16_t size) {
+    if (checked && stack_base + size > stack_ptr) exit(1);
     stack_end -= size;
   }
   
   #define GET_BYTES(num) (instructions + (prog_counter+=num)-num)
-  void execute_one() {
-    if (prog_counter >= instructions_size) exit(20);
+  template <bool checked = true> void execute_one() {
+    if (checked && prog_counter >= instructions_size) exit(20);
+    VM_TRACE_EVENT();
 
     byte opcode = *GET_BYTES(1);
     
     switch(opcode) {
-      SWITCH_CASE(OPCODE_LOADC, {
-        char size = *GET_BYTES(1);
-        int32_t pos = *(int32_t *) GET_BYTES(4);
-        if (instructions_size < pos + size) exit(1);
-        memcpy(registers, instructions + pos, size);
-      })
-      
-      SWITCH_CASE(OPCODE_SWAP, {
-        printf("Swap\n");
-        swap_u64(
-          (uint64_t *) registers,
-          (uint64_t *) (registers + 8)
-        );
-      })
-      
-      #define APPLY_OPB(type, op) \
-      do { \
-        *(type *) registers op##= *(type *) (registers + 8); \
-        break; \
-      } while(false)
-      
-      #define APPLY_OPU(type, op) \
-      do { \
-        *(type *) registers = op (*(type *) registers); \
-        break; \
-      } while(false)
-      
-      #define APPLY_OPC(type, op) \
-      do { \
-        *(uint8_t *) registers = \
-          (*(type *) registers) op \
-          (*(type *) (registers + 8)); \
-        break; \
-      } while(false)
-      
-      #define OP_CASE(name, op, ub) \
-      SWITCH_CASE(OPCODE_##name, { \
-        switch (*GET_BYTES(1)) { \
-          case MERGE(TYPE_UNSIGNED, FROM_SIZE(8)): \
-            APPLY_OP##ub(uint8_t , op); \
-            break; \
-          case MERGE(TYPE_UNSIGNED, FROM_SIZE(16)): \
-            APPLY_OP##ub(uint16_t, op); \
-            break; \
-          case MERGE(TYPE_UNSIGNED, FROM_SIZE(32)): \
-            APPLY_OP##ub(uint32_t, op); \
-            break; \
-          case MERGE(TYPE_UNSIGNED, FROM_SIZE(64)): \
-            APPLY_OP##ub(uint64_t, op); \
-            break; \
-          case MERGE(TYPE_SIGNED, FROM_SIZE(8)): \
-            APPLY_OP##ub( int8_t , op); \
-            break; \
-          case MERGE(TYPE_SIGNED, FROM_SIZE(16)): \
-            APPLY_OP##ub( int16_t, op); \
-            break; \
-          case MERGE(TYPE_SIGNED, FROM_SIZE(32)): \
-            APPLY_OP##ub( int32_t, op); \
-            break; \
-          case MERGE(TYPE_SIGNED, FROM_SIZE(64)): \
-            APPLY_OP##ub( int64_t, op); \
-            break; \
-          case MERGE(TYPE_FLOAT, FROM_SIZE(32)): \
-            APPLY_OP##ub(float, op); \
-            break; \
-          case MERGE(TYPE_FLOAT, FROM_SIZE(64)): \
-            APPLY_OP##ub(double, op); \
-            break; \
-        } \
-      })
-      
-      OP_CASE(ADD, +, B)
-      OP_CASE(SUB, -, B)
-      OP_CASE(MUL, *, B)
-      OP_CASE(DIV, /, B)
-      
-      OP_CASE(NEG, -, U)
-      
-      OP_CASE(CMPE, ==, C)
-      OP_CASE(CMPL, < , C)
-      OP_CASE(CMPG, > , C)
-      
-      #undef OP_CASE
-      #define OP_CASE(name, op, ub) \
-      SWITCH_CASE(OPCODE_##name, { \
-        switch (*GET_BYTES(1)) { \
-          case MERGE(TYPE_UNSIGNED, FROM_SIZE(8)): \
-            APPLY_OP##ub(uint8_t , op); \
-            break; \
-          case MERGE(TYPE_UNSIGNED, FROM_SIZE(16)): \
-            APPLY_OP##ub(uint16_t, op); \
-            break; \
-          case MERGE(TYPE_UNSIGNED, FROM_SIZE(32)): \
-            APPLY_OP##ub(uint32_t, op); \
-            break; \
-          case MERGE(TYPE_UNSIGNED, FROM_SIZE(64)): \
-            APPLY_OP##ub(uint64_t, op); \
-            break; \
-          case MERGE(TYPE_SIGNED, FROM_SIZE(8)): \
-            APPLY_OP##ub(uint8_t , op); \
-            break; \
-          case MERGE(TYPE_SIGNED, FROM_SIZE(16)): \
-            APPLY_OP##ub(uint16_t, op); \
-            break; \
-          case MERGE(TYPE_SIGNED, FROM_SIZE(32)): \
-            APPLY_OP##ub(uint32_t, op); \
-            break; \
-          case MERGE(TYPE_SIGNED, FROM_SIZE(64)): \
-            APPLY_OP##ub(uint64_t, op); \
-            break; \
-          case MERGE(TYPE_FLOAT, FROM_SIZE(32)): \
-            APPLY_OP##ub(uint32_t, op); \
-            break; \
-          case MERGE(TYPE_FLOAT, FROM_SIZE(64)): \
-            APPLY_OP##ub(uint64_t, op); \
-            break; \
-        } \
-      })
-      
-      OP_CASE(XOR, ^, B)
-      OP_CASE(AND, &, B)
-      OP_CASE(OR , |, B)
-      OP_CASE(NOT, ~, U)
-
-      SWITCH_CASE(OPCODE_BAND, {
-        APPLY_OPC(uint8_t, &&);
-      })
-
-      SWITCH_CASE(OPCODE_BOR, {
-        APPLY_OPC(uint8_t, ||);
-      })
-
-      SWITCH_CASE(OPCODE_BNOT, {
-        APPLY_OPU(uint8_t, !);
-      })
-      
-      SWITCH_CASE(OPCODE_RETURN, {
-        pop(&prog_counter, 4);
-        pop(&stack_frame, 4);
-        printf("Return\n");
-      })
-      
-      SWITCH_CASE(OPCODE_CALL, {
-        push(&stack_frame, 4);
-        push(&prog_counter, 4);
-        prog_counter = *(int32_t *) GET_BYTES(4);
-        stack_frame = stack_end;
-        printf("Call (%d)\n", (int) OPCODE_CALL);
-      })
-      
-      SWITCH_CASE(OPCODE_PUSH, {
-        byte reg = *GET_BYTES(1);
-        push(registers + UPPER(reg), LOWER(reg));
-        printf("Push 0x%.2hhX\n", reg);
-      })
-      
-      SWITCH_CASE(OPCODE_POP, {
-        byte reg = *GET_BYTES(1);
-        pop(registers + UPPER(reg), LOWER(reg));
-        printf("Pop 0x%.2hhX\n", reg);
-      })
-
-      SWITCH_CASE(OPCODE_RESERVE, {
-        int16_t size = *(int16_t *) GET_BYTES(2);
-        reserve(size);
-        printf("Reserve %d\n", size);
-      })
-      
-      SWITCH_CASE(OPCODE_RELEASE, {
-        int16_t size = *(int16_t *) GET_BYTES(2);
-        release(size);
-        printf("Release %d\n", size);
-      })
-      
-      SWITCH_CASE(OPCODE_LOAD, {
-        char size = *GET_BYTES(1);
-        void *ptr = * (void **) registers;
-        memcpy(registers, ptr, size);
-        printf("Loaded %d from %p\n", (int) size, ptr);
-      })
-      
-      SWITCH_CASE(OPCODE_STORE, {
-        char size = *GET_BYTES(1);
-        memcpy(*(void **) registers, registers + 8, size);
-      })
-      
-      SWITCH_CASE(OPCODE_SPP, {
-        int32_t index = *(int32_t *) GET_BYTES(4);
-        * (void **) registers = stack_base + index + 8;
-        printf("SPP(%d)=%p\n", index, * (void **) registers);
-      })
-      
-      SWITCH_CASE(OPCODE_FPP, {
-        int32_t index = *(int32_t *) GET_BYTES(4);
-        * (void **) registers = frame_ptr + index;
-      })
-      
-      SWITCH_CASE(OPCODE_JMP, {
-        prog_counter = *(int32_t *) GET_BYTES(4);
-        printf("JMP triggered\n");
-      })
-      
-      SWITCH_CASE(OPCODE_JMPZ, {
-        printf("JMPZ...\n");
-        int32_t pos = *(int32_t *) GET_BYTES(4);
-        printf("pos = %d\n", pos);
-        if (*(uint8_t *) registers) return;
-        printf("...triggered\n");
-        prog_counter = pos;
-      })
-
-      SWITCH_CASE(OPCODE_JMPNZ, {
-        printf("JMPNZ...\n");
-        int32_t pos = *(int32_t *) GET_BYTES(4);
-        printf("pos = %d\n", pos);
-        if (*(uint8_t *) registers == 0) return;
-        printf("...triggered\n");
-        prog_counter = pos;
-      })
-
-      SWITCH_CASE(OPCODE_PRINT, {
-        printf("Registers:\n   Left: 0x%.16llX\n   Left: %lli\n   Left: %ff\n",
-          *(uint64_t *)(registers),
-          *(int64_t *)(registers),
-          *(float *)(registers)
-        );
-
-        printf("\n  Right: 0x%.16llX\n  Right: %lli\n  Right: %ff\n",
-          *(uint64_t *)(registers + 8),
-          *(int64_t *)(registers + 8),
-          *(float *)(registers + 8)
-        );
-      })
+      #define VM_OP(name, _code) SWITCH_CASE(OPCODE_##name, _code)
+      #include "vmops.cpp"
+      #undef VM_OP
 
       default:
-        printf("Expected valid instruction\n", opcode);
+        printf("Expected valid instruction\n");
         exit(11);
     }
   }
-  
+
+  // Profiling and pause hooks, only the instrumented dispatch loops call this
+  void instrument() {
+    if (profile) profile->enter(prog_counter, instructions);
+    if (pause_fn && --pause_countdown <= 0) {
+      pause_countdown = pause_interval;
+      pause_fn(this);
+    }
+  }
+
+#ifdef VM_COMPUTED_GOTO
+  // Direct-threaded interpreter: every handler jumps straight to the next
+  // one through the dispatch table, so the whole run stays in this function.
+  template <bool checked, bool instrumented> void run() {
+    static const DispatchTable table({
+      #define VM_OP(name, _code) {OPCODE_##name, &&op_##name},
+      #include "vmops.cpp"
+      #undef VM_OP
+    }, &&op_invalid);
+
+    #define VM_DISPATCH() \
+    do { \
+      if (checked && prog_counter >= instructions_size) exit(20); \
+      VM_TRACE_EVENT(); \
+      if (instrumented) instrument(); \
+      goto *table.labels[*GET_BYTES(1)]; \
+    } while(false)
+
+    VM_DISPATCH();
+
+    #define VM_OP(name, _code) op_##name: {_code} VM_DISPATCH();
+    #include "vmops.cpp"
+    #undef VM_OP
+
+  op_invalid:
+    printf("Expected valid instruction\n");
+    exit(11);
+
+    #undef VM_DISPATCH
+  }
+#else
+  template <bool checked, bool instrumented> void run() {
+    do {
+      if (instrumented && prog_counter < instructions_size) instrument();
+      execute_one<checked>();
+    } while(prog_counter >= 0 && !suspended);
+  }
+#endif
+
+  // Pushes the entry frame, after which resume() runs the program. Native
+  // code runs here and hands back to the interpreter where it can't
+  // continue, it never suspends
+  void start() {
+    prog_counter = -10;
+    push(&stack_frame, 4);
+    push(&prog_counter, 4);
+    prog_counter = 0;
+    slice_left = 0;
+    suspended = false;
+    out_of_fuel = false;
+    if (native) native(this);
+  }
+
+  // Runs until the program returns, `slice` safe points have passed (0
+  // means no limit) or the fuel is gone. Returns true once the program has
+  // finished. Out of fuel it returns false right away until refuelled
+  bool resume(int slice = 0) {
+    if (prog_counter < 0) return true;
+    if (fuel < 0) return false;
+    slice_left = slice;
+    suspended = false;
+    out_of_fuel = false;
+
+    if (profile || pause_fn) {
+      pause_countdown = pause_interval;
+      if (unchecked) run<false, true>();
+      else run<true, true>();
+      if (profile) profile->finish();
+    } else {
+      if (unchecked) run<false, false>();
+      else run<true, false>();
+    }
+    return prog_counter < 0;
+  }
+
+  bool finished() const {
+    return prog_counter < 0;
+  }
+
   void execute() {
+    start();
+    resume();
+  }
+
+  // Reference loop kept around for comparison with run()
+  void execute_switch() {
     prog_counter = -10;
     push(&stack_frame, 4);
     push(&prog_counter, 4);
@@ -418,11 +692,11 @@ struct VM {
     stack_frame = 0;
   }
   #undef GET_BYTES
-  #undef APPLY_OPU
-  #undef APPLY_OPB
-  #undef OP_CASE
 };
 
 #undef SWITCH_CASE
+#undef VM_TRACE_EVENT
+#undef VM_SAFE_POINT
+#undef VM_JUMP
 
 #endif // _VM_CPP_
\ No newline at end of file
@@ -0,0 +1,507 @@
+// Opcode bodies shared by every dispatcher in vm.cpp.
+// This file has no include guard on purpose: it is included once per
+// dispatcher, with VM_OP(name, code) defined by the includer to expand each
+// body into a switch case, a threaded-code label or a dispatch table entry.
+// Bodies run inside VM member functions and may `return` to stop execution.
+// `checked` is false only for code that passed verifyBytecode() in verify.cpp.
+
+VM_OP(LOADC, {
+  char size = *GET_BYTES(1);
+  int32_t pos = *(int32_t *) GET_BYTES(4);
+  if (checked && instructions_size < pos + size) exit(1);
+  memcpy(registers, instructions + pos, size);
+})
+
+VM_OP(SWAP, {
+  swap_u64(
+    (uint64_t *) registers,
+    (uint64_t *) (registers + 8)
+  );
+})
+
+// Both types come from the instruction, see convert.cpp
+VM_OP(CONV, {
+  byte from = *GET_BYTES(1);
+  ConvertFn convert = conversionFor(from, *GET_BYTES(1));
+  if (convert) convert(registers);
+})
+
+#define APPLY_OPB(type, op) \
+do { \
+  *(type *) registers op##= *(type *) (registers + 8); \
+  break; \
+} while(false)
+
+#define APPLY_OPU(type, op) \
+do { \
+  *(type *) registers = op (*(type *) registers); \
+  break; \
+} while(false)
+
+#define APPLY_OPC(type, op) \
+do { \
+  *(uint8_t *) registers = \
+    (*(type *) registers) op \
+    (*(type *) (registers + 8)); \
+  break; \
+} while(false)
+
+// The generic form switches over the type byte, the quickened forms
+// (OPCODE_ADD_U8, ...) skip it. Both are expanded from the same lists
+#define TYPED_CASE(suffix, tbyte, value, bits, op, ub, sel) \
+  case tbyte: \
+    APPLY_OP##ub(sel(value, bits), op); \
+    break;
+
+#define QUICK_OP(suffix, tbyte, value, bits, name, op, ub, sel) \
+VM_OP(name##_##suffix, { \
+  prog_counter++; \
+  APPLY_OP##ub(sel(value, bits), op); \
+})
+
+#define OP_CASE(name, op, ub, sel, ...) \
+VM_OP(name, { \
+  switch (*GET_BYTES(1)) { \
+    PRIMITIVE_TYPES(TYPED_CASE, op, ub, sel) \
+  } \
+}) \
+PRIMITIVE_TYPES(QUICK_OP, name, op, ub, sel)
+
+TYPED_OPCODES(OP_CASE)
+
+#undef OP_CASE
+#undef QUICK_OP
+
+VM_OP(BAND, {
+  APPLY_OPC(uint8_t, &&);
+})
+
+VM_OP(BOR, {
+  APPLY_OPC(uint8_t, ||);
+})
+
+VM_OP(BNOT, {
+  APPLY_OPU(uint8_t, !);
+})
+
+// --- Superinstructions ---
+
+#define CMP_JMPZ(name, op) \
+VM_OP(name##_JMPZ, { \
+  switch (*GET_BYTES(1)) { \
+    PRIMITIVE_TYPES(TYPED_CASE, op, C, VALUE_TYPE) \
+  } \
+  int32_t pos = *(int32_t *) GET_BYTES(4); \
+  if (*(uint8_t *) registers == 0) VM_JUMP(pos); \
+})
+
+CMP_JMPZ(CMPE, ==)
+CMP_JMPZ(CMPL, < )
+CMP_JMPZ(CMPG, > )
+
+#undef CMP_JMPZ
+#undef TYPED_CASE
+
+#undef APPLY_OPC
+#undef APPLY_OPU
+#undef APPLY_OPB
+
+VM_OP(RETURN, {
+  pop<checked>(&prog_counter, 4);
+  pop<checked>(&stack_frame, 4);
+  if (prog_counter < 0) return;
+  VM_SAFE_POINT(0);
+})
+
+VM_OP(CALL, {
+  // The return address is the instruction after the call
+  int32_t target = *(int32_t *) GET_BYTES(4);
+  push<checked>(&stack_frame, 4);
+  push<checked>(&prog_counter, 4);
+  prog_counter = target;
+  stack_frame = stack_end;
+  VM_SAFE_POINT(VM_CALL_FUEL);
+})
+
+VM_OP(PUSH, {
+  byte reg = *GET_BYTES(1);
+  push<checked>(registers + UPPER(reg), LOWER(reg));
+})
+
+VM_OP(POP, {
+  byte reg = *GET_BYTES(1);
+  pop<checked>(registers + UPPER(reg), LOWER(reg));
+})
+
+VM_OP(RESERVE, {
+  int16_t size = *(int16_t *) GET_BYTES(2);
+  reserve<checked>(size);
+})
+
+VM_OP(RELEASE, {
+  int16_t size = *(int16_t *) GET_BYTES(2);
+  release<checked>(size);
+})
+
+VM_OP(LOAD, {
+  char size = *GET_BYTES(1);
+  void *ptr = * (void **) registers;
+  memcpy(registers, ptr, size);
+})
+
+VM_OP(STORE, {
+  char size = *GET_BYTES(1);
+  memcpy(*(void **) registers, registers + 8, size);
+})
+
+// Bulk memory, see bulk.cpp. Left holds the destination (or first operand)
+// pointer, right the source pointer or the fill value
+VM_OP(CPY, {
+  int32_t count = *(int32_t *) GET_BYTES(4);
+  if (checked && count < 0) exit(12);
+  bulk.copy(*(byte **) registers, *(byte **) (registers + 8), count);
+})
+
+VM_OP(FILL, {
+  byte width = *GET_BYTES(1);
+  int32_t count = *(int32_t *) GET_BYTES(4);
+  if (checked && (count < 0 || width == 0 || width > 8 || (width & (width - 1)))) exit(12);
+  uint64_t pattern;
+  memcpy(&pattern, registers + 8, 8);
+  bulk.fill(*(byte **) registers, pattern, width, count);
+})
+
+VM_OP(MCMP, {
+  int32_t count = *(int32_t *) GET_BYTES(4);
+  if (checked && count < 0) exit(12);
+  *(int8_t *) registers = bulk.compare(*(byte **) registers, *(byte **) (registers + 8), count);
+})
+
+VM_OP(SPP, {
+  int32_t index = *(int32_t *) GET_BYTES(4);
+  * (void **) registers = stack_base + index + 8;
+})
+
+VM_OP(FPP, {
+  int32_t index = *(int32_t *) GET_BYTES(4);
+  * (void **) registers = frame_ptr + index;
+})
+
+VM_OP(JMP, {
+  int32_t pos = *(int32_t *) GET_BYTES(4);
+  VM_JUMP(pos);
+})
+
+VM_OP(JMPZ, {
+  int32_t pos = *(int32_t *) GET_BYTES(4);
+  if (*(uint8_t *) registers == 0) VM_JUMP(pos);
+})
+
+VM_OP(JMPNZ, {
+  int32_t pos = *(int32_t *) GET_BYTES(4);
+  if (*(uint8_t *) registers) VM_JUMP(pos);
+})
+
+VM_OP(SPP_LOAD, {
+  int32_t index = *(int32_t *) GET_BYTES(4);
+  char size = *GET_BYTES(1);
+  void *ptr = stack_base + index + 8;
+  * (void **) registers = ptr;
+  memcpy(registers, ptr, size);
+})
+
+VM_OP(FPP_LOAD, {
+  int32_t index = *(int32_t *) GET_BYTES(4);
+  char size = *GET_BYTES(1);
+  void *ptr = frame_ptr + index;
+  * (void **) registers = ptr;
+  memcpy(registers, ptr, size);
+})
+
+// Swapping first and loading into right leaves both registers as
+// LOADC followed by SWAP would
+VM_OP(LOADC_SWAP, {
+  char size = *GET_BYTES(1);
+  int32_t pos = *(int32_t *) GET_BYTES(4);
+  if (checked && instructions_size < pos + size) exit(1);
+  swap_u64(
+    (uint64_t *) registers,
+    (uint64_t *) (registers + 8)
+  );
+  memcpy(registers + 8, instructions + pos, size);
+})
+
+VM_OP(SWAP_POP_STORE, {
+  byte reg = *GET_BYTES(1);
+  char size = *GET_BYTES(1);
+  swap_u64(
+    (uint64_t *) registers,
+    (uint64_t *) (registers + 8)
+  );
+  pop<checked>(registers + UPPER(reg), LOWER(reg));
+  memcpy(*(void **) registers, registers + 8, size);
+})
+
+// --- Register file ---
+
+#define REG(index) (register_file + (index) * 8)
+
+VM_OP(R_LOADC, {
+  byte *dst = REG(*GET_BYTES(1));
+  char size = *GET_BYTES(1);
+  int32_t pos = *(int32_t *) GET_BYTES(4);
+  if (checked && instructions_size < pos + size) exit(1);
+  memcpy(dst, instructions + pos, size);
+})
+
+VM_OP(R_MOV, {
+  byte *dst = REG(*GET_BYTES(1));
+  memcpy(dst, REG(*GET_BYTES(1)), 8);
+})
+
+VM_OP(R_SPP, {
+  byte *dst = REG(*GET_BYTES(1));
+  int32_t index = *(int32_t *) GET_BYTES(4);
+  * (void **) dst = stack_base + index + 8;
+})
+
+VM_OP(R_FPP, {
+  byte *dst = REG(*GET_BYTES(1));
+  int32_t index = *(int32_t *) GET_BYTES(4);
+  * (void **) dst = frame_ptr + index;
+})
+
+VM_OP(R_LOAD, {
+  byte *dst = REG(*GET_BYTES(1));
+  void *ptr = * (void **) REG(*GET_BYTES(1));
+  char size = *GET_BYTES(1);
+  memcpy(dst, ptr, size);
+})
+
+VM_OP(R_STORE, {
+  void *ptr = * (void **) REG(*GET_BYTES(1));
+  const byte *src = REG(*GET_BYTES(1));
+  char size = *GET_BYTES(1);
+  memcpy(ptr, src, size);
+})
+
+VM_OP(R_PUSH, {
+  const byte *src = REG(*GET_BYTES(1));
+  push<checked>(src, *GET_BYTES(1));
+})
+
+VM_OP(R_POP, {
+  byte *dst = REG(*GET_BYTES(1));
+  pop<checked>(dst, *GET_BYTES(1));
+})
+
+VM_OP(R_GET, {
+  memcpy(registers, REG(*GET_BYTES(1)), 8);
+})
+
+VM_OP(R_SET, {
+  memcpy(REG(*GET_BYTES(1)), registers, 8);
+})
+
+VM_OP(R_CONV, {
+  byte *dst = REG(*GET_BYTES(1));
+  byte from = *GET_BYTES(1);
+  ConvertFn convert = conversionFor(from, *GET_BYTES(1));
+  if (convert) convert(dst);
+})
+
+VM_OP(R_BNOT, {
+  byte *dst = REG(*GET_BYTES(1));
+  *(uint8_t *) dst = !*(uint8_t *) REG(*GET_BYTES(1));
+})
+
+#define APPLY_ROPB(type, op) *(type *) dst = *(type *) a op *(type *) b
+#define APPLY_ROPU(type, op) *(type *) dst = op *(type *) a
+#define APPLY_ROPC(type, op) *(uint8_t *) dst = *(type *) a op *(type *) b
+
+#define REGISTER_CASE(suffix, tbyte, value, bits, op, ub, sel) \
+  case tbyte: \
+    APPLY_ROP##ub(sel(value, bits), op); \
+    break;
+
+#define REGISTER_OP(name, op, ub, sel, ...) \
+VM_OP(R_##name, { \
+  byte *dst = REG(*GET_BYTES(1)); \
+  const byte *a = REG(*GET_BYTES(1)); \
+  const byte *b = REG(*GET_BYTES(1)); \
+  (void) b; \
+  switch (*GET_BYTES(1)) { \
+    PRIMITIVE_TYPES(REGISTER_CASE, op, ub, sel) \
+  } \
+})
+
+TYPED_OPCODES(REGISTER_OP)
+
+#undef REGISTER_OP
+#undef REGISTER_CASE
+#undef APPLY_ROPC
+#undef APPLY_ROPU
+#undef APPLY_ROPB
+#undef REG
+
+// --- Vectors ---
+
+#define VLEFT  vregisters
+#define VRIGHT (vregisters + VECTOR_MAX_SIZE)
+
+// Reads the lane type and count. Unverified code exits unless they make up
+// 16 or 32 bytes, VECTOR_SWITCH exits on lane types it doesn't know
+#define VECTOR_OPERANDS() \
+  byte type = *GET_BYTES(1); \
+  byte lanes = *GET_BYTES(1); \
+  int size = lanes * LOWER(type); \
+  if (checked && size != 16 && size != VECTOR_MAX_SIZE) exit(12)
+
+// Expands call(value, bits, size, ...) for the lane type and vector size
+// VECTOR_OPERANDS() read. Template calls are parenthesised to keep their
+// commas out of VM_OP
+#define VECTOR_CASE(suffix, tbyte, value, bits, call, ...) \
+  case tbyte: \
+    if (size == 16) call(value, bits, 16, __VA_ARGS__); \
+    else call(value, bits, VECTOR_MAX_SIZE, __VA_ARGS__); \
+    break;
+
+#define VECTOR_SWITCH(...) \
+  switch (type) { \
+    PRIMITIVE_TYPES(VECTOR_CASE, __VA_ARGS__) \
+    default: \
+      exit(12); \
+  }
+
+VM_OP(VLOAD, {
+  VECTOR_OPERANDS();
+  vectorCopy(VLEFT, *(void **) registers, size);
+})
+
+VM_OP(VSTORE, {
+  VECTOR_OPERANDS();
+  vectorCopy(*(void **) registers, VLEFT, size);
+})
+
+VM_OP(VSWAP, {
+  byte temp[VECTOR_MAX_SIZE];
+  memcpy(temp, VLEFT, VECTOR_MAX_SIZE);
+  memcpy(VLEFT, VRIGHT, VECTOR_MAX_SIZE);
+  memcpy(VRIGHT, temp, VECTOR_MAX_SIZE);
+})
+
+VM_OP(VPUSH, {
+  VECTOR_OPERANDS();
+  push<checked>(VLEFT, size);
+})
+
+VM_OP(VPOP, {
+  VECTOR_OPERANDS();
+  pop<checked>(VLEFT, size);
+})
+
+#define VECTOR_SPLAT(value, bits, size, ...) (vectorSplat<value, size>(VLEFT, registers))
+
+VM_OP(VSPLAT, {
+  VECTOR_OPERANDS();
+  VECTOR_SWITCH(VECTOR_SPLAT)
+})
+
+#define VECTOR_NOT(value, bits, size, ...) (vectorNot<bits, size>(VLEFT))
+
+VM_OP(VNOT, {
+  VECTOR_OPERANDS();
+  VECTOR_SWITCH(VECTOR_NOT)
+})
+
+#define VECTOR_SHUFFLE(value, bits, size, indices) (vectorShuffle<value, size>(VLEFT, indices))
+
+VM_OP(VSHUF, {
+  VECTOR_OPERANDS();
+  int32_t pos = *(int32_t *) GET_BYTES(4);
+  if (checked && instructions_size < pos + lanes) exit(1);
+  const byte *indices = instructions + pos;
+  VECTOR_SWITCH(VECTOR_SHUFFLE, indices)
+})
+
+// Lane indices wrap at the lane count like VSHUF's
+#define VECTOR_EXTRACT(value, bits, size, lane) \
+  memcpy(registers, VLEFT + ((lane) & (size / sizeof(value) - 1)) * sizeof(value), sizeof(value))
+
+VM_OP(VEXTRACT, {
+  VECTOR_OPERANDS();
+  byte lane = *GET_BYTES(1);
+  VECTOR_SWITCH(VECTOR_EXTRACT, lane)
+})
+
+#define VECTOR_APPLY(value, bits, size, kernel, sel) \
+  (vectorApply<kernel, sel(value, bits), bits, size>(VLEFT, VRIGHT))
+
+#define VECTOR_OP(name, kernel, sel, ...) \
+VM_OP(name, { \
+  VECTOR_OPERANDS(); \
+  VECTOR_SWITCH(VECTOR_APPLY, kernel, sel) \
+})
+
+VECTOR_OPCODES(VECTOR_OP)
+
+#define VECTOR_FOLD(value, bits, size, kernel) \
+do { \
+  value folded = (vectorReduce<kernel, value, size>(VLEFT)); \
+  memcpy(registers, &folded, sizeof(value)); \
+} while(false)
+
+#define VECTOR_REDUCTION(name, kernel, ...) \
+VM_OP(name, { \
+  VECTOR_OPERANDS(); \
+  VECTOR_SWITCH(VECTOR_FOLD, kernel) \
+})
+
+VECTOR_REDUCTIONS(VECTOR_REDUCTION)
+
+#undef VECTOR_REDUCTION
+#undef VECTOR_FOLD
+#undef VECTOR_OP
+#undef VECTOR_APPLY
+#undef VECTOR_EXTRACT
+#undef VECTOR_SHUFFLE
+#undef VECTOR_NOT
+#undef VECTOR_SPLAT
+#undef VECTOR_SWITCH
+#undef VECTOR_CASE
+#undef VECTOR_OPERANDS
+#undef VRIGHT
+#undef VLEFT
+
+// Host functions, see native.cpp. The compiler matched the arguments to the
+// bound types, so the trampoline takes the bytes as they are
+VM_OP(SPECCALL, {
+  const NativeFunction &native = natives.get(*GET_BYTES(1));
+  if (checked && !native.call) exit(11);
+  if (checked && stack_end < native.stack) exit(1);
+  stack_end -= native.stack;
+  native.call(registers, stack_ptr);
+  if (native.yields) VM_SAFE_POINT(VM_CALL_FUEL);
+})
+
+VM_OP(FTRIG, {
+  byte type = *GET_BYTES(1);
+  NativeFn function = trigFunction(type, *GET_BYTES(1));
+  if (checked && !function) exit(12);
+  function(registers, nullptr);
+})
+
+VM_OP(PRINT, {
+  printf("Registers:\n   Left: 0x%.16llX\n   Left: %lli\n   Left: %ff\n",
+    *(uint64_t *)(registers),
+    *(int64_t *)(registers),
+    *(float *)(registers)
+  );
+
+  printf("\n  Right: 0x%.16llX\n  Right: %lli\n  Right: %ff\n",
+    *(uint64_t *)(registers + 8),
+    *(int64_t *)(registers + 8),
+    *(float *)(registers + 8)
+  );
+  VM_SAFE_POINT(0);
+})